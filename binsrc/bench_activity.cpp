@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <jitsim/jit_frontend.hpp>
+#include <jitsim/json_loader.hpp>
+
+using namespace std;
+
+/* Compares activity mode against plain evaluation as the fraction of busy
+ * blocks grows. The top holds identical blocks, each an enabled
+ * accumulator followed by a chain of multiplies and xors on its output.
+ * An idle block keeps its inputs and state, so activity mode skips its
+ * compute_output, while every enabled block changes state each cycle */
+
+static const int Width = 32;
+static const int Stages = 16;
+
+static string bits(const string &dir)
+{
+  return "[\"Array\"," + to_string(Width) + ",\"" + dir + "\"]";
+}
+
+static string prim(const string &name, const string &op)
+{
+  return "\"" + name + "\":{\"genref\":\"coreir." + op + "\",\"genargs\":{\"width\":[\"Int\","
+         + to_string(Width) + "]}}";
+}
+
+static string conn(const string &a, const string &b)
+{
+  return "[\"" + a + "\",\"" + b + "\"]";
+}
+
+static void writeDesign(ostream &out, unsigned num_blocks)
+{
+  out << "{\"top\":\"global.top\",\n\"namespaces\":{\"global\":{\"modules\":{\n";
+
+  out << "\"Block\":{\"type\":[\"Record\",[[\"en\",\"BitIn\"],[\"d\"," << bits("BitIn") << "],"
+      << "[\"O\"," << bits("Bit") << "],[\"CLK\",[\"Named\",\"coreir.clkIn\"]]]],\n\"instances\":{\n"
+      << prim("r", "reg") << ",\n" << prim("m", "mux") << ",\n" << prim("a", "add");
+  for (int i = 0; i < Stages; i++) {
+    out << ",\n" << prim("p" + to_string(i), "mul") << ",\n" << prim("x" + to_string(i), "xor");
+  }
+  out << "},\n\"connections\":[\n"
+      << conn("r.clk", "self.CLK") << "," << conn("r.in", "m.out") << ","
+      << conn("m.in0", "r.out") << "," << conn("m.in1", "a.out") << "," << conn("m.sel", "self.en") << ",\n"
+      << conn("a.in0", "r.out") << "," << conn("a.in1", "self.d");
+  for (int i = 0; i < Stages; i++) {
+    string p = "p" + to_string(i), x = "x" + to_string(i);
+    string prev = i ? "x" + to_string(i - 1) + ".out" : "r.out";
+    out << ",\n" << conn(p + ".in0", prev) << "," << conn(p + ".in1", prev) << ","
+        << conn(x + ".in0", p + ".out") << "," << conn(x + ".in1", "self.d");
+  }
+  out << ",\n" << conn("x" + to_string(Stages - 1) + ".out", "self.O") << "]},\n";
+
+  out << "\"top\":{\"type\":[\"Record\",[[\"en\",[\"Array\"," << num_blocks << ",\"BitIn\"]],"
+      << "[\"d\"," << bits("BitIn") << "],[\"CLK\",[\"Named\",\"coreir.clkIn\"]]";
+  for (unsigned i = 0; i < num_blocks; i++) {
+    out << ",[\"o" << i << "\"," << bits("Bit") << "]";
+  }
+  out << "]],\n\"instances\":{";
+  for (unsigned i = 0; i < num_blocks; i++) {
+    out << (i ? ",\n" : "\n") << "\"b" << i << "\":{\"modref\":\"global.Block\"}";
+  }
+  out << "},\n\"connections\":[";
+  for (unsigned i = 0; i < num_blocks; i++) {
+    string b = "b" + to_string(i);
+    out << (i ? ",\n" : "\n") << conn(b + ".en", "self.en." + to_string(i)) << ","
+        << conn(b + ".d", "self.d") << "," << conn(b + ".CLK", "self.CLK") << ","
+        << conn(b + ".O", "self.o" + to_string(i));
+  }
+  out << "]}\n}}}}\n";
+}
+
+/* Cycles per second stepping and evaluating the whole design */
+static double measure(JITSim::JITFrontend &jit, const llvm::APInt &enables, unsigned num_cycles)
+{
+  jit.setInput("en", enables);
+
+  /* Lets activity mode fill its cache for the new inputs */
+  for (unsigned i = 0; i < 16; i++) {
+    jit.updateState();
+    jit.computeOutput();
+  }
+
+  auto start = chrono::steady_clock::now();
+  for (unsigned i = 0; i < num_cycles; i++) {
+    jit.updateState();
+    jit.computeOutput();
+  }
+
+  return num_cycles / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned num_blocks = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+  unsigned num_cycles = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000;
+  if (argc > 3 || num_blocks == 0 || num_cycles == 0) {
+    cerr << "Usage: " << argv[0] << " [BLOCKS] [CYCLES]\n";
+    return 1;
+  }
+
+  char path[] = "/tmp/jitsim_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    cerr << "Unable to create a temporary file\n";
+    return 1;
+  }
+  close(fd);
+
+  {
+    ofstream out(path);
+    writeDesign(out, num_blocks);
+  }
+  unique_ptr<JITSim::Circuit> circuit = JITSim::LoadJSONNetlist(path);
+  unlink(path);
+  if (!circuit) {
+    cerr << "Failed to load the generated design\n";
+    return 1;
+  }
+
+  JITSim::JITOptions options;
+  JITSim::JITFrontend plain(*circuit, options);
+  options.activity = true;
+  JITSim::JITFrontend active(*circuit, options);
+
+  for (JITSim::JITFrontend *jit : { &plain, &active }) {
+    jit->precompileParallel(max(thread::hardware_concurrency(), 1u));
+    jit->setInput("d", 0x9e3779b9);
+  }
+
+  /* The same blocks are busy in both runs, in a fixed pseudo random order */
+  vector<unsigned> order(num_blocks);
+  iota(order.begin(), order.end(), 0);
+  shuffle(order.begin(), order.end(), mt19937(1));
+
+  cout << "activity   plain (cycles/s)   activity mode (cycles/s)   speedup\n";
+  for (double factor : { 0.0, 0.01, 0.05, 0.1, 0.25, 0.5, 1.0 }) {
+    llvm::APInt enables(num_blocks, 0);
+    unsigned num_busy = factor * num_blocks + 0.5;
+    for (unsigned i = 0; i < num_busy; i++) {
+      enables.setBit(order[i]);
+    }
+
+    double plain_rate = measure(plain, enables, num_cycles);
+    double active_rate = measure(active, enables, num_cycles);
+    cout << factor << "   " << plain_rate << "   " << active_rate << "   "
+         << active_rate / plain_rate << "\n";
+  }
+
+  return 0;
+}
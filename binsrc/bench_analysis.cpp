@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <jitsim/circuit.hpp>
+#include <jitsim/primitive.hpp>
+#include <jitsim/simanalysis.hpp>
+
+using namespace std;
+using namespace JITSim;
+
+/* Times the dependency analysis of flat definitions of increasing size.
+ * Each definition is a chain of two input gates where gate i also reads
+ * gate 2i + 1, so every gate reaches the output and the sort has to look
+ * past the first few ready instances. Instances are stored output first,
+ * the reverse of their evaluation order */
+
+static const Definition & makeGate(deque<Definition> &definitions)
+{
+  vector<Sink> sinks;
+  sinks.emplace_back("out", 1);
+  vector<Source> sources;
+  sources.emplace_back("in0", 1);
+  sources.emplace_back("in1", 1);
+
+  definitions.emplace_back("bench.and",
+    IFace("self", move(sinks), move(sources), vector<ClkSink>(), vector<ClkSource>(), true),
+    Primitive([](auto &env, auto &args, auto &inst)
+    {
+      return vector<llvm::Value *> { env.getIRBuilder().CreateAnd(args[0], args[1], "out") };
+    }));
+
+  return definitions.back();
+}
+
+static const Definition & makeFlat(deque<Definition> &definitions, const Definition &gate, unsigned num_gates)
+{
+  vector<Sink> sinks;
+  sinks.emplace_back("out", 1);
+  vector<Source> sources;
+  sources.emplace_back("in", 1);
+
+  vector<Instance> instances;
+  instances.reserve(num_gates);
+  for (unsigned i = 0; i < num_gates; i++) {
+    instances.emplace_back(gate.makeInstance("g" + to_string(i)));
+  }
+
+  definitions.emplace_back("bench.flat",
+    IFace("self", move(sinks), move(sources), vector<ClkSink>(), vector<ClkSource>(), true),
+    move(instances),
+    [num_gates](Definition &defn, vector<Instance> &insts) {
+      auto driver = [&](unsigned idx) {
+        if (idx >= num_gates) {
+          return SourceSlice(&defn, nullptr, &defn.getIFace().getSources()[0], 0, 1);
+        }
+        return SourceSlice(nullptr, &insts[idx], &insts[idx].getIFace().getSources()[0], 0, 1);
+      };
+
+      for (unsigned i = 0; i < num_gates; i++) {
+        vector<Sink> &inputs = insts[i].getIFace().getSinks();
+        inputs[0].connect(Select(driver(i + 1)));
+        inputs[1].connect(Select(driver(2 * i + 1)));
+      }
+      defn.getIFace().getSinks()[0].connect(Select(driver(0)));
+    });
+
+  return definitions.back();
+}
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned max_gates = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1u << 20;
+  if (argc > 2 || max_gates == 0) {
+    cerr << "Usage: " << argv[0] << " [MAX_INSTANCES]\n";
+    return 1;
+  }
+
+  deque<Definition> definitions;
+  const Definition &gate = makeGate(definitions);
+
+  cout << "instances   construct (s)   analysis (s)   ns/instance\n";
+  for (unsigned num_gates = 1024; num_gates <= max_gates; num_gates *= 2) {
+    auto start = chrono::steady_clock::now();
+    const Definition &flat = makeFlat(definitions, gate, num_gates);
+    double build = secondsSince(start);
+
+    /* Construction includes one analysis, this times the analysis alone */
+    start = chrono::steady_clock::now();
+    SimInfo info(flat.getIFace(), flat.getInstances());
+    double analysis = secondsSince(start);
+
+    cout << num_gates << "   " << build << "   " << analysis << "   "
+         << analysis * 1e9 / num_gates << "\n";
+
+    definitions.pop_back();
+  }
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include <jitsim/coreir.hpp>
+#include <coreir/ir/context.h>
+#include <coreir/libs/commonlib.h>
+
+using namespace std;
+
+/* Times MaterializeArgs on generated designs with many parameterized
+ * instances, with and without memoized specializations. The top
+ * instantiates a parameterized module once per instance with one of a
+ * fixed number of distinct arguments, and that module passes its argument
+ * down to several parameterized children, so each specialization needs a
+ * copied definition and a nested walk. Memoized, the time grows with the
+ * number of distinct arguments and only a map lookup per instance beyond
+ * that. Unmemoized, every instance pays for the copy and the walk */
+
+static const int ValueWidth = 32;
+static const int LeavesPerMid = 8;
+
+static string bitsType()
+{
+  return "[\"Array\"," + to_string(ValueWidth) + ",\"Bit\"]";
+}
+
+static string valueArg(const string &value)
+{
+  return "[[\"BitVector\"," + to_string(ValueWidth) + "]," + value + "]";
+}
+
+static void writeDesign(ostream &out, unsigned num_insts, unsigned num_values)
+{
+  string param = "\"modparams\":{\"value\":[\"BitVector\"," + to_string(ValueWidth) + "]},";
+  string arg = valueArg("[\"Arg\",\"value\"]");
+
+  out << "{\"top\":\"global.top\",\n\"namespaces\":{\"global\":{\"modules\":{\n";
+
+  out << "\"Leaf\":{\"type\":[\"Record\",[[\"O\"," << bitsType() << "]]]," << param << "\n"
+      << "\"instances\":{\"c\":{\"genref\":\"coreir.const\",\"genargs\":{\"width\":[\"Int\","
+      << ValueWidth << "]},\"modargs\":{\"value\":" << arg << "}}},\n"
+      << "\"connections\":[[\"c.out\",\"self.O\"]]},\n";
+
+  out << "\"Mid\":{\"type\":[\"Record\",[[\"O\"," << bitsType() << "]]]," << param << "\n\"instances\":{";
+  for (int i = 0; i < LeavesPerMid; i++) {
+    out << (i ? ",\n" : "\n") << "\"l" << i << "\":{\"modref\":\"global.Leaf\",\"modargs\":{\"value\":" << arg << "}}";
+  }
+  out << "},\n\"connections\":[[\"l0.O\",\"self.O\"]]},\n";
+
+  out << "\"top\":{\"type\":[\"Record\",[[\"O\"," << bitsType() << "]]],\n\"instances\":{";
+  for (unsigned i = 0; i < num_insts; i++) {
+    char value[32];
+    snprintf(value, sizeof(value), "\"%d'h%x\"", ValueWidth, i % num_values);
+    out << (i ? ",\n" : "\n") << "\"m" << i << "\":{\"modref\":\"global.Mid\",\"modargs\":{\"value\":"
+        << valueArg(value) << "}}";
+  }
+  out << "},\n\"connections\":[[\"m0.O\",\"self.O\"]]}\n";
+
+  out << "}}}}\n";
+}
+
+/* Seconds spent in MaterializeArgs on the design, or a negative value if
+ * it failed to load */
+static double timeMaterialize(const string &path, bool memoize)
+{
+  using namespace CoreIR;
+
+  Context *ctx = newContext();
+  CoreIRLoadLibrary_commonlib(ctx);
+
+  Module *top = nullptr;
+  if (!loadFromFile(ctx, path, &top) || !top) {
+    deleteContext(ctx);
+    return -1;
+  }
+
+  ctx->addPass(new JITSim::MaterializeArgs(memoize));
+  ctx->runPasses({"rungenerators", "flattentypes"});
+
+  auto start = chrono::steady_clock::now();
+  ctx->runPasses({"materializeargs"});
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  deleteContext(ctx);
+
+  return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned max_insts = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1u << 14;
+  if (argc > 2 || max_insts == 0) {
+    cerr << "Usage: " << argv[0] << " [MAX_INSTANCES]\n";
+    return 1;
+  }
+
+  char path[] = "/tmp/jitsim_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    cerr << "Unable to create a temporary file\n";
+    return 1;
+  }
+  close(fd);
+
+  /* Each size runs once with a few distinct arguments, where the cost
+   * should follow the instance count only through lookups, and once with
+   * a distinct argument per instance */
+  cout << "instances   distinct args   memoized (s)   unmemoized (s)   speedup\n";
+  for (unsigned num_insts = 256; num_insts <= max_insts; num_insts *= 2) {
+    for (unsigned num_values : { 16u, num_insts }) {
+      {
+        ofstream out(path);
+        writeDesign(out, num_insts, num_values);
+      }
+
+      double memoized = timeMaterialize(path, true);
+      double unmemoized = timeMaterialize(path, false);
+      if (memoized < 0 || unmemoized < 0) {
+        cerr << "Failed to load the generated design\n";
+        unlink(path);
+        return 1;
+      }
+      cout << num_insts << "   " << num_values << "   " << memoized << "   " << unmemoized << "   "
+           << unmemoized / memoized << "\n";
+    }
+  }
+
+  unlink(path);
+
+  return 0;
+}
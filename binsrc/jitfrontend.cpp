@@ -1,10 +1,17 @@
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <regex>
 #include <ctime>
+#include <thread>
 
+#include <jitsim/aot.hpp>
+#include <jitsim/batch_runner.hpp>
+#include <jitsim/circuit_file.hpp>
 #include <jitsim/jit_frontend.hpp>
 #include <jitsim/coreir.hpp>
+#include <jitsim/json_loader.hpp>
 #include <coreir/ir/context.h>
 #include <coreir/libs/commonlib.h>
 
@@ -36,19 +43,162 @@ JITSim::Circuit loadJSON(const string &str)
   return circuit;
 }
 
+static int runBatch(const JITSim::Circuit &circuit, const JITSim::JITOptions &options,
+                    const string &list_path, unsigned num_threads)
+{
+  using namespace JITSim;
+
+  ifstream list(list_path);
+  if (!list) {
+    cerr << "Unable to open " << list_path << "\n";
+    return 1;
+  }
+
+  vector<StimulusJob> jobs;
+  string path;
+  while (getline(list, path)) {
+    if (!path.empty()) {
+      jobs.push_back({ path });
+    }
+  }
+
+  CompiledCircuit compiled(circuit, options);
+  BatchReport report = RunBatch(compiled, jobs, num_threads);
+
+  unsigned failed = 0;
+  for (const JobResult &result : report.results) {
+    if (!result.completed) {
+      cout << "ERROR " << result.path << ": " << result.error << "\n";
+    } else {
+      cout << (result.passed() ? "PASS " : "FAIL ") << result.path << ": " << result.cycles << " cycles, "
+           << result.mismatches << " mismatches, " << result.seconds << "s\n";
+    }
+    failed += !result.passed();
+  }
+
+  cout << jobs.size() - failed << "/" << jobs.size() << " passed, " << report.total_cycles << " cycles in "
+       << report.seconds << "s (" << report.getCyclesPerSecond() << " cycles/s) on " << report.num_threads << " threads\n";
+
+  return failed ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+  cerr << "Usage: " << prog << " [options] design.json|design.jsc\n";
+  cerr << "Options:\n";
+  cerr << "  --native-json      Load flattened netlists with the native loader instead of CoreIR\n";
+  cerr << "  --save-circuit FILE Save the loaded and analyzed circuit to FILE for faster reloads\n";
+  cerr << "  --cache-dir DIR    Reuse compiled objects stored in DIR across runs\n";
+  cerr << "  --jobs N           Compile all definitions up front on N threads (0 = all cores)\n";
+  cerr << "  --tiered           Start at O0 and recompile hot definitions at O3 in the background\n";
+  cerr << "  --tier-threshold N Calls before a definition is recompiled (default 10000)\n";
+  cerr << "  --merged           Compile the whole hierarchy as one module with cross-definition inlining\n";
+  cerr << "  --activity         Skip subcircuits whose inputs and state did not change\n";
+  cerr << "  --aot PREFIX       Write PREFIX.o and PREFIX.h for a prebuilt simulator and exit\n";
+  cerr << "  --aot-symbols NAME Start the --aot symbols with NAME_ instead of the top's name\n";
+  cerr << "  --probe SIGNAL     Record inst.port on every evaluation for print, '*' records all ports\n";
+  cerr << "  --trace FILE       Dump a VCD of the probed signals, or of everything without --probe\n";
+  cerr << "  --batch LIST       Run every stimulus file listed in LIST, one path per line, and exit\n";
+  cerr << "  --batch-threads N  Worker threads for --batch (default: all cores)\n";
+}
+
 int main(int argc, char *argv[])
 {
   using namespace JITSim;
 
-  if (argc < 2) {
+  JITOptions options;
+  string json_file;
+  string aot_prefix;
+  string aot_symbols;
+  string batch_list;
+  unsigned batch_threads = max(thread::hardware_concurrency(), 1u);
+  bool native_json = false;
+  string save_circuit;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--cache-dir" && i + 1 < argc) {
+      options.cache_dir = argv[++i];
+    } else if (arg == "--jobs" && i + 1 < argc) {
+      options.compile_threads = stoul(argv[++i]);
+      if (options.compile_threads == 0) {
+        options.compile_threads = max(thread::hardware_concurrency(), 1u);
+      }
+    } else if (arg == "--aot" && i + 1 < argc) {
+      aot_prefix = argv[++i];
+    } else if (arg == "--aot-symbols" && i + 1 < argc) {
+      aot_symbols = argv[++i];
+    } else if (arg == "--probe" && i + 1 < argc) {
+      options.probes.push_back(argv[++i]);
+    } else if (arg == "--trace" && i + 1 < argc) {
+      options.trace_file = argv[++i];
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (arg == "--batch-threads" && i + 1 < argc) {
+      batch_threads = max(stoul(argv[++i]), 1ul);
+    } else if (arg == "--save-circuit" && i + 1 < argc) {
+      save_circuit = argv[++i];
+    } else if (arg == "--native-json") {
+      native_json = true;
+    } else if (arg == "--merged") {
+      options.merged = true;
+    } else if (arg == "--activity") {
+      options.activity = true;
+    } else if (arg == "--tiered") {
+      options.tiered = true;
+    } else if (arg == "--tier-threshold" && i + 1 < argc) {
+      options.tier_up_threshold = stoull(argv[++i]);
+    } else if (arg.size() > 0 && arg[0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      json_file = arg;
+    }
+  }
+
+  if (json_file.empty()) {
     cerr << "Provide a json file to load\n";
+    usage(argv[0]);
     return 1;
   }
 
-  Circuit circuit = loadJSON(argv[1]);
+  /* Saved circuit files are used as is. With --native-json flattened
+   * netlists skip building a CoreIR Context, and everything the native
+   * loader rejects goes through CoreIR's passes */
+  unique_ptr<Circuit> circuit_ptr;
+  if (IsCircuitFile(json_file)) {
+    circuit_ptr = LoadCircuit(json_file);
+    if (!circuit_ptr) {
+      return 1;
+    }
+  } else if (native_json) {
+    circuit_ptr = LoadJSONNetlist(json_file);
+    if (!circuit_ptr) {
+      cerr << "Falling back to the CoreIR loader\n";
+    }
+  }
+  if (!circuit_ptr) {
+    circuit_ptr = make_unique<Circuit>(loadJSON(json_file));
+  }
+  const Circuit &circuit = *circuit_ptr;
+
+  if (!save_circuit.empty() && !SaveCircuit(circuit, save_circuit)) {
+    return 1;
+  }
+
+  if (!aot_prefix.empty()) {
+    return CompileAOT(circuit, aot_prefix, aot_symbols) ? 0 : 1;
+  }
+
+  if (!batch_list.empty()) {
+    return runBatch(circuit, options, batch_list, batch_threads);
+  }
+
   circuit.print();
 
-  JITFrontend jit(circuit);
+  JITFrontend jit(circuit, options);
+  if (!options.trace_file.empty() && !jit.isTracing()) {
+    return 1;
+  }
   jit.dumpIR();
 
   LLVMStruct out = jit.computeOutput();
@@ -57,10 +207,14 @@ int main(int argc, char *argv[])
   cout << "\n";
 
   int advance = 0;
-  regex next(R"(next(?:\s+(\d+))?)");
-  regex assign(R"(assign\s+(\w+)\s+(\d+))");
-  regex print(R"(print\s+((\w+.)+(\w+)))");
+  regex next(R"(^next(?:\s+(\d+))?)");
+  regex run(R"(^run\s+(\d+))");
+  regex assign(R"(^assign\s+(\w+)\s+(\d+))");
+  regex print(R"(^print\s+((\w+.)+(\w+)))");
   regex instsplit(R"((\w+))");
+  regex save(R"(^save\s+(\S+))");
+  regex load(R"(^load\s+(\S+))");
+  regex tick(R"(^tick\s+(\S+))");
   
   int numcycles = -1;
   //clock_t start = 0;
@@ -78,7 +232,28 @@ int main(int argc, char *argv[])
         break;
       }
       smatch match;
-      if (regex_search(input, match, next)) {
+      if (regex_search(input, match, save)) {
+        if (jit.saveCheckpoint(match[1])) {
+          cout << "Saved " << match[1] << "\n";
+        }
+      } else if (regex_search(input, match, load)) {
+        if (jit.loadCheckpoint(match[1])) {
+          out = jit.computeOutput();
+          out.dump();
+        }
+      } else if (regex_search(input, match, tick)) {
+        /* Steps a single clock domain, where next steps all of them */
+        if (jit.tick(match[1])) {
+          out = jit.computeOutput();
+          out.dump();
+        } else {
+          cout << "Unknown clock " << match[1] << "\n";
+        }
+      } else if (regex_search(input, match, run)) {
+        /* Unlike next, only the final outputs are printed */
+        out = jit.run(stoull(match[1]));
+        out.dump();
+      } else if (regex_search(input, match, next)) {
         if (match[1] == "") {
           advance = 1;
         } else {
@@ -23,6 +23,7 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
+#include <jitsim/object_cache.hpp>
 #include <algorithm>
 #include <memory>
 #include <unordered_set>
@@ -36,6 +37,7 @@ namespace JITSim {
 class JIT {
 private:
   const llvm::DataLayout data_layout;
+  DiskObjectCache *object_cache;
   std::unique_ptr<llvm::orc::JITCompileCallbackManager> compile_callback_manager;
   std::unique_ptr<llvm::orc::IndirectStubsManager> indirect_stubs_manager;
   using TransformFunction =
@@ -48,40 +50,84 @@ private:
   llvm::orc::IRTransformLayer<decltype(compile_layer), TransformFunction> optimize_layer;
   llvm::orc::IRTransformLayer<decltype(optimize_layer), TransformFunction> debug_layer;
 
-  std::shared_ptr<llvm::Module> optimizeModule(std::shared_ptr<llvm::Module> module);
+  std::shared_ptr<llvm::Module> optimizeModule(std::shared_ptr<llvm::Module> module, unsigned level);
   std::shared_ptr<llvm::Module> debugModule(std::shared_ptr<llvm::Module> module);
   std::string mangle(const std::string name);
 
+  /* The compile layer hands back object handles, so modules and objects
+   * loaded from the cache share one handle type */
   using ModuleHandle = decltype(debug_layer)::ModuleHandleT;
 
   std::unordered_map<std::string, std::deque<TransformFunction>> debug_functions;
   std::unordered_map<std::string, ModuleHandle> live_modules;
   std::unordered_set<llvm::JITTargetAddress> callback_addrs;
+  std::unordered_map<std::string, llvm::JITTargetAddress> lazy_callbacks;
+  std::unordered_map<std::string, uint64_t> call_counters;
 
+  std::shared_ptr<llvm::JITSymbolResolver> createResolver();
   void removeModule(ModuleHandle handle);
   llvm::JITTargetAddress updateStub(const std::string &name);
 
   bool debug_print_ir;
+  unsigned opt_level;
+  bool inline_functions;
 
 public:
 
-  JIT(llvm::TargetMachine &target_machine, const llvm::DataLayout &data_layout);
+  JIT(llvm::TargetMachine &target_machine, const llvm::DataLayout &data_layout,
+      DiskObjectCache *object_cache = nullptr);
 
   llvm::JITSymbol findSymbol(const std::string name);
 
   llvm::JITTargetAddress getSymbolAddress(const std::string name);
 
   ModuleHandle addModule(std::shared_ptr<llvm::Module> module);
+  ModuleHandle addObject(DiskObjectCache::ObjectPtr object);
+
+  /* If cache_key is non empty and an object cache is attached, a cached
+   * object is linked in place of calling module_generator */
   void addLazyFunction(const std::string &name,
-                       std::function<std::shared_ptr<llvm::Module>()> module_generator);
+                       std::function<std::shared_ptr<llvm::Module>()> module_generator,
+                       const std::string &cache_key = "");
   std::deque<TransformFunction>::iterator addDebugTransform(const std::string &name,
                                                             TransformFunction debug_transform);
 
   void removeDebugTransform(const std::string &name, std::deque<TransformFunction>::iterator iter);
   bool removeModule(const std::string &name);
 
+  /* Optimizes and compiles module to an object without linking it. Safe to
+   * call from several threads as long as each uses its own TargetMachine and
+   * the modules live in distinct LLVMContexts */
+  DiskObjectCache::ObjectPtr compileObject(std::shared_ptr<llvm::Module> module,
+                                           llvm::TargetMachine &target_machine,
+                                           unsigned level,
+                                           const std::string &cache_key = "");
+  DiskObjectCache::ObjectPtr loadCachedObject(const std::string &cache_key);
+
+  /* Links an object defining name and points name's stub at it, replacing
+   * the pending lazy compile */
+  void addCompiledFunction(const std::string &name, DiskObjectCache::ObjectPtr object);
+  bool isCompiled(const std::string &name) const { return live_modules.count(name) > 0; }
+
+  /* Swaps the live definition of name for object, e.g. a recompile at a
+   * higher optimization level. Must not race with calls into name */
+  void replaceFunction(const std::string &name, DiskObjectCache::ObjectPtr object);
+
+  /* Allocates the call counter of name, which lives as long as the JIT */
+  const uint64_t * addCallCounter(const std::string &name);
+  /* Increments counter on every entry into name. The counter address is
+   * baked into the code, so instrumented modules must not be cached */
+  static void instrumentCallCounter(llvm::Module &module, const std::string &name, const uint64_t *counter);
+
   void precompileIR();
   void precompileDumpIR();
+
+  unsigned getOptLevel() const { return opt_level; }
+  void setOptLevel(unsigned level) { opt_level = level; }
+  void setInlining(bool enable) { inline_functions = enable; }
+
+  /* The pass pipeline used for every module, shared with ahead of time compilation */
+  static void runOptimizations(llvm::Module &module, unsigned level, bool inline_functions);
 };
 
 } // end namespace JITSim
@@ -0,0 +1,42 @@
+#ifndef JITSIM_ACTIVITY_HPP_INCLUDED
+#define JITSIM_ACTIVITY_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <unordered_map>
+
+namespace JITSim {
+
+/* Lays out the activity buffer, which caches the compute_output results of
+ * composite instances so that idle subcircuits are skipped. Each cached
+ * instance gets an entry in its parent's region: a clean byte that is set
+ * once the entry is filled and cleared whenever the instance's state
+ * changes, followed by the inputs of the last call and the outputs it
+ * returned, each rounded up to whole bytes. Like the probe buffer, a
+ * definition's region holds its own entries followed by the regions of
+ * its children. The buffer follows the top's state in the state blob, so
+ * it is saved, forked and restored together with the state it caches */
+class ActivityLayout {
+private:
+  std::unordered_map<const Definition *, unsigned> region_bytes;
+  std::unordered_map<const Instance *, unsigned> entry_offsets;
+  std::unordered_map<const Instance *, unsigned> inst_offsets;
+
+  unsigned layoutDefinition(const Definition &defn);
+
+public:
+  explicit ActivityLayout(const Definition &top);
+
+  unsigned getNumBytes(const Definition &defn) const;
+  bool hasActivity(const Definition &defn) const { return getNumBytes(defn) > 0; }
+
+  /* Offset of inst's region within its parent's region */
+  unsigned getOffset(const Instance *inst) const { return inst_offsets.find(inst)->second; }
+
+  bool hasEntry(const Instance *inst) const { return entry_offsets.count(inst); }
+  unsigned getEntryOffset(const Instance *inst) const { return entry_offsets.find(inst)->second; }
+};
+
+}
+
+#endif
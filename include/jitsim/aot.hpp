@@ -0,0 +1,23 @@
+#ifndef JITSIM_AOT_HPP_INCLUDED
+#define JITSIM_AOT_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <string>
+
+namespace JITSim {
+
+/* Compiles the hierarchy under the circuit's top definition ahead of time.
+ * Writes <prefix>.o, a position independent object exporting the
+ * compute_output, update_state and run_cycles wrappers plus the initial
+ * state, and <prefix>.h, a C header describing the wrapper structs. Every
+ * exported symbol and header declaration starts with symbol_prefix, or
+ * the top's name when that is empty, followed by an underscore. Link the
+ * object with `cc -shared` to get a simulator that can be dlopened.
+ * Returns false and prints a diagnostic if either file can't be written */
+bool CompileAOT(const Circuit &circuit, const std::string &prefix, const std::string &symbol_prefix = "",
+                unsigned opt_level = 3);
+
+}
+
+#endif
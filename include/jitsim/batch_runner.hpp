@@ -0,0 +1,50 @@
+#ifndef JITSIM_BATCH_RUNNER_HPP_INCLUDED
+#define JITSIM_BATCH_RUNNER_HPP_INCLUDED
+
+#include <jitsim/compiled_circuit.hpp>
+
+#include <string>
+#include <vector>
+
+namespace JITSim {
+
+/* A stimulus file holds one command per line, '#' starts a comment:
+ *   assign INPUT VALUE   sets an input
+ *   run N                advances N cycles
+ *   expect OUTPUT VALUE  compares an output against VALUE
+ * Values are decimal. An expected value wider than its output fails the
+ * job rather than being truncated into a match */
+struct StimulusJob {
+  std::string path;
+};
+
+struct JobResult {
+  std::string path;
+  bool completed;
+  uint64_t cycles;
+  uint64_t mismatches;
+  double seconds;
+  std::string error;
+
+  bool passed() const { return completed && mismatches == 0; }
+};
+
+struct BatchReport {
+  std::vector<JobResult> results;
+  uint64_t total_cycles;
+  double seconds;
+  /* Workers actually started, at most one per job */
+  unsigned num_threads;
+
+  double getCyclesPerSecond() const { return seconds > 0 ? total_cycles / seconds : 0; }
+};
+
+/* Runs every job on its own Simulation of circuit, which gets frozen first.
+ * Each of the num_threads workers starts with a share of the jobs and
+ * steals from the others once its own run out, so a few long stimuli do
+ * not leave the rest of the cores idle. Results keep the order of jobs */
+BatchReport RunBatch(CompiledCircuit &circuit, const std::vector<StimulusJob> &jobs, unsigned num_threads);
+
+}
+
+#endif
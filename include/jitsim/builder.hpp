@@ -13,6 +13,7 @@
 #include <llvm/Target/TargetMachine.h>
 
 #include <iostream>
+#include <functional>
 #include <unordered_map>
 #include <memory>
 
@@ -21,25 +22,51 @@ namespace JITSim {
 class Source;
 class Sink;
 class FunctionEnvironment;
+class ProbeLayout;
+class ActivityLayout;
 
 class ModuleEnvironment {
 private:
   std::shared_ptr<llvm::Module> module;
   llvm::LLVMContext *context;
   std::unique_ptr<llvm::DIBuilder> di_builder;
+  unsigned lanes;
+  bool bit_sliced;
+  const ProbeLayout *probe_layout;
+  const ActivityLayout *activity_layout;
 
   std::unordered_map<std::string, llvm::Function *> named_functions;
 
   std::unordered_map<const Source *, llvm::Value *> src_value_lookup; 
   std::unordered_map<const Sink *, llvm::Value *> sink_value_lookup; 
 public:
-  ModuleEnvironment(std::unique_ptr<llvm::Module> &&module_, llvm::LLVMContext *context_)
-    : module(move(module_)), context(context_), di_builder(std::make_unique<llvm::DIBuilder>(*module))
+  ModuleEnvironment(std::unique_ptr<llvm::Module> &&module_, llvm::LLVMContext *context_,
+                    unsigned lanes_ = 1, bool bit_sliced_ = false)
+    : module(move(module_)), context(context_), di_builder(std::make_unique<llvm::DIBuilder>(*module)),
+      lanes(lanes_), bit_sliced(bit_sliced_), probe_layout(nullptr), activity_layout(nullptr)
   {}
 
   llvm::LLVMContext & getContext() { return *context; }
   llvm::DIBuilder & getDIBuilder() { return *di_builder; }
 
+  /* Number of independent simulations every value in this module carries.
+   * With more than one lane, a width bit value is a <lanes x iwidth> vector.
+   * Bit sliced modules transpose that into <width x ilanes>, where word b
+   * holds bit b of every simulation */
+  unsigned getLanes() const { return lanes; }
+  bool isBitSliced() const { return bit_sliced; }
+  llvm::Type * getValueType(unsigned width);
+  llvm::Constant * getConstant(const llvm::APInt &val);
+
+  /* Probed signals get stored into the probe buffer, see ProbeLayout */
+  const ProbeLayout * getProbeLayout() const { return probe_layout; }
+  void setProbeLayout(const ProbeLayout *layout) { probe_layout = layout; }
+
+  /* Child compute_output results are cached in the activity buffer, see
+   * ActivityLayout. Only scalar modules track activity */
+  const ActivityLayout * getActivityLayout() const { return activity_layout; }
+  void setActivityLayout(const ActivityLayout *layout) { activity_layout = layout; }
+
   llvm::Function * getFunctionDecl(const std::string &name);
   llvm::Function * makeFunctionDecl(const std::string &name, llvm::FunctionType *function_type);
   FunctionEnvironment makeFunction(const std::string &name, llvm::FunctionType *function_type);
@@ -104,11 +131,15 @@ class Builder {
       : data_layout(dl), triple(target_machine.getTargetTriple().getTriple())
     {}
 
-    ModuleEnvironment makeModule(const std::string &name);
+    ModuleEnvironment makeModule(const std::string &name, unsigned lanes = 1, bool bit_sliced = false);
 
     llvm::LLVMContext & getContext() { return context; }
 };
 
+/* Generates a module in the given Builder's context, which lets the same
+ * code generation run on any thread that owns a Builder */
+using ModuleGenerator = std::function<std::shared_ptr<llvm::Module>(Builder &)>;
+
 } // end namespace JITSim
 
 #endif // JITSIM_JIT_HPP_INCLUDED
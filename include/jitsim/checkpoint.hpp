@@ -0,0 +1,63 @@
+#ifndef JITSIM_CHECKPOINT_HPP_INCLUDED
+#define JITSIM_CHECKPOINT_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace JITSim {
+
+/* Simulation state, either owned on the heap or mapped copy on write from
+ * a checkpoint file. A mapped state only faults in the pages the
+ * simulation touches, and writes never reach the file */
+class StateBuffer {
+private:
+  std::vector<uint8_t> heap;
+  uint8_t *mapping;
+  size_t mapping_size;
+  uint8_t *ptr;
+  size_t num_bytes;
+
+  void unmap();
+
+public:
+  StateBuffer(std::vector<uint8_t> &&initial);
+  ~StateBuffer();
+
+  StateBuffer(const StateBuffer &) = delete;
+  StateBuffer & operator=(const StateBuffer &) = delete;
+
+  /* Maps num_bytes at offset of fd, which must be page aligned */
+  bool mapFile(int fd, uint64_t offset, size_t num_bytes);
+
+  uint8_t *data() { return ptr; }
+  const uint8_t *data() const { return ptr; }
+  size_t size() const { return num_bytes; }
+  const uint8_t *begin() const { return ptr; }
+  const uint8_t *end() const { return ptr + num_bytes; }
+};
+
+/* Copies state into an unlinked temporary file once and maps it privately
+ * num_children times, so the children share every page until they write to
+ * it and only the pages each one modifies are duplicated */
+std::vector<std::unique_ptr<StateBuffer>> ForkState(const StateBuffer &state, unsigned num_children);
+
+/* Identifies the state layout of top: the state offsets of every stateful
+ * instance in the hierarchy. A checkpoint only loads into a simulation
+ * with the same fingerprint */
+std::string GetLayoutFingerprint(const Definition &top);
+
+/* Checkpoint files start with a fixed header, followed by the state at a
+ * page aligned offset so it can be mapped, followed by the input buffers */
+bool SaveCheckpoint(const std::string &path, const std::string &fingerprint, const StateBuffer &state,
+                    const std::vector<std::pair<const uint8_t *, size_t>> &inputs);
+bool LoadCheckpoint(const std::string &path, const std::string &fingerprint, StateBuffer &state,
+                    const std::vector<std::pair<uint8_t *, size_t>> &inputs);
+
+}
+
+#endif
@@ -4,8 +4,11 @@
 #include <jitsim/simanalysis.hpp>
 #include <jitsim/primitive.hpp>
 #include <jitsim/optional.hpp>
+#include <jitsim/intern.hpp>
 
 #include <cassert>
+#include <cstdint>
+#include <memory>
 #include <unordered_map>
 #include <string>
 #include <iostream>
@@ -22,52 +25,65 @@ class IFace;
 class Definition;
 class Instance;
 
+class Sink;
+
 class Source {
 private:
-  std::string name;
+  Symbol name;
   int width;
 public:
   Source(const std::string &name_, int w)
-    : name(name_), width(w)
+    : name(InternSymbol(name_)), width(w)
   {}
 
+  /* The source facing sink across an instance boundary */
+  explicit Source(const Sink &sink);
+
   Source(const Source &) = delete;
   Source(Source &&) = default;
 
-  const std::string & getName() const { return name; }
+  const std::string & getName() const { return GetSymbolName(name); }
+  Symbol getSymbol() const { return name; }
   int getWidth() const { return width; }
 };
 
 class SourceSlice {
 private:
-  const Definition *definition;
-  const Instance *instance;
-  const IFace *iface;
+  enum class Kind : uint8_t { Constant, Definition, Instance };
+
+  /* Constants have no source, so the owner slot holds their interned value */
+  union {
+    const Definition *definition;
+    const Instance *instance;
+    const llvm::APInt *constant;
+  };
   const Source *val;
   int offset;
   int width;
-  optional<llvm::APInt> constant;
+  Kind kind;
 
 public:
   SourceSlice(const Definition *definition_, const Instance *instance_,
              const Source *val_, int offset_, int width_);
 
   SourceSlice(const std::vector<bool> &constant_);
+  SourceSlice(const llvm::APInt &constant_);
 
-  const Definition * getDefinition() const { return definition; }
-  const Instance * getInstance() const { return instance; }
-  const IFace * getIFace() const { return iface; }
+  const Definition * getDefinition() const { return kind == Kind::Definition ? definition : nullptr; }
+  const Instance * getInstance() const { return kind == Kind::Instance ? instance : nullptr; }
+  const IFace * getIFace() const;
   const Source * getSource() const { return val; }
-  const llvm::APInt & getConstant() const { return *constant; }
+  const llvm::APInt & getConstant() const { assert(isConstant()); return *constant; }
 
   int getEndIdx() const { return offset + width; }
   int getWidth() const { return width; }
   int getOffset() const { return offset; }
   bool isWhole() const { return offset == 0 && width == val->getWidth(); }
-  bool isConstant() const { return constant.has_value(); }
-  bool isDefinitionAttached() const { return !!definition; }
-  bool isInstanceAttached() const { return !!instance; }
+  bool isConstant() const { return kind == Kind::Constant; }
+  bool isDefinitionAttached() const { return kind == Kind::Definition; }
+  bool isInstanceAttached() const { return kind == Kind::Instance; }
 
+  /* Widens a source slice over the adjacent bits of the same source */
   void extend(const SourceSlice &other);
 
   std::string repr() const;
@@ -96,12 +112,16 @@ public:
 
 class Sink {
 private:
-  std::string name;
+  Symbol name;
   int width;
   optional<Select> select;
 public:
   Sink(const std::string &name_, int w)
-    : name(name_), width(w), select() {}
+    : name(InternSymbol(name_)), width(w), select() {}
+
+  /* The sink facing src across an instance boundary */
+  explicit Sink(const Source &src)
+    : name(src.getSymbol()), width(src.getWidth()), select() {}
 
   Sink(const Sink &) = delete;
   Sink(Sink &&) = default;
@@ -111,46 +131,81 @@ public:
 
   const Select & getSelect() const { return *select; }
 
-  const std::string & getName() const { return name; }
+  const std::string & getName() const { return GetSymbolName(name); }
+  Symbol getSymbol() const { return name; }
   int getWidth() const { return width; }
 };
 
+inline Source::Source(const Sink &sink)
+  : name(sink.getSymbol()), width(sink.getWidth())
+{}
+
 class ClkSource {
 private:
-  std::string name;
+  Symbol name;
 public:
   ClkSource(const std::string &name_)
-    : name(name_)
+    : name(InternSymbol(name_))
   {}
 
-  const std::string & getName() const { return name; }
+  const std::string & getName() const { return GetSymbolName(name); }
+  Symbol getSymbol() const { return name; }
 };
 
 class ClkSink {
 private:
-  std::string name;
+  Symbol name;
   const ClkSource *source;
 public:
   ClkSink(const std::string &name_, const ClkSource *source_)
-    : name(name_), source(source_)
+    : name(InternSymbol(name_)), source(source_)
   {}
 
-  const std::string & getName() const { return name; }
+  const std::string & getName() const { return GetSymbolName(name); }
+  Symbol getSymbol() const { return name; }
 
   bool isConnected() const { return source != nullptr; }
+  const ClkSource * getSource() const { return source; }
   void connect(const ClkSource *source_) { source = source_; }
 };
 
+/* Port indices by name. A definition shares its lookup with the interfaces
+ * of all its instances, whose sinks and sources are the definition's
+ * sources and sinks respectively */
+struct PortLookup {
+  std::unordered_map<Symbol, unsigned> sinks;
+  std::unordered_map<Symbol, unsigned> sources;
+};
+
 class IFace {
 private:
-  std::string name;
+  Symbol name;
   std::vector<Sink> sinks;
   std::vector<Source> sources;
   std::vector<ClkSink> clk_sinks;
   std::vector<ClkSource> clk_sources;
-  std::unordered_map<std::string, Sink *> sink_lookup;
-  std::unordered_map<std::string, Source *> source_lookup;
+  std::shared_ptr<const PortLookup> lookup;
   bool is_definition;
+
+  const std::unordered_map<Symbol, unsigned> & getSinkLookup() const
+  {
+    return is_definition ? lookup->sinks : lookup->sources;
+  }
+
+  const std::unordered_map<Symbol, unsigned> & getSourceLookup() const
+  {
+    return is_definition ? lookup->sources : lookup->sinks;
+  }
+
+protected:
+  IFace(const std::string &name_,
+        std::vector<Sink> &&sinks_,
+        std::vector<Source> &&sources_,
+        std::vector<ClkSink> &&clk_sinks,
+        std::vector<ClkSource> &&clk_sources,
+        std::shared_ptr<const PortLookup> lookup_,
+        const bool is_definition_);
+
 public:
   IFace(const std::string &name_,
         std::vector<Sink> &&sinks_,
@@ -161,8 +216,10 @@ public:
 
   IFace(const IFace &) = delete;
   IFace(IFace &&) = default;
+  IFace & operator=(IFace &&) = default;
 
-  const std::string & getName() const { return name; }
+  const std::string & getName() const { return GetSymbolName(name); }
+  Symbol getSymbol() const { return name; }
   const std::vector<Source> & getSources() const { return sources; }
   const std::vector<Sink> & getSinks() const { return sinks; }
   std::vector<Source> & getSources() { return sources; }
@@ -170,13 +227,35 @@ public:
 
   const std::vector<ClkSource> & getClkSources() const { return clk_sources; }
   const std::vector<ClkSink> & getClkSinks() const { return clk_sinks; }
+  std::vector<ClkSink> & getClkSinks() { return clk_sinks; }
+
+  /* Position of clk among this interface's clock sources, or -1 when it
+   * belongs to another interface. There are only ever a few clocks */
+  int getClkSourceIndex(const ClkSource *clk) const
+  {
+    for (size_t i = 0; i < clk_sources.size(); i++) {
+      if (&clk_sources[i] == clk) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  bool hasSource(Symbol name) const { return getSourceLookup().count(name); }
+  bool hasSink(Symbol name) const { return getSinkLookup().count(name); }
+  const Source * getSource(Symbol name) const { return &sources[getSourceLookup().find(name)->second]; }
+  const Sink * getSink(Symbol name) const { return &sinks[getSinkLookup().find(name)->second]; }
+  Source * getSource(Symbol name) { return &sources[getSourceLookup().find(name)->second]; }
+  Sink * getSink(Symbol name) { return &sinks[getSinkLookup().find(name)->second]; }
+
+  bool hasSource(const std::string &name) const { return hasSource(LookupSymbol(name)); }
+  bool hasSink(const std::string &name) const { return hasSink(LookupSymbol(name)); }
+  const Source * getSource(const std::string &name) const { return getSource(LookupSymbol(name)); }
+  const Sink * getSink(const std::string &name) const { return getSink(LookupSymbol(name)); }
+  Source * getSource(const std::string &name) { return getSource(LookupSymbol(name)); }
+  Sink * getSink(const std::string &name) { return getSink(LookupSymbol(name)); }
 
-  bool hasSource(const std::string &name) const { return source_lookup.count(name); }
-  bool hasSink(const std::string &name) const { return sink_lookup.count(name); }
-  const Source * getSource(const std::string &name) const;
-  const Sink * getSink(const std::string &name) const;
-  Source * getSource(const std::string &name);
-  Sink * getSink(const std::string &name);
+  const std::shared_ptr<const PortLookup> & getPortLookup() const { return lookup; }
 
   void print(const std::string &prefix = "") const;
   void print_connectivity(const std::string &prefix = "") const;
@@ -187,23 +266,29 @@ public:
 
 class InstanceIFace : public IFace {
 private:
-  std::unordered_map<const Source *, const Sink *> defn_source_to_sink;
+  /* Sink i of the instance is fed to source i of the definition */
+  const Source *defn_sources;
 
 public:
   InstanceIFace(const std::string &name_, const IFace &defn_iface);
 
+  using IFace::getSink;
   const Sink * getSink(const Source *src) const 
   {
-    return defn_source_to_sink.find(src)->second;
+    return &getSinks()[src - defn_sources];
   }
+
+  /* Follows the instance to another definition with the same ports */
+  void rebind(const IFace &defn_iface) { defn_sources = defn_iface.getSources().data(); }
 };
 
 class Instance {
 private:
-  std::string name;
   InstanceIFace interface;
   const Definition *defn;
-  std::unordered_map<std::string, std::string> args;
+  /* Key, value symbol pairs. Primitives take a handful of arguments, so a
+   * scan beats hashing */
+  std::vector<std::pair<Symbol, Symbol>> args;
 public:
   Instance(const std::string &name_, 
            const Definition *defn);
@@ -212,9 +297,17 @@ public:
   const InstanceIFace & getIFace() const { return interface; }
   const SimInfo & getSimInfo() const;
   const Definition & getDefinition() const { return *defn; }
-  const std::string & getName() const { return name; }
-  const std::string & getArg(const std::string &key) const { return args.find(key)->second; }
-  void setArg(const std::string &key, const std::string &val) { args[key] = val; }
+  const std::string & getName() const { return interface.getName(); }
+  Symbol getSymbol() const { return interface.getSymbol(); }
+  const std::string & getArg(Symbol key) const;
+  const std::string & getArg(const std::string &key) const { return getArg(LookupSymbol(key)); }
+  const std::vector<std::pair<Symbol, Symbol>> & getArgs() const { return args; }
+  void setArg(const std::string &key, const std::string &val);
+  /* Switches to a structurally identical definition, see Circuit::deduplicate */
+  void redirect(const Definition *defn_);
+  /* Switches to a definition with other ports. Every sink starts out
+   * unconnected, and the caller reconnects slices of the old sources */
+  void replaceDefinition(const Definition *defn_);
 
   void print(const std::string &prefix = "") const;
 };
@@ -226,7 +319,7 @@ private:
   IFace interface;
 
   std::vector<Instance> instances;
-  std::unordered_map<std::string, const Instance *> instance_lookup;
+  std::unordered_map<Symbol, const Instance *> instance_lookup;
 
   SimInfo siminfo;
 public:
@@ -235,6 +328,13 @@ public:
              std::vector<Instance> &&instances,
              std::function<void (Definition&, std::vector<Instance> &instances)> make_connections);
 
+  /* Restores previously computed dependency orders instead of analyzing */
+  Definition(const std::string &name,
+             IFace &&interface,
+             std::vector<Instance> &&instances,
+             std::function<void (Definition&, std::vector<Instance> &instances)> make_connections,
+             const SimOrders &orders);
+
   Definition(const std::string &name,
              IFace &&interface,
              const Primitive &primitive);
@@ -246,7 +346,15 @@ public:
   const std::string & getName() const { return name; }
   const std::string & getSafeName() const { return safe_name; }
   const SimInfo & getSimInfo() const { return siminfo; }
-  const Instance & getInstance(const std::string &name) const;
+  bool hasInstance(Symbol name) const { return instance_lookup.count(name); }
+  bool hasInstance(const std::string &name) const { return hasInstance(LookupSymbol(name)); }
+  const Instance & getInstance(Symbol name) const { return *instance_lookup.find(name)->second; }
+  const Instance & getInstance(const std::string &name) const { return getInstance(LookupSymbol(name)); }
+  const std::vector<Instance> & getInstances() const { return instances; }
+  std::vector<Instance> & getInstances() { return instances; }
+
+  /* Recomputes the SimInfo after instances were rewired */
+  void reanalyze() { siminfo = SimInfo(interface, instances); }
 
   void print(const std::string &prefix = "") const;
 };
@@ -255,15 +363,31 @@ class Circuit {
 private:
   std::deque<Definition> definitions;
   Definition *top_defn;
+  std::vector<const Definition *> unique_definitions;
+
+  /* Redirects every instance of a definition that is structurally identical
+   * to an earlier one, down to port, instance and argument names, so each
+   * distinct structure is analyzed and compiled once */
+  void deduplicate();
+  /* Rewrites registers that recirculate their own output through a mux
+   * into enabled registers, so they skip the store while the mux holds */
+  void foldRegisterEnables();
 public:
   Circuit(std::deque<Definition>&& defns)
     : definitions(move(defns)),
-      top_defn(&definitions.back())
-  {}
+      top_defn(&definitions.back()),
+      unique_definitions()
+  {
+    foldRegisterEnables();
+    deduplicate();
+  }
 
   void print() const;
 
+  /* Every definition, including duplicates nothing instantiates anymore */
   const std::deque<Definition>& getDefinitions() const { return definitions; }
+  /* The definitions left after deduplication, children before parents */
+  const std::vector<const Definition *>& getUniqueDefinitions() const { return unique_definitions; }
   const Definition& getTopDefinition() const { return *top_defn; }
 };
 
@@ -0,0 +1,26 @@
+#ifndef JITSIM_CIRCUIT_FILE_HPP_INCLUDED
+#define JITSIM_CIRCUIT_FILE_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <memory>
+#include <string>
+
+namespace JITSim {
+
+/* A loaded and analyzed Circuit saved as a versioned binary file of flat,
+ * native endian tables: names, ports, instances and their arguments, the
+ * Select of every sink as SourceSlice records, the clock input driving
+ * every instance clock, and each definition's SimInfo dependency orders.
+ * Loading maps the file and walks the tables in place, so a fixed netlist
+ * skips both the JSON import and the dependency analysis on every later
+ * run. Primitives are rebuilt from their generator name and arguments */
+bool SaveCircuit(const Circuit &circuit, const std::string &path);
+std::unique_ptr<Circuit> LoadCircuit(const std::string &path);
+
+/* Whether path starts with the circuit file magic */
+bool IsCircuitFile(const std::string &path);
+
+}
+
+#endif
@@ -8,13 +8,63 @@
 
 namespace JITSim {
 
-ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition);
-ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition);
+class ProbeLayout;
+class ActivityLayout;
+
+/* With probes, definitions that own probed signals store them into the
+ * probe buffer whenever they are computed. The wrappers always take the
+ * probe buffer as their last argument, which may be null without probes.
+ * With an activity layout, compute_output skips composite children whose
+ * inputs and state are unchanged and the wrappers expect the state to be
+ * followed by the activity buffer */
+ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition,
+                                    const ProbeLayout *probes = nullptr,
+                                    const ActivityLayout *activity = nullptr);
+ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition,
+                                  const ProbeLayout *probes = nullptr,
+                                  const ActivityLayout *activity = nullptr);
+/* Steps only the state behind clock input clk of definition, which must
+ * satisfy SimInfo::hasClockDomain */
+ModuleEnvironment MakeClockUpdateState(Builder &builder, const Definition &definition, unsigned clk,
+                                       const ProbeLayout *probes = nullptr,
+                                       const ActivityLayout *activity = nullptr);
 ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition);
 ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition);
-ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn);
-ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &defn);
+ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn,
+                                           const ProbeLayout *probes = nullptr,
+                                           const ActivityLayout *activity = nullptr);
+ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &defn,
+                                         const ProbeLayout *probes = nullptr,
+                                         const ActivityLayout *activity = nullptr);
+/* update_state_<clk>(input, state, probes) takes the update_state input */
+ModuleEnvironment MakeClockUpdateStateWrapper(Builder &builder, const Definition &defn, unsigned clk,
+                                              const ProbeLayout *probes = nullptr,
+                                              const ActivityLayout *activity = nullptr);
 ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn);
+/* run_cycles(us_input, co_input, output, state, n, probes) advances the state n
+ * cycles with fixed inputs and then computes the outputs */
+ModuleEnvironment MakeRunCyclesWrapper(Builder &builder, const Definition &defn,
+                                       const ProbeLayout *probes = nullptr,
+                                       const ActivityLayout *activity = nullptr);
+
+/* Emits every definition reachable from top together with the
+ * compute_output, update_state, update_state_<clk> and run_cycles wrappers
+ * into a single module. With with_deps the deps functions and the
+ * get_values wrapper are included */
+ModuleEnvironment MakeMergedModule(Builder &builder, const Definition &top, bool with_deps = false,
+                                   const ProbeLayout *probes = nullptr,
+                                   const ActivityLayout *activity = nullptr);
+
+/* Emits every definition reachable from top with each value widened to a
+ * vector of lanes independent simulations, plus the compute_output_batch and
+ * update_state_batch wrappers, which take structure of arrays buffers.
+ * Bit sliced modules pack one bit of every simulation into a lanes bit
+ * word instead, and only handle bitwise primitives, see CanBitSlice */
+ModuleEnvironment MakeBatchModule(Builder &builder, const Definition &top, unsigned lanes,
+                                  bool bit_sliced = false);
+
+/* Whether every primitive under defn has a bit sliced lowering */
+bool CanBitSlice(const Definition &defn);
 
 }
 
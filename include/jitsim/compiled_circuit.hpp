@@ -0,0 +1,308 @@
+#ifndef JITSIM_COMPILED_CIRCUIT_HPP_INCLUDED
+#define JITSIM_COMPILED_CIRCUIT_HPP_INCLUDED
+
+#include <jitsim/JIT.hpp>
+#include <jitsim/activity.hpp>
+#include <jitsim/builder.hpp>
+#include <jitsim/checkpoint.hpp>
+#include <jitsim/circuit.hpp>
+#include <jitsim/circuit_llvm.hpp>
+#include <jitsim/object_cache.hpp>
+#include <jitsim/probes.hpp>
+#include <jitsim/tier_up.hpp>
+
+#include <mutex>
+
+namespace JITSim {
+
+class LLVMStruct {
+private:
+  /* Never changes once built, so copies for each Simulation share it and
+   * only get their own data */
+  struct Layout {
+    llvm::StructType *type;
+    const llvm::StructLayout *struct_layout;
+    std::unordered_map<Symbol, int> member_indices;
+  };
+
+  std::shared_ptr<const Layout> layout;
+  std::vector<uint8_t> data;
+
+  uint8_t *getMemberAddr(int idx);
+  const uint8_t *getMemberAddr(int idx) const;
+  int getMemberBits(int idx) const;
+
+public:
+  template <typename T>
+  LLVMStruct(const std::vector<T> &members, const llvm::DataLayout &data_layout,
+             llvm::LLVMContext &context);
+
+  void setMember(Symbol name, llvm::APInt val);
+  void setMember(const std::string &name, llvm::APInt val) { setMember(LookupSymbol(name), val); }
+  bool hasMember(Symbol name) const { return layout->member_indices.count(name); }
+  bool hasMember(const std::string &name) const { return hasMember(LookupSymbol(name)); }
+
+  llvm::APInt getValue(int idx) const;
+  llvm::APInt getValue(const std::string &name) const;
+
+  uint8_t *getData() { return data.data(); }
+  const uint8_t *getData() const { return data.data(); }
+  size_t getSize() const { return data.size(); }
+
+  void dump() const;
+};
+
+/* Structure of arrays storage for the batch wrappers generated by
+ * MakeBatchModule: each member holds one byte rounded element per lane,
+ * or when bit sliced one lanes bit word per bit of the member */
+class LaneBuffer {
+private:
+  unsigned lanes;
+  bool bit_sliced;
+  std::unordered_map<Symbol, int> member_indices;
+  std::vector<Symbol> member_names;
+  std::vector<int> member_bits;
+  std::vector<uint64_t> member_offsets;
+  std::vector<uint8_t> data;
+
+  uint8_t *getElementAddr(int idx, unsigned lane);
+  const uint8_t *getElementAddr(int idx, unsigned lane) const;
+
+public:
+  template <typename T>
+  LaneBuffer(const std::vector<T> &members, unsigned lanes, bool bit_sliced);
+
+  void setMember(Symbol name, unsigned lane, llvm::APInt val);
+  void setMember(const std::string &name, unsigned lane, llvm::APInt val) { setMember(LookupSymbol(name), lane, val); }
+
+  llvm::APInt getValue(int idx, unsigned lane) const;
+  llvm::APInt getValue(const std::string &name, unsigned lane) const;
+
+  uint8_t *getData() { return data.data(); }
+
+  void dump(unsigned lane) const;
+};
+
+struct JITOptions {
+  /* Directory for persisting compiled objects between runs, empty disables caching */
+  std::string cache_dir;
+  /* Number of threads compiling every definition up front, 0 compiles lazily on first call */
+  unsigned compile_threads = 0;
+  /* Compile definitions at O0 first and recompile the hot ones at O3 in the background */
+  bool tiered = false;
+  /* Calls to a definition function before it is recompiled at the higher tier */
+  uint64_t tier_up_threshold = 10000;
+  /* Compile the whole hierarchy as one module so definitions inline into
+   * each other. Compiles eagerly, so tiering does not apply */
+  bool merged = false;
+  /* Independent simulations evaluated together by the batch functions with
+   * LLVM vector types, 0 skips generating them */
+  unsigned lanes = 0;
+  /* Pack one bit of each of the lanes simulations into a lanes bit word, for
+   * netlists of bitwise primitives. lanes must be a multiple of 8 */
+  bool bit_sliced = false;
+  /* Hierarchical instance ports recorded on every evaluation, so getValue
+   * reads them without recompiling anything. "*" probes every port */
+  std::vector<std::string> probes;
+  /* Write a VCD of every probed signal to this file, with the time counting
+   * updateState cycles. Without probes the whole design is traced, otherwise
+   * select subtrees with probes like "inst.*" */
+  std::string trace_file;
+  /* Cache the outputs of composite instances and skip evaluating them
+   * while their inputs and state are unchanged, see ActivityLayout. Pays
+   * off for designs where most blocks are idle most of the time */
+  bool activity = false;
+};
+
+
+class CompiledCircuit;
+
+/* A simulation with its own inputs, outputs and state that runs the code
+ * of a CompiledCircuit. Simulations never compile anything, so different
+ * Simulations may run on different threads */
+class Simulation {
+public:
+  using UpdateStateFn = void (*)(const uint8_t *input, uint8_t *state, uint8_t *probes);
+  using ComputeOutputFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state,
+                                   uint8_t *probes);
+  using RunCyclesFn = void (*)(const uint8_t *us_input, const uint8_t *co_input,
+                               uint8_t *output, uint8_t *state, uint64_t num_cycles,
+                               uint8_t *probes);
+
+  struct EntryPoints {
+    ComputeOutputFn compute_output;
+    UpdateStateFn update_state;
+    RunCyclesFn run_cycles;
+    /* update_state_<clk> of every top level clock input, null for clocks
+     * that drive no state */
+    std::vector<std::pair<Symbol, UpdateStateFn>> clock_update_state;
+  };
+
+private:
+  EntryPoints entry_points;
+  LLVMStruct co_in;
+  LLVMStruct co_out;
+  LLVMStruct us_in;
+  LLVMStruct gv_in;
+  std::unique_ptr<StateBuffer> state;
+  std::vector<uint8_t> probes;
+
+  /* Starts from a copy of the circuit's initial state. Only the circuit
+   * creates simulations, freezing itself first, except for the single
+   * simulation JITFrontend drives while the circuit may still tier up */
+  explicit Simulation(const CompiledCircuit &circuit);
+  Simulation(const CompiledCircuit &circuit, std::unique_ptr<StateBuffer> state);
+
+  friend class CompiledCircuit;
+  friend class JITFrontend;
+
+public:
+  void setInput(const std::string &name, uint64_t val);
+  void setInput(const std::string &name, llvm::APInt val);
+  void setInput(Symbol name, llvm::APInt val);
+  /* Every top level input, whether or not outputs or state depend on it */
+  bool hasInput(const std::string &name) const { return gv_in.hasMember(name); }
+
+  const StateBuffer & getState() const { return *state; }
+
+  void updateState();
+  /* Steps only the state clocked by the top level clock input clk, reading
+   * the same inputs as updateState. False if the top has no such clock */
+  bool tick(Symbol clk);
+  bool tick(const std::string &clk) { return tick(LookupSymbol(clk)); }
+  const LLVMStruct & computeOutput();
+  const LLVMStruct & run(uint64_t num_cycles);
+};
+
+/* The compiled code of a design along with the layouts of its inputs,
+ * outputs, state and probes. Simulations only read from it, so once frozen
+ * any number of them can run against one set of machine code */
+class CompiledCircuit {
+public:
+  using GetValuesFn = void (*)(const uint8_t *input, uint8_t *state);
+  using BatchUpdateStateFn = void (*)(const uint8_t *input, uint8_t *state);
+  using BatchComputeOutputFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state);
+
+private:
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  const llvm::DataLayout data_layout;
+
+  Builder builder;
+  std::unique_ptr<DiskObjectCache> object_cache;
+  JIT jit;
+  const unsigned final_opt_level;
+  const bool merged;
+  const unsigned lanes;
+  const bool bit_sliced;
+
+  /* Must be destroyed before the JIT it compiles for */
+  std::unique_ptr<TierUpCompiler> tier_up;
+  uint64_t tier_up_threshold;
+  unsigned calls_since_tier_poll;
+
+  std::unordered_map<std::string, ModuleEnvironment> debug_modules;
+  std::unordered_map<std::string, llvm::ValueToValueMapTy> debug_clone_map;
+
+  const Definition *top;
+  std::unique_ptr<ProbeLayout> probe_layout;
+  std::unique_ptr<ActivityLayout> activity_layout;
+
+  /* Zeroed inputs and outputs every Simulation starts from */
+  LLVMStruct co_in;
+  LLVMStruct co_out;
+  LLVMStruct us_in;
+  LLVMStruct gv_in;
+
+  /* The top's state followed by the activity buffer, if any */
+  std::vector<uint8_t> initial_state;
+  std::vector<uint8_t> batch_initial_state;
+
+  Simulation::EntryPoints entry_points;
+  GetValuesFn get_values_ptr;
+  BatchComputeOutputFn batch_compute_output_ptr;
+  BatchUpdateStateFn batch_update_state_ptr;
+
+  /* Functions that can be generated in any Builder, and therefore on any thread */
+  struct CompileJob {
+    std::string name;
+    ModuleGenerator generator;
+    std::string cache_key;
+    /* Set when the job is compiled at the first tier, which counts its calls */
+    const uint64_t *call_counter;
+  };
+  std::deque<CompileJob> compile_jobs;
+
+  /* First tier functions still waiting to get hot */
+  std::vector<const CompileJob *> tier_candidates;
+
+  bool frozen;
+  std::mutex freeze_lock;
+
+  void addCompileJob(const std::string &name, ModuleGenerator generator,
+                     const std::string &cache_key, bool tierable);
+  void pollTierUp();
+  void finishTiering();
+  void compileJobs(const std::vector<const CompileJob *> &jobs, unsigned num_threads);
+  static std::shared_ptr<llvm::Module> generateJob(const CompileJob &job, Builder &builder);
+  void addDefinitionFunctions(const Definition &defn);
+  void addDefinitionComputeFunctions(const Definition &defn);
+  void addDefinitionDebugFunctions(const Definition &defn);
+  void addWrappers(const Definition &top);
+  void addMergedModule(const Definition &top);
+  void addBatchModule(const Definition &top);
+  std::vector<uint8_t> allocateDebugStorage(const Instance *inst, const std::string &input);
+  std::string getCacheKey(const Definition &defn, const std::string &kind);
+
+  friend class Simulation;
+
+  CompiledCircuit(const Circuit &circuit, const Definition &top, const JITOptions &options);
+public:
+  CompiledCircuit(const Circuit &circuit, const JITOptions &options = JITOptions());
+
+  CompiledCircuit(const CompiledCircuit &) = delete;
+
+  const Definition & getTop() const { return *top; }
+  const ProbeLayout * getProbeLayout() const { return probe_layout.get(); }
+  const Simulation::EntryPoints & getEntryPoints() const { return entry_points; }
+
+  /* Compiles every function that is still lazy and recompiles the first
+   * tier ones at the final tier, after which the code never changes again */
+  void freeze();
+
+  /* Freezes the circuit and copies its initial state */
+  std::unique_ptr<Simulation> makeSimulation();
+  /* Freezes the circuit and starts from state */
+  std::unique_ptr<Simulation> makeSimulation(std::unique_ptr<StateBuffer> state);
+
+  /* Swaps in functions recompiled at the higher tier. Only one thread may
+   * be simulating while the circuit is not frozen */
+  void maybePollTierUp()
+  {
+    if (tier_up && ++calls_since_tier_poll >= 1024) {
+      calls_since_tier_poll = 0;
+      pollTierUp();
+    }
+  }
+
+  /* Computes a signal of the simulation with the given get_values input
+   * and state by recompiling the debug functions, so it is neither fast
+   * nor thread safe */
+  llvm::APInt getDebugValue(const std::vector<std::string> &inst_names, const std::string &input,
+                            const uint8_t *gv_input, uint8_t *state);
+
+  unsigned getNumLanes() const { return lanes; }
+  bool isBitSliced() const { return bit_sliced; }
+  const std::vector<uint8_t> & getBatchInitialState() const { return batch_initial_state; }
+  BatchComputeOutputFn getBatchComputeOutput() const { return batch_compute_output_ptr; }
+  BatchUpdateStateFn getBatchUpdateState() const { return batch_update_state_ptr; }
+
+  /* Generates and compiles every definition on num_threads workers, each
+   * with its own LLVMContext, then links the objects into the JIT */
+  void precompileParallel(unsigned num_threads);
+
+  void dumpIR();
+};
+
+}
+
+#endif
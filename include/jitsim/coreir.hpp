@@ -4,7 +4,11 @@
 #include <coreir/ir/module.h>
 #include <coreir/ir/passes.h>
 #include <jitsim/circuit.hpp>
-#include <unordered_map>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace JITSim {
 
@@ -13,12 +17,23 @@ Circuit BuildFromCoreIR(CoreIR::Module *core_mod);
 class MaterializeArgs : public CoreIR::ContextPass {
   private:
     bool materializeArgs(CoreIR::Instance *instance);
+    bool materializeCopy(CoreIR::ModuleDef *defn, CoreIR::Values &modargs);
     bool traverseInstance(CoreIR::Instance *);
-    std::unordered_map<std::string, CoreIR::Module *> uniquified_modules;
+    using SpecKey = std::pair<CoreIR::Module *, std::vector<std::pair<std::string, std::string>>>;
+    /* Specializations by module and stringified argument values, so each
+     * definition is copied and walked once however often it is used */
+    std::map<SpecKey, CoreIR::Module *> specializations;
+    /* Modules whose definitions have already been walked */
+    std::unordered_set<CoreIR::Module *> visited;
+    std::unordered_set<std::string> specialized_names;
+    /* Off copies and walks a definition for every parameterized instance,
+     * as the pass did before specializations were memoized, so benchmarks
+     * can compare the two */
+    bool memoize;
   public:
     static std::string ID;
-    MaterializeArgs() :
-      ContextPass(ID, "Gets rid of modargs on non primitives") {}
+    explicit MaterializeArgs(bool memoize_ = true) :
+      ContextPass(ID, "Gets rid of modargs on non primitives"), memoize(memoize_) {}
     bool runOnContext(CoreIR::Context *);
 };
 }
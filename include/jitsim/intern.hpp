@@ -0,0 +1,31 @@
+#ifndef JITSIM_INTERN_HPP_INCLUDED
+#define JITSIM_INTERN_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+#include <llvm/ADT/APInt.h>
+
+namespace JITSim {
+
+/* Netlist names are interned once for the whole process and referred to
+ * by a dense integer ID. Every instance of a definition shares its port
+ * symbols, and argument keys and values repeat across thousands of
+ * primitives. Symbols are never freed, so IDs and the names they resolve
+ * to stay valid for the program */
+using Symbol = uint32_t;
+constexpr Symbol NoSymbol = ~0u;
+
+Symbol InternSymbol(const std::string &name);
+/* Returns NoSymbol for names that were never interned, since no port or
+ * instance can have them */
+Symbol LookupSymbol(const std::string &name);
+/* NoSymbol resolves to the empty name */
+const std::string & GetSymbolName(Symbol sym);
+
+/* Constants are deduplicated by width and value */
+const llvm::APInt & InternConstant(const llvm::APInt &val);
+
+}
+
+#endif
@@ -1,85 +1,80 @@
 #ifndef SIMJIT_JIT_FRONTEND_HPP_INCLUDED
 #define SIMJIT_JIT_FRONTEND_HPP_INCLUDED
 
-#include <jitsim/JIT.hpp>
-#include <jitsim/builder.hpp>
-#include <jitsim/circuit.hpp>
-#include <jitsim/circuit_llvm.hpp>
+#include <jitsim/compiled_circuit.hpp>
+#include <jitsim/trace.hpp>
 
 namespace JITSim {
 
-class LLVMStruct {
-private:
-  llvm::StructType *type;
-  const llvm::StructLayout *layout;
-  std::unordered_map<std::string, int> member_indices;
-  std::vector<uint8_t> data;
-
-  uint8_t *getMemberAddr(int idx);
-  const uint8_t *getMemberAddr(int idx) const;
-  int getMemberBits(int idx) const;
-
-public:
-  template <typename T>
-  LLVMStruct(const std::vector<T> &members, const llvm::DataLayout &data_layout,
-             llvm::LLVMContext &context);
-
-  void setMember(const std::string &name, llvm::APInt val);
-
-  llvm::APInt getValue(int idx) const;
-  llvm::APInt getValue(const std::string &name) const;
-
-  uint8_t *getData() { return data.data(); }
-
-  void dump() const;
-};
-
+/* A CompiledCircuit together with one Simulation of it, plus the batch
+ * buffers, probes and tracing that drive that simulation */
 class JITFrontend {
 private:
-  std::unique_ptr<llvm::TargetMachine> target_machine;
-  const llvm::DataLayout data_layout;
+  CompiledCircuit compiled;
+  Simulation sim;
 
-  Builder builder;
-  JIT jit;
-  std::unordered_map<std::string, ModuleEnvironment> debug_modules;
-  std::unordered_map<std::string, llvm::ValueToValueMapTy> debug_clone_map;
+  /* Reads the probe buffer from its own thread, so it is destroyed first */
+  std::unique_ptr<TraceWriter> tracer;
 
-  LLVMStruct co_in;
-  LLVMStruct co_out;
-  LLVMStruct us_in;
-  LLVMStruct gv_in;
+  LaneBuffer batch_co_in;
+  LaneBuffer batch_co_out;
+  LaneBuffer batch_us_in;
+  std::vector<uint8_t> batch_state;
 
-  std::vector<uint8_t> state;
+  llvm::APInt getProbedValue(unsigned offset, unsigned width) const;
 
-  using WrapperUpdateStateFn = void (*)(const uint8_t *input, uint8_t *state);
-  using WrapperComputeOutputFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state);
-  using WrapperGetValuesFn = void (*)(const uint8_t *input, uint8_t *state);
-
-  WrapperComputeOutputFn compute_output_ptr;
-  WrapperUpdateStateFn update_state_ptr;
-  WrapperGetValuesFn get_values_ptr;
+public:
+  JITFrontend(const Circuit &circuit, const JITOptions &options = JITOptions());
 
-  const Definition *top;
+  CompiledCircuit & getCompiledCircuit() { return compiled; }
 
-  void addDefinitionFunctions(const Definition &defn);
-  void addWrappers(const Definition &top);
-  std::vector<uint8_t> allocateDebugStorage(const Instance *inst, const std::string &input);
-
-  JITFrontend(const Circuit &circuit, const Definition &top);
-public:
-  JITFrontend(const Circuit &circuit);
+  /* False if JITOptions::trace_file could not be opened */
+  bool isTracing() const { return tracer != nullptr; }
 
   void setInput(const std::string &name, uint64_t val);
   void setInput(const std::string &name, llvm::APInt val);
+  void setInput(Symbol name, llvm::APInt val);
+
+  const StateBuffer & getState() const { return *sim.state; }
 
-  const std::vector<uint8_t> & getState() const { return state; }
+  /* Saves the state and current inputs. Loading maps the state straight
+   * from the file, and fails if it was saved from a different design */
+  bool saveCheckpoint(const std::string &path) const;
+  bool loadCheckpoint(const std::string &path);
+
+  /* Splits the current state and inputs into num_children Simulations that
+   * continue independently. Freezes the compiled circuit, and the children
+   * share state pages copy on write */
+  std::vector<std::unique_ptr<Simulation>> fork(unsigned num_children);
 
   void updateState();
+  /* Steps only the state behind one top level clock input, see
+   * Simulation::tick. Traces count it as a cycle like updateState */
+  bool tick(const std::string &clk);
   const LLVMStruct & computeOutput();
 
+  /* Runs num_cycles calls of updateState inside JIT code with the current
+   * inputs, then returns the outputs computeOutput would give */
+  const LLVMStruct & run(uint64_t num_cycles);
+
+  /* Probed signals hold their value from the latest updateState,
+   * computeOutput or run call. Signals that only feed the state are not
+   * reevaluated after the update, so they show the values that were
+   * latched. Other signals are computed on demand by recompiling the
+   * debug functions */
   llvm::APInt getValue(const std::vector<std::string> &inst_names, const std::string &input);
 
-  void dumpIR();
+  /* Batch simulation, only available when JITOptions::lanes is set. Every
+   * lane steps through its own inputs and state in a single call */
+  unsigned getNumLanes() const { return compiled.getNumLanes(); }
+  void setInput(unsigned lane, const std::string &name, llvm::APInt val);
+  void updateStateBatch();
+  const LaneBuffer & computeOutputBatch();
+  const std::vector<uint8_t> & getBatchState() const { return batch_state; }
+
+  void precompileParallel(unsigned num_threads) { compiled.precompileParallel(num_threads); }
+
+  void dumpIR() { compiled.dumpIR(); }
 };
 
 }
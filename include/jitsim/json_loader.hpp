@@ -0,0 +1,25 @@
+#ifndef JITSIM_JSON_LOADER_HPP_INCLUDED
+#define JITSIM_JSON_LOADER_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <memory>
+#include <string>
+
+namespace JITSim {
+
+/* Builds a Circuit straight from a CoreIR JSON file without a CoreIR
+ * Context. The file is streamed once into compact per module records,
+ * and Definitions are then built from the top module down to the
+ * primitives it reaches. Only flattened netlists are handled: Bit and
+ * BitIn ports or arrays of them, clocks fed from the module's clock
+ * inputs, asynchronous resets, the primitives in coreir_primitives.cpp,
+ * corebit/coreir const and term instances, and mantle.reg without resets.
+ * Anything else, including module arguments on user modules, fails with a
+ * message on stderr and returns nullptr, so callers can fall back to
+ * BuildFromCoreIR */
+std::unique_ptr<Circuit> LoadJSONNetlist(const std::string &path);
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef JITSIM_OBJECT_CACHE_HPP_INCLUDED
+#define JITSIM_OBJECT_CACHE_HPP_INCLUDED
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace JITSim {
+
+class Definition;
+
+/* Persists the objects produced by the JIT's compile layer in a directory
+ * so later runs on the same netlist can link them without generating IR.
+ * Entries are keyed by a hash of everything that determines the generated
+ * code: the definition hierarchy, the target and the optimization level. */
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  using ObjectPtr = std::shared_ptr<llvm::object::OwningBinary<llvm::object::ObjectFile>>;
+
+private:
+  std::string cache_dir;
+  std::string target_desc;
+
+  std::unordered_map<const Definition *, std::string> defn_hashes;
+  std::unordered_map<const llvm::Module *, std::string> pending_keys;
+  std::mutex pending_lock;
+
+  const std::string & hashDefinition(const Definition &defn);
+  std::string getObjectPath(const std::string &key) const;
+
+public:
+  DiskObjectCache(const std::string &cache_dir_, const llvm::TargetMachine &target_machine);
+
+  std::string getKey(const Definition &defn, const std::string &kind, unsigned opt_level);
+
+  ObjectPtr loadObject(const std::string &key);
+  bool hasObject(const std::string &key) const;
+
+  /* The next time module is compiled the object will be stored under key */
+  void setModuleKey(const llvm::Module *module, const std::string &key);
+
+  void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override;
+};
+
+}
+
+#endif
@@ -2,7 +2,10 @@
 #define JITSIM_PRIMITIVE_HPP_INCLUDED
 
 #include <functional>
+#include <string>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 #include <jitsim/builder.hpp>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Function.h>
@@ -16,6 +19,11 @@ public:
   bool is_stateful;
   bool has_definition;
   unsigned int num_state_bytes;
+  /* Batched state interleaves the lanes at this granularity, so a memory
+   * stores each word for every lane before moving on to the next word */
+  unsigned int state_elem_bytes;
+  /* Whether the generators handle bit sliced modules, see ModuleEnvironment::isBitSliced */
+  bool supports_bit_slicing;
   std::unordered_set<std::string> state_deps;
   std::unordered_set<std::string> output_deps;
   
@@ -33,6 +41,11 @@ public:
   StateInit state_init;
   ModuleGen make_def;
 
+  /* The generator and sorted arguments this primitive was built from, so
+   * a saved circuit can rebuild it */
+  std::string generator;
+  std::vector<std::pair<std::string, int>> genargs;
+
   Primitive(bool is_stateful_,
             unsigned int num_state_bytes_,
             const std::unordered_set<std::string> & state_deps_,
@@ -43,6 +56,8 @@ public:
     : is_stateful(is_stateful_),
       has_definition(true),
       num_state_bytes(num_state_bytes_),
+      state_elem_bytes(num_state_bytes_),
+      supports_bit_slicing(false),
       state_deps(state_deps_),
       output_deps(output_deps_),
       make_compute_output(make_compute_output_),
@@ -61,6 +76,8 @@ public:
     : is_stateful(is_stateful_),
       has_definition(false),
       num_state_bytes(num_state_bytes_),
+      state_elem_bytes(num_state_bytes_),
+      supports_bit_slicing(false),
       state_deps(state_deps_),
       output_deps(output_deps_),
       make_compute_output(make_compute_output_),
@@ -80,6 +97,8 @@ public:
     : is_stateful(is_stateful_),
       has_definition(false),
       num_state_bytes(num_state_bytes_),
+      state_elem_bytes(num_state_bytes_),
+      supports_bit_slicing(false),
       state_deps(state_deps_),
       output_deps(output_deps_),
       make_compute_output(make_compute_output_),
@@ -94,6 +113,8 @@ public:
     : is_stateful(false),
       has_definition(false),
       num_state_bytes(0),
+      state_elem_bytes(0),
+      supports_bit_slicing(false),
       state_deps(),
       output_deps(),
       make_compute_output(make_compute_output_),
@@ -0,0 +1,71 @@
+#ifndef JITSIM_PROBES_HPP_INCLUDED
+#define JITSIM_PROBES_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace JITSim {
+
+/* Assigns every probed signal a fixed offset in a probe buffer that the
+ * generated compute_output and update_state functions write into. The
+ * buffer is laid out like state: each definition with probes owns a region
+ * holding its own probed instance ports followed by the regions of its
+ * children, and callers pass each child a pointer offset into their own
+ * region. A probe therefore records the signal in every instance of the
+ * definition it belongs to. Probes are stored when their signal is
+ * evaluated, so a signal that only feeds the state holds the value
+ * update_state latched, computed from the state before the update. */
+class ProbeLayout {
+public:
+  struct Signal {
+    unsigned offset;
+    unsigned width;
+  };
+
+private:
+  std::unordered_map<const Definition *, unsigned> region_bytes;
+  std::unordered_map<const Instance *, unsigned> inst_offsets;
+  std::unordered_map<const Source *, Signal> source_signals;
+  std::unordered_map<const Sink *, Signal> sink_signals;
+
+  std::unordered_set<const Source *> probed_sources;
+  std::unordered_set<const Sink *> probed_sinks;
+
+  bool traced;
+
+  bool addProbe(const Definition &top, const std::string &path);
+  void probeAll(const Definition &defn);
+  void probeInstance(const Instance &inst);
+  unsigned layoutDefinition(const Definition &defn);
+
+public:
+  /* Signals are instance ports named by their hierarchical path, like
+   * "inst.child.port". "inst.child.*" probes every port in that subtree and
+   * a lone "*" every instance port. Traced probes additionally report
+   * each change to the active TraceWriter */
+  ProbeLayout(const Definition &top, const std::vector<std::string> &signals, bool traced = false);
+
+  bool isTraced() const { return traced; }
+
+  unsigned getNumBytes(const Definition &defn) const;
+  bool hasProbes(const Definition &defn) const { return getNumBytes(defn) > 0; }
+
+  unsigned getOffset(const Instance *inst) const { return inst_offsets.find(inst)->second; }
+  const Signal * getSignal(const Source *src) const;
+  const Signal * getSignal(const Sink *sink) const;
+
+  /* Offset of a port of the instance at inst_names in the top's buffer */
+  const Signal * lookup(const Definition &top, const std::vector<std::string> &inst_names,
+                        const std::string &port, unsigned &offset) const;
+
+  /* Describes the probe code generated for defn, for cache keys */
+  std::string getSignature(const Definition &defn) const;
+};
+
+}
+
+#endif
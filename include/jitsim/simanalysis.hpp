@@ -4,25 +4,46 @@
 #include <jitsim/primitive.hpp>
 #include <jitsim/optional.hpp>
 
+#include <cstdint>
+#include <utility>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 
 namespace JITSim {
 
 class Instance;
 class IFace;
 
+/* A definition's dependency orders by instance and source index, which a
+ * saved circuit stores so loading it skips the analysis */
+struct SimOrders {
+  std::vector<uint32_t> state_deps;
+  std::vector<uint32_t> output_deps;
+  std::vector<uint32_t> state_dep_srcs;
+  std::vector<uint32_t> output_dep_srcs;
+};
+
+/* The part of update_state one clock input of a definition drives. Each
+ * tick is a stateful instance along with the clock input of its own
+ * definition that this clock feeds, so a composite instance is stepped
+ * through its matching domain */
+struct ClockDomain {
+  std::vector<std::pair<const Instance *, unsigned>> ticks;
+  std::vector<const Instance *> state_deps;
+  std::vector<const Source *> state_dep_srcs;
+};
+
 class SimInfo
 {
 private:
   std::vector<const Instance *> stateful_insts;
   std::vector<const Instance *> state_deps;
   std::vector<const Instance *> output_deps;
-  std::unordered_set<const Instance *> state_deps_lookup;
-  std::unordered_set<const Instance *> output_deps_lookup;
-  std::unordered_map<const Instance *, unsigned> offset_map;
-  std::unordered_map<const Instance *, unsigned> inst_nums;
+  /* Instances are numbered densely by their position in the definition,
+   * so per instance facts live in flat arrays indexed by getInstNum */
+  const Instance *first_inst;
+  std::vector<bool> state_deps_lookup;
+  std::vector<bool> output_deps_lookup;
+  std::vector<unsigned> offsets;
   optional<Primitive> primitive;
 
   bool is_stateful;
@@ -31,31 +52,60 @@ private:
   std::vector<const Source *> state_dep_srcs; /* These input sources are directly necessary to update the state */
   std::vector<const Source *> output_dep_srcs; /* These input sources are directly necessary to compute the output */
 
+  /* Indexed like the definition's clock sources. Stateful instances whose
+   * clock is not wired to one of them only step in the full update_state */
+  std::vector<ClockDomain> clock_domains;
+
   void calculateStateOffsets();
-  void calculateInstanceNumbers(const std::vector<Instance> &instances);
-  void analyzeStateDeps(const IFace &);
-  void analyzeOutputDeps(const IFace &);
+  void analyzeClockDomains(const IFace &, const std::vector<Instance> &instances);
+  void analyzeStateDeps(const IFace &, const std::vector<Instance> &instances);
+  void analyzeOutputDeps(const IFace &, const std::vector<Instance> &instances);
 
   void initializeState(uint8_t *state) const;
+  void spreadStateToLanes(const uint8_t *state, uint8_t *batch_state, unsigned lanes) const;
 public:
   SimInfo(const IFace &defn_iface, const std::vector<Instance> &instances);
   SimInfo(const IFace &defn_iface, const Primitive &primitive);
+  /* Restores orders from getOrders, recomputing only the state offsets */
+  SimInfo(const IFace &defn_iface, const std::vector<Instance> &instances, const SimOrders &orders);
+
+  SimOrders getOrders(const IFace &defn_iface) const;
 
   std::vector<uint8_t> allocateState() const;
+  /* Initial state for lanes simulations, as laid out by MakeBatchModule:
+   * every element of every primitive's state is repeated once per lane */
+  std::vector<uint8_t> allocateBatchState(unsigned lanes) const;
+  /* Initial state for a bit sliced module with lanes bit words */
+  std::vector<uint8_t> allocateBitSlicedState(unsigned lanes) const;
 
   bool isStateful() const { return is_stateful; }
   bool isPrimitive() const { return primitive.has_value(); }
 
-  bool isStateDep(const Instance *inst) const { return state_deps_lookup.count(inst); }
-  bool isOutputDep(const Instance *inst) const { return output_deps_lookup.count(inst); }
+  bool isStateDep(const Instance *inst) const { return state_deps_lookup[getInstNum(inst)]; }
+  bool isOutputDep(const Instance *inst) const { return output_deps_lookup[getInstNum(inst)]; }
   const std::vector<const Instance *> & getStateDeps() const { return state_deps; }
   const std::vector<const Instance *> & getOutputDeps() const { return output_deps; }
   const std::vector<const Instance *> & getStatefulInstances() const { return stateful_insts; }
   const std::vector<const Source *> & getStateSources() const { return state_dep_srcs; }
   const std::vector<const Source *> & getOutputSources() const { return output_dep_srcs; }
 
-  unsigned getOffset(const Instance *inst) const { return offset_map.find(inst)->second; }
-  unsigned getInstNum(const Instance *inst) const { return inst_nums.find(inst)->second; }
+  /* Whether ticking clock input clk changes any state. A stateful primitive
+   * is driven entirely by each of its clocks */
+  bool hasClockDomain(unsigned clk) const
+  {
+    if (clk >= clock_domains.size()) {
+      return false;
+    }
+    return isPrimitive() ? is_stateful : !clock_domains[clk].ticks.empty();
+  }
+  const ClockDomain & getClockDomain(unsigned clk) const { return clock_domains[clk]; }
+  const std::vector<const Source *> & getClockStateSources(unsigned clk) const
+  {
+    return isPrimitive() ? state_dep_srcs : clock_domains[clk].state_dep_srcs;
+  }
+
+  unsigned getOffset(const Instance *inst) const { return offsets[getInstNum(inst)]; }
+  unsigned getInstNum(const Instance *inst) const;
 
   unsigned int getNumStateBytes() const { return num_state_bytes; }
   const Primitive& getPrimitive() const { return *primitive; }
@@ -0,0 +1,59 @@
+#ifndef JITSIM_TIER_UP_HPP_INCLUDED
+#define JITSIM_TIER_UP_HPP_INCLUDED
+
+#include <jitsim/JIT.hpp>
+#include <jitsim/builder.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace JITSim {
+
+/* Recompiles hot functions at a higher optimization level on a background
+ * thread. Finished objects are collected by the simulation thread, which
+ * swaps them in between cycles with JIT::replaceFunction. */
+class TierUpCompiler {
+public:
+  using Result = std::pair<std::string, DiskObjectCache::ObjectPtr>;
+
+private:
+  struct Request {
+    std::string name;
+    ModuleGenerator generator;
+    std::string cache_key;
+  };
+
+  JIT &jit;
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  Builder builder;
+  unsigned opt_level;
+
+  std::deque<Request> requests;
+  std::vector<Result> finished;
+  std::mutex lock;
+  std::condition_variable wakeup;
+  bool shutting_down;
+
+  std::thread worker;
+
+  void run();
+
+public:
+  TierUpCompiler(JIT &jit, const llvm::DataLayout &data_layout, unsigned opt_level);
+  ~TierUpCompiler();
+
+  TierUpCompiler(const TierUpCompiler &) = delete;
+
+  void enqueue(const std::string &name, ModuleGenerator generator, const std::string &cache_key);
+  std::vector<Result> takeFinished();
+};
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef JITSIM_TRACE_HPP_INCLUDED
+#define JITSIM_TRACE_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+#include <jitsim/probes.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* Entry points for generated code with traced probes. jitsim_trace_change
+ * receives the address of a probe slot right after a new value was stored
+ * into it, jitsim_trace_cycle is called by run_cycles after every
+ * update_state. Both report to the TraceWriter active on the calling thread */
+extern "C" {
+void jitsim_trace_change(const uint8_t *slot);
+void jitsim_trace_cycle();
+}
+
+namespace JITSim {
+
+/* Writes every change of a traced probe buffer to a VCD file. Generated
+ * code pushes changes into a single producer, single consumer ring buffer
+ * and a background thread formats them, so the simulation thread only
+ * blocks when the writer falls a whole ring behind. */
+class TraceWriter {
+private:
+  /* Signals wider than 64 bits take one entry per 64 bit chunk */
+  struct Entry {
+    uint64_t time;
+    uint32_t offset;
+    uint32_t chunk;
+    uint64_t bits;
+  };
+
+  struct TracedSignal {
+    std::string id;
+    unsigned width;
+  };
+
+  const uint8_t *probes;
+  unsigned num_bytes;
+  std::unordered_map<unsigned, TracedSignal> signals;
+  uint64_t time;
+
+  std::vector<Entry> ring;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<bool> done;
+
+  std::ofstream out;
+  std::thread writer;
+
+  static thread_local TraceWriter *current;
+
+  void declareScope(const Definition &defn, const ProbeLayout &layout, unsigned base);
+  void writeHeader(const Definition &top, const ProbeLayout &layout);
+  void drain();
+
+  friend void ::jitsim_trace_change(const uint8_t *slot);
+  friend void ::jitsim_trace_cycle();
+
+public:
+  /* capacity is the number of ring entries and must be a power of two */
+  TraceWriter(const Definition &top, const ProbeLayout &layout, const uint8_t *probes,
+              const std::string &path, size_t capacity = 1 << 16);
+  ~TraceWriter();
+
+  TraceWriter(const TraceWriter &) = delete;
+
+  bool isOpen() const { return out.is_open(); }
+
+  /* Routes changes reported by generated code on this thread to a writer
+   * for as long as it lives, so generated code run afterwards for other
+   * simulations on the same thread is not traced */
+  class Activation {
+  private:
+    TraceWriter *previous;
+
+  public:
+    explicit Activation(TraceWriter *writer) : previous(current) { current = writer; }
+    ~Activation() { current = previous; }
+
+    Activation(const Activation &) = delete;
+  };
+
+  void push(const uint8_t *slot);
+  void advance() { time++; }
+};
+
+}
+
+#endif
@@ -2,7 +2,9 @@
 #include <iostream>
 #include <tuple>
 
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
 namespace JITSim {
@@ -17,35 +19,37 @@ static __attribute__((constructor)) void initializeLLVM()
   LLVMInitializeNativeAsmParser();
 }
 
-JIT::JIT(TargetMachine &target_machine, const DataLayout &dl)
+JIT::JIT(TargetMachine &target_machine, const DataLayout &dl, DiskObjectCache *object_cache_)
   : data_layout(dl),
+    object_cache(object_cache_),
     compile_callback_manager(
       createLocalCompileCallbackManager(target_machine.getTargetTriple(), 0)),
     indirect_stubs_manager(
       createLocalIndirectStubsManagerBuilder(target_machine.getTargetTriple())()),
     object_layer([]() { return std::make_shared<SectionMemoryManager>(); }),
-    compile_layer(object_layer, SimpleCompiler(target_machine)),
+    compile_layer(object_layer, SimpleCompiler(target_machine, object_cache)),
     optimize_layer(compile_layer,
                   [this](std::shared_ptr<Module> module) {
-                    return optimizeModule(std::move(module));
+                    return optimizeModule(std::move(module), opt_level);
                   }),
     debug_layer(optimize_layer,
                 [this](std::shared_ptr<Module> module) {
                   return debugModule(std::move(module));
                 }),
-    debug_print_ir(false)
+    debug_print_ir(false),
+    opt_level(2),
+    inline_functions(false)
 {
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 }
 
-JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
-  assert(module->getDataLayout() == data_layout);
-
+std::shared_ptr<JITSymbolResolver> JIT::createResolver()
+{
   // Build our symbol resolver:
   // Lambda 1: Look back into the JIT itself to find symbols that are part of
   //           the same "logical dylib".
   // Lambda 2: Search for external symbols in the host process.
-  auto resolver = createLambdaResolver(
+  return createLambdaResolver(
     [&](const std::string &name) {
       if (auto sym = indirect_stubs_manager->findStub(name, false)) {
         return sym;
@@ -59,14 +63,24 @@ JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
         return JITSymbol(sym_addr, JITSymbolFlags::Exported);
       return JITSymbol(nullptr);
     }); 
+}
 
-  // Add the set to the JIT with the resolver we created above and a newly
-  // return created SectionMemoryManager.
-  ModuleHandle handle = cantFail(debug_layer.addModule(std::move(module), std::move(resolver)));
+JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
+  assert(module->getDataLayout() == data_layout);
+
+  // Add the set to the JIT with a fresh resolver and a newly
+  // created SectionMemoryManager.
+  ModuleHandle handle = cantFail(debug_layer.addModule(std::move(module), createResolver()));
 
   return handle;
 }
 
+JIT::ModuleHandle JIT::addObject(DiskObjectCache::ObjectPtr object)
+{
+  // Objects skip the IR layers entirely and go straight to the linker
+  return cantFail(object_layer.addObject(std::move(object), createResolver()));
+}
+
 JITSymbol JIT::findSymbol(const std::string name) {
   if (auto sym = indirect_stubs_manager->findStub(mangle(name), true)) {
     return sym;
@@ -96,13 +110,19 @@ bool JIT::removeModule(const std::string &name) {
   return true;
 }
 
-std::shared_ptr<Module> JIT::optimizeModule(std::shared_ptr<Module> module) {
+std::shared_ptr<Module> JIT::optimizeModule(std::shared_ptr<Module> module, unsigned level) {
+  runOptimizations(*module, level, inline_functions);
+
+  return module;
+}
+
+void JIT::runOptimizations(Module &module, unsigned level, bool inline_functions) {
   // Create a function pass manager.
-  auto fpm = make_unique<legacy::FunctionPassManager>(module.get());
+  auto fpm = make_unique<legacy::FunctionPassManager>(&module);
 
   /* FIXME revisit this */
   PassManagerBuilder manager_builder;
-  manager_builder.OptLevel = 2;
+  manager_builder.OptLevel = level;
   manager_builder.populateFunctionPassManager(*fpm);
 
   // Add some optimizations.
@@ -114,10 +134,18 @@ std::shared_ptr<Module> JIT::optimizeModule(std::shared_ptr<Module> module) {
 
   // Run the optimizations over all functions in the module being added to
   // the JIT.
-  for (auto &fn : *module)
+  for (auto &fn : module)
     fpm->run(fn);
 
-  return module;
+  // Merged modules hold whole hierarchies, so run the interprocedural
+  // pipeline to inline and constant fold across definitions
+  if (inline_functions && level > 0) {
+    manager_builder.Inliner = createFunctionInliningPass(level, 0, false);
+
+    legacy::PassManager mpm;
+    manager_builder.populateModulePassManager(mpm);
+    mpm.run(module);
+  }
 }
 
 std::shared_ptr<Module> JIT::debugModule(std::shared_ptr<Module> module)
@@ -162,7 +190,8 @@ JITTargetAddress JIT::updateStub(const std::string &name)
 }
 
 void JIT::addLazyFunction(const std::string &name,
-                          std::function<std::shared_ptr<Module>()> module_generator)
+                          std::function<std::shared_ptr<Module>()> module_generator,
+                          const std::string &cache_key)
 {
   auto compile_callback = cantFail(compile_callback_manager->getCompileCallback());
   JITTargetAddress callback_address = compile_callback.getAddress();
@@ -177,16 +206,95 @@ void JIT::addLazyFunction(const std::string &name,
                                                 JITSymbolFlags::Exported));
   }
 
-  compile_callback.setCompileAction([this, name, module_generator, callback_address]() {
-    auto module = module_generator();
-    auto compiled_handle = addModule(module);
-    live_modules[name] = compiled_handle;
+  compile_callback.setCompileAction([this, name, module_generator, callback_address, cache_key]() {
+    bool use_cache = object_cache && !cache_key.empty();
+
+    DiskObjectCache::ObjectPtr cached;
+    if (use_cache) {
+      cached = object_cache->loadObject(cache_key);
+    }
+
+    if (cached) {
+      live_modules[name] = addObject(std::move(cached));
+    } else {
+      auto module = module_generator();
+      if (use_cache) {
+        object_cache->setModuleKey(module.get(), cache_key);
+      }
+      live_modules[name] = addModule(module);
+    }
 
     callback_addrs.erase(callback_address);
+    lazy_callbacks.erase(name);
 
     return updateStub(name);
   });
   callback_addrs.insert(callback_address);
+  lazy_callbacks[name] = callback_address;
+}
+
+DiskObjectCache::ObjectPtr JIT::compileObject(std::shared_ptr<Module> module,
+                                              TargetMachine &target_machine,
+                                              unsigned level,
+                                              const std::string &cache_key)
+{
+  if (object_cache && !cache_key.empty()) {
+    object_cache->setModuleKey(module.get(), cache_key);
+  }
+
+  module = optimizeModule(std::move(module), level);
+
+  SimpleCompiler compiler(target_machine, object_cache);
+  using CompileResult = decltype(compiler(*module));
+
+  return std::make_shared<CompileResult>(compiler(*module));
+}
+
+DiskObjectCache::ObjectPtr JIT::loadCachedObject(const std::string &cache_key)
+{
+  if (!object_cache || cache_key.empty()) {
+    return nullptr;
+  }
+
+  return object_cache->loadObject(cache_key);
+}
+
+void JIT::addCompiledFunction(const std::string &name, DiskObjectCache::ObjectPtr object)
+{
+  assert(!isCompiled(name) && "Function was already compiled");
+
+  live_modules[name] = addObject(std::move(object));
+
+  auto iter = lazy_callbacks.find(name);
+  if (iter != lazy_callbacks.end()) {
+    callback_addrs.erase(iter->second);
+    lazy_callbacks.erase(iter);
+  }
+
+  updateStub(name);
+}
+
+void JIT::replaceFunction(const std::string &name, DiskObjectCache::ObjectPtr object)
+{
+  removeModule(name);
+  addCompiledFunction(name, std::move(object));
+}
+
+const uint64_t * JIT::addCallCounter(const std::string &name)
+{
+  return &call_counters[name];
+}
+
+void JIT::instrumentCallCounter(Module &module, const std::string &name, const uint64_t *counter)
+{
+  Function *func = module.getFunction(name);
+  assert(func && "unable to find function to instrument");
+
+  IRBuilder<> ir_builder(&*func->getEntryBlock().getFirstInsertionPt());
+  Value *addr = Constant::getIntegerValue(Type::getInt64PtrTy(module.getContext()),
+                                          APInt(64, (uint64_t)counter));
+  Value *count = ir_builder.CreateLoad(addr, "call_count");
+  ir_builder.CreateStore(ir_builder.CreateAdd(count, ir_builder.getInt64(1)), addr);
 }
 
 std::deque<JIT::TransformFunction>::iterator JIT::addDebugTransform(const std::string &name,
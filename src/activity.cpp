@@ -0,0 +1,79 @@
+#include <jitsim/activity.hpp>
+#include "utils.hpp"
+
+namespace JITSim {
+
+using namespace std;
+
+ActivityLayout::ActivityLayout(const Definition &top)
+  : region_bytes(),
+    entry_offsets(),
+    inst_offsets()
+{
+  layoutDefinition(top);
+}
+
+/* Only composite children are cached: a primitive's compute_output is
+ * about as cheap as comparing its inputs */
+static bool isCached(const Instance &inst, const SimInfo &defn_info)
+{
+  const Definition &child = inst.getDefinition();
+  if (child.getSimInfo().isPrimitive() || child.getIFace().getSinks().empty()) {
+    return false;
+  }
+
+  return defn_info.isOutputDep(&inst) || defn_info.isStateDep(&inst);
+}
+
+unsigned ActivityLayout::layoutDefinition(const Definition &defn)
+{
+  auto iter = region_bytes.find(&defn);
+  if (iter != region_bytes.end()) {
+    return iter->second;
+  }
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  unsigned offset = 0;
+  for (const Instance &inst : defn.getInstances()) {
+    if (!isCached(inst, defn_info)) {
+      continue;
+    }
+
+    entry_offsets[&inst] = offset;
+    offset += 1;
+    for (const Source *src : inst.getSimInfo().getOutputSources()) {
+      offset += JITSim::getNumBytes(src->getWidth());
+    }
+    for (const Sink &sink : inst.getDefinition().getIFace().getSinks()) {
+      offset += JITSim::getNumBytes(sink.getWidth());
+    }
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    if (inst.getSimInfo().isPrimitive()) {
+      continue;
+    }
+
+    unsigned child_bytes = layoutDefinition(inst.getDefinition());
+    if (child_bytes > 0) {
+      inst_offsets[&inst] = offset;
+      offset += child_bytes;
+    }
+  }
+
+  region_bytes[&defn] = offset;
+
+  return offset;
+}
+
+unsigned ActivityLayout::getNumBytes(const Definition &defn) const
+{
+  auto iter = region_bytes.find(&defn);
+  if (iter == region_bytes.end()) {
+    return 0;
+  }
+
+  return iter->second;
+}
+
+}
@@ -0,0 +1,243 @@
+#include <jitsim/aot.hpp>
+#include <jitsim/JIT.hpp>
+#include <jitsim/builder.hpp>
+#include <jitsim/circuit_llvm.hpp>
+#include "utils.hpp"
+#include "llvm_utils.hpp"
+
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <cctype>
+#include <memory>
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+static string cIdentifier(const string &name)
+{
+  string ident;
+  for (char c : name) {
+    ident += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  if (ident.empty() || isdigit(static_cast<unsigned char>(ident[0]))) {
+    ident = "_" + ident;
+  }
+
+  return ident;
+}
+
+/* The integer type exactly bytes wide, or an empty string if C has none */
+static string cType(unsigned bytes)
+{
+  switch (bytes) {
+    case 1:
+      return "uint8_t";
+    case 2:
+      return "uint16_t";
+    case 4:
+      return "uint32_t";
+    case 8:
+      return "uint64_t";
+    default:
+      return "";
+  }
+}
+
+/* Mirrors the LLVM struct layout the wrappers were compiled against, with
+ * explicit padding so the C compiler can't disagree about offsets */
+template <typename T>
+static void writeStruct(raw_ostream &out, const string &struct_name, const string &comment,
+                        const vector<T> &members, const DataLayout &data_layout, LLVMContext &context)
+{
+  StructType *type = ConstructStructType(members, context);
+  const StructLayout *layout = data_layout.getStructLayout(type);
+
+  out << "/* " << comment << " */\n";
+  out << "struct " << struct_name << " {\n";
+
+  uint64_t offset = 0;
+  unsigned num_pads = 0;
+  for (unsigned i = 0; i < members.size(); i++) {
+    const auto &m = condDeref(members[i]);
+    uint64_t member_offset = layout->getElementOffset(i);
+    if (member_offset > offset) {
+      out << "  uint8_t _pad" << num_pads++ << "[" << member_offset - offset << "];\n";
+    }
+
+    /* The member spans exactly the bytes the wrappers store, so i24 is
+     * three bytes rather than a uint32_t that would shift later members */
+    unsigned bytes = data_layout.getTypeStoreSize(type->getElementType(i));
+    string member_type = cType(bytes);
+    out << "  ";
+    if (!member_type.empty()) {
+      out << member_type << " " << cIdentifier(m.getName());
+    } else {
+      /* Little endian bytes, like APInt::getRawData */
+      out << "uint8_t " << cIdentifier(m.getName()) << "[" << bytes << "]";
+    }
+    out << "; /* " << m.getWidth() << " bits */\n";
+
+    offset = member_offset + bytes;
+  }
+
+  if (layout->getSizeInBytes() > offset) {
+    out << "  uint8_t _pad" << num_pads++ << "[" << layout->getSizeInBytes() - offset << "];\n";
+  } else if (members.empty()) {
+    /* Empty structs aren't valid C, the wrappers never touch this */
+    out << "  uint8_t _unused;\n";
+  }
+
+  out << "};\n\n";
+}
+
+static bool writeHeader(const Definition &top, const string &name, const string &path,
+                        const DataLayout &data_layout, LLVMContext &context)
+{
+  error_code err;
+  raw_fd_ostream out(path, err, sys::fs::F_Text);
+  if (err) {
+    errs() << "Unable to open " << path << ": " << err.message() << "\n";
+    return false;
+  }
+
+  const SimInfo &siminfo = top.getSimInfo();
+  string upper_name = name;
+  for (char &c : upper_name) {
+    c = toupper(static_cast<unsigned char>(c));
+  }
+  string guard = "JITSIM_AOT_" + upper_name + "_H";
+
+  out << "/* Generated by jitfrontend --aot for " << top.getName() << ", do not edit */\n";
+  out << "#ifndef " << guard << "\n";
+  out << "#define " << guard << "\n\n";
+  out << "#include <stdint.h>\n\n";
+  out << "#ifdef __cplusplus\n";
+  out << "extern \"C\" {\n";
+  out << "#endif\n\n";
+
+  out << "/* Values narrower than their member type must be zero extended */\n\n";
+  writeStruct(out, name + "_co_input", "Inputs that combinationally affect the outputs",
+              siminfo.getOutputSources(), data_layout, context);
+  writeStruct(out, name + "_co_output", "Outputs of the top definition",
+              top.getIFace().getSinks(), data_layout, context);
+  writeStruct(out, name + "_us_input", "Inputs that affect the next state",
+              siminfo.getStateSources(), data_layout, context);
+
+  out << "/* Bytes of state, copy " << name << "_initial_state into a buffer this size before simulating */\n";
+  out << "#define " << upper_name << "_STATE_SIZE " << siminfo.getNumStateBytes() << "\n\n";
+  out << "extern const uint64_t " << name << "_state_size;\n";
+  out << "extern const uint8_t " << name << "_initial_state[];\n\n";
+
+  out << "/* The object is built without probes, pass NULL for the probe buffer */\n";
+  out << "void " << name << "_compute_output(const struct " << name << "_co_input *input, struct "
+      << name << "_co_output *output, uint8_t *state, uint8_t *probes);\n";
+  out << "void " << name << "_update_state(const struct " << name
+      << "_us_input *input, uint8_t *state, uint8_t *probes);\n";
+  for (unsigned clk = 0; clk < top.getIFace().getClkSources().size(); clk++) {
+    if (siminfo.hasClockDomain(clk)) {
+      const string &clk_name = top.getIFace().getClkSources()[clk].getName();
+      out << "/* Steps only the state clocked by " << clk_name << " */\n";
+      out << "void " << cIdentifier(name + "_update_state_" + clk_name) << "(const struct " << name
+          << "_us_input *input, uint8_t *state, uint8_t *probes);\n";
+    }
+  }
+  out << "/* " << name << "_update_state num_cycles times, then " << name << "_compute_output */\n";
+  out << "void " << name << "_run_cycles(const struct " << name << "_us_input *us_input, const struct "
+      << name << "_co_input *co_input,\n";
+  out << "    struct " << name << "_co_output *output, uint8_t *state, uint64_t num_cycles, uint8_t *probes);\n\n";
+
+  out << "#ifdef __cplusplus\n";
+  out << "}\n";
+  out << "#endif\n\n";
+  out << "#endif\n";
+
+  return true;
+}
+
+static void addStateGlobals(Module &module, const SimInfo &siminfo, const string &name)
+{
+  LLVMContext &context = module.getContext();
+
+  vector<uint8_t> initial_state = siminfo.allocateState();
+  Constant *init = ConstantDataArray::get(context, initial_state);
+  new GlobalVariable(module, init->getType(), true, GlobalValue::ExternalLinkage,
+                     init, name + "_initial_state");
+
+  Constant *size = ConstantInt::get(Type::getInt64Ty(context), initial_state.size());
+  new GlobalVariable(module, size->getType(), true, GlobalValue::ExternalLinkage,
+                     size, name + "_state_size");
+}
+
+/* Gives the wrappers their exported names. Objects for several designs
+ * can then be linked into one program */
+static void prefixEntryPoints(Module &module, const Definition &top, const string &name)
+{
+  vector<string> entry_points = { "compute_output", "update_state", "run_cycles" };
+  for (unsigned clk = 0; clk < top.getIFace().getClkSources().size(); clk++) {
+    if (top.getSimInfo().hasClockDomain(clk)) {
+      entry_points.push_back("update_state_" + top.getIFace().getClkSources()[clk].getName());
+    }
+  }
+
+  for (const string &entry_point : entry_points) {
+    Function *fn = module.getFunction(entry_point);
+    assert(fn);
+    fn->setName(cIdentifier(name + "_" + entry_point));
+  }
+}
+
+static bool writeObject(Module &module, TargetMachine &target_machine, const string &path)
+{
+  error_code err;
+  raw_fd_ostream out(path, err, sys::fs::F_None);
+  if (err) {
+    errs() << "Unable to open " << path << ": " << err.message() << "\n";
+    return false;
+  }
+
+  legacy::PassManager pm;
+  if (target_machine.addPassesToEmitFile(pm, out, TargetMachine::CGFT_ObjectFile)) {
+    errs() << "Target can't emit object files\n";
+    return false;
+  }
+  pm.run(module);
+
+  return true;
+}
+
+bool CompileAOT(const Circuit &circuit, const string &prefix, const string &symbol_prefix, unsigned opt_level)
+{
+  const Definition &top = circuit.getTopDefinition();
+  string name = cIdentifier(symbol_prefix.empty() ? top.getSafeName() : symbol_prefix);
+
+  /* The object is meant to end up in a shared library */
+  unique_ptr<TargetMachine> target_machine(
+    EngineBuilder().setRelocationModel(Reloc::PIC_)
+                   .setOptLevel(opt_level >= 3 ? CodeGenOpt::Aggressive : CodeGenOpt::Default)
+                   .selectTarget());
+  const DataLayout data_layout = target_machine->createDataLayout();
+  Builder builder(data_layout, *target_machine);
+
+  /* get_values only feeds the JIT's debug instrumentation, which a
+   * prebuilt object doesn't have, so it is left out */
+  ModuleEnvironment mod_env = MakeMergedModule(builder, top);
+  Module &module = *mod_env.getModule();
+  addStateGlobals(module, top.getSimInfo(), name);
+  prefixEntryPoints(module, top, name);
+
+  JIT::runOptimizations(module, opt_level, true);
+
+  return writeObject(module, *target_machine, prefix + ".o") &&
+         writeHeader(top, name, prefix + ".h", data_layout, builder.getContext());
+}
+
+}
@@ -0,0 +1,180 @@
+#include <jitsim/batch_runner.hpp>
+
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace JITSim {
+
+using namespace std;
+
+namespace {
+
+/* Every worker owns a queue it pops from the back of, while thieves take
+ * from the front, so owner and thief rarely contend for the same lock */
+class WorkQueue {
+private:
+  deque<size_t> jobs;
+  mutex lock;
+
+public:
+  void push(size_t job)
+  {
+    lock_guard<mutex> guard(lock);
+    jobs.push_back(job);
+  }
+
+  bool pop(size_t &job)
+  {
+    lock_guard<mutex> guard(lock);
+    if (jobs.empty()) {
+      return false;
+    }
+    job = jobs.back();
+    jobs.pop_back();
+    return true;
+  }
+
+  bool steal(size_t &job)
+  {
+    lock_guard<mutex> guard(lock);
+    if (jobs.empty()) {
+      return false;
+    }
+    job = jobs.front();
+    jobs.pop_front();
+    return true;
+  }
+};
+
+}
+
+static bool parseValue(const string &str, llvm::APInt &val)
+{
+  return !llvm::StringRef(str).getAsInteger(10, val);
+}
+
+static JobResult runStimulus(CompiledCircuit &circuit, const StimulusJob &job)
+{
+  JobResult result { job.path, false, 0, 0, 0, "" };
+  auto start = chrono::steady_clock::now();
+
+  /* Failed jobs still report how long they ran before the error */
+  auto fail = [&](const string &error) {
+    result.error = error;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+  };
+
+  ifstream in(job.path);
+  if (!in) {
+    return fail("unable to open stimulus");
+  }
+
+  unique_ptr<Simulation> sim = circuit.makeSimulation();
+  const LLVMStruct *outputs = &sim->computeOutput();
+  bool outputs_stale = false;
+
+  string line;
+  unsigned line_num = 0;
+  while (getline(in, line)) {
+    line_num++;
+    line = line.substr(0, line.find('#'));
+
+    istringstream words(line);
+    string cmd, name, value;
+    if (!(words >> cmd)) {
+      continue;
+    }
+
+    llvm::APInt val;
+    uint64_t num_cycles;
+    if (cmd == "assign" && words >> name >> value && parseValue(value, val)) {
+      if (!sim->hasInput(name)) {
+        return fail("line " + to_string(line_num) + ": unknown input " + name);
+      }
+      sim->setInput(name, val);
+      outputs_stale = true;
+    } else if (cmd == "run" && words >> value && !llvm::StringRef(value).getAsInteger(10, num_cycles)) {
+      outputs = &sim->run(num_cycles);
+      outputs_stale = false;
+      result.cycles += num_cycles;
+    } else if (cmd == "expect" && words >> name >> value && parseValue(value, val)) {
+      if (outputs_stale) {
+        outputs = &sim->computeOutput();
+        outputs_stale = false;
+      }
+      if (!outputs->hasMember(name)) {
+        return fail("line " + to_string(line_num) + ": unknown output " + name);
+      }
+      llvm::APInt actual = outputs->getValue(name);
+      if (val.getActiveBits() > actual.getBitWidth()) {
+        return fail("line " + to_string(line_num) + ": value wider than output " + name);
+      }
+      if (actual != val.zextOrTrunc(actual.getBitWidth())) {
+        result.mismatches++;
+      }
+    } else {
+      return fail("line " + to_string(line_num) + ": invalid command");
+    }
+  }
+
+  result.completed = true;
+  result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  return result;
+}
+
+BatchReport RunBatch(CompiledCircuit &circuit, const vector<StimulusJob> &jobs, unsigned num_threads)
+{
+  num_threads = max(1u, min<unsigned>(num_threads, jobs.size()));
+  BatchReport report { vector<JobResult>(jobs.size()), 0, 0, num_threads };
+
+  /* Simulations may only run concurrently on frozen code */
+  circuit.freeze();
+
+  vector<WorkQueue> queues(num_threads);
+  for (size_t i = 0; i < jobs.size(); i++) {
+    queues[i % num_threads].push(i);
+  }
+
+  auto worker = [&](unsigned worker_idx) {
+    size_t job;
+    while (true) {
+      bool found = queues[worker_idx].pop(job);
+      for (unsigned i = 1; !found && i < num_threads; i++) {
+        found = queues[(worker_idx + i) % num_threads].steal(job);
+      }
+      /* Jobs never get added later, so empty queues everywhere means done */
+      if (!found) {
+        return;
+      }
+
+      report.results[job] = runStimulus(circuit, jobs[job]);
+    }
+  };
+
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> threads;
+  for (unsigned i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+
+  for (thread &t : threads) {
+    t.join();
+  }
+
+  report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  for (const JobResult &result : report.results) {
+    report.total_cycles += result.cycles;
+  }
+
+  return report;
+}
+
+}
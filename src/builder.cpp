@@ -72,7 +72,11 @@ Function * ModuleEnvironment::makeFunctionDecl(const std::string &name, Function
 
 FunctionEnvironment ModuleEnvironment::makeFunction(const std::string &name, FunctionType *function_type)
 {
-  Function *fn = makeFunctionDecl(name, function_type);
+  /* Callers may already have declared the function in this module */
+  Function *fn = getFunctionDecl(name);
+  if (!fn) {
+    fn = makeFunctionDecl(name, function_type);
+  }
 
   return FunctionEnvironment(fn, this);
 }
@@ -87,13 +91,43 @@ std::string ModuleEnvironment::getIRStr() const
   return str;
 }
 
-ModuleEnvironment Builder::makeModule(const std::string &name)
+Type * ModuleEnvironment::getValueType(unsigned width)
+{
+  if (bit_sliced) {
+    return VectorType::get(Type::getIntNTy(*context, lanes), width);
+  }
+
+  Type *type = Type::getIntNTy(*context, width);
+  if (lanes == 1) {
+    return type;
+  }
+
+  return VectorType::get(type, lanes);
+}
+
+Constant * ModuleEnvironment::getConstant(const APInt &val)
+{
+  if (bit_sliced) {
+    std::vector<Constant *> words;
+    for (unsigned i = 0; i < val.getBitWidth(); i++) {
+      words.push_back(val[i] ? Constant::getAllOnesValue(Type::getIntNTy(*context, lanes)) :
+                               Constant::getNullValue(Type::getIntNTy(*context, lanes)));
+    }
+
+    return ConstantVector::get(words);
+  }
+
+  /* Splats across every lane for vector types */
+  return ConstantInt::get(getValueType(val.getBitWidth()), val);
+}
+
+ModuleEnvironment Builder::makeModule(const std::string &name, unsigned lanes, bool bit_sliced)
 {
   std::unique_ptr<Module> module = make_unique<Module>(StringRef(name), context);
   module->setDataLayout(data_layout);
   module->setTargetTriple(triple);
 
-  return ModuleEnvironment(move(module), &context);
+  return ModuleEnvironment(move(module), &context, lanes, bit_sliced);
 }
 
 bool FunctionEnvironment::verify() const
@@ -0,0 +1,303 @@
+#include <jitsim/checkpoint.hpp>
+
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+static const char CheckpointMagic[8] = { 'J', 'I', 'T', 'S', 'I', 'M', 'C', 'K' };
+static const uint32_t CheckpointVersion = 1;
+static const unsigned MaxCheckpointInputs = 4;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_inputs;
+  char fingerprint[32];
+  uint64_t state_offset;
+  uint64_t state_size;
+  uint64_t input_offsets[MaxCheckpointInputs];
+  uint64_t input_sizes[MaxCheckpointInputs];
+};
+
+StateBuffer::StateBuffer(vector<uint8_t> &&initial)
+  : heap(move(initial)),
+    mapping(nullptr),
+    mapping_size(0),
+    ptr(heap.data()),
+    num_bytes(heap.size())
+{
+}
+
+StateBuffer::~StateBuffer()
+{
+  unmap();
+}
+
+void StateBuffer::unmap()
+{
+  if (mapping) {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+}
+
+bool StateBuffer::mapFile(int fd, uint64_t offset, size_t size)
+{
+  if (size == 0) {
+    num_bytes = 0;
+    return true;
+  }
+
+  /* Private mappings copy pages on write, so the file stays untouched */
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  unmap();
+  heap.clear();
+  heap.shrink_to_fit();
+  mapping = (uint8_t *)addr;
+  mapping_size = size;
+  ptr = mapping;
+  num_bytes = size;
+
+  return true;
+}
+
+static void hashLayout(MD5 &hash, const Definition &defn)
+{
+  const SimInfo &siminfo = defn.getSimInfo();
+  hash.update(defn.getName());
+  hash.update(StringRef("\0", 1));
+  hash.update(to_string(siminfo.getNumStateBytes()));
+
+  if (siminfo.isPrimitive()) {
+    return;
+  }
+
+  for (const Instance *inst : siminfo.getStatefulInstances()) {
+    hash.update(inst->getName() + "@" + to_string(siminfo.getOffset(inst)));
+    hash.update(StringRef("\0", 1));
+    hashLayout(hash, inst->getDefinition());
+  }
+}
+
+string GetLayoutFingerprint(const Definition &top)
+{
+  MD5 hash;
+  hashLayout(hash, top);
+
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<32> str;
+  MD5::stringifyResult(result, str);
+
+  return str.str();
+}
+
+static uint64_t alignToPage(uint64_t offset)
+{
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  return (offset + page - 1) / page * page;
+}
+
+static bool writeAt(int fd, const void *data, size_t size, uint64_t offset)
+{
+  const uint8_t *cur = (const uint8_t *)data;
+  while (size > 0) {
+    ssize_t written = pwrite(fd, cur, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    cur += written;
+    size -= written;
+    offset += written;
+  }
+
+  return true;
+}
+
+static bool readAt(int fd, void *data, size_t size, uint64_t offset)
+{
+  uint8_t *cur = (uint8_t *)data;
+  while (size > 0) {
+    ssize_t num_read = pread(fd, cur, size, offset);
+    if (num_read <= 0) {
+      return false;
+    }
+    cur += num_read;
+    size -= num_read;
+    offset += num_read;
+  }
+
+  return true;
+}
+
+vector<unique_ptr<StateBuffer>> ForkState(const StateBuffer &state, unsigned num_children)
+{
+  vector<unique_ptr<StateBuffer>> children;
+  if (state.size() == 0) {
+    for (unsigned i = 0; i < num_children; i++) {
+      children.push_back(make_unique<StateBuffer>(vector<uint8_t>()));
+    }
+    return children;
+  }
+
+  const char *tmp_dir = getenv("TMPDIR");
+  string arena_path = string(tmp_dir ? tmp_dir : "/tmp") + "/jitsim-fork-XXXXXX";
+  int fd = mkstemp(&arena_path[0]);
+  bool ok = fd >= 0;
+  if (ok) {
+    /* The mappings keep the arena alive after the name and fd are gone */
+    unlink(arena_path.c_str());
+    ok = writeAt(fd, state.data(), state.size(), 0);
+  }
+
+  for (unsigned i = 0; ok && i < num_children; i++) {
+    children.push_back(make_unique<StateBuffer>(vector<uint8_t>()));
+    ok = children.back()->mapFile(fd, 0, state.size());
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (!ok) {
+    /* Fall back to private heap copies */
+    errs() << "Unable to map a shared state arena, copying state instead\n";
+    children.clear();
+    for (unsigned i = 0; i < num_children; i++) {
+      children.push_back(make_unique<StateBuffer>(vector<uint8_t>(state.begin(), state.end())));
+    }
+  }
+
+  return children;
+}
+
+bool SaveCheckpoint(const string &path, const string &fingerprint, const StateBuffer &state,
+                    const vector<pair<const uint8_t *, size_t>> &inputs)
+{
+  assert(inputs.size() <= MaxCheckpointInputs);
+  assert(fingerprint.size() == sizeof(CheckpointHeader::fingerprint));
+
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CheckpointMagic, sizeof(header.magic));
+  header.version = CheckpointVersion;
+  header.num_inputs = inputs.size();
+  memcpy(header.fingerprint, fingerprint.data(), sizeof(header.fingerprint));
+  header.state_offset = alignToPage(sizeof(header));
+  header.state_size = state.size();
+
+  uint64_t offset = header.state_offset + state.size();
+  for (unsigned i = 0; i < inputs.size(); i++) {
+    header.input_offsets[i] = offset;
+    header.input_sizes[i] = inputs[i].second;
+    offset += inputs[i].second;
+  }
+
+  /* Write to a temporary and rename, so a crash never leaves a torn checkpoint */
+  string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    errs() << "Unable to create checkpoint " << path << "\n";
+    return false;
+  }
+
+  bool ok = writeAt(fd, &header, sizeof(header), 0) &&
+            writeAt(fd, state.data(), state.size(), header.state_offset);
+  for (unsigned i = 0; ok && i < inputs.size(); i++) {
+    ok = writeAt(fd, inputs[i].first, inputs[i].second, header.input_offsets[i]);
+  }
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+
+  if (!ok) {
+    errs() << "Unable to write checkpoint " << path << "\n";
+    unlink(tmp_path.c_str());
+  }
+
+  return ok;
+}
+
+bool LoadCheckpoint(const string &path, const string &fingerprint, StateBuffer &state,
+                    const vector<pair<uint8_t *, size_t>> &inputs)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    errs() << "Unable to open checkpoint " << path << "\n";
+    return false;
+  }
+
+  CheckpointHeader header;
+  if (!readAt(fd, &header, sizeof(header), 0) ||
+      memcmp(header.magic, CheckpointMagic, sizeof(header.magic)) != 0 ||
+      header.version != CheckpointVersion) {
+    errs() << path << " is not a checkpoint\n";
+    close(fd);
+    return false;
+  }
+
+  bool matches = fingerprint.size() == sizeof(header.fingerprint) &&
+                 memcmp(header.fingerprint, fingerprint.data(), sizeof(header.fingerprint)) == 0 &&
+                 header.state_size == state.size() && header.num_inputs == inputs.size();
+  for (unsigned i = 0; matches && i < inputs.size(); i++) {
+    matches = header.input_sizes[i] == inputs[i].second;
+  }
+  if (!matches) {
+    errs() << "Checkpoint " << path << " was saved from a different design\n";
+    close(fd);
+    return false;
+  }
+
+  /* Touching a mapped page past the end of the file raises SIGBUS */
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || (uint64_t)file_stat.st_size < header.state_offset + header.state_size) {
+    errs() << "Checkpoint " << path << " is truncated\n";
+    close(fd);
+    return false;
+  }
+
+  /* Inputs are read up front so a short file leaves the simulation untouched */
+  vector<vector<uint8_t>> input_data;
+  for (unsigned i = 0; i < inputs.size(); i++) {
+    input_data.emplace_back(inputs[i].second);
+    if (!readAt(fd, input_data.back().data(), inputs[i].second, header.input_offsets[i])) {
+      errs() << "Checkpoint " << path << " is truncated\n";
+      close(fd);
+      return false;
+    }
+  }
+
+  bool ok = state.mapFile(fd, header.state_offset, header.state_size);
+  close(fd);
+  if (!ok) {
+    errs() << "Unable to map checkpoint " << path << "\n";
+    return false;
+  }
+
+  for (unsigned i = 0; i < inputs.size(); i++) {
+    memcpy(inputs[i].first, input_data[i].data(), inputs[i].second);
+  }
+
+  return true;
+}
+
+}
@@ -1,4 +1,5 @@
 #include <jitsim/circuit.hpp>
+#include "coreir_primitives.hpp"
 
 #include <unordered_map>
 #include <list>
@@ -8,6 +9,7 @@
 #include <sstream>
 #include <numeric>
 
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/StringRef.h>
 
 namespace JITSim {
@@ -16,11 +18,15 @@ using namespace std;
 
 SourceSlice::SourceSlice(const Definition *definition_, const Instance *instance_,
                        const Source *val_, int offset_, int width_)
-  : definition(definition_), instance(instance_),
-    iface(definition ? &definition->getIFace() : &instance->getIFace()),
-    val(val_), offset(offset_), width(width_),
-    constant()
-{}
+  : val(val_), offset(offset_), width(width_),
+    kind(definition_ ? Kind::Definition : Kind::Instance)
+{
+  if (definition_) {
+    definition = definition_;
+  } else {
+    instance = instance_;
+  }
+}
 
 llvm::APInt makeAPInt(const std::vector<bool> &constant)
 {
@@ -34,21 +40,31 @@ llvm::APInt makeAPInt(const std::vector<bool> &constant)
 }
 
 SourceSlice::SourceSlice(const std::vector<bool> &constant_)
-  : definition(nullptr), instance(nullptr), iface(nullptr),
-    val(nullptr), offset(0), width(constant_.size()),
-    constant(makeAPInt(constant_))
+  : SourceSlice(makeAPInt(constant_))
+{}
+
+SourceSlice::SourceSlice(const llvm::APInt &constant_)
+  : constant(&InternConstant(constant_)),
+    val(nullptr), offset(0), width(constant_.getBitWidth()),
+    kind(Kind::Constant)
 {}
 
+const IFace * SourceSlice::getIFace() const
+{
+  switch (kind) {
+    case Kind::Definition:
+      return &definition->getIFace();
+    case Kind::Instance:
+      return &instance->getIFace();
+    default:
+      return nullptr;
+  }
+}
+
 void SourceSlice::extend(const SourceSlice &other)
 {
+  assert(!isConstant());
   width += other.width;
-
-  if (isConstant()) {
-    llvm::APInt new_const = other.constant->zext(width);
-    new_const <<= (width - other.width);
-    new_const |= constant->zext(width);
-    *constant = new_const;
-  }
 }
 
 Select::Select(SourceSlice &&slice) 
@@ -65,20 +81,49 @@ void Select::compressSlices()
 {
   vector<SourceSlice> new_slices;
   new_slices.emplace_back(slices.front());
+
+  /* Runs of constants are concatenated here and interned once at the end
+   * of the run, with later slices taking the high bits */
+  llvm::APInt const_run;
+  unsigned run_length = 0;
+  auto finishRun = [&]() {
+    if (run_length > 1) {
+      new_slices.back() = SourceSlice(const_run);
+    }
+    run_length = 0;
+  };
+
+  if (slices.front().isConstant()) {
+    const_run = slices.front().getConstant();
+    run_length = 1;
+  }
+
   for (unsigned i = 1; i < slices.size(); i++) {
     const SourceSlice &cur_slice = slices[i];
     SourceSlice &new_slice = new_slices.back();
 
-    if ((cur_slice.getSource() == new_slice.getSource() &&
-        cur_slice.getOffset() == new_slice.getEndIdx()) ||
-        (cur_slice.isConstant() && new_slice.isConstant())) {
-
-        new_slice.extend(cur_slice);
+    if (cur_slice.isConstant() && new_slice.isConstant()) {
+      unsigned width = const_run.getBitWidth() + cur_slice.getWidth();
+      llvm::APInt new_const = cur_slice.getConstant().zext(width);
+      new_const <<= const_run.getBitWidth();
+      new_const |= const_run.zext(width);
+      const_run = new_const;
+      run_length++;
+    } else if (!cur_slice.isConstant() && !new_slice.isConstant() &&
+               cur_slice.getSource() == new_slice.getSource() &&
+               cur_slice.getOffset() == new_slice.getEndIdx()) {
+      new_slice.extend(cur_slice);
     } else {
       // Can't merge these slices
+      finishRun();
       new_slices.emplace_back(cur_slice);
+      if (cur_slice.isConstant()) {
+        const_run = cur_slice.getConstant();
+        run_length = 1;
+      }
     }
   }
+  finishRun();
 
   slices = move(new_slices);
   if (slices.size() == 1) {
@@ -89,48 +134,51 @@ void Select::compressSlices()
   }
 }
 
+static shared_ptr<const PortLookup> makePortLookup(const vector<Sink> &sinks, const vector<Source> &sources,
+                                                   bool is_defn)
+{
+  shared_ptr<PortLookup> lookup = make_shared<PortLookup>();
+
+  /* Lookups are stored from the definition's point of view */
+  unordered_map<Symbol, unsigned> &sink_map = is_defn ? lookup->sinks : lookup->sources;
+  unordered_map<Symbol, unsigned> &source_map = is_defn ? lookup->sources : lookup->sinks;
+  for (unsigned i = 0; i < sources.size(); i++) {
+    source_map[sources[i].getSymbol()] = i;
+  }
+
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    sink_map[sinks[i].getSymbol()] = i;
+  }
+
+  return lookup;
+}
+
 IFace::IFace(const string &name_,
              vector<Sink> &&sinks_,
              vector<Source> &&sources_,
              vector<ClkSink> &&clk_sinks_,
              vector<ClkSource> &&clk_sources_,
+             shared_ptr<const PortLookup> lookup_,
              bool is_defn)
-  : name(name_),
+  : name(InternSymbol(name_)),
     sinks(move(sinks_)),
     sources(move(sources_)), 
     clk_sinks(move(clk_sinks_)),
     clk_sources(move(clk_sources_)), 
-    sink_lookup(),
-    source_lookup(),
+    lookup(move(lookup_)),
     is_definition(is_defn)
 {
-  for (Source &source : sources) {
-    source_lookup[source.getName()] = &source;
-  }
-
-  for (Sink &sink : sinks) {
-    sink_lookup[sink.getName()] = &sink;
-  }
-}
-
-const Source * IFace::getSource(const string &name) const
-{
-  return source_lookup.find(name)->second;
-}
-
-Source * IFace::getSource(const string &name)
-{
-  return source_lookup.find(name)->second;
-}
-
-const Sink * IFace::getSink(const string &name) const
-{
-  return sink_lookup.find(name)->second;
 }
 
-Sink * IFace::getSink(const string &name)
+IFace::IFace(const string &name_,
+             vector<Sink> &&sinks_,
+             vector<Source> &&sources_,
+             vector<ClkSink> &&clk_sinks_,
+             vector<ClkSource> &&clk_sources_,
+             bool is_defn)
+  : IFace(name_, move(sinks_), move(sources_), move(clk_sinks_), move(clk_sources_), nullptr, is_defn)
 {
-  return sink_lookup.find(name)->second;
+  lookup = makePortLookup(sinks, sources, is_defn);
 }
 
 static vector<Sink> flipSources(const IFace &orig)
@@ -138,7 +186,7 @@ static vector<Sink> flipSources(const IFace &orig)
   vector<Sink> sinks;
 
   for (const Source &val : orig.getSources()) {
-    sinks.emplace_back(val.getName(), val.getWidth());
+    sinks.emplace_back(val);
   }
 
   return sinks;
@@ -149,7 +197,7 @@ static vector<Source> flipSinks(const IFace &orig)
   vector<Source> sources;
 
   for (const Sink &sink : orig.getSinks()) {
-    sources.emplace_back(sink.getName(), sink.getWidth());
+    sources.emplace_back(sink);
   }
 
   return sources;
@@ -178,24 +226,58 @@ static vector<ClkSource> flipClkSinks(const IFace &orig)
 }
 
 InstanceIFace::InstanceIFace(const string &name_, const IFace &defn_iface)
-  : IFace(name_, flipSources(defn_iface), flipSinks(defn_iface), flipClkSources(defn_iface), flipClkSinks(defn_iface), false),
-    defn_source_to_sink()
+  : IFace(name_, flipSources(defn_iface), flipSinks(defn_iface), flipClkSources(defn_iface), flipClkSinks(defn_iface),
+          defn_iface.getPortLookup(), false),
+    defn_sources(defn_iface.getSources().data())
 {
-  const vector<Source> &sources = defn_iface.getSources();
-  const vector<Sink> &sinks = getSinks();
-  for (unsigned i = 0; i < sinks.size(); i++) {
-    defn_source_to_sink.insert(make_pair(&sources[i], &sinks[i]));
-  }
 }
 
 Instance::Instance(const string &name_,
                    const Definition *defn_)
-  : name(name_),
-    interface(name_, defn_->getIFace()),
-    defn(defn_)
+  : interface(name_, defn_->getIFace()),
+    defn(defn_),
+    args()
 {
 }
 
+const string & Instance::getArg(Symbol key) const
+{
+  for (const auto &arg : args) {
+    if (arg.first == key) {
+      return GetSymbolName(arg.second);
+    }
+  }
+
+  assert(false && "Missing instance argument");
+  return GetSymbolName(key);
+}
+
+void Instance::setArg(const string &key, const string &val)
+{
+  Symbol key_sym = InternSymbol(key);
+  Symbol val_sym = InternSymbol(val);
+  for (auto &arg : args) {
+    if (arg.first == key_sym) {
+      arg.second = val_sym;
+      return;
+    }
+  }
+
+  args.emplace_back(key_sym, val_sym);
+}
+
+void Instance::redirect(const Definition *defn_)
+{
+  defn = defn_;
+  interface.rebind(defn->getIFace());
+}
+
+void Instance::replaceDefinition(const Definition *defn_)
+{
+  defn = defn_;
+  interface = InstanceIFace(interface.getName(), defn->getIFace());
+}
+
 const SimInfo & Instance::getSimInfo() const 
 {
   return defn->getSimInfo();
@@ -232,25 +314,37 @@ Definition::Definition(const string &name_,
     siminfo(interface, fully_connect(*this, instances, make_connections))
 {
   for (const Instance &inst : instances) {
-    instance_lookup[inst.getName()] = &inst;
+    instance_lookup[inst.getSymbol()] = &inst;
   }
 }
 
 Definition::Definition(const string &name_,
                        IFace &&iface,
-                       const Primitive &primitive)
+                       vector<Instance> &&insts,
+                       function<void (Definition&, vector<Instance> &instances)> make_connections,
+                       const SimOrders &orders)
   : name(name_),
     safe_name(cleanName(name)),
     interface(move(iface)),
-    instances(),
+    instances(move(insts)),
     instance_lookup(),
-    siminfo(interface, primitive)
+    siminfo(interface, fully_connect(*this, instances, make_connections), orders)
 {
+  for (const Instance &inst : instances) {
+    instance_lookup[inst.getSymbol()] = &inst;
+  }
 }
 
-const Instance & Definition::getInstance(const std::string &name) const
+Definition::Definition(const string &name_,
+                       IFace &&iface,
+                       const Primitive &primitive)
+  : name(name_),
+    safe_name(cleanName(name)),
+    interface(move(iface)),
+    instances(),
+    instance_lookup(),
+    siminfo(interface, primitive)
 {
-  return *instance_lookup.find(name)->second;
 }
 
 Instance Definition::makeInstance(const string &name) const
@@ -265,7 +359,7 @@ string SourceSlice::repr() const
   if (isConstant()) {
     return constant->toString(10, false);
   } else {
-    r << iface->getName() << "." << val->getName();
+    r << getIFace()->getName() << "." << val->getName();
 
     if (!isWhole()) {
       if (width > 1) {
@@ -371,8 +465,392 @@ void Definition::print(const string &prefix) const
 
 void Circuit::print() const
 {
-  for (const Definition &defn : definitions) {
-    defn.print();
+  for (const Definition *defn : unique_definitions) {
+    defn->print();
+  }
+}
+
+static bool samePorts(const IFace &a, const IFace &b)
+{
+  if (a.getSinks().size() != b.getSinks().size() || a.getSources().size() != b.getSources().size() ||
+      a.getClkSinks().size() != b.getClkSinks().size() || a.getClkSources().size() != b.getClkSources().size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.getSinks().size(); i++) {
+    if (a.getSinks()[i].getSymbol() != b.getSinks()[i].getSymbol() ||
+        a.getSinks()[i].getWidth() != b.getSinks()[i].getWidth()) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.getSources().size(); i++) {
+    if (a.getSources()[i].getSymbol() != b.getSources()[i].getSymbol() ||
+        a.getSources()[i].getWidth() != b.getSources()[i].getWidth()) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.getClkSinks().size(); i++) {
+    if (a.getClkSinks()[i].getSymbol() != b.getClkSinks()[i].getSymbol()) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.getClkSources().size(); i++) {
+    if (a.getClkSources()[i].getSymbol() != b.getClkSources()[i].getSymbol()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Slices are compared by position, since the sources they point at belong
+ * to different definitions */
+static bool sameSlice(const SourceSlice &a, const Definition &a_defn,
+                      const SourceSlice &b, const Definition &b_defn)
+{
+  if (a.isConstant() != b.isConstant() || a.isDefinitionAttached() != b.isDefinitionAttached() ||
+      a.getOffset() != b.getOffset() || a.getWidth() != b.getWidth()) {
+    return false;
+  } else if (a.isConstant()) {
+    return a.getConstant() == b.getConstant();
+  } else if (a.isDefinitionAttached()) {
+    return a.getSource() - a_defn.getIFace().getSources().data() ==
+           b.getSource() - b_defn.getIFace().getSources().data();
+  }
+
+  const Instance *a_inst = a.getInstance();
+  const Instance *b_inst = b.getInstance();
+  return a_inst - a_defn.getInstances().data() == b_inst - b_defn.getInstances().data() &&
+         a.getSource() - a_inst->getIFace().getSources().data() ==
+         b.getSource() - b_inst->getIFace().getSources().data();
+}
+
+static bool sameSinks(const vector<Sink> &a, const Definition &a_defn,
+                      const vector<Sink> &b, const Definition &b_defn)
+{
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].isConnected() != b[i].isConnected()) {
+      return false;
+    } else if (!a[i].isConnected()) {
+      continue;
+    }
+
+    const vector<SourceSlice> &a_slices = a[i].getSelect().getSlices();
+    const vector<SourceSlice> &b_slices = b[i].getSelect().getSlices();
+    if (a_slices.size() != b_slices.size()) {
+      return false;
+    }
+    for (size_t j = 0; j < a_slices.size(); j++) {
+      if (!sameSlice(a_slices[j], a_defn, b_slices[j], b_defn)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/* Clocks are compared by the index of the definition clock driving them */
+static bool sameClocks(const Instance &a, const Definition &a_defn, const Instance &b, const Definition &b_defn)
+{
+  const vector<ClkSink> &a_clks = a.getIFace().getClkSinks();
+  const vector<ClkSink> &b_clks = b.getIFace().getClkSinks();
+  for (size_t i = 0; i < a_clks.size(); i++) {
+    if (a_defn.getIFace().getClkSourceIndex(a_clks[i].getSource()) !=
+        b_defn.getIFace().getClkSourceIndex(b_clks[i].getSource())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Instances must already point at their canonical definitions */
+static bool sameStructure(const Definition &a, const Definition &b)
+{
+  const SimInfo &a_info = a.getSimInfo();
+  const SimInfo &b_info = b.getSimInfo();
+  if (a_info.isPrimitive() != b_info.isPrimitive() || !samePorts(a.getIFace(), b.getIFace())) {
+    return false;
+  } else if (a_info.isPrimitive()) {
+    /* Primitives are closures, only those from the same generator call match */
+    const Primitive &a_prim = a_info.getPrimitive();
+    const Primitive &b_prim = b_info.getPrimitive();
+    return !a_prim.generator.empty() && a_prim.generator == b_prim.generator && a_prim.genargs == b_prim.genargs;
+  }
+
+  const vector<Instance> &a_insts = a.getInstances();
+  const vector<Instance> &b_insts = b.getInstances();
+  if (a_insts.size() != b_insts.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a_insts.size(); i++) {
+    if (a_insts[i].getSymbol() != b_insts[i].getSymbol() ||
+        &a_insts[i].getDefinition() != &b_insts[i].getDefinition() ||
+        a_insts[i].getArgs() != b_insts[i].getArgs()) {
+      return false;
+    }
+  }
+
+  if (!sameSinks(a.getIFace().getSinks(), a, b.getIFace().getSinks(), b)) {
+    return false;
+  }
+  for (size_t i = 0; i < a_insts.size(); i++) {
+    if (!sameSinks(a_insts[i].getIFace().getSinks(), a, b_insts[i].getIFace().getSinks(), b) ||
+        !sameClocks(a_insts[i], a, b_insts[i], b)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Covers the ports, instances and primitive generator, which separates
+ * most distinct definitions without walking their connections */
+static llvm::hash_code hashStructure(const Definition &defn)
+{
+  const IFace &iface = defn.getIFace();
+  llvm::hash_code hash = llvm::hash_combine(defn.getSimInfo().isPrimitive(), iface.getSinks().size(),
+                                            iface.getSources().size(), iface.getClkSources().size());
+  for (const Sink &sink : iface.getSinks()) {
+    hash = llvm::hash_combine(hash, sink.getSymbol(), sink.getWidth());
+  }
+  for (const Source &src : iface.getSources()) {
+    hash = llvm::hash_combine(hash, src.getSymbol(), src.getWidth());
+  }
+
+  if (defn.getSimInfo().isPrimitive()) {
+    const Primitive &prim = defn.getSimInfo().getPrimitive();
+    hash = llvm::hash_combine(hash, prim.generator);
+    for (const auto &arg : prim.genargs) {
+      hash = llvm::hash_combine(hash, arg.first, arg.second);
+    }
+    return hash;
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    hash = llvm::hash_combine(hash, inst.getSymbol(), &inst.getDefinition());
+    for (const auto &arg : inst.getArgs()) {
+      hash = llvm::hash_combine(hash, arg.first, arg.second);
+    }
+  }
+
+  return hash;
+}
+
+void Circuit::deduplicate()
+{
+  /* Definitions come after everything they instantiate, so children are
+   * canonical by the time their parents are hashed */
+  unordered_map<const Definition *, const Definition *> canonical;
+  unordered_map<size_t, vector<const Definition *>> by_hash;
+
+  for (Definition &defn : definitions) {
+    for (Instance &inst : defn.getInstances()) {
+      auto iter = canonical.find(&inst.getDefinition());
+      if (iter != canonical.end() && iter->second != &inst.getDefinition()) {
+        inst.redirect(iter->second);
+      }
+    }
+
+    vector<const Definition *> &candidates = by_hash[hashStructure(defn)];
+    const Definition *match = nullptr;
+    if (&defn != top_defn) {
+      for (const Definition *candidate : candidates) {
+        if (sameStructure(*candidate, defn)) {
+          match = candidate;
+          break;
+        }
+      }
+    }
+
+    if (match) {
+      canonical[&defn] = match;
+    } else {
+      canonical[&defn] = &defn;
+      candidates.push_back(&defn);
+      unique_definitions.push_back(&defn);
+    }
+  }
+}
+
+/* The slice behind a sink fed by the whole of one instance source */
+static const SourceSlice * getWholeInstanceSlice(const Sink &sink)
+{
+  if (!sink.isConnected() || !sink.getSelect().isDirect()) {
+    return nullptr;
+  }
+
+  const SourceSlice &slice = sink.getSelect().getDirect();
+  if (!slice.isInstanceAttached() || !slice.isWhole()) {
+    return nullptr;
+  }
+
+  return &slice;
+}
+
+static bool hasGenerator(const Definition &defn, const char *coreir_name, const char *corebit_name)
+{
+  if (!defn.getSimInfo().isPrimitive()) {
+    return false;
+  }
+
+  const string &generator = defn.getSimInfo().getPrimitive().generator;
+  return generator == coreir_name || generator == corebit_name;
+}
+
+static bool isRegisterOutput(const Sink &sink, const Instance &reg)
+{
+  const SourceSlice *slice = getWholeInstanceSlice(sink);
+  return slice && slice->getInstance() == &reg && slice->getSource() == reg.getIFace().getSource("out");
+}
+
+namespace {
+
+/* A Select to rebuild once an instance has new sources. Those are looked
+ * up by port name, since the old ones are gone by then */
+struct PendingSelect {
+  Sink *sink;
+  vector<SourceSlice> slices;
+  vector<Symbol> ports;
+
+  PendingSelect(Sink *sink_, const Select &select, const Instance &inst)
+    : sink(sink_), slices(select.getSlices()), ports()
+  {
+    for (const SourceSlice &slice : slices) {
+      ports.push_back(slice.getInstance() == &inst ? slice.getSource()->getSymbol() : NoSymbol);
+    }
+  }
+
+  void reconnect(const Instance &inst)
+  {
+    for (unsigned i = 0; i < slices.size(); i++) {
+      if (ports[i] != NoSymbol) {
+        slices[i] = SourceSlice(nullptr, &inst, inst.getIFace().getSource(ports[i]),
+                                slices[i].getOffset(), slices[i].getWidth());
+      }
+    }
+    sink->connect(Select(move(slices)));
+  }
+};
+
+}
+
+/* Swaps reg over to enabled, fed by the mux inputs en and in. Every other
+ * reader of reg keeps its slices, moved over to the new sources */
+static void foldRegister(Definition &defn, Instance &reg, const Definition *enabled,
+                         const Sink &en, const Sink &in)
+{
+  vector<PendingSelect> pending;
+  auto collect = [&](vector<Sink> &sinks) {
+    for (Sink &sink : sinks) {
+      if (!sink.isConnected()) {
+        continue;
+      }
+      for (const SourceSlice &slice : sink.getSelect().getSlices()) {
+        if (slice.getInstance() == &reg) {
+          pending.emplace_back(&sink, sink.getSelect(), reg);
+          break;
+        }
+      }
+    }
+  };
+
+  collect(defn.getIFace().getSinks());
+  for (Instance &inst : defn.getInstances()) {
+    if (&inst != &reg) {
+      collect(inst.getIFace().getSinks());
+    }
+  }
+
+  PendingSelect new_en(nullptr, en.getSelect(), reg);
+  PendingSelect new_in(nullptr, in.getSelect(), reg);
+  vector<const ClkSource *> clocks;
+  for (const ClkSink &clk : reg.getIFace().getClkSinks()) {
+    clocks.push_back(clk.getSource());
+  }
+
+  reg.replaceDefinition(enabled);
+
+  for (PendingSelect &select : pending) {
+    select.reconnect(reg);
+  }
+  new_en.sink = reg.getIFace().getSink("en");
+  new_en.reconnect(reg);
+  new_in.sink = reg.getIFace().getSink("in");
+  new_in.reconnect(reg);
+  for (unsigned i = 0; i < clocks.size(); i++) {
+    reg.getIFace().getClkSinks()[i].connect(clocks[i]);
+  }
+}
+
+/* A register fed by a mux that selects its own output only loads when the
+ * mux picks the other input. As jitsim.reg_en the mux becomes a branch
+ * around the store and drops out of every dependency cone. The external
+ * sources each definition depends on are unchanged, so parents analyzed
+ * against the old version stay valid */
+void Circuit::foldRegisterEnables()
+{
+  unordered_map<string, const Definition *> enabled_regs;
+  vector<Definition *> composites;
+  for (Definition &defn : definitions) {
+    if (!defn.getSimInfo().isPrimitive()) {
+      composites.push_back(&defn);
+    } else if (defn.getSimInfo().getPrimitive().generator == "jitsim.reg_en") {
+      enabled_regs.emplace(defn.getName(), &defn);
+    }
+  }
+
+  auto getEnabledRegister = [&](int width, bool en_low) {
+    GenArgs genargs = { { "en_low", en_low }, { "width", width } };
+    string name = "jitsim.reg_en_en_low_" + to_string(en_low) + "_width_" + to_string(width);
+
+    auto iter = enabled_regs.find(name);
+    if (iter != enabled_regs.end()) {
+      return iter->second;
+    }
+
+    /* Children come before their parents, so new primitives go in front */
+    definitions.emplace_front(name, BuildCoreIRPrimitiveIFace("jitsim.reg_en", genargs),
+                              BuildCoreIRPrimitive("jitsim.reg_en", genargs));
+    enabled_regs[name] = &definitions.front();
+
+    return (const Definition *)&definitions.front();
+  };
+
+  for (Definition *defn : composites) {
+    bool folded = false;
+
+    for (Instance &reg : defn->getInstances()) {
+      if (!hasGenerator(reg.getDefinition(), "coreir.reg", "corebit.reg")) {
+        continue;
+      }
+
+      const SourceSlice *mux_out = getWholeInstanceSlice(*reg.getIFace().getSink("in"));
+      if (!mux_out || !hasGenerator(mux_out->getInstance()->getDefinition(), "coreir.mux", "corebit.mux") ||
+          mux_out->getSource() != mux_out->getInstance()->getIFace().getSource("out")) {
+        continue;
+      }
+
+      const InstanceIFace &mux = mux_out->getInstance()->getIFace();
+      const Sink &sel = *mux.getSink("sel");
+      bool en_low = isRegisterOutput(*mux.getSink("in1"), reg);
+      if (!en_low && !isRegisterOutput(*mux.getSink("in0"), reg)) {
+        continue;
+      }
+      const Sink &data = *mux.getSink(en_low ? "in0" : "in1");
+      if (!sel.isConnected() || !data.isConnected()) {
+        continue;
+      }
+
+      int width = reg.getIFace().getSource("out")->getWidth();
+      foldRegister(*defn, reg, getEnabledRegister(width, en_low), sel, data);
+      folded = true;
+    }
+
+    if (folded) {
+      defn->reanalyze();
+    }
   }
 }
 
@@ -0,0 +1,806 @@
+#include <jitsim/circuit_file.hpp>
+#include "coreir_primitives.hpp"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+static const char CircuitMagic[8] = { 'J', 'I', 'T', 'S', 'I', 'M', 'C', 'F' };
+static const uint32_t CircuitVersion = 2;
+/* Written natively, so a file from a host of the other byte order is rejected */
+static const uint32_t CircuitByteOrder = 0x01020304;
+static const uint32_t NoString = ~0u;
+static const uint32_t NoClock = ~0u;
+
+namespace {
+
+struct Section {
+  uint64_t offset;
+  uint64_t count;
+};
+
+struct CircuitHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  Section chars;
+  Section strings;
+  Section words;
+  Section definitions;
+  Section ports;
+  Section instances;
+  Section args;
+  Section genargs;
+  Section selects;
+  Section slices;
+  Section orders;
+  Section clocks;
+};
+
+struct StringRecord {
+  uint32_t offset;
+  uint32_t size;
+};
+
+/* Definitions are stored in Circuit order, so instances only refer back.
+ * Ports are stored as sinks, sources, clock sinks then clock sources */
+struct DefinitionRecord {
+  uint32_t name;
+  /* NoString for definitions built from instances */
+  uint32_t generator;
+  uint32_t first_genarg;
+  uint32_t num_genargs;
+  uint32_t first_port;
+  uint32_t num_sinks;
+  uint32_t num_sources;
+  uint32_t num_clk_sinks;
+  uint32_t num_clk_sources;
+  uint32_t first_inst;
+  uint32_t num_insts;
+  /* The definition's sinks, then the sinks of each instance in order */
+  uint32_t first_select;
+  uint32_t num_selects;
+  /* The clock source feeding each clock input of each instance in order,
+   * or NoClock */
+  uint32_t first_clock;
+  uint32_t num_clocks;
+  /* State deps, output deps, state sources and output sources back to back */
+  uint32_t first_order;
+  uint32_t num_orders[4];
+};
+
+struct PortRecord {
+  uint32_t name;
+  int32_t width;
+};
+
+struct InstanceRecord {
+  uint32_t name;
+  uint32_t definition;
+  uint32_t first_arg;
+  uint32_t num_args;
+};
+
+struct ArgRecord {
+  uint32_t key;
+  uint32_t value;
+};
+
+struct GenArgRecord {
+  uint32_t name;
+  int32_t value;
+};
+
+/* Unconnected sinks have no slices */
+struct SelectRecord {
+  uint32_t first_slice;
+  uint32_t num_slices;
+};
+
+enum SliceKind : uint32_t { ConstantSlice, DefinitionSlice, InstanceSlice };
+
+/* Sources are indexed within the owning interface. Constants index their
+ * first word instead */
+struct SliceRecord {
+  uint32_t kind;
+  uint32_t owner;
+  uint32_t index;
+  int32_t offset;
+  int32_t width;
+};
+
+class CircuitWriter {
+private:
+  vector<char> chars;
+  vector<StringRecord> strings;
+  unordered_map<string, uint32_t> string_ids;
+  vector<uint64_t> words;
+  vector<DefinitionRecord> definitions;
+  vector<PortRecord> ports;
+  vector<InstanceRecord> instances;
+  vector<ArgRecord> args;
+  vector<GenArgRecord> genargs;
+  vector<SelectRecord> selects;
+  vector<SliceRecord> slices;
+  vector<uint32_t> orders;
+  vector<uint32_t> clocks;
+  unordered_map<const Definition *, uint32_t> defn_ids;
+
+  uint32_t addString(const string &str);
+  void addSelects(const vector<Sink> &sinks, const Definition &defn);
+
+public:
+  bool addDefinition(const Definition &defn);
+  vector<uint8_t> serialize() const;
+};
+
+template <typename T>
+struct Table {
+  const T *data = nullptr;
+  uint64_t count = 0;
+
+  bool contains(uint64_t first, uint64_t num) const { return first <= count && num <= count - first; }
+  const T & operator[](uint64_t idx) const { return data[idx]; }
+};
+
+class CircuitReader {
+private:
+  string path;
+  Table<char> chars;
+  Table<StringRecord> strings;
+  Table<uint64_t> words;
+  Table<DefinitionRecord> definitions;
+  Table<PortRecord> ports;
+  Table<InstanceRecord> instances;
+  Table<ArgRecord> args;
+  Table<GenArgRecord> genargs;
+  Table<SelectRecord> selects;
+  Table<SliceRecord> slices;
+  Table<uint32_t> orders;
+  Table<uint32_t> clocks;
+
+  deque<Definition> built;
+
+  bool validString(uint32_t id) const;
+  string getString(uint32_t id) const;
+  const PortRecord & getSink(const DefinitionRecord &rec, uint32_t idx) const { return ports[rec.first_port + idx]; }
+  const PortRecord & getSource(const DefinitionRecord &rec, uint32_t idx) const
+  {
+    return ports[rec.first_port + rec.num_sinks + idx];
+  }
+
+  bool checkSelects(const DefinitionRecord &rec, uint64_t &sel, const DefinitionRecord &owner, bool of_instance) const;
+  bool checkDefinition(uint32_t idx) const;
+  IFace makeIFace(const DefinitionRecord &rec) const;
+  SourceSlice makeSlice(const SliceRecord &slice, Definition &defn, const vector<Instance> &insts) const;
+  bool buildDefinition(uint32_t idx);
+
+public:
+  CircuitReader(const string &path_)
+    : path(path_)
+  {}
+
+  bool map(const uint8_t *base, size_t size);
+  bool build();
+
+  deque<Definition> takeDefinitions() { return move(built); }
+};
+
+}
+
+uint32_t CircuitWriter::addString(const string &str)
+{
+  auto iter = string_ids.find(str);
+  if (iter != string_ids.end()) {
+    return iter->second;
+  }
+
+  uint32_t id = strings.size();
+  strings.push_back({ (uint32_t)chars.size(), (uint32_t)str.size() });
+  chars.insert(chars.end(), str.begin(), str.end());
+  string_ids.emplace(str, id);
+
+  return id;
+}
+
+void CircuitWriter::addSelects(const vector<Sink> &sinks, const Definition &defn)
+{
+  for (const Sink &sink : sinks) {
+    if (!sink.isConnected()) {
+      selects.push_back({ (uint32_t)slices.size(), 0 });
+      continue;
+    }
+
+    const vector<SourceSlice> &sink_slices = sink.getSelect().getSlices();
+    selects.push_back({ (uint32_t)slices.size(), (uint32_t)sink_slices.size() });
+
+    for (const SourceSlice &slice : sink_slices) {
+      SliceRecord rec = { ConstantSlice, 0, 0, slice.getOffset(), slice.getWidth() };
+      if (slice.isConstant()) {
+        const APInt &val = slice.getConstant();
+        rec.index = words.size();
+        words.insert(words.end(), val.getRawData(), val.getRawData() + val.getNumWords());
+      } else if (slice.isDefinitionAttached()) {
+        rec.kind = DefinitionSlice;
+        rec.index = slice.getSource() - defn.getIFace().getSources().data();
+      } else {
+        const Instance *inst = slice.getInstance();
+        rec.kind = InstanceSlice;
+        rec.owner = inst - defn.getInstances().data();
+        rec.index = slice.getSource() - inst->getIFace().getSources().data();
+      }
+      slices.push_back(rec);
+    }
+  }
+}
+
+bool CircuitWriter::addDefinition(const Definition &defn)
+{
+  const IFace &iface = defn.getIFace();
+  const SimInfo &info = defn.getSimInfo();
+
+  DefinitionRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.name = addString(defn.getName());
+  rec.generator = NoString;
+
+  if (info.isPrimitive()) {
+    const Primitive &prim = info.getPrimitive();
+    if (prim.generator.empty()) {
+      errs() << "Primitive " << defn.getName() << " has no generator to rebuild it from\n";
+      return false;
+    }
+
+    rec.generator = addString(prim.generator);
+    rec.first_genarg = genargs.size();
+    rec.num_genargs = prim.genargs.size();
+    for (const auto &arg : prim.genargs) {
+      genargs.push_back({ addString(arg.first), arg.second });
+    }
+  }
+
+  rec.first_port = ports.size();
+  rec.num_sinks = iface.getSinks().size();
+  rec.num_sources = iface.getSources().size();
+  rec.num_clk_sinks = iface.getClkSinks().size();
+  rec.num_clk_sources = iface.getClkSources().size();
+  for (const Sink &sink : iface.getSinks()) {
+    ports.push_back({ addString(sink.getName()), sink.getWidth() });
+  }
+  for (const Source &src : iface.getSources()) {
+    ports.push_back({ addString(src.getName()), src.getWidth() });
+  }
+  for (const ClkSink &clk : iface.getClkSinks()) {
+    ports.push_back({ addString(clk.getName()), 0 });
+  }
+  for (const ClkSource &clk : iface.getClkSources()) {
+    ports.push_back({ addString(clk.getName()), 0 });
+  }
+
+  rec.first_inst = instances.size();
+  rec.num_insts = defn.getInstances().size();
+  for (const Instance &inst : defn.getInstances()) {
+    auto iter = defn_ids.find(&inst.getDefinition());
+    assert(iter != defn_ids.end() && "Definitions are saved after everything they instantiate");
+
+    instances.push_back({ addString(inst.getName()), iter->second,
+                          (uint32_t)args.size(), (uint32_t)inst.getArgs().size() });
+    for (const auto &arg : inst.getArgs()) {
+      args.push_back({ addString(GetSymbolName(arg.first)), addString(GetSymbolName(arg.second)) });
+    }
+  }
+
+  rec.first_select = selects.size();
+  rec.first_clock = clocks.size();
+  rec.first_order = orders.size();
+  if (!info.isPrimitive()) {
+    addSelects(iface.getSinks(), defn);
+    for (const Instance &inst : defn.getInstances()) {
+      addSelects(inst.getIFace().getSinks(), defn);
+    }
+    for (const Instance &inst : defn.getInstances()) {
+      for (const ClkSink &clk : inst.getIFace().getClkSinks()) {
+        int idx = iface.getClkSourceIndex(clk.getSource());
+        clocks.push_back(idx < 0 ? NoClock : idx);
+      }
+    }
+
+    SimOrders sim_orders = info.getOrders(iface);
+    const vector<uint32_t> *lists[] = { &sim_orders.state_deps, &sim_orders.output_deps,
+                                        &sim_orders.state_dep_srcs, &sim_orders.output_dep_srcs };
+    for (unsigned i = 0; i < 4; i++) {
+      rec.num_orders[i] = lists[i]->size();
+      orders.insert(orders.end(), lists[i]->begin(), lists[i]->end());
+    }
+  }
+  rec.num_selects = selects.size() - rec.first_select;
+  rec.num_clocks = clocks.size() - rec.first_clock;
+
+  defn_ids[&defn] = definitions.size();
+  definitions.push_back(rec);
+
+  return true;
+}
+
+vector<uint8_t> CircuitWriter::serialize() const
+{
+  CircuitHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CircuitMagic, sizeof(header.magic));
+  header.version = CircuitVersion;
+  header.byte_order = CircuitByteOrder;
+
+  vector<uint8_t> out(sizeof(header));
+  auto append = [&](Section &section, const auto &table) {
+    /* Every table starts 8 byte aligned so it can be used in place */
+    out.resize((out.size() + 7) & ~(size_t)7);
+    section.offset = out.size();
+    section.count = table.size();
+    const uint8_t *data = (const uint8_t *)table.data();
+    out.insert(out.end(), data, data + table.size() * sizeof(table[0]));
+  };
+
+  append(header.chars, chars);
+  append(header.strings, strings);
+  append(header.words, words);
+  append(header.definitions, definitions);
+  append(header.ports, ports);
+  append(header.instances, instances);
+  append(header.args, args);
+  append(header.genargs, genargs);
+  append(header.selects, selects);
+  append(header.slices, slices);
+  append(header.orders, orders);
+  append(header.clocks, clocks);
+  memcpy(out.data(), &header, sizeof(header));
+
+  return out;
+}
+
+static bool writeAll(int fd, const vector<uint8_t> &data)
+{
+  const uint8_t *cur = data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    ssize_t written = write(fd, cur, size);
+    if (written <= 0) {
+      return false;
+    }
+    cur += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+bool SaveCircuit(const Circuit &circuit, const string &path)
+{
+  CircuitWriter writer;
+  for (const Definition *defn : circuit.getUniqueDefinitions()) {
+    if (!writer.addDefinition(*defn)) {
+      return false;
+    }
+  }
+  vector<uint8_t> data = writer.serialize();
+
+  /* Write to a temporary and rename, so a crash never leaves a torn file */
+  string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    errs() << "Unable to create circuit file " << path << "\n";
+    return false;
+  }
+
+  bool ok = writeAll(fd, data);
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+
+  if (!ok) {
+    errs() << "Unable to write circuit file " << path << "\n";
+    unlink(tmp_path.c_str());
+  }
+
+  return ok;
+}
+
+template <typename T>
+static bool mapTable(const uint8_t *base, size_t size, const Section &section, Table<T> &table)
+{
+  if (section.offset % alignof(uint64_t) != 0 || section.offset > size ||
+      section.count > (size - section.offset) / sizeof(T)) {
+    return false;
+  }
+
+  table.data = (const T *)(base + section.offset);
+  table.count = section.count;
+
+  return true;
+}
+
+bool CircuitReader::map(const uint8_t *base, size_t size)
+{
+  const CircuitHeader &header = *(const CircuitHeader *)base;
+  if (size < sizeof(CircuitHeader) || memcmp(header.magic, CircuitMagic, sizeof(header.magic)) != 0) {
+    errs() << path << " is not a circuit file\n";
+    return false;
+  } else if (header.version != CircuitVersion || header.byte_order != CircuitByteOrder) {
+    errs() << "Circuit file " << path << " was saved by an incompatible build\n";
+    return false;
+  }
+
+  bool ok = mapTable(base, size, header.chars, chars) &&
+            mapTable(base, size, header.strings, strings) &&
+            mapTable(base, size, header.words, words) &&
+            mapTable(base, size, header.definitions, definitions) &&
+            mapTable(base, size, header.ports, ports) &&
+            mapTable(base, size, header.instances, instances) &&
+            mapTable(base, size, header.args, args) &&
+            mapTable(base, size, header.genargs, genargs) &&
+            mapTable(base, size, header.selects, selects) &&
+            mapTable(base, size, header.slices, slices) &&
+            mapTable(base, size, header.orders, orders) &&
+            mapTable(base, size, header.clocks, clocks);
+  if (!ok || definitions.count == 0) {
+    errs() << "Circuit file " << path << " is truncated\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool CircuitReader::validString(uint32_t id) const
+{
+  return id < strings.count && chars.contains(strings[id].offset, strings[id].size);
+}
+
+string CircuitReader::getString(uint32_t id) const
+{
+  return string(chars.data + strings[id].offset, strings[id].size);
+}
+
+/* Checks the Selects of sinks, the sinks of owner or of an instance of it,
+ * starting at sel, against the ports of rec */
+bool CircuitReader::checkSelects(const DefinitionRecord &rec, uint64_t &sel, const DefinitionRecord &owner,
+                                 bool of_instance) const
+{
+  uint32_t num_sinks = of_instance ? owner.num_sources : owner.num_sinks;
+  for (uint32_t i = 0; i < num_sinks; i++, sel++) {
+    const SelectRecord &sel_rec = selects[sel];
+    int sink_width = of_instance ? getSource(owner, i).width : getSink(owner, i).width;
+    if (sel_rec.num_slices == 0) {
+      continue;
+    } else if (!slices.contains(sel_rec.first_slice, sel_rec.num_slices)) {
+      return false;
+    }
+
+    int64_t total_width = 0;
+    for (uint32_t j = 0; j < sel_rec.num_slices; j++) {
+      const SliceRecord &slice = slices[sel_rec.first_slice + j];
+      if (slice.width <= 0 || slice.offset < 0) {
+        return false;
+      }
+      total_width += slice.width;
+
+      int src_width;
+      if (slice.kind == ConstantSlice) {
+        if (slice.offset != 0 || !words.contains(slice.index, APInt::getNumWords(slice.width))) {
+          return false;
+        }
+        continue;
+      } else if (slice.kind == DefinitionSlice) {
+        if (slice.index >= rec.num_sources) {
+          return false;
+        }
+        src_width = getSource(rec, slice.index).width;
+      } else if (slice.kind == InstanceSlice) {
+        if (slice.owner >= rec.num_insts) {
+          return false;
+        }
+        /* An instance's sources are its definition's sinks */
+        const DefinitionRecord &child = definitions[instances[rec.first_inst + slice.owner].definition];
+        if (slice.index >= child.num_sinks) {
+          return false;
+        }
+        src_width = getSink(child, slice.index).width;
+      } else {
+        return false;
+      }
+
+      if ((int64_t)slice.offset + slice.width > src_width) {
+        return false;
+      }
+    }
+
+    if (total_width != sink_width) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Everything buildDefinition indexes is checked up front, so a corrupt file
+ * is reported instead of building dangling slices */
+bool CircuitReader::checkDefinition(uint32_t idx) const
+{
+  const DefinitionRecord &rec = definitions[idx];
+  uint64_t num_ports = (uint64_t)rec.num_sinks + rec.num_sources + rec.num_clk_sinks + rec.num_clk_sources;
+  if (!validString(rec.name) || !ports.contains(rec.first_port, num_ports)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < num_ports; i++) {
+    const PortRecord &port = ports[rec.first_port + i];
+    bool is_clock = i >= (uint64_t)rec.num_sinks + rec.num_sources;
+    if (!validString(port.name) || (!is_clock && port.width <= 0)) {
+      return false;
+    }
+  }
+
+  if (rec.generator != NoString) {
+    if (!validString(rec.generator) || !genargs.contains(rec.first_genarg, rec.num_genargs) ||
+        rec.num_insts != 0 || rec.num_selects != 0 || rec.num_clocks != 0) {
+      return false;
+    }
+    for (uint32_t i = 0; i < rec.num_genargs; i++) {
+      if (!validString(genargs[rec.first_genarg + i].name)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  if (!instances.contains(rec.first_inst, rec.num_insts)) {
+    return false;
+  }
+  uint64_t num_selects = rec.num_sinks;
+  uint64_t num_clocks = 0;
+  for (uint32_t i = 0; i < rec.num_insts; i++) {
+    const InstanceRecord &inst = instances[rec.first_inst + i];
+    if (!validString(inst.name) || inst.definition >= idx || !args.contains(inst.first_arg, inst.num_args)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < inst.num_args; j++) {
+      const ArgRecord &arg = args[inst.first_arg + j];
+      if (!validString(arg.key) || !validString(arg.value)) {
+        return false;
+      }
+    }
+    num_selects += definitions[inst.definition].num_sources;
+    num_clocks += definitions[inst.definition].num_clk_sources;
+  }
+
+  if (rec.num_clocks != num_clocks || !clocks.contains(rec.first_clock, num_clocks)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < rec.num_clocks; i++) {
+    uint32_t clk = clocks[rec.first_clock + i];
+    if (clk != NoClock && clk >= rec.num_clk_sources) {
+      return false;
+    }
+  }
+
+  if (rec.num_selects != num_selects || !selects.contains(rec.first_select, num_selects)) {
+    return false;
+  }
+  uint64_t sel = rec.first_select;
+  if (!checkSelects(rec, sel, rec, false)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < rec.num_insts; i++) {
+    if (!checkSelects(rec, sel, definitions[instances[rec.first_inst + i].definition], true)) {
+      return false;
+    }
+  }
+
+  uint64_t num_orders = (uint64_t)rec.num_orders[0] + rec.num_orders[1] + rec.num_orders[2] + rec.num_orders[3];
+  if (!orders.contains(rec.first_order, num_orders)) {
+    return false;
+  }
+  uint64_t order = rec.first_order;
+  for (unsigned i = 0; i < 4; i++) {
+    uint32_t limit = i < 2 ? rec.num_insts : rec.num_sources;
+    for (uint32_t j = 0; j < rec.num_orders[i]; j++, order++) {
+      if (orders[order] >= limit) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+IFace CircuitReader::makeIFace(const DefinitionRecord &rec) const
+{
+  vector<Sink> sinks;
+  vector<Source> sources;
+  vector<ClkSink> clk_sinks;
+  vector<ClkSource> clk_sources;
+
+  uint32_t port = rec.first_port;
+  for (uint32_t i = 0; i < rec.num_sinks; i++, port++) {
+    sinks.emplace_back(getString(ports[port].name), ports[port].width);
+  }
+  for (uint32_t i = 0; i < rec.num_sources; i++, port++) {
+    sources.emplace_back(getString(ports[port].name), ports[port].width);
+  }
+  for (uint32_t i = 0; i < rec.num_clk_sinks; i++, port++) {
+    clk_sinks.emplace_back(getString(ports[port].name), nullptr);
+  }
+  for (uint32_t i = 0; i < rec.num_clk_sources; i++, port++) {
+    clk_sources.emplace_back(getString(ports[port].name));
+  }
+
+  return IFace("self", move(sinks), move(sources), move(clk_sinks), move(clk_sources), true);
+}
+
+SourceSlice CircuitReader::makeSlice(const SliceRecord &slice, Definition &defn, const vector<Instance> &insts) const
+{
+  if (slice.kind == DefinitionSlice) {
+    return SourceSlice(&defn, nullptr, &defn.getIFace().getSources()[slice.index], slice.offset, slice.width);
+  } else if (slice.kind == InstanceSlice) {
+    const Instance &inst = insts[slice.owner];
+    return SourceSlice(nullptr, &inst, &inst.getIFace().getSources()[slice.index], slice.offset, slice.width);
+  }
+
+  ArrayRef<uint64_t> val(&words[slice.index], APInt::getNumWords(slice.width));
+  return SourceSlice(APInt(slice.width, val));
+}
+
+bool CircuitReader::buildDefinition(uint32_t idx)
+{
+  const DefinitionRecord &rec = definitions[idx];
+  string name = getString(rec.name);
+  IFace iface = makeIFace(rec);
+
+  if (rec.generator != NoString) {
+    string generator = getString(rec.generator);
+    if (!IsCoreIRPrimitive(generator)) {
+      errs() << "Circuit file " << path << " uses unsupported primitive " << generator << "\n";
+      return false;
+    }
+
+    GenArgs gen;
+    for (uint32_t i = 0; i < rec.num_genargs; i++) {
+      const GenArgRecord &arg = genargs[rec.first_genarg + i];
+      gen[getString(arg.name)] = arg.value;
+    }
+    built.emplace_back(name, move(iface), BuildCoreIRPrimitive(generator, gen));
+
+    return true;
+  }
+
+  vector<Instance> insts;
+  insts.reserve(rec.num_insts);
+  for (uint32_t i = 0; i < rec.num_insts; i++) {
+    const InstanceRecord &inst = instances[rec.first_inst + i];
+    insts.emplace_back(built[inst.definition].makeInstance(getString(inst.name)));
+    for (uint32_t j = 0; j < inst.num_args; j++) {
+      const ArgRecord &arg = args[inst.first_arg + j];
+      insts.back().setArg(getString(arg.key), getString(arg.value));
+    }
+  }
+
+  SimOrders sim_orders;
+  vector<uint32_t> *lists[] = { &sim_orders.state_deps, &sim_orders.output_deps,
+                                &sim_orders.state_dep_srcs, &sim_orders.output_dep_srcs };
+  const uint32_t *order = orders.data + rec.first_order;
+  for (unsigned i = 0; i < 4; i++) {
+    lists[i]->assign(order, order + rec.num_orders[i]);
+    order += rec.num_orders[i];
+  }
+
+  built.emplace_back(name, move(iface), move(insts),
+    [&](Definition &defn, vector<Instance> &defn_insts) {
+      uint64_t sel = rec.first_select;
+      auto connectSinks = [&](vector<Sink> &sinks) {
+        for (Sink &sink : sinks) {
+          const SelectRecord &sel_rec = selects[sel++];
+          if (sel_rec.num_slices == 0) {
+            continue;
+          }
+
+          vector<SourceSlice> sink_slices;
+          sink_slices.reserve(sel_rec.num_slices);
+          for (uint32_t i = 0; i < sel_rec.num_slices; i++) {
+            sink_slices.push_back(makeSlice(slices[sel_rec.first_slice + i], defn, defn_insts));
+          }
+          sink.connect(Select(move(sink_slices)));
+        }
+      };
+
+      connectSinks(defn.getIFace().getSinks());
+      for (Instance &inst : defn_insts) {
+        connectSinks(inst.getIFace().getSinks());
+      }
+
+      const uint32_t *clk = clocks.data + rec.first_clock;
+      for (Instance &inst : defn_insts) {
+        for (ClkSink &clk_sink : inst.getIFace().getClkSinks()) {
+          if (*clk != NoClock) {
+            clk_sink.connect(&defn.getIFace().getClkSources()[*clk]);
+          }
+          clk++;
+        }
+      }
+    },
+    sim_orders);
+
+  return true;
+}
+
+bool CircuitReader::build()
+{
+  for (uint32_t idx = 0; idx < definitions.count; idx++) {
+    if (!checkDefinition(idx)) {
+      errs() << "Circuit file " << path << " is corrupt\n";
+      return false;
+    } else if (!buildDefinition(idx)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+unique_ptr<Circuit> LoadCircuit(const string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    errs() << "Unable to open circuit file " << path << "\n";
+    return nullptr;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(CircuitHeader)) {
+    errs() << path << " is not a circuit file\n";
+    close(fd);
+    return nullptr;
+  }
+
+  /* The tables are read in place and copied into the Circuit, after which
+   * the mapping is no longer needed */
+  size_t size = file_stat.st_size;
+  void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    errs() << "Unable to map circuit file " << path << "\n";
+    return nullptr;
+  }
+
+  CircuitReader reader(path);
+  bool ok = reader.map((const uint8_t *)addr, size) && reader.build();
+  munmap(addr, size);
+  if (!ok) {
+    return nullptr;
+  }
+
+  return make_unique<Circuit>(reader.takeDefinitions());
+}
+
+bool IsCircuitFile(const string &path)
+{
+  ifstream file(path, ios::binary);
+  char magic[sizeof(CircuitMagic)];
+  if (!file.read(magic, sizeof(magic))) {
+    return false;
+  }
+
+  return memcmp(magic, CircuitMagic, sizeof(magic)) == 0;
+}
+
+}
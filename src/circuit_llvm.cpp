@@ -1,40 +1,112 @@
 #include <jitsim/circuit_llvm.hpp>
+#include <jitsim/activity.hpp>
+#include <jitsim/probes.hpp>
 #include "llvm_utils.hpp"
 
+#include <unordered_set>
+
 namespace JITSim {
 
 using namespace llvm;
 
+static Function * getOrMakeFunctionDecl(ModuleEnvironment &mod_env, const std::string &name, FunctionType *type)
+{
+  Function *decl = mod_env.getFunctionDecl(name);
+  if (decl) {
+    return decl;
+  }
+
+  return mod_env.makeFunctionDecl(name, type);
+}
+
 std::vector<Type *> getArgTypes(const std::vector<const Source *> &sources, ModuleEnvironment &mod_env)
 {
   std::vector<Type *> arg_types;
   for (const Source *src: sources) {
-    arg_types.push_back(Type::getIntNTy(mod_env.getContext(), src->getWidth()));
+    arg_types.push_back(mod_env.getValueType(src->getWidth()));
   }
 
   return arg_types;
 }
 
-std::string getComputeOutputName(const Definition &definition)
+/* Batched functions operate on different types, so keep their names apart */
+static std::string getLaneSuffix(const ModuleEnvironment &mod_env)
+{
+  if (mod_env.isBitSliced()) {
+    return "_bs" + std::to_string(mod_env.getLanes());
+  } else if (mod_env.getLanes() == 1) {
+    return "";
+  }
+
+  return "_x" + std::to_string(mod_env.getLanes());
+}
+
+std::string getComputeOutputName(const Definition &definition, const ModuleEnvironment &mod_env)
+{
+  return definition.getSafeName() + "_compute_output" + getLaneSuffix(mod_env);
+}
+
+std::string getUpdateStateName(const Definition &definition, const ModuleEnvironment &mod_env)
 {
-  return Twine(definition.getSafeName(), "_compute_output").str();
+  return definition.getSafeName() + "_update_state" + getLaneSuffix(mod_env);
 }
 
-std::string getUpdateStateName(const Definition &definition)
+static std::string getClockUpdateStateName(const Definition &definition, unsigned clk, const ModuleEnvironment &mod_env)
 {
-  return Twine(definition.getSafeName(), "_update_state").str();
+  const std::string &clk_name = definition.getIFace().getClkSources()[clk].getName();
+  return definition.getSafeName() + "_update_state_" + clk_name + getLaneSuffix(mod_env);
 }
 
 static StructType *makeReturnType(const Definition &definition, ModuleEnvironment &mod_env)
 {
-  std::string out_type_name = definition.getSafeName() + "_output_type";
-  return ConstructStructType(definition.getIFace().getSinks(), mod_env.getContext(), out_type_name);
+  std::string out_type_name = definition.getSafeName() + "_output_type" + getLaneSuffix(mod_env);
+  if (mod_env.getLanes() == 1 && !mod_env.isBitSliced()) {
+    return ConstructStructType(definition.getIFace().getSinks(), mod_env.getContext(), out_type_name);
+  }
+
+  std::vector<Type *> elem_types;
+  for (const Sink &sink : definition.getIFace().getSinks()) {
+    elem_types.push_back(mod_env.getValueType(sink.getWidth()));
+  }
+
+  return StructType::create(mod_env.getContext(), elem_types, out_type_name);
+}
+
+/* Definitions with probed signals take a trailing pointer to their region
+ * of the probe buffer */
+static bool takesProbes(const Definition &definition, const ModuleEnvironment &mod_env)
+{
+  const ProbeLayout *layout = mod_env.getProbeLayout();
+  return layout && layout->hasProbes(definition);
+}
+
+/* With an activity layout every update_state returns whether it changed
+ * any state, and definitions with cached children take a pointer to their
+ * region of the activity buffer after the probes */
+static bool reportsChanges(const ModuleEnvironment &mod_env)
+{
+  return mod_env.getActivityLayout() != nullptr;
+}
+
+static bool takesActivity(const Definition &definition, const ModuleEnvironment &mod_env)
+{
+  const ActivityLayout *layout = mod_env.getActivityLayout();
+  return layout && layout->hasActivity(definition);
+}
+
+static Type * makeUpdateStateReturnType(ModuleEnvironment &mod_env)
+{
+  if (reportsChanges(mod_env)) {
+    return Type::getInt1Ty(mod_env.getContext());
+  }
+
+  return Type::getVoidTy(mod_env.getContext());
 }
 
 static FunctionType * makeComputeOutputType(const Definition &definition, ModuleEnvironment &mod_env) 
 {
   const SimInfo &sim_info = definition.getSimInfo();
-  Function *decl = mod_env.getFunctionDecl(getComputeOutputName(definition));
+  Function *decl = mod_env.getFunctionDecl(getComputeOutputName(definition, mod_env));
   if (decl) {
     return decl->getFunctionType();
   }
@@ -46,6 +118,14 @@ static FunctionType * makeComputeOutputType(const Definition &definition, Module
     arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
   }
 
+  if (takesProbes(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  if (takesActivity(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
   StructType *ret_type = makeReturnType(definition, mod_env);
 
   return FunctionType::get(ret_type, arg_types, false);
@@ -53,7 +133,7 @@ static FunctionType * makeComputeOutputType(const Definition &definition, Module
 
 static FunctionType * makeUpdateStateType(const Definition &definition, ModuleEnvironment &mod_env)
 {
-  Function *decl = mod_env.getFunctionDecl(getUpdateStateName(definition));
+  Function *decl = mod_env.getFunctionDecl(getUpdateStateName(definition, mod_env));
   if (decl) {
     return decl->getFunctionType();
   }
@@ -61,7 +141,37 @@ static FunctionType * makeUpdateStateType(const Definition &definition, ModuleEn
   std::vector<Type *> arg_types = getArgTypes(definition.getSimInfo().getStateSources(), mod_env);
   arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
 
-  return FunctionType::get(Type::getVoidTy(mod_env.getContext()), arg_types, false);
+  if (takesProbes(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  if (takesActivity(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  return FunctionType::get(makeUpdateStateReturnType(mod_env), arg_types, false);
+}
+
+static FunctionType * makeClockUpdateStateType(const Definition &definition, unsigned clk,
+                                              ModuleEnvironment &mod_env)
+{
+  Function *decl = mod_env.getFunctionDecl(getClockUpdateStateName(definition, clk, mod_env));
+  if (decl) {
+    return decl->getFunctionType();
+  }
+
+  std::vector<Type *> arg_types = getArgTypes(definition.getSimInfo().getClockStateSources(clk), mod_env);
+  arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+
+  if (takesProbes(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  if (takesActivity(definition, mod_env)) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  return FunctionType::get(makeUpdateStateReturnType(mod_env), arg_types, false);
 }
 
 static FunctionType * makeOutputDepsType(const Definition &definition, ModuleEnvironment &mod_env)
@@ -98,23 +208,62 @@ static FunctionType * makeStateDepsType(const Definition &definition, ModuleEnvi
 
 static Value * createSlice(Value *whole, int offset, int width, FunctionEnvironment &env)
 {
+  if (env.getModule().isBitSliced()) {
+    std::vector<uint32_t> words;
+    for (int i = 0; i < width; i++) {
+      words.push_back(offset + i);
+    }
+
+    return env.getIRBuilder().CreateShuffleVector(whole, UndefValue::get(whole->getType()), words);
+  }
+
   Value *cur = whole;
   if (offset > 0) {
     cur = env.getIRBuilder().CreateLShr(cur, offset);
   }
 
-  return env.getIRBuilder().CreateTrunc(cur, Type::getIntNTy(env.getContext(), width));
+  return env.getIRBuilder().CreateTrunc(cur, env.getModule().getValueType(width));
+}
+
+/* Bit sliced values concatenate by collecting words, lowest bit first */
+static Value * makeBitSlicedConcat(const Select &select, FunctionEnvironment &env)
+{
+  std::vector<Value *> words;
+  for (const SourceSlice &slice : select.getSlices()) {
+    Value *sliced_val;
+    if (slice.isConstant()) {
+      sliced_val = env.getModule().getConstant(slice.getConstant());
+    } else {
+      sliced_val = env.lookupValue(slice.getSource());
+    }
+
+    for (int i = 0; i < slice.getWidth(); i++) {
+      int word = slice.isConstant() ? i : slice.getOffset() + i;
+      words.push_back(env.getIRBuilder().CreateExtractElement(sliced_val, (uint64_t)word));
+    }
+  }
+
+  Value *acc = UndefValue::get(env.getModule().getValueType(words.size()));
+  for (unsigned i = 0; i < words.size(); i++) {
+    acc = env.getIRBuilder().CreateInsertElement(acc, words[i], (uint64_t)i);
+  }
+
+  return acc;
 }
 
 /* Builds a larger integer out of a list of smaller slices of other integers */
 
 static Value * makeValueReference(const Select &select, FunctionEnvironment &env)
 {
+  if (!select.isDirect() && env.getModule().isBitSliced()) {
+    return makeBitSlicedConcat(select, env);
+  }
+
   if (select.isDirect()) {
     const SourceSlice &slice = select.getDirect();
     if (slice.isConstant()) {
       const APInt &const_int = slice.getConstant();
-      return ConstantInt::get(env.getContext(), const_int);
+      return env.getModule().getConstant(const_int);
     }
     else {
       return env.lookupValue(slice.getSource());
@@ -125,7 +274,7 @@ static Value * makeValueReference(const Select &select, FunctionEnvironment &env
     for (const SourceSlice &slice : select.getSlices()) {
       Value *sliced_val;
       if (slice.isConstant()) {
-        sliced_val = ConstantInt::get(env.getContext(), slice.getConstant());
+        sliced_val = env.getModule().getConstant(slice.getConstant());
       } else {
         Value *whole_val = env.lookupValue(slice.getSource());
         sliced_val = createSlice(whole_val, slice.getOffset(), slice.getWidth(), env);
@@ -135,8 +284,8 @@ static Value * makeValueReference(const Select &select, FunctionEnvironment &env
       if (!acc) {
         acc = sliced_val;
       } else {
-        Value *src = env.getIRBuilder().CreateZExt(sliced_val, Type::getIntNTy(env.getContext(), total_width), "src");
-        Value *dest = env.getIRBuilder().CreateZExt(acc, Type::getIntNTy(env.getContext(), total_width), "dst");
+        Value *src = env.getIRBuilder().CreateZExt(sliced_val, env.getModule().getValueType(total_width), "src");
+        Value *dest = env.getIRBuilder().CreateZExt(acc, env.getModule().getValueType(total_width), "dst");
 
         src = env.getIRBuilder().CreateShl(src, total_width - slice.getWidth(), "src_shift");
         dest = env.getIRBuilder().CreateOr(dest, src, "concat");
@@ -149,16 +298,150 @@ static Value * makeValueReference(const Select &select, FunctionEnvironment &env
   }
 }
 
+/* Batched state gives every instance lanes copies of its scalar state */
 static Value * incrementStatePtr(Value *cur_ptr, int incr, FunctionEnvironment &env)
 {
   if (incr == 0) {
     return cur_ptr;
   } else {
-    return env.getIRBuilder().CreateConstInBoundsGEP1_64(cur_ptr, incr);
+    return env.getIRBuilder().CreateConstInBoundsGEP1_64(cur_ptr, (uint64_t)incr * env.getModule().getLanes());
   }
 }
 
-static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env, Value *base_state)
+template <typename T>
+static void storeProbe(const T *port, Value *val, FunctionEnvironment &env, Value *base_probes)
+{
+  if (!base_probes) {
+    return;
+  }
+
+  const ProbeLayout *layout = env.getModule().getProbeLayout();
+  const ProbeLayout::Signal *signal = layout->getSignal(port);
+  if (!signal) {
+    return;
+  }
+
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Value *slot = ir_builder.CreateConstInBoundsGEP1_64(base_probes, signal->offset);
+  Value *addr = ir_builder.CreateBitCast(slot, val->getType()->getPointerTo());
+  if (!layout->isTraced()) {
+    ir_builder.CreateAlignedStore(val, addr, 1);
+    return;
+  }
+
+  /* The slot still holds the previous value, so only changes reach the tracer */
+  BasicBlock *changed_bb = env.addBasicBlock("probe_changed", false);
+  BasicBlock *merge_bb = env.addBasicBlock("probe_merge", false);
+  Value *prev = ir_builder.CreateAlignedLoad(addr, 1);
+  ir_builder.CreateCondBr(ir_builder.CreateICmpNE(prev, val), changed_bb, merge_bb);
+
+  env.setCurBasicBlock(changed_bb);
+  ir_builder.CreateAlignedStore(val, addr, 1);
+  FunctionType *change_type = FunctionType::get(Type::getVoidTy(env.getContext()),
+                                                {Type::getInt8PtrTy(env.getContext())}, false);
+  ir_builder.CreateCall(getOrMakeFunctionDecl(env.getModule(), "jitsim_trace_change", change_type), {slot});
+  ir_builder.CreateBr(merge_bb);
+
+  env.setCurBasicBlock(merge_bb);
+}
+
+static void pushInstanceProbes(const Instance *inst, std::vector<Value *> &argument_values,
+                               FunctionEnvironment &env, Value *base_probes)
+{
+  if (!takesProbes(inst->getDefinition(), env.getModule())) {
+    return;
+  }
+
+  unsigned offset = env.getModule().getProbeLayout()->getOffset(inst);
+  argument_values.push_back(env.getIRBuilder().CreateConstInBoundsGEP1_64(base_probes, offset));
+}
+
+static void pushInstanceActivity(const Instance *inst, std::vector<Value *> &argument_values,
+                                 FunctionEnvironment &env, Value *base_activity)
+{
+  if (!takesActivity(inst->getDefinition(), env.getModule())) {
+    return;
+  }
+
+  unsigned offset = env.getModule().getActivityLayout()->getOffset(inst);
+  argument_values.push_back(env.getIRBuilder().CreateConstInBoundsGEP1_64(base_activity, offset));
+}
+
+/* Addresses of consecutive byte rounded values of the given types */
+static std::vector<Value *> makeEntrySlots(Value *entry, unsigned &offset, ArrayRef<Type *> types,
+                                           FunctionEnvironment &env)
+{
+  std::vector<Value *> slots;
+  for (Type *type : types) {
+    Value *slot = env.getIRBuilder().CreateConstInBoundsGEP1_64(entry, offset);
+    slots.push_back(env.getIRBuilder().CreateBitCast(slot, type->getPointerTo()));
+    offset += getNumBytes(type->getIntegerBitWidth());
+  }
+
+  return slots;
+}
+
+/* Calls inst's compute_output only when its cache entry is not clean or
+ * the inputs differ from the last call, and otherwise returns the outputs
+ * the entry holds. The cached outputs can only be stale if the state
+ * changed, which clears the clean byte, see markStateChanged */
+static Value * makeCachedComputeOutput(const Instance *inst, Function *inst_func,
+                                       const std::vector<Value *> &argument_values, unsigned num_inputs,
+                                       FunctionEnvironment &env, Value *base_activity)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  const ActivityLayout *layout = env.getModule().getActivityLayout();
+  StructType *ret_type = cast<StructType>(inst_func->getReturnType());
+  Type *byte_type = Type::getInt8Ty(env.getContext());
+
+  Value *entry = ir_builder.CreateConstInBoundsGEP1_64(base_activity, layout->getEntryOffset(inst));
+  unsigned offset = 1;
+  std::vector<Type *> input_types;
+  for (unsigned i = 0; i < num_inputs; i++) {
+    input_types.push_back(argument_values[i]->getType());
+  }
+  std::vector<Value *> input_slots = makeEntrySlots(entry, offset, input_types, env);
+  std::vector<Value *> output_slots = makeEntrySlots(entry, offset, ret_type->elements(), env);
+
+  Value *hit = ir_builder.CreateICmpNE(ir_builder.CreateLoad(entry), ConstantInt::get(byte_type, 0), "clean");
+  for (unsigned i = 0; i < num_inputs; i++) {
+    Value *prev = ir_builder.CreateAlignedLoad(input_slots[i], 1);
+    hit = ir_builder.CreateAnd(hit, ir_builder.CreateICmpEQ(prev, argument_values[i]));
+  }
+
+  BasicBlock *hit_bb = env.addBasicBlock(inst->getName() + "_hit", false);
+  BasicBlock *miss_bb = env.addBasicBlock(inst->getName() + "_miss", false);
+  BasicBlock *merge_bb = env.addBasicBlock(inst->getName() + "_merge", false);
+  ir_builder.CreateCondBr(hit, hit_bb, miss_bb);
+
+  env.setCurBasicBlock(hit_bb);
+  Value *cached = UndefValue::get(ret_type);
+  for (unsigned i = 0; i < output_slots.size(); i++) {
+    cached = ir_builder.CreateInsertValue(cached, ir_builder.CreateAlignedLoad(output_slots[i], 1), { i });
+  }
+  ir_builder.CreateBr(merge_bb);
+
+  env.setCurBasicBlock(miss_bb);
+  Value *computed = ir_builder.CreateCall(inst_func, argument_values);
+  for (unsigned i = 0; i < num_inputs; i++) {
+    ir_builder.CreateAlignedStore(argument_values[i], input_slots[i], 1);
+  }
+  for (unsigned i = 0; i < output_slots.size(); i++) {
+    ir_builder.CreateAlignedStore(ir_builder.CreateExtractValue(computed, { i }), output_slots[i], 1);
+  }
+  ir_builder.CreateStore(ConstantInt::get(byte_type, 1), entry);
+  ir_builder.CreateBr(merge_bb);
+
+  env.setCurBasicBlock(merge_bb);
+  PHINode *ret_struct = ir_builder.CreatePHI(ret_type, 2, inst->getName() + "_output");
+  ret_struct->addIncoming(cached, hit_bb);
+  ret_struct->addIncoming(computed, miss_bb);
+
+  return ret_struct;
+}
+
+static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env,
+                                      Value *base_state, Value *base_probes, Value *base_activity)
 {
   const SimInfo &inst_info = inst->getDefinition().getSimInfo();
   const InstanceIFace &iface = inst->getIFace();
@@ -170,6 +453,7 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
     const Sink *sink = iface.getSink(src);
     Value *arg_val = makeValueReference(sink->getSelect(), env);
     env.addValue(sink, arg_val);
+    storeProbe(sink, arg_val, env, base_probes);
     argument_values.push_back(arg_val);
   }
 
@@ -183,13 +467,23 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
     const Primitive &prim = inst_info.getPrimitive();
     ret_values = prim.make_compute_output(env, argument_values, *inst);
   } else {
-    std::string inst_comp_output = getComputeOutputName(inst->getDefinition());
+    pushInstanceProbes(inst, argument_values, env, base_probes);
+    pushInstanceActivity(inst, argument_values, env, base_activity);
+
+    std::string inst_comp_output = getComputeOutputName(inst->getDefinition(), env.getModule());
     Function *inst_func = env.getModule().getFunctionDecl(inst_comp_output);
     if (inst_func == nullptr) {
       inst_func = env.getModule().makeFunctionDecl(inst_comp_output, makeComputeOutputType(inst->getDefinition(), env.getModule()));
     }
 
-    Value *ret_struct = env.getIRBuilder().CreateCall(inst_func, argument_values, inst->getName() + "_output");
+    const ActivityLayout *layout = env.getModule().getActivityLayout();
+    Value *ret_struct;
+    if (layout && layout->hasEntry(inst)) {
+      ret_struct = makeCachedComputeOutput(inst, inst_func, argument_values, inst_info.getOutputSources().size(),
+                                           env, base_activity);
+    } else {
+      ret_struct = env.getIRBuilder().CreateCall(inst_func, argument_values, inst->getName() + "_output");
+    }
     for (unsigned i = 0; i < sources.size(); i++) {
       Value *struct_elem = env.getIRBuilder().CreateExtractValue(ret_struct, { i });
       ret_values.push_back(struct_elem);
@@ -198,53 +492,125 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
 
   for (unsigned i = 0; i < ret_values.size(); i++) {
     env.addValue(&sources[i], ret_values[i]);
+    storeProbe(&sources[i], ret_values[i], env, base_probes);
   }
 }
 
-static void makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env, Value *base_state)
+/* A primitive's whole state as one integer, so update_state can tell
+ * whether it changed. Null for memories, which are too large to compare
+ * and always count as changed */
+static Value * loadPrimitiveState(const Primitive &prim, Value *state_ptr, FunctionEnvironment &env)
+{
+  if (prim.state_elem_bytes != prim.num_state_bytes || prim.num_state_bytes > 16) {
+    return nullptr;
+  }
+
+  Type *state_type = Type::getIntNTy(env.getContext(), prim.num_state_bytes * 8);
+  Value *addr = env.getIRBuilder().CreateBitCast(state_ptr, state_type->getPointerTo());
+
+  return env.getIRBuilder().CreateAlignedLoad(addr, 1);
+}
+
+/* Clears the clean byte of inst's cache entry if its state changed */
+static void markStateChanged(const Instance *inst, Value *changed, FunctionEnvironment &env, Value *base_activity)
+{
+  const ActivityLayout *layout = env.getModule().getActivityLayout();
+  if (!layout || !layout->hasEntry(inst)) {
+    return;
+  }
+
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Value *entry = ir_builder.CreateConstInBoundsGEP1_64(base_activity, layout->getEntryOffset(inst));
+  Value *clean = ir_builder.CreateLoad(entry, "clean");
+  ir_builder.CreateStore(ir_builder.CreateSelect(changed, ConstantInt::get(clean->getType(), 0), clean), entry);
+}
+
+/* Steps inst's whole state, or with clk only the part its clock input clk
+ * drives. Returns whether the state changed when the module reports
+ * changes and null otherwise */
+static Value * makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env,
+                                       Value *base_state, Value *base_probes, Value *base_activity, int clk = -1)
 {
   const SimInfo &inst_info = inst->getDefinition().getSimInfo();
   const InstanceIFace &iface = inst->getIFace();
+  const std::vector<const Source *> &sources = clk < 0 ? inst_info.getStateSources() :
+                                                         inst_info.getClockStateSources(clk);
 
   std::vector<Value *> argument_values;
 
-  for (const Source *src : inst_info.getStateSources()) {
+  for (const Source *src : sources) {
     const Sink *sink = iface.getSink(src);
     Value *arg_val = makeValueReference(sink->getSelect(), env);
     env.addValue(sink, arg_val);
+    storeProbe(sink, arg_val, env, base_probes);
     argument_values.push_back(arg_val);
   }
 
   Value *state_ptr = incrementStatePtr(base_state, defn_info.getOffset(inst), env);
   argument_values.push_back(state_ptr);
 
+  Value *changed = nullptr;
   if (inst_info.isPrimitive()) {
     const Primitive &prim = inst_info.getPrimitive();
+    Value *old_state = reportsChanges(env.getModule()) ? loadPrimitiveState(prim, state_ptr, env) : nullptr;
     prim.make_update_state(env, argument_values, *inst);
+
+    if (old_state) {
+      changed = env.getIRBuilder().CreateICmpNE(old_state, loadPrimitiveState(prim, state_ptr, env), "changed");
+    } else if (reportsChanges(env.getModule())) {
+      changed = ConstantInt::getTrue(env.getContext());
+    }
   } else {
-    std::string inst_update_state = getUpdateStateName(inst->getDefinition());
-    Function *inst_func = env.getModule().getFunctionDecl(inst_update_state);
-    if (inst_func == nullptr) {
-      inst_func = env.getModule().makeFunctionDecl(inst_update_state, makeUpdateStateType(inst->getDefinition(), env.getModule()));
+    pushInstanceProbes(inst, argument_values, env, base_probes);
+    pushInstanceActivity(inst, argument_values, env, base_activity);
+
+    const Definition &inst_defn = inst->getDefinition();
+    Function *inst_func;
+    if (clk < 0) {
+      inst_func = getOrMakeFunctionDecl(env.getModule(), getUpdateStateName(inst_defn, env.getModule()),
+                                        makeUpdateStateType(inst_defn, env.getModule()));
+    } else {
+      inst_func = getOrMakeFunctionDecl(env.getModule(), getClockUpdateStateName(inst_defn, clk, env.getModule()),
+                                        makeClockUpdateStateType(inst_defn, clk, env.getModule()));
     }
 
-    env.getIRBuilder().CreateCall(inst_func, argument_values);
+    Value *result = env.getIRBuilder().CreateCall(inst_func, argument_values);
+    if (reportsChanges(env.getModule())) {
+      changed = result;
+    }
+  }
+
+  if (changed) {
+    markStateChanged(inst, changed, env, base_activity);
   }
+
+  return changed;
 }
 
-ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition)
+/* Returns any_changed from update_state in modules that report changes */
+static void makeUpdateStateReturn(FunctionEnvironment &env, Value *any_changed)
 {
-  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_compute_output");
+  if (reportsChanges(env.getModule())) {
+    env.getIRBuilder().CreateRet(any_changed);
+  } else {
+    env.getIRBuilder().CreateRetVoid();
+  }
+}
 
+static void emitComputeOutput(ModuleEnvironment &mod_env, const Definition &definition)
+{
   const SimInfo &defn_info = definition.getSimInfo();
 
   FunctionType *co_type = makeComputeOutputType(definition, mod_env);
-  FunctionEnvironment compute_output = mod_env.makeFunction(getComputeOutputName(definition), co_type);
+  FunctionEnvironment compute_output = mod_env.makeFunction(getComputeOutputName(definition, mod_env), co_type);
   compute_output.addBasicBlock("entry");
 
   const std::vector<const Source *> &sources = defn_info.getOutputSources();
   auto arg = compute_output.getFunction()->arg_begin();
-  assert(compute_output.getFunction()->arg_size() == sources.size() + defn_info.isStateful());
+  bool has_probes = takesProbes(definition, mod_env);
+  bool has_activity = takesActivity(definition, mod_env);
+  assert(compute_output.getFunction()->arg_size() ==
+         sources.size() + defn_info.isStateful() + has_probes + has_activity);
 
   for (unsigned i = 0; i < sources.size(); i++, arg++) {
     const Source *src = sources[i];
@@ -255,13 +621,25 @@ ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definiti
   
   Value *state_ptr = nullptr;
   if (defn_info.isStateful()) {
-    state_ptr = compute_output.getFunction()->arg_end() - 1;
+    state_ptr = arg++;
     state_ptr->setName("state_ptr");
   }
 
+  Value *probe_ptr = nullptr;
+  if (has_probes) {
+    probe_ptr = arg++;
+    probe_ptr->setName("probe_ptr");
+  }
+
+  Value *activity_ptr = nullptr;
+  if (has_activity) {
+    activity_ptr = arg++;
+    activity_ptr->setName("activity_ptr");
+  }
+
   const std::vector<const Instance *> &output_deps = defn_info.getOutputDeps();
   for (const Instance *inst : output_deps) {
-    makeInstanceComputeOutput(inst, defn_info, compute_output, state_ptr);
+    makeInstanceComputeOutput(inst, defn_info, compute_output, state_ptr, probe_ptr, activity_ptr);
   }
 
   const std::vector<JITSim::Sink> & sinks = definition.getIFace().getSinks();
@@ -278,23 +656,32 @@ ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definiti
   compute_output.getIRBuilder().CreateRet(ret_val);
 
   assert(!compute_output.verify());
-  
-  return mod_env;
 }
 
-ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition)
+ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition, const ProbeLayout *probes,
+                                    const ActivityLayout *activity)
 {
-  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_update_state");
+  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_compute_output");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitComputeOutput(mod_env, definition);
 
+  return mod_env;
+}
+
+static void emitUpdateState(ModuleEnvironment &mod_env, const Definition &definition)
+{
   const SimInfo &defn_info = definition.getSimInfo();
 
   FunctionType *us_type = makeUpdateStateType(definition, mod_env);
-  FunctionEnvironment update_state = mod_env.makeFunction(getUpdateStateName(definition), us_type);
+  FunctionEnvironment update_state = mod_env.makeFunction(getUpdateStateName(definition, mod_env), us_type);
   update_state.addBasicBlock("entry");
 
   const std::vector<const Source *> & sources = defn_info.getStateSources();
   auto arg = update_state.getFunction()->arg_begin();
-  assert(update_state.getFunction()->arg_size() == sources.size() + 1);
+  bool has_probes = takesProbes(definition, mod_env);
+  bool has_activity = takesActivity(definition, mod_env);
+  assert(update_state.getFunction()->arg_size() == sources.size() + 1 + has_probes + has_activity);
 
   for (unsigned i = 0; i < sources.size(); i++, arg++) {
     const Source *src = sources[i];
@@ -303,19 +690,111 @@ ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition
     arg->setName("self." + src->getName());
   }
 
-  Value *state_ptr = update_state.getFunction()->arg_end() - 1;
+  Value *state_ptr = arg++;
   state_ptr->setName("state_ptr");
 
+  Value *probe_ptr = nullptr;
+  if (has_probes) {
+    probe_ptr = arg++;
+    probe_ptr->setName("probe_ptr");
+  }
+
+  Value *activity_ptr = nullptr;
+  if (has_activity) {
+    activity_ptr = arg++;
+    activity_ptr->setName("activity_ptr");
+  }
+
   for (const Instance *inst : defn_info.getStateDeps()) {
-    makeInstanceComputeOutput(inst, defn_info, update_state, state_ptr);
+    makeInstanceComputeOutput(inst, defn_info, update_state, state_ptr, probe_ptr, activity_ptr);
   }
 
+  Value *any_changed = ConstantInt::getFalse(mod_env.getContext());
   for (const Instance *inst : defn_info.getStatefulInstances()) {
-    makeInstanceUpdateState(inst, defn_info, update_state, state_ptr);
+    Value *changed = makeInstanceUpdateState(inst, defn_info, update_state, state_ptr, probe_ptr, activity_ptr);
+    if (changed) {
+      any_changed = update_state.getIRBuilder().CreateOr(any_changed, changed);
+    }
   }
 
-  update_state.getIRBuilder().CreateRetVoid();
+  makeUpdateStateReturn(update_state, any_changed);
   assert(!update_state.verify());
+}
+
+ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition, const ProbeLayout *probes,
+                                  const ActivityLayout *activity)
+{
+  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_update_state");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitUpdateState(mod_env, definition);
+  assert(!mod_env.verify());
+
+  return mod_env;
+}
+
+/* Like update_state, but computes only what the ticks of one clock domain
+ * read and then steps just those instances */
+static void emitClockUpdateState(ModuleEnvironment &mod_env, const Definition &definition, unsigned clk)
+{
+  const SimInfo &defn_info = definition.getSimInfo();
+  const ClockDomain &domain = defn_info.getClockDomain(clk);
+
+  FunctionType *us_type = makeClockUpdateStateType(definition, clk, mod_env);
+  FunctionEnvironment update_state = mod_env.makeFunction(getClockUpdateStateName(definition, clk, mod_env), us_type);
+  update_state.addBasicBlock("entry");
+
+  const std::vector<const Source *> &sources = domain.state_dep_srcs;
+  auto arg = update_state.getFunction()->arg_begin();
+  bool has_probes = takesProbes(definition, mod_env);
+  bool has_activity = takesActivity(definition, mod_env);
+  assert(update_state.getFunction()->arg_size() == sources.size() + 1 + has_probes + has_activity);
+
+  for (unsigned i = 0; i < sources.size(); i++, arg++) {
+    update_state.addValue(sources[i], arg);
+    arg->setName("self." + sources[i]->getName());
+  }
+
+  Value *state_ptr = arg++;
+  state_ptr->setName("state_ptr");
+
+  Value *probe_ptr = nullptr;
+  if (has_probes) {
+    probe_ptr = arg++;
+    probe_ptr->setName("probe_ptr");
+  }
+
+  Value *activity_ptr = nullptr;
+  if (has_activity) {
+    activity_ptr = arg++;
+    activity_ptr->setName("activity_ptr");
+  }
+
+  for (const Instance *inst : domain.state_deps) {
+    makeInstanceComputeOutput(inst, defn_info, update_state, state_ptr, probe_ptr, activity_ptr);
+  }
+
+  Value *any_changed = ConstantInt::getFalse(mod_env.getContext());
+  for (const auto &tick : domain.ticks) {
+    Value *changed = makeInstanceUpdateState(tick.first, defn_info, update_state, state_ptr, probe_ptr,
+                                             activity_ptr, tick.second);
+    if (changed) {
+      any_changed = update_state.getIRBuilder().CreateOr(any_changed, changed);
+    }
+  }
+
+  makeUpdateStateReturn(update_state, any_changed);
+  assert(!update_state.verify());
+}
+
+ModuleEnvironment MakeClockUpdateState(Builder &builder, const Definition &definition, unsigned clk,
+                                       const ProbeLayout *probes, const ActivityLayout *activity)
+{
+  const std::string &clk_name = definition.getIFace().getClkSources()[clk].getName();
+  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_update_state_" + clk_name);
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitClockUpdateState(mod_env, definition, clk);
   assert(!mod_env.verify());
 
   return mod_env;
@@ -403,10 +882,8 @@ static void makeInstanceStateDeps(const Instance *inst, const SimInfo &defn_info
 }
 
 
-ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition)
+static void emitOutputDeps(ModuleEnvironment &mod_env, const Definition &definition)
 {
-  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_output_deps");
-
   const SimInfo &defn_info = definition.getSimInfo();
 
   FunctionType *od_type = makeOutputDepsType(definition, mod_env);
@@ -456,14 +933,18 @@ ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition)
   output_deps.getIRBuilder().CreateRet(ret_val);
 
   assert(!output_deps.verify());
-  
-  return mod_env;
 }
 
-ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
+ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition)
 {
-  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_state_deps");
+  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_output_deps");
+  emitOutputDeps(mod_env, definition);
 
+  return mod_env;
+}
+
+static void emitStateDeps(ModuleEnvironment &mod_env, const Definition &definition)
+{
   const SimInfo &defn_info = definition.getSimInfo();
 
   FunctionType *sd_type = makeStateDepsType(definition, mod_env);
@@ -502,15 +983,29 @@ ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
 
   state_deps.getIRBuilder().CreateRetVoid();
   assert(!state_deps.verify());
+}
+
+ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
+{
+  ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_state_deps");
+  emitStateDeps(mod_env, definition);
   assert(!mod_env.verify());
 
   return mod_env;
 }
 
-ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn)
+/* The activity buffer follows the top's state */
+static void pushWrapperActivity(const Definition &defn, std::vector<Value *> &args, FunctionEnvironment &func,
+                                Value *state)
 {
-  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_compute_output_wrapper");
+  if (takesActivity(defn, func.getModule())) {
+    args.push_back(func.getIRBuilder().CreateConstInBoundsGEP1_64(state, defn.getSimInfo().getNumStateBytes(),
+                                                                  "activity"));
+  }
+}
 
+static void emitComputeOutputWrapper(ModuleEnvironment &mod_env, const Definition &defn)
+{
   const std::vector<const Source *> & sources = defn.getSimInfo().getOutputSources();
   const std::vector<Sink> & sinks = defn.getIFace().getSinks();
 
@@ -518,6 +1013,7 @@ ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &d
     FunctionType::get(Type::getVoidTy(mod_env.getContext()),
                       {ConstructStructType(sources, mod_env.getContext(), "co_wrapper_input")->getPointerTo(),
                        ConstructStructType(sinks, mod_env.getContext(), "co_wrapper_output")->getPointerTo(),
+                       Type::getInt8PtrTy(mod_env.getContext()),
                        Type::getInt8PtrTy(mod_env.getContext())}, false);
 
   FunctionEnvironment func = mod_env.makeFunction("compute_output", wrapper_type);
@@ -526,9 +1022,10 @@ ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &d
   Value *inputs = func.getFunction()->arg_begin();
   Value *outputs = func.getFunction()->arg_begin() + 1;
   Value *state = func.getFunction()->arg_begin() + 2;
+  Value *probes = func.getFunction()->arg_begin() + 3;
 
   FunctionType *co_type = makeComputeOutputType(defn, mod_env);
-  Function *underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_compute_output", co_type);
+  Function *underlying = getOrMakeFunctionDecl(mod_env, getComputeOutputName(defn, mod_env), co_type);
 
   std::vector<Value *> args;
   for (unsigned i = 0; i < sources.size(); i++) {
@@ -536,7 +1033,13 @@ ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &d
     arg = func.getIRBuilder().CreateLoad(arg);
     args.push_back(arg);
   }
-  args.push_back(state);
+  if (defn.getSimInfo().isStateful()) {
+    args.push_back(state);
+  }
+  if (takesProbes(defn, mod_env)) {
+    args.push_back(probes);
+  }
+  pushWrapperActivity(defn, args, func, state);
 
   Value *output_struct = func.getIRBuilder().CreateCall(underlying, args);
 
@@ -549,19 +1052,27 @@ ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &d
   func.getIRBuilder().CreateRetVoid();
 
   func.verify();
+}
+
+ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn, const ProbeLayout *probes,
+                                           const ActivityLayout *activity)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_compute_output_wrapper");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitComputeOutputWrapper(mod_env, defn);
 
   return mod_env;
 }
 
-ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &defn)
+static void emitUpdateStateWrapper(ModuleEnvironment &mod_env, const Definition &defn)
 {
-  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_update_state_wrapper");
-
   const std::vector<const Source *> & sources = defn.getSimInfo().getStateSources();
 
   FunctionType *wrapper_type =
     FunctionType::get(Type::getVoidTy(mod_env.getContext()),
                       {ConstructStructType(sources, mod_env.getContext(), "us_wrapper_input")->getPointerTo(), 
+                       Type::getInt8PtrTy(mod_env.getContext()),
                        Type::getInt8PtrTy(mod_env.getContext())}, false);
 
   FunctionEnvironment func = mod_env.makeFunction("update_state", wrapper_type);
@@ -569,9 +1080,10 @@ ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &def
 
   Value *inputs = func.getFunction()->arg_begin();
   Value *state = func.getFunction()->arg_begin() + 1;
+  Value *probes = func.getFunction()->arg_begin() + 2;
 
   FunctionType *us_type = makeUpdateStateType(defn, mod_env);
-  Function *underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_update_state", us_type);
+  Function *underlying = getOrMakeFunctionDecl(mod_env, getUpdateStateName(defn, mod_env), us_type);
 
   std::vector<Value *> args;
   for (unsigned i = 0; i < sources.size(); i++) {
@@ -580,19 +1092,193 @@ ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &def
     args.push_back(arg);
   }
   args.push_back(state);
+  if (takesProbes(defn, mod_env)) {
+    args.push_back(probes);
+  }
+  pushWrapperActivity(defn, args, func, state);
 
   func.getIRBuilder().CreateCall(underlying, args);
 
   func.getIRBuilder().CreateRetVoid();
   func.verify();
+}
+
+ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &defn, const ProbeLayout *probes,
+                                         const ActivityLayout *activity)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_update_state_wrapper");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitUpdateStateWrapper(mod_env, defn);
 
   return mod_env;
 }
 
-ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
+/* Takes the same input struct as update_state, of which only the fields
+ * the clock domain reads are loaded */
+static void emitClockUpdateStateWrapper(ModuleEnvironment &mod_env, const Definition &defn, unsigned clk)
 {
-  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_get_values_wrapper");
+  const std::vector<const Source *> &sources = defn.getSimInfo().getStateSources();
+  const std::vector<const Source *> &clk_sources = defn.getSimInfo().getClockStateSources(clk);
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(mod_env.getContext()),
+                      {ConstructStructType(sources, mod_env.getContext(), "us_wrapper_input")->getPointerTo(),
+                       Type::getInt8PtrTy(mod_env.getContext()),
+                       Type::getInt8PtrTy(mod_env.getContext())}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction("update_state_" + defn.getIFace().getClkSources()[clk].getName(),
+                                                  wrapper_type);
+  func.addBasicBlock("entry");
+
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *state = func.getFunction()->arg_begin() + 1;
+  Value *probes = func.getFunction()->arg_begin() + 2;
+
+  FunctionType *us_type = makeClockUpdateStateType(defn, clk, mod_env);
+  Function *underlying = getOrMakeFunctionDecl(mod_env, getClockUpdateStateName(defn, clk, mod_env), us_type);
+
+  /* Both lists are in source order, so the domain's inputs are a subsequence */
+  std::vector<Value *> args;
+  for (unsigned i = 0, clk_idx = 0; i < sources.size() && clk_idx < clk_sources.size(); i++) {
+    if (sources[i] != clk_sources[clk_idx]) {
+      continue;
+    }
+    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
+    args.push_back(func.getIRBuilder().CreateLoad(arg));
+    clk_idx++;
+  }
+  assert(args.size() == clk_sources.size());
+  args.push_back(state);
+  if (takesProbes(defn, mod_env)) {
+    args.push_back(probes);
+  }
+  pushWrapperActivity(defn, args, func, state);
+
+  func.getIRBuilder().CreateCall(underlying, args);
+
+  func.getIRBuilder().CreateRetVoid();
+  func.verify();
+}
+
+ModuleEnvironment MakeClockUpdateStateWrapper(Builder &builder, const Definition &defn, unsigned clk,
+                                              const ProbeLayout *probes, const ActivityLayout *activity)
+{
+  const std::string &clk_name = defn.getIFace().getClkSources()[clk].getName();
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_update_state_" + clk_name + "_wrapper");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitClockUpdateStateWrapper(mod_env, defn, clk);
+
+  return mod_env;
+}
+
+static std::vector<Value *> loadWrapperInputs(FunctionEnvironment &func, Value *inputs, unsigned num_inputs)
+{
+  std::vector<Value *> args;
+  for (unsigned i = 0; i < num_inputs; i++) {
+    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
+    args.push_back(func.getIRBuilder().CreateLoad(arg));
+  }
 
+  return args;
+}
+
+static void emitRunCyclesWrapper(ModuleEnvironment &mod_env, const Definition &defn)
+{
+  const std::vector<const Source *> & us_sources = defn.getSimInfo().getStateSources();
+  const std::vector<const Source *> & co_sources = defn.getSimInfo().getOutputSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+  LLVMContext &context = mod_env.getContext();
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(context),
+                      {ConstructStructType(us_sources, context, "rc_wrapper_us_input")->getPointerTo(),
+                       ConstructStructType(co_sources, context, "rc_wrapper_co_input")->getPointerTo(),
+                       ConstructStructType(sinks, context, "rc_wrapper_output")->getPointerTo(),
+                       Type::getInt8PtrTy(context),
+                       Type::getInt64Ty(context),
+                       Type::getInt8PtrTy(context)}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction("run_cycles", wrapper_type);
+  BasicBlock *entry = func.addBasicBlock("entry");
+  IRBuilder<> &ir_builder = func.getIRBuilder();
+
+  auto arg = func.getFunction()->arg_begin();
+  Value *us_inputs = arg++;
+  Value *co_inputs = arg++;
+  Value *outputs = arg++;
+  Value *state = arg++;
+  Value *num_cycles = arg++;
+  num_cycles->setName("num_cycles");
+  Value *probes = arg++;
+  bool has_probes = takesProbes(defn, mod_env);
+
+  Function *update_state = getOrMakeFunctionDecl(mod_env, getUpdateStateName(defn, mod_env), makeUpdateStateType(defn, mod_env));
+  Function *compute_output = getOrMakeFunctionDecl(mod_env, getComputeOutputName(defn, mod_env), makeComputeOutputType(defn, mod_env));
+
+  /* Inputs are held for the whole run, so they are loaded once up front */
+  std::vector<Value *> us_args = loadWrapperInputs(func, us_inputs, us_sources.size());
+  us_args.push_back(state);
+  if (has_probes) {
+    us_args.push_back(probes);
+  }
+  pushWrapperActivity(defn, us_args, func, state);
+
+  BasicBlock *loop = func.addBasicBlock("loop", false);
+  BasicBlock *done = func.addBasicBlock("done", false);
+
+  Value *zero = ConstantInt::get(Type::getInt64Ty(context), 0);
+  ir_builder.CreateCondBr(ir_builder.CreateICmpEQ(num_cycles, zero), done, loop);
+
+  func.setCurBasicBlock(loop);
+  PHINode *cycle = ir_builder.CreatePHI(Type::getInt64Ty(context), 2, "cycle");
+  cycle->addIncoming(zero, entry);
+  ir_builder.CreateCall(update_state, us_args);
+  if (has_probes && mod_env.getProbeLayout()->isTraced()) {
+    FunctionType *cycle_type = FunctionType::get(Type::getVoidTy(context), false);
+    ir_builder.CreateCall(getOrMakeFunctionDecl(mod_env, "jitsim_trace_cycle", cycle_type));
+  }
+  Value *next_cycle = ir_builder.CreateAdd(cycle, ConstantInt::get(Type::getInt64Ty(context), 1));
+  cycle->addIncoming(next_cycle, loop);
+  ir_builder.CreateCondBr(ir_builder.CreateICmpEQ(next_cycle, num_cycles), done, loop);
+
+  /* compute_output only reads state, so evaluating it once after the last
+   * update gives the same outputs as evaluating it every cycle */
+  func.setCurBasicBlock(done);
+  std::vector<Value *> co_args = loadWrapperInputs(func, co_inputs, co_sources.size());
+  if (defn.getSimInfo().isStateful()) {
+    co_args.push_back(state);
+  }
+  if (has_probes) {
+    co_args.push_back(probes);
+  }
+  pushWrapperActivity(defn, co_args, func, state);
+  Value *output_struct = ir_builder.CreateCall(compute_output, co_args);
+
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    Value *val = ir_builder.CreateExtractValue(output_struct, { i });
+    Value *addr = ir_builder.CreateStructGEP(outputs->getType()->getPointerElementType(), outputs, i);
+    ir_builder.CreateStore(val, addr);
+  }
+
+  ir_builder.CreateRetVoid();
+  func.verify();
+}
+
+ModuleEnvironment MakeRunCyclesWrapper(Builder &builder, const Definition &defn, const ProbeLayout *probes,
+                                       const ActivityLayout *activity)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_run_cycles_wrapper");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+  emitRunCyclesWrapper(mod_env, defn);
+
+  return mod_env;
+}
+
+static void emitGetValuesWrapper(ModuleEnvironment &mod_env, const Definition &defn)
+{
   const std::vector<Source> &sources = defn.getIFace().getSources();
 
   FunctionType *wrapper_type =
@@ -640,15 +1326,215 @@ ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
   state_deps_args.push_back(zero);
 
   FunctionType *sd_type = makeStateDepsType(defn, mod_env);
-  Function *sd_underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_state_deps", sd_type);
+  Function *sd_underlying = getOrMakeFunctionDecl(mod_env, defn.getSafeName() + "_state_deps", sd_type);
   FunctionType *od_type = makeOutputDepsType(defn, mod_env);
-  Function *od_underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_output_deps", od_type);
+  Function *od_underlying = getOrMakeFunctionDecl(mod_env, defn.getSafeName() + "_output_deps", od_type);
 
   func.getIRBuilder().CreateCall(od_underlying, output_deps_args);
   func.getIRBuilder().CreateCall(sd_underlying, state_deps_args);
 
   func.getIRBuilder().CreateRetVoid();
   func.verify();
+}
+
+ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_get_values_wrapper");
+  emitGetValuesWrapper(mod_env, defn);
+
+  return mod_env;
+}
+
+static void collectDefinitions(const Definition &defn,
+                               std::unordered_set<const Definition *> &visited,
+                               std::vector<const Definition *> &order)
+{
+  if (defn.getSimInfo().isPrimitive() || !visited.insert(&defn).second) {
+    return;
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    collectDefinitions(inst.getDefinition(), visited, order);
+  }
+
+  order.push_back(&defn);
+}
+
+ModuleEnvironment MakeMergedModule(Builder &builder, const Definition &top, bool with_deps, const ProbeLayout *probes,
+                                   const ActivityLayout *activity)
+{
+  ModuleEnvironment mod_env = builder.makeModule(top.getSafeName() + "_merged");
+  mod_env.setProbeLayout(probes);
+  mod_env.setActivityLayout(activity);
+
+  std::unordered_set<const Definition *> visited;
+  std::vector<const Definition *> order;
+  collectDefinitions(top, visited, order);
+
+  for (const Definition *defn : order) {
+    emitComputeOutput(mod_env, *defn);
+    emitUpdateState(mod_env, *defn);
+    for (unsigned clk = 0; clk < defn->getIFace().getClkSources().size(); clk++) {
+      if (defn->getSimInfo().hasClockDomain(clk)) {
+        emitClockUpdateState(mod_env, *defn, clk);
+      }
+    }
+    if (with_deps) {
+      emitOutputDeps(mod_env, *defn);
+      emitStateDeps(mod_env, *defn);
+    }
+  }
+
+  emitComputeOutputWrapper(mod_env, top);
+  emitUpdateStateWrapper(mod_env, top);
+  emitRunCyclesWrapper(mod_env, top);
+  if (with_deps) {
+    emitGetValuesWrapper(mod_env, top);
+  }
+
+  std::unordered_set<std::string> entry_points = { "compute_output", "update_state", "run_cycles", "get_values" };
+  for (unsigned clk = 0; clk < top.getIFace().getClkSources().size(); clk++) {
+    if (top.getSimInfo().hasClockDomain(clk)) {
+      emitClockUpdateStateWrapper(mod_env, top, clk);
+      entry_points.insert("update_state_" + top.getIFace().getClkSources()[clk].getName());
+    }
+  }
+
+  /* Only the wrappers are entry points, so the inliner is free to flatten
+   * and then discard every definition function */
+  for (Function &fn : *mod_env.getModule()) {
+    if (!fn.isDeclaration() && !entry_points.count(fn.getName().str())) {
+      fn.setLinkage(GlobalValue::InternalLinkage);
+    }
+  }
+
+  assert(!mod_env.verify());
+
+  return mod_env;
+}
+
+bool CanBitSlice(const Definition &defn)
+{
+  const SimInfo &siminfo = defn.getSimInfo();
+  if (siminfo.isPrimitive()) {
+    return siminfo.getPrimitive().supports_bit_slicing;
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    if (!CanBitSlice(inst.getDefinition())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* The batch wrappers take structure of arrays buffers: every port holds
+ * its elements for every lane, and ports follow each other in order */
+static std::vector<Value *> loadLanePorts(FunctionEnvironment &func, Value *base,
+                                          const std::vector<const Source *> &sources)
+{
+  std::vector<Value *> values;
+  uint64_t offset = 0;
+  for (const Source *src : sources) {
+    Value *addr = func.getIRBuilder().CreateConstInBoundsGEP1_64(base, offset);
+    values.push_back(LoadLaneElements(func, addr, src->getWidth(), "self." + src->getName()));
+    offset += GetLaneElementsBytes(func.getModule(), src->getWidth());
+  }
+
+  return values;
+}
+
+static void emitBatchComputeOutputWrapper(ModuleEnvironment &mod_env, const Definition &defn, const std::string &name)
+{
+  const std::vector<const Source *> & sources = defn.getSimInfo().getOutputSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+  Type *byte_ptr = Type::getInt8PtrTy(mod_env.getContext());
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(mod_env.getContext()), {byte_ptr, byte_ptr, byte_ptr}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction(name, wrapper_type);
+  func.addBasicBlock("entry");
+
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *outputs = func.getFunction()->arg_begin() + 1;
+  Value *state = func.getFunction()->arg_begin() + 2;
+
+  FunctionType *co_type = makeComputeOutputType(defn, mod_env);
+  Function *underlying = getOrMakeFunctionDecl(mod_env, getComputeOutputName(defn, mod_env), co_type);
+
+  std::vector<Value *> args = loadLanePorts(func, inputs, sources);
+  if (defn.getSimInfo().isStateful()) {
+    args.push_back(state);
+  }
+
+  Value *output_struct = func.getIRBuilder().CreateCall(underlying, args);
+
+  uint64_t offset = 0;
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    Value *val = func.getIRBuilder().CreateExtractValue(output_struct, { i });
+    Value *addr = func.getIRBuilder().CreateConstInBoundsGEP1_64(outputs, offset);
+    StoreLaneElements(func, val, addr, sinks[i].getWidth());
+    offset += GetLaneElementsBytes(mod_env, sinks[i].getWidth());
+  }
+
+  func.getIRBuilder().CreateRetVoid();
+  func.verify();
+}
+
+static void emitBatchUpdateStateWrapper(ModuleEnvironment &mod_env, const Definition &defn, const std::string &name)
+{
+  const std::vector<const Source *> & sources = defn.getSimInfo().getStateSources();
+  Type *byte_ptr = Type::getInt8PtrTy(mod_env.getContext());
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(mod_env.getContext()), {byte_ptr, byte_ptr}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction(name, wrapper_type);
+  func.addBasicBlock("entry");
+
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *state = func.getFunction()->arg_begin() + 1;
+
+  FunctionType *us_type = makeUpdateStateType(defn, mod_env);
+  Function *underlying = getOrMakeFunctionDecl(mod_env, getUpdateStateName(defn, mod_env), us_type);
+
+  std::vector<Value *> args = loadLanePorts(func, inputs, sources);
+  args.push_back(state);
+
+  func.getIRBuilder().CreateCall(underlying, args);
+
+  func.getIRBuilder().CreateRetVoid();
+  func.verify();
+}
+
+ModuleEnvironment MakeBatchModule(Builder &builder, const Definition &top, unsigned lanes, bool bit_sliced)
+{
+  assert(!bit_sliced || CanBitSlice(top));
+
+  ModuleEnvironment mod_env = builder.makeModule(top.getSafeName() + "_batch", lanes, bit_sliced);
+
+  std::unordered_set<const Definition *> visited;
+  std::vector<const Definition *> order;
+  collectDefinitions(top, visited, order);
+
+  for (const Definition *defn : order) {
+    emitComputeOutput(mod_env, *defn);
+    emitUpdateState(mod_env, *defn);
+  }
+
+  emitBatchComputeOutputWrapper(mod_env, top, "compute_output_batch");
+  emitBatchUpdateStateWrapper(mod_env, top, "update_state_batch");
+
+  for (Function &fn : *mod_env.getModule()) {
+    if (!fn.isDeclaration() && fn.getName() != "compute_output_batch" && fn.getName() != "update_state_batch") {
+      fn.setLinkage(GlobalValue::InternalLinkage);
+    }
+  }
+
+  assert(!mod_env.verify());
+
   return mod_env;
 }
 
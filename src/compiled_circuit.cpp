@@ -0,0 +1,857 @@
+#include <jitsim/compiled_circuit.hpp>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include "utils.hpp"
+#include "llvm_utils.hpp"
+
+#include <llvm/IR/ValueSymbolTable.h>
+
+#include <atomic>
+#include <thread>
+
+namespace JITSim {
+
+using namespace std;
+
+static bool isPrimitive(const Definition &definition)
+{
+  const SimInfo &siminfo = definition.getSimInfo();
+  return siminfo.isPrimitive();
+}
+
+template <typename T>
+LLVMStruct::LLVMStruct(const vector<T> &members,
+                       const llvm::DataLayout &data_layout,
+                       llvm::LLVMContext &context)
+  : layout(),
+    data()
+{
+  auto new_layout = std::make_shared<Layout>();
+  new_layout->type = ConstructStructType(members, context);
+  new_layout->struct_layout = data_layout.getStructLayout(new_layout->type);
+  for (unsigned i = 0; i < members.size(); i++) {
+    const auto &m = condDeref(members[i]);
+    new_layout->member_indices[m.getSymbol()] = i;
+  }
+
+  data.assign(new_layout->struct_layout->getSizeInBytes(), 0);
+  layout = move(new_layout);
+}
+
+uint8_t * LLVMStruct::getMemberAddr(int idx)
+{
+  uint8_t *ptr = data.data();
+  uint64_t offset = layout->struct_layout->getElementOffset(idx);
+
+  return ptr + offset;
+}
+
+const uint8_t * LLVMStruct::getMemberAddr(int idx) const
+{
+  const uint8_t *ptr = data.data();
+  uint64_t offset = layout->struct_layout->getElementOffset(idx);
+
+  return ptr + offset;
+}
+
+int LLVMStruct::getMemberBits(int idx) const
+{
+  llvm::Type *elemty = layout->type->getElementType(idx);
+  return elemty->getIntegerBitWidth();
+}
+
+void LLVMStruct::setMember(Symbol name, llvm::APInt val)
+{
+  auto iter = layout->member_indices.find(name);
+  if (iter == layout->member_indices.end()) {
+    return;
+  }
+  int idx = iter->second;
+  val = val.zextOrTrunc(getMemberBits(idx));
+  uint8_t *ptr = getMemberAddr(idx);
+  memcpy(ptr, val.getRawData(), getNumBytes(getMemberBits(idx)));
+}
+
+llvm::APInt LLVMStruct::getValue(int idx) const 
+{
+  return loadAPInt(getMemberAddr(idx), getMemberBits(idx));
+}
+
+llvm::APInt LLVMStruct::getValue(const string &name) const
+{
+  int idx = layout->member_indices.find(LookupSymbol(name))->second;
+  return getValue(idx);
+}
+
+void LLVMStruct::dump() const
+{
+  for (const auto &name_pair : layout->member_indices) {
+    cout << GetSymbolName(name_pair.first) << ": " << getValue(name_pair.second).toString(10, false) << endl;
+  }
+}
+
+template <typename T>
+LaneBuffer::LaneBuffer(const vector<T> &members, unsigned lanes_, bool bit_sliced_)
+  : lanes(lanes_),
+    bit_sliced(bit_sliced_),
+    member_indices(),
+    member_names(),
+    member_bits(),
+    member_offsets(),
+    data()
+{
+  uint64_t offset = 0;
+  for (unsigned i = 0; i < members.size(); i++) {
+    const auto &m = condDeref(members[i]);
+    member_indices[m.getSymbol()] = i;
+    member_names.push_back(m.getSymbol());
+    member_bits.push_back(m.getWidth());
+    member_offsets.push_back(offset);
+    if (bit_sliced) {
+      offset += (uint64_t)m.getWidth() * lanes / 8;
+    } else {
+      offset += (uint64_t)lanes * getNumBytes(m.getWidth());
+    }
+  }
+
+  data.resize(offset, 0);
+}
+
+/* JITFrontend builds its batch buffers from the top definition's ports */
+template LaneBuffer::LaneBuffer(const vector<const Source *> &, unsigned, bool);
+template LaneBuffer::LaneBuffer(const vector<Sink> &, unsigned, bool);
+
+uint8_t * LaneBuffer::getElementAddr(int idx, unsigned lane)
+{
+  return data.data() + member_offsets[idx] + lane * getNumBytes(member_bits[idx]);
+}
+
+const uint8_t * LaneBuffer::getElementAddr(int idx, unsigned lane) const
+{
+  return data.data() + member_offsets[idx] + lane * getNumBytes(member_bits[idx]);
+}
+
+void LaneBuffer::setMember(Symbol name, unsigned lane, llvm::APInt val)
+{
+  auto iter = member_indices.find(name);
+  if (iter == member_indices.end() || lane >= lanes) {
+    return;
+  }
+  int idx = iter->second;
+  val = val.zextOrTrunc(member_bits[idx]);
+
+  if (bit_sliced) {
+    for (int bit = 0; bit < member_bits[idx]; bit++) {
+      uint8_t *byte = data.data() + member_offsets[idx] + (uint64_t)bit * lanes / 8 + lane / 8;
+      if (val[bit]) {
+        *byte |= 1 << (lane % 8);
+      } else {
+        *byte &= ~(1 << (lane % 8));
+      }
+    }
+    return;
+  }
+
+  memcpy(getElementAddr(idx, lane), val.getRawData(), getNumBytes(member_bits[idx]));
+}
+
+llvm::APInt LaneBuffer::getValue(int idx, unsigned lane) const
+{
+  int bits = member_bits[idx];
+  if (bit_sliced) {
+    llvm::APInt val(bits, 0);
+    for (int bit = 0; bit < bits; bit++) {
+      const uint8_t *byte = data.data() + member_offsets[idx] + (uint64_t)bit * lanes / 8 + lane / 8;
+      if (*byte & (1 << (lane % 8))) {
+        val.setBit(bit);
+      }
+    }
+    return val;
+  }
+
+  return loadAPInt(getElementAddr(idx, lane), bits);
+}
+
+llvm::APInt LaneBuffer::getValue(const string &name, unsigned lane) const
+{
+  int idx = member_indices.find(LookupSymbol(name))->second;
+  return getValue(idx, lane);
+}
+
+void LaneBuffer::dump(unsigned lane) const
+{
+  for (unsigned i = 0; i < member_names.size(); i++) {
+    cout << GetSymbolName(member_names[i]) << ": " << getValue(i, lane).toString(10, false) << endl;
+  }
+}
+
+Simulation::Simulation(const CompiledCircuit &circuit)
+  : Simulation(circuit, std::make_unique<StateBuffer>(vector<uint8_t>(circuit.initial_state)))
+{
+}
+
+Simulation::Simulation(const CompiledCircuit &circuit, unique_ptr<StateBuffer> state_)
+  : entry_points(circuit.entry_points),
+    co_in(circuit.co_in),
+    co_out(circuit.co_out),
+    us_in(circuit.us_in),
+    gv_in(circuit.gv_in),
+    state(move(state_)),
+    probes(circuit.probe_layout ? circuit.probe_layout->getNumBytes(*circuit.top) : 0, 0)
+{
+}
+
+void Simulation::setInput(const std::string &name, uint64_t val)
+{
+  setInput(name, llvm::APInt(64, val));
+}
+
+void Simulation::setInput(const std::string &name, llvm::APInt val)
+{
+  setInput(LookupSymbol(name), val);
+}
+
+void Simulation::setInput(Symbol name, llvm::APInt val)
+{
+  co_in.setMember(name, val);
+  us_in.setMember(name, val);
+  gv_in.setMember(name, val);
+}
+
+void Simulation::updateState()
+{
+  entry_points.update_state(us_in.getData(), state->data(), probes.data());
+}
+
+bool Simulation::tick(Symbol clk)
+{
+  for (const auto &clock : entry_points.clock_update_state) {
+    if (clock.first != clk) {
+      continue;
+    }
+    if (clock.second) {
+      clock.second(us_in.getData(), state->data(), probes.data());
+    }
+    return true;
+  }
+
+  return false;
+}
+
+const LLVMStruct & Simulation::computeOutput()
+{
+  entry_points.compute_output(co_in.getData(), co_out.getData(), state->data(), probes.data());
+  return co_out;
+}
+
+const LLVMStruct & Simulation::run(uint64_t num_cycles)
+{
+  entry_points.run_cycles(us_in.getData(), co_in.getData(), co_out.getData(), state->data(), num_cycles,
+                          probes.data());
+  return co_out;
+}
+
+std::string CompiledCircuit::getCacheKey(const Definition &defn, const std::string &kind)
+{
+  if (!object_cache) {
+    return "";
+  }
+
+  /* Probes and activity tracking change the generated code and the
+   * function signatures */
+  string variant = kind;
+  if (probe_layout) {
+    variant += "|probes:" + probe_layout->getSignature(defn);
+  }
+  if (activity_layout) {
+    variant += "|activity";
+  }
+
+  return object_cache->getKey(defn, variant, final_opt_level);
+}
+
+void CompiledCircuit::addCompileJob(const string &name, ModuleGenerator generator,
+                                const string &cache_key, bool tierable)
+{
+  compile_jobs.push_back({ name, generator, cache_key, nullptr });
+  CompileJob &job = compile_jobs.back();
+
+  /* A previous run may already have left the top tier object in the cache */
+  bool top_tier_cached = object_cache && object_cache->hasObject(cache_key);
+
+  if (tier_up && tierable && !top_tier_cached) {
+    job.call_counter = jit.addCallCounter(name);
+    tier_candidates.push_back(&job);
+  }
+
+  /* The counter address is baked into first tier code, so it skips the cache */
+  jit.addLazyFunction(name, [this, &job]() {
+    return generateJob(job, builder);
+  }, job.call_counter ? "" : cache_key);
+}
+
+shared_ptr<llvm::Module> CompiledCircuit::generateJob(const CompileJob &job, Builder &builder)
+{
+  shared_ptr<llvm::Module> module = job.generator(builder);
+  if (job.call_counter) {
+    JIT::instrumentCallCounter(*module, job.name, job.call_counter);
+  }
+
+  return module;
+}
+
+void CompiledCircuit::pollTierUp()
+{
+  for (TierUpCompiler::Result &result : tier_up->takeFinished()) {
+    jit.replaceFunction(result.first, move(result.second));
+    for (CompileJob &job : compile_jobs) {
+      if (job.name == result.first) {
+        job.call_counter = nullptr;
+      }
+    }
+  }
+
+  for (auto iter = tier_candidates.begin(); iter != tier_candidates.end();) {
+    const CompileJob &job = **iter;
+    if (*job.call_counter >= tier_up_threshold) {
+      tier_up->enqueue(job.name, job.generator, job.cache_key);
+      iter = tier_candidates.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void CompiledCircuit::addDefinitionFunctions(const Definition &defn)
+{
+  if (!merged) {
+    addDefinitionComputeFunctions(defn);
+  }
+
+  addDefinitionDebugFunctions(defn);
+}
+
+void CompiledCircuit::addDefinitionComputeFunctions(const Definition &defn)
+{
+  const ProbeLayout *layout = probe_layout.get();
+  const ActivityLayout *activity = activity_layout.get();
+
+  addCompileJob(defn.getSafeName() + "_update_state", [&defn, layout, activity](Builder &builder) {
+    ModuleEnvironment env = MakeUpdateState(builder, defn, layout, activity);
+
+    return env.getModule();
+  }, getCacheKey(defn, "update_state"), true);
+
+  addCompileJob(defn.getSafeName() + "_compute_output", [&defn, layout, activity](Builder &builder) {
+    ModuleEnvironment env = MakeComputeOutput(builder, defn, layout, activity);
+
+    return env.getModule();
+  }, getCacheKey(defn, "compute_output"), true);
+
+  const vector<ClkSource> &clocks = defn.getIFace().getClkSources();
+  for (unsigned clk = 0; clk < clocks.size(); clk++) {
+    if (!defn.getSimInfo().hasClockDomain(clk)) {
+      continue;
+    }
+
+    const string &clk_name = clocks[clk].getName();
+    addCompileJob(defn.getSafeName() + "_update_state_" + clk_name,
+                  [&defn, clk, layout, activity](Builder &builder) {
+      ModuleEnvironment env = MakeClockUpdateState(builder, defn, clk, layout, activity);
+
+      return env.getModule();
+    }, getCacheKey(defn, "update_state_" + clk_name), true);
+  }
+}
+
+void CompiledCircuit::addDefinitionDebugFunctions(const Definition &defn)
+{
+  /* The deps modules are rewritten by debug transforms, so they are never cached */
+
+  jit.addLazyFunction(defn.getSafeName() + "_state_deps", [this, &defn]() {
+    ModuleEnvironment env = MakeStateDeps(builder, defn);
+    shared_ptr<llvm::Module> mod = env.getModule();
+    debug_modules.emplace(defn.getSafeName() + "_state_deps", move(env));
+
+    return llvm::CloneModule(mod.get(), debug_clone_map[defn.getSafeName() + "_state_deps"]);
+  });
+
+  jit.addLazyFunction(defn.getSafeName() + "_output_deps", [this, &defn]() {
+    ModuleEnvironment env = MakeOutputDeps(builder, defn);
+    shared_ptr<llvm::Module> mod = env.getModule();
+    debug_modules.emplace(defn.getSafeName() + "_output_deps", move(env));
+
+    return llvm::CloneModule(mod.get(), debug_clone_map[defn.getSafeName() + "_state_deps"]);
+  });
+}
+
+void CompiledCircuit::addMergedModule(const Definition &top)
+{
+  string cache_key = getCacheKey(top, "merged");
+
+  DiskObjectCache::ObjectPtr object = jit.loadCachedObject(cache_key);
+  if (!object) {
+    object = jit.compileObject(MakeMergedModule(builder, top, false, probe_layout.get(), activity_layout.get()).getModule(), *target_machine,
+                               final_opt_level, cache_key);
+  }
+
+  /* No stubs point here, compute_output and update_state resolve straight to the object */
+  jit.addObject(move(object));
+}
+
+void CompiledCircuit::addBatchModule(const Definition &top)
+{
+  string cache_key = getCacheKey(top, (bit_sliced ? "bitsliced" : "batch") + to_string(lanes));
+
+  DiskObjectCache::ObjectPtr object = jit.loadCachedObject(cache_key);
+  if (!object) {
+    object = jit.compileObject(MakeBatchModule(builder, top, lanes, bit_sliced).getModule(), *target_machine,
+                               final_opt_level, cache_key);
+  }
+
+  jit.addObject(move(object));
+}
+
+void CompiledCircuit::addWrappers(const Definition &top)
+{
+  if (merged) {
+    addMergedModule(top);
+  } else {
+    const ProbeLayout *layout = probe_layout.get();
+    const ActivityLayout *activity = activity_layout.get();
+
+    /* The step wrappers are entered on every cycle, so they tier up like
+     * the definition functions */
+    addCompileJob("update_state", [&top, layout, activity](Builder &builder) {
+      return MakeUpdateStateWrapper(builder, top, layout, activity).getModule();
+    }, getCacheKey(top, "update_state_wrapper"), true);
+
+    addCompileJob("compute_output", [&top, layout, activity](Builder &builder) {
+      return MakeComputeOutputWrapper(builder, top, layout, activity).getModule();
+    }, getCacheKey(top, "compute_output_wrapper"), true);
+
+    /* run_cycles is entered once per run rather than once per cycle, so
+     * its call count says nothing about how hot its loop is. It starts
+     * out at the final tier instead */
+    addCompileJob("run_cycles", [&top, layout, activity](Builder &builder) {
+      return MakeRunCyclesWrapper(builder, top, layout, activity).getModule();
+    }, getCacheKey(top, "run_cycles_wrapper"), false);
+    const CompileJob *run_cycles = &compile_jobs.back();
+
+    const vector<ClkSource> &clocks = top.getIFace().getClkSources();
+    for (unsigned clk = 0; clk < clocks.size(); clk++) {
+      if (!top.getSimInfo().hasClockDomain(clk)) {
+        continue;
+      }
+
+      addCompileJob("update_state_" + clocks[clk].getName(), [&top, clk, layout, activity](Builder &builder) {
+        return MakeClockUpdateStateWrapper(builder, top, clk, layout, activity).getModule();
+      }, getCacheKey(top, "update_state_" + clocks[clk].getName() + "_wrapper"), true);
+    }
+
+    if (tier_up) {
+      compileJobs({ run_cycles }, 1);
+    }
+  }
+
+  addCompileJob("get_values", [&top](Builder &builder) {
+    return MakeGetValuesWrapper(builder, top).getModule();
+  }, getCacheKey(top, "get_values_wrapper"), false);
+}
+
+static unique_ptr<ProbeLayout> makeProbeLayout(const Definition &top, const JITOptions &options)
+{
+  bool traced = !options.trace_file.empty();
+  if (traced && options.probes.empty()) {
+    return std::make_unique<ProbeLayout>(top, vector<string>{ "*" }, true);
+  } else if (options.probes.empty()) {
+    return nullptr;
+  }
+
+  return std::make_unique<ProbeLayout>(top, options.probes, traced);
+}
+
+/* Every activity cache entry starts out dirty */
+static vector<uint8_t> allocateInitialState(const Definition &top, const ActivityLayout *activity)
+{
+  vector<uint8_t> state = top.getSimInfo().allocateState();
+  if (activity) {
+    state.resize(state.size() + activity->getNumBytes(top), 0);
+  }
+
+  return state;
+}
+
+CompiledCircuit::CompiledCircuit(const Circuit &circuit, const Definition &top_, const JITOptions &options)
+  : target_machine(llvm::EngineBuilder().selectTarget()),
+    data_layout(target_machine->createDataLayout()),
+    builder(data_layout, *target_machine),
+    object_cache(options.cache_dir.empty() ? nullptr :
+                 std::make_unique<DiskObjectCache>(options.cache_dir, *target_machine)),
+    jit(*target_machine, data_layout, object_cache.get()),
+    /* Merged modules are compiled once and never tier up */
+    final_opt_level(options.tiered && !options.merged ? 3 : jit.getOptLevel()),
+    merged(options.merged),
+    lanes(options.lanes),
+    bit_sliced(options.bit_sliced),
+    tier_up(options.tiered && !merged ?
+            std::make_unique<TierUpCompiler>(jit, data_layout, final_opt_level) : nullptr),
+    tier_up_threshold(options.tier_up_threshold),
+    calls_since_tier_poll(0),
+    debug_modules(),
+    debug_clone_map(),
+    top(&top_),
+    probe_layout(makeProbeLayout(top_, options)),
+    activity_layout(options.activity ? std::make_unique<ActivityLayout>(top_) : nullptr),
+    co_in(top_.getSimInfo().getOutputSources(), data_layout, builder.getContext()),
+    co_out(top_.getIFace().getSinks(), data_layout, builder.getContext()),
+    us_in(top_.getSimInfo().getStateSources(), data_layout, builder.getContext()),
+    gv_in(top_.getIFace().getSources(), data_layout, builder.getContext()),
+    initial_state(allocateInitialState(top_, activity_layout.get())),
+    batch_initial_state(bit_sliced ? top_.getSimInfo().allocateBitSlicedState(lanes) :
+                                     top_.getSimInfo().allocateBatchState(lanes)),
+    entry_points({ nullptr, nullptr, nullptr, {} }),
+    get_values_ptr(nullptr),
+    batch_compute_output_ptr(nullptr),
+    batch_update_state_ptr(nullptr),
+    compile_jobs(),
+    tier_candidates(),
+    frozen(false),
+    freeze_lock()
+{
+  if (tier_up) {
+    /* First tier: skip as much optimization and codegen work as possible */
+    jit.setOptLevel(0);
+    target_machine->setOptLevel(llvm::CodeGenOpt::None);
+  }
+
+  if (merged) {
+    jit.setInlining(true);
+  }
+
+  for (const Definition *defn : circuit.getUniqueDefinitions()) {
+    if (!isPrimitive(*defn)) {
+      addDefinitionFunctions(*defn);
+    } else {
+      // FIXME handle primitives that want to provide function definitions
+    }
+  }
+  addWrappers(top_);
+
+  entry_points.compute_output = (Simulation::ComputeOutputFn)jit.getSymbolAddress("compute_output");
+  entry_points.update_state = (Simulation::UpdateStateFn)jit.getSymbolAddress("update_state");
+  entry_points.run_cycles = (Simulation::RunCyclesFn)jit.getSymbolAddress("run_cycles");
+  for (unsigned clk = 0; clk < top_.getIFace().getClkSources().size(); clk++) {
+    const ClkSource &clock = top_.getIFace().getClkSources()[clk];
+    Simulation::UpdateStateFn fn = nullptr;
+    if (top_.getSimInfo().hasClockDomain(clk)) {
+      fn = (Simulation::UpdateStateFn)jit.getSymbolAddress("update_state_" + clock.getName());
+      assert(fn);
+    }
+    entry_points.clock_update_state.emplace_back(clock.getSymbol(), fn);
+  }
+  get_values_ptr = (GetValuesFn)jit.getSymbolAddress("get_values");
+
+  assert(entry_points.compute_output && entry_points.update_state && entry_points.run_cycles);
+
+  /* Bit slicing only matters once there are lanes to slice */
+  if (lanes > 0) {
+    if (bit_sliced && (lanes % 8 != 0 || !CanBitSlice(top_))) {
+      llvm::errs() << "Bit slicing needs a multiple of 8 lanes and only bitwise primitives, "
+                   << "batch functions are unavailable\n";
+    } else {
+      addBatchModule(top_);
+      batch_compute_output_ptr = (BatchComputeOutputFn)jit.getSymbolAddress("compute_output_batch");
+      batch_update_state_ptr = (BatchUpdateStateFn)jit.getSymbolAddress("update_state_batch");
+
+      assert(batch_compute_output_ptr && batch_update_state_ptr);
+    }
+  }
+
+  if (options.compile_threads > 0) {
+    precompileParallel(options.compile_threads);
+  }
+}
+
+CompiledCircuit::CompiledCircuit(const Circuit &circuit, const JITOptions &options)
+  : CompiledCircuit(circuit, circuit.getTopDefinition(), options)
+{}
+
+void CompiledCircuit::freeze()
+{
+  lock_guard<mutex> guard(freeze_lock);
+  if (frozen) {
+    return;
+  }
+
+  /* Lazy compilation and tier swaps patch shared stubs, neither of which
+   * may happen once simulations run on other threads */
+  if (tier_up) {
+    finishTiering();
+  }
+  precompileParallel(1);
+
+  frozen = true;
+}
+
+/* First tier code bumps plain counters that every simulation would share,
+ * and the background compiler swaps code under running simulations, so
+ * both have to be done with before freezing */
+void CompiledCircuit::finishTiering()
+{
+  pollTierUp();
+  tier_up.reset();
+  tier_candidates.clear();
+
+  /* Jobs that were never compiled are left to precompileParallel, which
+   * compiles them at the final tier now that their counters are gone */
+  vector<const CompileJob *> first_tier;
+  for (CompileJob &job : compile_jobs) {
+    if (job.call_counter) {
+      job.call_counter = nullptr;
+      if (jit.isCompiled(job.name)) {
+        first_tier.push_back(&job);
+      }
+    }
+  }
+
+  compileJobs(first_tier, max(1u, thread::hardware_concurrency()));
+}
+
+unique_ptr<Simulation> CompiledCircuit::makeSimulation()
+{
+  freeze();
+
+  return unique_ptr<Simulation>(new Simulation(*this));
+}
+
+unique_ptr<Simulation> CompiledCircuit::makeSimulation(unique_ptr<StateBuffer> state)
+{
+  freeze();
+
+  return unique_ptr<Simulation>(new Simulation(*this, move(state)));
+}
+
+static tuple<const Definition *, const Instance *, unsigned> getDefnAndInst(const Definition *top, const vector<string> &inst_names)
+{
+  const Definition *cur_defn = top;
+  unsigned inst_num = 0;
+  for (unsigned i = 0; i < inst_names.size() - 1; i++) {
+    const string &inst_name = inst_names[i];
+    const SimInfo &sim_info = cur_defn->getSimInfo();
+    const Instance &inst = cur_defn->getInstance(inst_name);
+    cur_defn = &inst.getDefinition();
+    inst_num += sim_info.getInstNum(&inst);
+  }
+
+  const Instance *inst = &cur_defn->getInstance(inst_names.back());
+
+  return make_tuple(cur_defn, inst, inst_num);
+}
+
+vector<uint8_t> CompiledCircuit::allocateDebugStorage(const Instance *inst, const string &input)
+{
+  int num_bits = 0;
+  const IFace &iface = inst->getIFace();
+  if (iface.hasSource(input)) {
+    const Source *src = iface.getSource(input);
+    num_bits = src->getWidth();
+  } else if (iface.hasSink(input)) {
+    const Sink *sink = iface.getSink(input);
+    num_bits = sink->getWidth();
+  }
+
+  unsigned num_bytes = num_bits / 8;
+  if (num_bits % 8 != 0) {
+    num_bytes++;
+  }
+  
+  assert(num_bytes);
+  return vector<uint8_t>(num_bytes, 0);
+}
+
+llvm::APInt CompiledCircuit::getDebugValue(const vector<string> &inst_names, const string &input,
+                                           const uint8_t *gv_input, uint8_t *state)
+{
+  const Definition *defn;
+  const Instance *inst;
+  unsigned inst_num;
+  tie(defn, inst, inst_num) = getDefnAndInst(top, inst_names);
+  vector<uint8_t> debug_store = allocateDebugStorage(inst, input);
+  assert(debug_store.data() && "Data store is null?");
+  const SimInfo &defn_info = defn->getSimInfo();
+
+  bool in_output_deps = defn_info.isOutputDep(inst);
+  assert(in_output_deps || defn_info.isStateDep(inst));
+
+  string mod_name;
+  if (in_output_deps) {
+    mod_name = defn->getSafeName() + "_output_deps";
+  } else {
+    mod_name = defn->getSafeName() + "_state_deps";
+  }
+  if (jit.removeModule(mod_name)) {
+    /* If the module was removed, add a new callback to use the already generated IR */
+    assert(debug_modules.count(mod_name));
+
+    jit.addLazyFunction(mod_name, [this, mod_name]() {
+      ModuleEnvironment &env = debug_modules.find(mod_name)->second;
+
+      auto cloned = llvm::CloneModule(env.getModule().get(), debug_clone_map[mod_name]);
+      return cloned;
+    });
+  }
+  auto txfm = jit.addDebugTransform(mod_name, [this, inst, defn, inst_num, &mod_name, &input, &debug_store](std::shared_ptr<llvm::Module> module) {
+    ModuleEnvironment &env = debug_modules.find(mod_name)->second;
+    llvm::ValueToValueMapTy &val_map = debug_clone_map.find(mod_name)->second;
+
+    llvm::Value *llvm_val = nullptr;
+    const IFace &inst_iface = inst->getIFace();
+    if (inst_iface.hasSource(input)) {
+      const Source *src = inst_iface.getSource(input);
+      llvm_val = env.lookupValue(src);
+    } else if (inst_iface.hasSink(input)) {
+      const Sink *sink = inst_iface.getSink(input);
+      llvm_val = env.lookupValue(sink);
+    } else {
+      assert(false);
+    }
+    assert(llvm_val && "Can't find queried value");
+    llvm_val = val_map.find(llvm_val)->second;
+
+    auto func = module->getFunction(mod_name);
+    assert(func && "unable to find function to modify");
+    auto symtab = func->getValueSymbolTable();
+    assert(symtab && "unable to find function symbol table");
+
+    llvm::Value *inst_offset = symtab->lookup("inst_offset");
+    assert(inst_offset && "Can't find inst_offset param");
+    llvm::IRBuilder<> ir_builder(builder.getContext());
+
+    llvm::BasicBlock *last_bb = &func->back();
+    llvm::BasicBlock *debug_block = llvm::BasicBlock::Create(builder.getContext(), "debug_block", func);
+
+    // Rewrite every predecessor of the return block to instead jump to the debug block
+    vector<llvm::Instruction *> terms;
+    for (auto pred : llvm::predecessors(last_bb)) {
+      llvm::Instruction *term = pred->getTerminator();
+      terms.push_back(term); // Can't erase term here since it will mess up the predecessor iterator
+      ir_builder.SetInsertPoint(term);
+      ir_builder.CreateBr(debug_block);
+    }
+
+    for (auto term : terms) {
+      term->eraseFromParent();
+    }
+
+    ir_builder.SetInsertPoint(debug_block);
+    llvm::Value *inst_eq = ir_builder.CreateICmpEQ(inst_offset, llvm::ConstantInt::get(builder.getContext(), llvm::APInt(64, inst_num)));
+    llvm::BasicBlock *val_save = llvm::BasicBlock::Create(builder.getContext(), "inst_match", func);
+    ir_builder.CreateCondBr(inst_eq, val_save, last_bb);
+    ir_builder.SetInsertPoint(val_save);
+
+
+    llvm::Value *addr = llvm::Constant::getIntegerValue(llvm_val->getType()->getPointerTo(), llvm::APInt(64, (uint64_t)debug_store.data()));
+    ir_builder.CreateStore(llvm_val, addr);
+    ir_builder.CreateBr(last_bb);
+
+    llvm::outs() << "========== Modified " << defn->getName() << " ===========\n";
+    llvm::outs() << *module;
+    llvm::outs() << "=====================================\n";
+    if (llvm::verifyModule(*module)) {
+      llvm::errs() << "Modified module has errors\n";
+    }
+
+    return module;
+  });
+
+  get_values_ptr(gv_input, state);
+
+  jit.removeDebugTransform(mod_name, txfm);
+
+  assert(!debug_store.empty());
+
+  return loadAPInt(debug_store.data(), debug_store.size() * 8);
+}
+
+void CompiledCircuit::precompileParallel(unsigned num_threads)
+{
+  vector<const CompileJob *> jobs;
+  for (const CompileJob &job : compile_jobs) {
+    if (!jit.isCompiled(job.name)) {
+      jobs.push_back(&job);
+    }
+  }
+
+  compileJobs(jobs, num_threads);
+}
+
+void CompiledCircuit::compileJobs(const vector<const CompileJob *> &jobs, unsigned num_threads)
+{
+  num_threads = min<unsigned>(num_threads, jobs.size());
+  if (num_threads == 0) {
+    return;
+  }
+
+  /* Neither LLVMContext nor TargetMachine may be shared between threads,
+   * so every worker gets its own pair */
+  vector<unique_ptr<llvm::TargetMachine>> worker_targets;
+  vector<unique_ptr<Builder>> worker_builders;
+  for (unsigned i = 0; i < num_threads; i++) {
+    worker_targets.emplace_back(llvm::EngineBuilder().selectTarget());
+    worker_builders.emplace_back(std::make_unique<Builder>(data_layout, *worker_targets.back()));
+  }
+
+  vector<DiskObjectCache::ObjectPtr> objects(jobs.size());
+  atomic<size_t> next_job(0);
+
+  auto worker = [&](unsigned worker_idx) {
+    Builder &worker_builder = *worker_builders[worker_idx];
+    llvm::TargetMachine &worker_target = *worker_targets[worker_idx];
+
+    for (size_t idx = next_job++; idx < jobs.size(); idx = next_job++) {
+      const CompileJob &job = *jobs[idx];
+
+      /* First tier jobs compile like the lazy path does, with their
+       * counters, so tiering works the same with and without threads */
+      DiskObjectCache::ObjectPtr object;
+      if (job.call_counter) {
+        worker_target.setOptLevel(llvm::CodeGenOpt::None);
+        object = jit.compileObject(generateJob(job, worker_builder), worker_target, jit.getOptLevel());
+      } else {
+        object = jit.loadCachedObject(job.cache_key);
+        if (!object) {
+          worker_target.setOptLevel(final_opt_level >= 3 ? llvm::CodeGenOpt::Aggressive : llvm::CodeGenOpt::Default);
+          object = jit.compileObject(job.generator(worker_builder), worker_target,
+                                     final_opt_level, job.cache_key);
+        }
+      }
+      objects[idx] = move(object);
+    }
+  };
+
+  vector<thread> threads;
+  for (unsigned i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+
+  for (thread &t : threads) {
+    t.join();
+  }
+
+  /* Linking and stub updates touch shared JIT state, so they stay on this thread */
+  for (size_t idx = 0; idx < jobs.size(); idx++) {
+    if (jit.isCompiled(jobs[idx]->name)) {
+      jit.replaceFunction(jobs[idx]->name, move(objects[idx]));
+    } else {
+      jit.addCompiledFunction(jobs[idx]->name, move(objects[idx]));
+    }
+  }
+}
+
+void CompiledCircuit::dumpIR()
+{
+  jit.precompileDumpIR();
+}
+
+}
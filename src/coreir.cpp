@@ -102,6 +102,8 @@ GenInstances(CoreIR::ModuleDef *core_def,
         stringstream strm;
         strm << bv->get();
         inst.setArg(val.first, strm.str());
+      } else if (val.second->getKind() == CoreIR::Value::VK_ConstBool) {
+        inst.setArg(val.first, val.second->get<bool>() ? "1" : "0");
       }
     }
     core_instances.push_back(coreinst);
@@ -114,6 +116,20 @@ GenInstances(CoreIR::ModuleDef *core_def,
   return make_pair(move(instances), move(instance_map));
 }
 
+static GenArgs GetGenArgs(CoreIR::Module *core_mod)
+{
+  GenArgs genargs;
+  for (const auto &val : core_mod->getGenArgs()) {
+    if (val.second->getKind() == CoreIR::Value::VK_ConstInt) {
+      genargs[val.first] = val.second->get<int>();
+    } else if (val.second->getKind() == CoreIR::Value::VK_ConstBool) {
+      genargs[val.first] = val.second->get<bool>();
+    }
+  }
+
+  return genargs;
+}
+
 static void ProcessPrimitive(CoreIR::Module *core_mod,
                              unordered_map<CoreIR::Module *, const Definition *> &mod_map,
                              deque<Definition> &definitions)
@@ -125,9 +141,10 @@ static void ProcessPrimitive(CoreIR::Module *core_mod,
 
   auto interface = GenInterface(core_mod);
 
-  Primitive prim = BuildCoreIRPrimitive(core_mod);
+  string name = core_mod->getNamespace()->getName()+"."+core_mod->getName();
+  Primitive prim = BuildCoreIRPrimitive(name, GetGenArgs(core_mod));
 
-  definitions.emplace_back(core_mod->getNamespace()->getName()+"."+core_mod->getName(), move(interface), prim);
+  definitions.emplace_back(name, move(interface), prim);
   mod_map[core_mod] = &definitions.back();
 }
 
@@ -244,6 +261,28 @@ static void SetupIFaceConnections(CoreIR::Wireable *core_w, IFace &iface, const
   }
 }
 
+/* Only clocks driven straight from one of the definition's own clock
+ * inputs are connected. Clocks produced by instances are left unconnected,
+ * so their registers just step with every update_state */
+static void SetupClockConnections(CoreIR::Wireable *core_w, IFace &iface, const Definition &defn)
+{
+  for (ClkSink &clk : iface.getClkSinks()) {
+    for (CoreIR::Wireable *connected : core_w->sel(clk.getName())->getConnectedWireables()) {
+      assert(connected->getKind() == CoreIR::Wireable::WK_Select);
+      CoreIR::Select *source = static_cast<CoreIR::Select *>(connected);
+      if (source->getParent()->getKind() != CoreIR::Wireable::WK_Interface) {
+        continue;
+      }
+
+      for (const ClkSource &defn_clk : defn.getIFace().getClkSources()) {
+        if (defn_clk.getName() == source->getSelStr()) {
+          clk.connect(&defn_clk);
+        }
+      }
+    }
+  }
+}
+
 static void SetupModuleConnections(CoreIR::ModuleDef *core_def, Definition &defn,
                                    const unordered_map<CoreIR::Instance *, Instance *> &inst_map)
 {
@@ -257,6 +296,7 @@ static void SetupModuleConnections(CoreIR::ModuleDef *core_def, Definition &defn
     Instance *jitinst = inst_map.find(coreinst)->second;
     IFace &iface = jitinst->getIFace();
     SetupIFaceConnections(coreinst, iface, defn, inst_map);
+    SetupClockConnections(coreinst, iface, defn);
   }
 
   SetupIFaceConnections(core_def->getInterface(), defn.getIFace(), defn, inst_map);
@@ -312,6 +352,7 @@ bool MaterializeArgs::runOnContext(CoreIR::Context *ctx)
 {
   assert(ctx->hasTop());
   CoreIR::Module *top = ctx->getTop();
+  visited.insert(top);
 
   bool changed = false;
   for (auto instpair : top->getDef()->getInstances()) {
@@ -330,43 +371,71 @@ bool MaterializeArgs::materializeArgs(CoreIR::Instance *inst)
   bool changed = false;
 
   CoreIR::Values instModArgs = inst->getModArgs();
-  if (instModArgs.size() == 0) { // Just recurse
+  if (instModArgs.size() == 0) {
+    /* Shared definitions only need their instances materialized once */
+    if (memoize && !visited.insert(module).second) {
+      return false;
+    }
     for (auto instpair : module->getDef()->getInstances()) {
       changed |= materializeArgs(instpair.second);
     }
     return changed;
   }
 
-  CoreIR::ModuleDef *new_inst_def = module->getDef()->copy();
-  string newname = module->getLongName();
+  SpecKey key(module, {});
   for (auto &vpair : instModArgs) {
     assert(vpair.second->getKind() != CoreIR::Value::VK_Arg);
-    string strarg = vpair.second->toString();
+    key.second.emplace_back(vpair.first, vpair.second->toString());
+  }
+
+  auto iter = specializations.find(key);
+  if (iter != specializations.end()) {
+    if (!memoize) {
+      /* The unmemoized pass copied and walked the definition before
+       * finding the specialization by name, and never freed the copy */
+      materializeCopy(module->getDef()->copy(), instModArgs);
+    }
+    inst->replace(iter->second, CoreIR::Values());
+    return true;
+  }
+
+  string newname = module->getLongName();
+  for (const auto &arg : key.second) {
+    string strarg = arg.second;
     strarg.erase(std::remove(strarg.begin(), strarg.end(), '\''), strarg.end());
     strarg.erase(std::remove(strarg.begin(), strarg.end(), '/'), strarg.end());
-    newname += "_" + vpair.first + "_" + strarg;
+    newname += "_" + arg.first + "_" + strarg;
   }
-
-  CoreIR::Module *uniquified_mod = nullptr;
-  auto iter = uniquified_modules.find(newname);
-  if (iter != uniquified_modules.end()) {
-    uniquified_mod = iter->second;
-  } else {
-    uniquified_mod = new CoreIR::Module(module->getNamespace(), newname,
-                                        module->getType(), CoreIR::Params());
-    uniquified_mod->setDef(new_inst_def);
-    uniquified_modules[newname] = uniquified_mod;
+  /* Stripping quotes and slashes can make distinct arguments collide */
+  string basename = newname;
+  for (unsigned suffix = 1; !specialized_names.insert(newname).second; suffix++) {
+    newname = basename + "_" + to_string(suffix);
   }
-    
+
+  CoreIR::ModuleDef *new_inst_def = module->getDef()->copy();
+  CoreIR::Module *uniquified_mod = new CoreIR::Module(module->getNamespace(), newname,
+                                                      module->getType(), CoreIR::Params());
+  uniquified_mod->setDef(new_inst_def);
+  specializations[key] = uniquified_mod;
+  visited.insert(uniquified_mod);
+
   inst->replace(uniquified_mod, CoreIR::Values());
-  
-  for (auto instpair : new_inst_def->getInstances()) {
+  materializeCopy(new_inst_def, instModArgs);
+
+  return true;
+}
+
+/* Substitutes the arguments of a freshly copied definition into its
+ * instances and materializes them in turn */
+bool MaterializeArgs::materializeCopy(CoreIR::ModuleDef *defn, CoreIR::Values &instModArgs)
+{
+  bool changed = false;
+  for (auto instpair : defn->getInstances()) {
     CoreIR::Values modargs = instpair.second->getModArgs();
     for (auto vpair : modargs) {
       if (CoreIR::Arg *varg = CoreIR::dyn_cast<CoreIR::Arg>(vpair.second)) {
         ASSERT(instModArgs.count(varg->getField()),"Invalid Arg()");
         modargs[vpair.first] = instModArgs[varg->getField()];
-        changed = true;
       }
     }
     instpair.second->replace(instpair.second->getModuleRef(), modargs);
@@ -1,9 +1,9 @@
+#include <algorithm>
 #include <cmath>
+#include <unordered_set>
 #include "coreir_primitives.hpp"
 #include "utils.hpp"
-
-#include <coreir/ir/namespace.h>
-#include <coreir/ir/value.h>
+#include "llvm_utils.hpp"
 
 #include <jitsim/circuit.hpp>
 
@@ -11,7 +11,20 @@ namespace JITSim {
 
 using namespace std;
 
-Primitive BuildAdd(CoreIR::Module *mod)
+static int getGenArg(const GenArgs &genargs, const string &name, int default_val = 0)
+{
+  auto iter = genargs.find(name);
+  return iter == genargs.end() ? default_val : iter->second;
+}
+
+/* Marks primitives whose generators also lower bit sliced values */
+static Primitive BitSliceable(Primitive prim)
+{
+  prim.supports_bit_slicing = true;
+  return prim;
+}
+
+Primitive BuildAdd(const GenArgs &genargs)
 {
   return Primitive(
     [](auto &env, auto &args, auto &inst)
@@ -25,7 +38,7 @@ Primitive BuildAdd(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildSub(CoreIR::Module *mod)
+Primitive BuildSub(const GenArgs &genargs)
 {
   return Primitive(
     [](auto &env, auto &args, auto &inst)
@@ -39,7 +52,7 @@ Primitive BuildSub(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildMul(CoreIR::Module *mod)
+Primitive BuildMul(const GenArgs &genargs)
 {
   return Primitive(
     [](auto &env, auto &args, auto &inst)
@@ -53,7 +66,7 @@ Primitive BuildMul(CoreIR::Module *mod)
   );
 }      
 
-Primitive BuildEq(CoreIR::Module *mod)
+Primitive BuildEq(const GenArgs &genargs)
 {
   return Primitive(
     [](auto &env, auto &args, auto &inst)
@@ -67,7 +80,7 @@ Primitive BuildEq(CoreIR::Module *mod)
   );
 }      
       
-Primitive BuildNeq(CoreIR::Module *mod)
+Primitive BuildNeq(const GenArgs &genargs)
 {
   return Primitive(
     [](auto &env, auto &args, auto &inst)
@@ -80,7 +93,7 @@ Primitive BuildNeq(CoreIR::Module *mod)
   );
 }      
 
-Primitive BuildUGT(CoreIR::Module *mod)
+Primitive BuildUGT(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -93,7 +106,7 @@ Primitive BuildUGT(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildUGE(CoreIR::Module *mod)
+Primitive BuildUGE(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -106,7 +119,7 @@ Primitive BuildUGE(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildULT(CoreIR::Module *mod)
+Primitive BuildULT(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -119,7 +132,7 @@ Primitive BuildULT(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildULE(CoreIR::Module *mod)
+Primitive BuildULE(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -132,7 +145,7 @@ Primitive BuildULE(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildSGT(CoreIR::Module *mod)
+Primitive BuildSGT(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -145,7 +158,7 @@ Primitive BuildSGT(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildSGE(CoreIR::Module *mod)
+Primitive BuildSGE(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -158,7 +171,7 @@ Primitive BuildSGE(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildSLT(CoreIR::Module *mod)
+Primitive BuildSLT(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -171,7 +184,7 @@ Primitive BuildSLT(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildSLE(CoreIR::Module *mod)
+Primitive BuildSLE(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -184,80 +197,261 @@ Primitive BuildSLE(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildReg(CoreIR::Module *mod)
+/* Per lane choice of a where cond is set and b elsewhere. Bit sliced
+ * modules hold a 1 bit cond as a single word, which is broadcast to every
+ * bit of the operands */
+static llvm::Value * makeLaneSelect(FunctionEnvironment &env, llvm::Value *cond,
+                                    llvm::Value *a, llvm::Value *b, const llvm::Twine &name = "")
+{
+  if (env.getModule().isBitSliced()) {
+    unsigned width = a->getType()->getVectorNumElements();
+    llvm::Value *cond_words =
+      env.getIRBuilder().CreateShuffleVector(cond, llvm::UndefValue::get(cond->getType()),
+                                             std::vector<uint32_t>(width, 0));
+    llvm::Value *take_a = env.getIRBuilder().CreateAnd(cond_words, a);
+    llvm::Value *take_b = env.getIRBuilder().CreateAnd(env.getIRBuilder().CreateNot(cond_words), b);
+
+    return env.getIRBuilder().CreateOr(take_a, take_b, name);
+  }
+
+  return env.getIRBuilder().CreateSelect(cond, a, b, name);
+}
+
+/* A register argument that CoreIR passes as a module argument rather than
+ * a generator argument, so it can differ between instances. Bool
+ * arguments arrive as a single binary digit */
+static bool getRegFlag(const Instance &inst, const string &name, bool default_val)
+{
+  Symbol key = LookupSymbol(name);
+  for (const auto &arg : inst.getArgs()) {
+    if (arg.first == key) {
+      return GetSymbolName(arg.second) != "0";
+    }
+  }
+
+  return default_val;
+}
+
+/* The initial and reset value of a register, from the binary digits of its
+ * init argument, which may follow a Verilog style N'b prefix */
+static llvm::APInt getRegInit(const Instance &inst, unsigned width)
+{
+  Symbol key = LookupSymbol("init");
+  for (const auto &arg : inst.getArgs()) {
+    if (arg.first != key) {
+      continue;
+    }
+
+    string digits = GetSymbolName(arg.second);
+    size_t prefix = digits.find("'b");
+    if (prefix != string::npos) {
+      digits = digits.substr(prefix + 2);
+    }
+
+    return llvm::APInt(width, digits, 2);
+  }
+
+  return llvm::APInt(width, 0);
+}
+
+/* The argument a primitive function receives for the source name, given
+ * the sources it takes in order. The state pointer always comes last */
+static llvm::Value * getPortArg(const vector<const Source *> &sources, const vector<llvm::Value *> &args,
+                                const string &name)
 {
-  int width = 0;
-  for (const auto & val : mod->getGenArgs()) {
-    if (val.first == "width") {
-      width = val.second->get<int>();
+  for (unsigned i = 0; i < sources.size(); i++) {
+    if (sources[i]->getName() == name) {
+      return args[i];
     }
   }
 
-  return Primitive(true, getNumBytes(width),
-    { "in" }, {},
-    [width](auto &env, auto &args, auto &inst)
+  assert(false && "Primitive has no such port");
+  return nullptr;
+}
+
+/* The asynchronous reset of a register, high while it is asserted */
+static llvm::Value * getResetActive(FunctionEnvironment &env, llvm::Value *arst, const Instance &inst)
+{
+  if (getRegFlag(inst, "arst_posedge", true)) {
+    return arst;
+  }
+
+  return env.getIRBuilder().CreateNot(arst, "arst_active");
+}
+
+/* Registers with an optional enable and asynchronous reset. While the
+ * reset is asserted the output is the init value and the state update
+ * stores it, winning over the enable. A scalar enable branches around the
+ * store, so an idle register costs a compare; lanes enable independently,
+ * so batched and bit sliced modules select between the old and the new
+ * value instead */
+static Primitive makeRegister(int width, bool has_en, bool en_low, bool has_arst)
+{
+  unordered_set<string> state_deps = { "in" };
+  unordered_set<string> output_deps;
+  if (has_en) {
+    state_deps.insert("en");
+  }
+  if (has_arst) {
+    state_deps.insert("arst");
+    output_deps.insert("arst");
+  }
+
+  return BitSliceable(Primitive(true, getNumBytes(width),
+    state_deps, output_deps,
+    [width, has_arst](auto &env, auto &args, auto &inst)
     {
-      llvm::Value *addr = env.getIRBuilder().CreateBitCast(args[0], llvm::Type::getIntNPtrTy(env.getContext(), width));
-      llvm::Value *output = env.getIRBuilder().CreateLoad(addr, "output");
+      llvm::Value *output = LoadLaneElements(env, args.back(), width, "output");
+
+      if (has_arst) {
+        const vector<const Source *> &sources = inst.getDefinition().getSimInfo().getOutputSources();
+        llvm::Value *arst = getResetActive(env, getPortArg(sources, args, "arst"), inst);
+        llvm::Value *init = env.getModule().getConstant(getRegInit(inst, width));
+        output = makeLaneSelect(env, arst, init, output, "output");
+      }
 
       return std::vector<llvm::Value *> { output };
     },
-    [width](auto &env, auto &args, auto &inst)
+    [width, has_en, en_low, has_arst](auto &env, auto &args, auto &inst)
     {
-      llvm::Value *input = args[0];
-      llvm::Value *addr = env.getIRBuilder().CreateBitCast(args[1], llvm::Type::getIntNPtrTy(env.getContext(), width));
-      env.getIRBuilder().CreateStore(input, addr);
+      const vector<const Source *> &sources = inst.getDefinition().getSimInfo().getStateSources();
+      llvm::Value *arst = has_arst ? getPortArg(sources, args, "arst") : nullptr;
+      llvm::Value *en = has_en ? getPortArg(sources, args, "en") : nullptr;
+      llvm::Value *input = getPortArg(sources, args, "in");
+      llvm::Value *state_addr = args.back();
+
+      if (en && en_low) {
+        en = env.getIRBuilder().CreateNot(en, "en_active");
+      }
+
+      if (arst) {
+        arst = getResetActive(env, arst, inst);
+        llvm::Value *init = env.getModule().getConstant(getRegInit(inst, width));
+        input = makeLaneSelect(env, arst, init, input, "next");
+        if (en) {
+          en = env.getIRBuilder().CreateOr(en, arst, "load");
+        }
+      }
+
+      if (!en) {
+        StoreLaneElements(env, input, state_addr, width);
+        return;
+      }
+
+      if (env.getModule().getLanes() > 1 || env.getModule().isBitSliced()) {
+        llvm::Value *output = LoadLaneElements(env, state_addr, width, "output");
+        StoreLaneElements(env, makeLaneSelect(env, en, input, output, "next"), state_addr, width);
+        return;
+      }
+
+      llvm::BasicBlock *load_bb = env.addBasicBlock("load", false);
+      llvm::BasicBlock *hold_bb = env.addBasicBlock("hold", false);
+      env.getIRBuilder().CreateCondBr(en, load_bb, hold_bb);
+
+      env.setCurBasicBlock(load_bb);
+      StoreLaneElements(env, input, state_addr, width);
+      env.getIRBuilder().CreateBr(hold_bb);
+
+      env.setCurBasicBlock(hold_bb);
+    },
+    [width](uint8_t *state_ptr, const Instance &inst) {
+      llvm::APInt init = getRegInit(inst, width);
+      memcpy(state_ptr, init.getRawData(), getNumBytes(width));
     }
-  );
+  ));
 }
 
-Primitive BuildMux(CoreIR::Module *mod)
+Primitive BuildReg(const GenArgs &genargs)
 {
-  return Primitive(
+  return makeRegister(getGenArg(genargs, "width", 1), false, false, false);
+}
+
+Primitive BuildRegArst(const GenArgs &genargs)
+{
+  return makeRegister(getGenArg(genargs, "width", 1), false, false, true);
+}
+
+/* Not a CoreIR generator: Circuit::foldRegisterEnables rewrites registers
+ * that recirculate their output through a mux to this, and mantle.reg
+ * with has_en loads as it */
+Primitive BuildRegEn(const GenArgs &genargs)
+{
+  return makeRegister(getGenArg(genargs, "width", 1), true, getGenArg(genargs, "en_low"), false);
+}
+
+Primitive BuildMux(const GenArgs &genargs)
+{
+  return BitSliceable(Primitive(
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
       llvm::Value *sel = args[2];
 
-      llvm::Value *if_cond =
-        env.getIRBuilder().CreateICmpEQ(sel,
-                                        llvm::ConstantInt::get(env.getContext(), llvm::APInt(1, 0)),
-                                        "ifcond");
-
-      llvm::Value *result =
-        env.getIRBuilder().CreateSelect(if_cond, lhs, rhs, "result");
+      llvm::Value *result = makeLaneSelect(env, sel, rhs, lhs, "result");
 
       return std::vector<llvm::Value *> { result };
     }
-  );
+  ));
 }      
-      
-Primitive BuildMem(CoreIR::Module *mod)
+
+/* Pointers to the word at addr in every lane of a batched memory, which
+ * stores word i of lane l at element i * lanes + l */
+static llvm::Value * makeLaneWordPtrs(FunctionEnvironment &env, llvm::Value *state_addr,
+                                      llvm::Value *full_addr, unsigned word_bytes)
 {
-  int width = 0; 
-  unsigned depth = 0;
+  unsigned lanes = env.getModule().getLanes();
 
-  for (const auto & val : mod->getGenArgs()) {
-    if (val.first == "width") {
-      width = val.second->get<int>();
-    } else if (val.first == "depth") {
-      depth = val.second->get<int>();
-    }
+  std::vector<uint64_t> lane_ids;
+  for (unsigned i = 0; i < lanes; i++) {
+    lane_ids.push_back(i);
   }
 
-  return Primitive(true, getNumBytes(width*depth),
+  llvm::Value *elem = env.getIRBuilder().CreateMul(full_addr, env.getModule().getConstant(llvm::APInt(64, lanes)));
+  elem = env.getIRBuilder().CreateAdd(elem, llvm::ConstantDataVector::get(env.getContext(), lane_ids));
+  llvm::Value *byte_offset = env.getIRBuilder().CreateMul(elem, env.getModule().getConstant(llvm::APInt(64, word_bytes)));
+
+  llvm::Value *ptrs = env.getIRBuilder().CreateInBoundsGEP(state_addr, byte_offset);
+  llvm::Type *word_ptr = llvm::Type::getIntNPtrTy(env.getContext(), word_bytes * 8);
+
+  return env.getIRBuilder().CreateBitCast(ptrs, llvm::VectorType::get(word_ptr, lanes), "addrs");
+}
+
+Primitive BuildMem(const GenArgs &genargs)
+{
+  int width = getGenArg(genargs, "width");
+  unsigned depth = getGenArg(genargs, "depth");
+
+  /* Every word starts on a byte boundary so it can be addressed directly */
+  unsigned word_bytes = getNumBytes(width);
+
+  Primitive prim(true, word_bytes*depth,
     { "waddr", "wdata", "wen" }, { "raddr" },
-    [width, depth](auto &env, auto &args, auto &inst)
+    [width, depth, word_bytes](auto &env, auto &args, auto &inst)
     {
       llvm::Value *raddr = args[0];
       llvm::Value *state_addr = args[1];
 
+      /* Need to 0 extend this to the address width or llvm interprets it as negative */
+      llvm::Value *full_addr = env.getIRBuilder().CreateZExt(raddr, env.getModule().getValueType(64));
+
       // Check if raddr < depth
       llvm::Value *valid_cond =
-        env.getIRBuilder().CreateICmpULT(raddr, 
-                                         llvm::ConstantInt::get(env.getContext(), llvm::APInt(ceil(log2(depth)), 1)),
+        env.getIRBuilder().CreateICmpULT(full_addr,
+                                         env.getModule().getConstant(llvm::APInt(64, depth)),
                                          "valid_cond");
+
+      if (env.getModule().getLanes() > 1) {
+        /* Lanes read different addresses, so gather and zero the out of range ones */
+        llvm::Value *addrs = makeLaneWordPtrs(env, state_addr, full_addr, word_bytes);
+        llvm::Value *rdata =
+          env.getIRBuilder().CreateMaskedGather(addrs, 1, valid_cond,
+                                                env.getModule().getConstant(llvm::APInt(word_bytes * 8, 0)));
+        rdata = env.getIRBuilder().CreateTrunc(rdata, env.getModule().getValueType(width), "rdata");
+
+        return std::vector<llvm::Value *> { rdata };
+      }
+
       llvm::BasicBlock *then_bb = env.addBasicBlock("then", false);
       llvm::BasicBlock *else_bb = env.addBasicBlock("else", false);
       llvm::BasicBlock *merge_bb = env.addBasicBlock("merge", false);
@@ -265,15 +459,10 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       // Emit then block.
       env.setCurBasicBlock(then_bb);
-      llvm::Value *cast_addr = 
-        env.getIRBuilder().CreateBitCast(state_addr,
-                                         llvm::Type::getIntNPtrTy(env.getContext(), width));
-
-      /* Need to 0 extend this to the address width or llvm interprets it as negative */
-      llvm::Value *full_addr = env.getIRBuilder().CreateZExt(raddr, llvm::Type::getInt64Ty(env.getContext()));
-
-      llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(cast_addr, full_addr, "addr");
-      llvm::Value *rdata = env.getIRBuilder().CreateLoad(addr, "rdata");
+      llvm::Value *byte_offset =
+        env.getIRBuilder().CreateMul(full_addr, llvm::ConstantInt::get(full_addr->getType(), word_bytes));
+      llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(state_addr, byte_offset, "addr");
+      llvm::Value *rdata = LoadLaneElements(env, addr, width, "rdata");
       
       env.getIRBuilder().CreateBr(merge_bb);
 
@@ -293,18 +482,30 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       return std::vector<llvm::Value *> { phi_node };
     },
-    [width, depth](auto &env, auto &args, auto &inst)
+    [width, depth, word_bytes](auto &env, auto &args, auto &inst)
     {
       llvm::Value *waddr = args[0];
       llvm::Value *wdata = args[1];
       llvm::Value *wen = args[2];
       llvm::Value *state_addr = args[3];
 
+      llvm::Value *full_addr = env.getIRBuilder().CreateZExt(waddr, env.getModule().getValueType(64));
+
       // Check if waddr < depth
       llvm::Value *valid_cond =
-        env.getIRBuilder().CreateICmpULT(waddr, 
-                                         llvm::ConstantInt::get(env.getContext(), llvm::APInt(ceil(log2(depth)), 1)),
+        env.getIRBuilder().CreateICmpULT(full_addr,
+                                         env.getModule().getConstant(llvm::APInt(64, depth)),
                                          "valid_cond");
+
+      if (env.getModule().getLanes() > 1) {
+        llvm::Value *addrs = makeLaneWordPtrs(env, state_addr, full_addr, word_bytes);
+        llvm::Value *mask = env.getIRBuilder().CreateAnd(valid_cond, wen, "write_mask");
+        llvm::Value *words = env.getIRBuilder().CreateZExt(wdata, env.getModule().getValueType(word_bytes * 8));
+        env.getIRBuilder().CreateMaskedScatter(words, addrs, 1, mask);
+
+        return;
+      }
+
       llvm::BasicBlock *valid_then_bb = env.addBasicBlock("valid_then", false);
       llvm::BasicBlock *valid_else_bb = env.addBasicBlock("valid_else", false);
       env.getIRBuilder().CreateCondBr(valid_cond, valid_then_bb, valid_else_bb);
@@ -312,13 +513,9 @@ Primitive BuildMem(CoreIR::Module *mod)
       // Emit valid_then block.
       env.setCurBasicBlock(valid_then_bb);
 
-      llvm::Value *cast_addr = 
-        env.getIRBuilder().CreateBitCast(state_addr,
-                                         llvm::Type::getIntNPtrTy(env.getContext(), width));
-
-      llvm::Value *full_addr = env.getIRBuilder().CreateZExt(waddr, llvm::Type::getInt64Ty(env.getContext()));
-
-      llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(cast_addr, full_addr, "addr");
+      llvm::Value *byte_offset =
+        env.getIRBuilder().CreateMul(full_addr, llvm::ConstantInt::get(full_addr->getType(), word_bytes));
+      llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(state_addr, byte_offset, "addr");
 
       llvm::Value *wen_cond =
         env.getIRBuilder().CreateICmpEQ(wen,
@@ -331,7 +528,7 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       // Emit wen_then block.
       env.setCurBasicBlock(wen_then_bb);
-      env.getIRBuilder().CreateStore(wdata, addr);
+      StoreLaneElements(env, wdata, addr, width);
       env.getIRBuilder().CreateBr(wen_else_bb);
 
       env.setCurBasicBlock(wen_else_bb); // wen_else
@@ -339,20 +536,22 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       env.setCurBasicBlock(valid_else_bb); // valid_else
     },
-    [width, depth](uint8_t *state_ptr, const Instance &inst) {
+    [width, depth, word_bytes](uint8_t *state_ptr, const Instance &inst) {
       std::string str = inst.getArg("init");
       llvm::APInt init(width*depth, str, 2);
-      int num_bytes = width*depth / 8;
-      if (width*depth % 8 != 0) {
-        num_bytes++;
-      }
 
-      memcpy(state_ptr, init.getRawData(), num_bytes);
+      for (unsigned i = 0; i < depth; i++) {
+        llvm::APInt word = init.extractBits(width, i*width);
+        memcpy(state_ptr + i*word_bytes, word.getRawData(), word_bytes);
+      }
     }
   );
+  prim.state_elem_bytes = word_bytes;
+
+  return prim;
 }      
 
-Primitive BuildLShr(CoreIR::Module *mod)
+Primitive BuildLShr(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -365,7 +564,7 @@ Primitive BuildLShr(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildAShr(CoreIR::Module *mod)
+Primitive BuildAShr(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -378,7 +577,7 @@ Primitive BuildAShr(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildShl(CoreIR::Module *mod)
+Primitive BuildShl(const GenArgs &genargs)
 {
   return Primitive( 
     [](auto &env, auto &args, auto &inst)
@@ -391,9 +590,9 @@ Primitive BuildShl(CoreIR::Module *mod)
   );
 }
 
-Primitive BuildAnd(CoreIR::Module *mod)
+Primitive BuildAnd(const GenArgs &genargs)
 {
-  return Primitive( 
+  return BitSliceable(Primitive( 
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *lhs = args[0];
@@ -401,12 +600,12 @@ Primitive BuildAnd(CoreIR::Module *mod)
       llvm::Value *result = env.getIRBuilder().CreateAnd(lhs, rhs, "and_res");
       return std::vector<llvm::Value *> { result };
     }
-  );
+  ));
 }
 
-Primitive BuildOr(CoreIR::Module *mod)
+Primitive BuildOr(const GenArgs &genargs)
 {
-  return Primitive( 
+  return BitSliceable(Primitive( 
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *lhs = args[0];
@@ -414,12 +613,12 @@ Primitive BuildOr(CoreIR::Module *mod)
       llvm::Value *result = env.getIRBuilder().CreateOr(lhs, rhs, "or_res");
       return std::vector<llvm::Value *> { result };
     }
-  );
+  ));
 }
 
-Primitive BuildXor(CoreIR::Module *mod)
+Primitive BuildXor(const GenArgs &genargs)
 {
-  return Primitive( 
+  return BitSliceable(Primitive( 
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *lhs = args[0];
@@ -427,51 +626,76 @@ Primitive BuildXor(CoreIR::Module *mod)
       llvm::Value *result = env.getIRBuilder().CreateXor(lhs, rhs, "xor_res");
       return std::vector<llvm::Value *> { result };
     }
-  );
+  ));
 }
 
-Primitive BuildNot(CoreIR::Module *mod)
+Primitive BuildNot(const GenArgs &genargs)
 {
-  return Primitive( 
+  return BitSliceable(Primitive( 
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *value = args[0];
       llvm::Value *result = env.getIRBuilder().CreateNot(value, "not_res");
       return std::vector<llvm::Value *> { result };
     }
-  );
+  ));
 }
 
-Primitive BuildOrr(CoreIR::Module *mod)
+Primitive BuildOrr(const GenArgs &genargs)
 {
-  return Primitive( 
+  return BitSliceable(Primitive( 
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *value = args[0];
+      if (env.getModule().isBitSliced()) {
+        llvm::Value *any = env.getIRBuilder().CreateExtractElement(value, (uint64_t)0);
+        for (unsigned i = 1; i < value->getType()->getVectorNumElements(); i++) {
+          any = env.getIRBuilder().CreateOr(any, env.getIRBuilder().CreateExtractElement(value, (uint64_t)i));
+        }
+        llvm::Value *comp = env.getIRBuilder().CreateInsertElement(
+          llvm::UndefValue::get(env.getModule().getValueType(1)), any, (uint64_t)0, "orr_comp");
+
+        return std::vector<llvm::Value *> { comp };
+      }
+
       llvm::Value *comp = env.getIRBuilder().CreateICmpNE(value,
                                                           llvm::ConstantInt::get(value->getType(), 0),
                                                           "orr_comp");
       return std::vector<llvm::Value *> { comp };
     }
-  );
+  ));
 }
 
-Primitive BuildZExt(CoreIR::Module *mod)
+Primitive BuildZExt(const GenArgs &genargs)
 {
-  return Primitive(
+  return BitSliceable(Primitive(
     [](auto &env, auto &args, auto &inst)
     {
       std::string width_arg = inst.getArg("width_in");
       int width = std::stoi(width_arg);
 
       llvm::Value *value = args[0];
+      if (env.getModule().isBitSliced()) {
+        /* Indices past the input select words of the all zero vector */
+        unsigned in_width = value->getType()->getVectorNumElements();
+        std::vector<uint32_t> words;
+        for (int i = 0; i < width; i++) {
+          words.push_back(std::min<unsigned>(i, in_width));
+        }
+        llvm::Value *extended =
+          env.getIRBuilder().CreateShuffleVector(value, llvm::Constant::getNullValue(value->getType()),
+                                                 words, "zext");
+
+        return std::vector<llvm::Value *> { extended };
+      }
+
       llvm::Value *extended = env.getIRBuilder().CreateZExt(value,
-        llvm::Type::getIntNTy(env.getContext(), width),
+        env.getModule().getValueType(width),
         "zext");
 
       return std::vector<llvm::Value *> { extended };
     }
-  );
+  ));
 }
 
 std::vector<llvm::Constant *> GetLUTInit(FunctionEnvironment &env, int bits, const Instance &inst)
@@ -489,21 +713,51 @@ std::vector<llvm::Constant *> GetLUTInit(FunctionEnvironment &env, int bits, con
   return r;
 }
 
-Primitive BuildLUT(CoreIR::Module *mod)
+/* Shannon expansion of the truth table, one input bit at a time starting
+ * from the lowest. Constant entries fold away as the tree is built */
+static llvm::Value * makeBitSlicedLUT(FunctionEnvironment &env, llvm::Value *lookup, int num_elems,
+                                      const Instance &inst)
 {
-  int N = 0;
-  for (const auto & val : mod->getGenArgs()) {
-    if (val.first == "N") {
-      N = val.second->get<int>();
+  std::string str = inst.getArg("init");
+  llvm::Type *word_type = llvm::Type::getIntNTy(env.getContext(), env.getModule().getLanes());
+
+  std::vector<llvm::Value *> entries;
+  for (int i = 0; i < num_elems; i++) {
+    bool set = i < (int)str.size() && str[i] == '1';
+    entries.push_back(set ? llvm::Constant::getAllOnesValue(word_type) : llvm::Constant::getNullValue(word_type));
+  }
+
+  for (uint64_t var = 0; entries.size() > 1; var++) {
+    llvm::Value *sel = env.getIRBuilder().CreateExtractElement(lookup, var);
+    llvm::Value *not_sel = env.getIRBuilder().CreateNot(sel);
+
+    std::vector<llvm::Value *> reduced;
+    for (unsigned i = 0; i < entries.size(); i += 2) {
+      llvm::Value *hi = env.getIRBuilder().CreateAnd(sel, entries[i + 1]);
+      llvm::Value *lo = env.getIRBuilder().CreateAnd(not_sel, entries[i]);
+      reduced.push_back(env.getIRBuilder().CreateOr(hi, lo));
     }
+    entries = move(reduced);
   }
 
+  return env.getIRBuilder().CreateInsertElement(llvm::UndefValue::get(env.getModule().getValueType(1)),
+                                                entries[0], (uint64_t)0, "load");
+}
+
+Primitive BuildLUT(const GenArgs &genargs)
+{
+  int N = getGenArg(genargs, "N");
+
   int num_elems = 1 << N;
 
-  return Primitive(
+  return BitSliceable(Primitive(
     [num_elems](auto &env, auto &args, auto &inst)
     {
       llvm::Value *lookup = args[0];
+      if (env.getModule().isBitSliced()) {
+        return std::vector<llvm::Value *> { makeBitSlicedLUT(env, lookup, num_elems, inst) };
+      }
+
       std::vector<llvm::Constant *> init = GetLUTInit(env, num_elems, inst);
       llvm::Type *boolty = llvm::Type::getInt1Ty(env.getContext());
       llvm::ArrayType *luttype = llvm::ArrayType::get(boolty, num_elems);
@@ -511,18 +765,27 @@ Primitive BuildLUT(CoreIR::Module *mod)
       llvm::GlobalVariable *lutvar = new llvm::GlobalVariable(*env.getModule().getModule(), luttype, true,
                                                               llvm::GlobalValue::PrivateLinkage,
                                                               lut);
+      /* GEP indices are signed, so widen the lookup before indexing */
+      llvm::Value *index = env.getIRBuilder().CreateZExt(lookup, env.getModule().getValueType(64), "index");
       llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(lutvar,
-                            {llvm::ConstantInt::getFalse(env.getContext()), lookup}, "addr");
-      llvm::Value *load = env.getIRBuilder().CreateLoad(addr, "load");
+                            {llvm::ConstantInt::get(llvm::Type::getInt64Ty(env.getContext()), 0), index}, "addr");
+
+      llvm::Value *load;
+      if (env.getModule().getLanes() > 1) {
+        load = env.getIRBuilder().CreateMaskedGather(addr, 1, env.getModule().getConstant(llvm::APInt(1, 1)),
+                                                     nullptr, "load");
+      } else {
+        load = env.getIRBuilder().CreateLoad(addr, "load");
+      }
 
       return std::vector<llvm::Value *> { load };
     }
-  );
+  ));
 }
 
-static unordered_map<string,function<Primitive (CoreIR::Module *mod)>> InitializeMapping()
+static unordered_map<string,function<Primitive (const GenArgs &genargs)>> InitializeMapping()
 {
-  unordered_map<string,function<Primitive (CoreIR::Module *mod)>> m;
+  unordered_map<string,function<Primitive (const GenArgs &genargs)>> m;
   m["coreir.add"] = BuildAdd;
   m["coreir.sub"] = BuildSub;
   m["coreir.mul"] = BuildMul;
@@ -541,6 +804,10 @@ static unordered_map<string,function<Primitive (CoreIR::Module *mod)>> Initializ
   m["coreir.zext"] = BuildZExt;
 
   m["coreir.reg"] = BuildReg;
+  m["corebit.reg"] = BuildReg;
+  m["coreir.reg_arst"] = BuildRegArst;
+  m["corebit.reg_arst"] = BuildRegArst;
+  m["jitsim.reg_en"] = BuildRegEn;
   m["coreir.mux"] = BuildMux;
   m["corebit.mux"] = BuildMux;
   m["coreir.mem"] = BuildMem;
@@ -563,21 +830,108 @@ static unordered_map<string,function<Primitive (CoreIR::Module *mod)>> Initializ
   return m;
 }
 
-Primitive BuildCoreIRPrimitive(CoreIR::Module *mod)
+static const unordered_map<string,function<Primitive (const GenArgs &genargs)>> & GetMapping()
 {
-  static const unordered_map<string,function<Primitive (CoreIR::Module *mod)>> prim_map =
+  static const unordered_map<string,function<Primitive (const GenArgs &genargs)>> prim_map =
     InitializeMapping();
-  string fullname = mod->getNamespace()->getName() + "." + mod->getName();
 
-  if (prim_map.count(fullname) == 0) {
-    cerr << "Unsupported primitive " << fullname << endl;
+  return prim_map;
+}
+
+bool IsCoreIRPrimitive(const string &name)
+{
+  return GetMapping().count(name) > 0;
+}
+
+Primitive BuildCoreIRPrimitive(const string &name, const GenArgs &genargs)
+{
+  const auto &prim_map = GetMapping();
+
+  if (prim_map.count(name) == 0) {
+    cerr << "Unsupported primitive " << name << endl;
     assert(false);
   }
 
-  auto iter = prim_map.find(fullname);
+  auto iter = prim_map.find(name);
   assert(iter != prim_map.end());
 
-  return iter->second(mod);
+  Primitive prim = iter->second(genargs);
+  prim.generator = name;
+  prim.genargs.assign(genargs.begin(), genargs.end());
+  sort(prim.genargs.begin(), prim.genargs.end());
+
+  return prim;
+}
+
+namespace {
+
+struct PortSpec {
+  const char *name;
+  int width;
+  bool is_input;
+};
+
+}
+
+static IFace makeIFace(const vector<PortSpec> &ports, bool clocked)
+{
+  vector<Sink> sinks;
+  vector<Source> sources;
+  vector<ClkSource> clk_sources;
+
+  if (clocked) {
+    clk_sources.emplace_back("clk");
+  }
+
+  for (const PortSpec &port : ports) {
+    if (port.is_input) {
+      sources.emplace_back(port.name, port.width);
+    } else {
+      sinks.emplace_back(port.name, port.width);
+    }
+  }
+
+  return IFace("self", move(sinks), move(sources), vector<ClkSink>(), move(clk_sources), true);
+}
+
+IFace BuildCoreIRPrimitiveIFace(const string &name, const GenArgs &genargs)
+{
+  static const unordered_set<string> comparisons = {
+    "eq", "neq", "ugt", "uge", "ult", "ule", "sgt", "sge", "slt", "sle"
+  };
+
+  assert(IsCoreIRPrimitive(name));
+  string op = name.substr(name.find('.') + 1);
+  int width = getGenArg(genargs, "width", 1);
+
+  if (op == "reg") {
+    return makeIFace({ { "in", width, true }, { "out", width, false } }, true);
+  } else if (op == "reg_arst") {
+    return makeIFace({ { "arst", 1, true }, { "in", width, true }, { "out", width, false } }, true);
+  } else if (op == "reg_en") {
+    return makeIFace({ { "en", 1, true }, { "in", width, true }, { "out", width, false } }, true);
+  } else if (op == "mem") {
+    int depth = getGenArg(genargs, "depth");
+    int addr_width = max(1, (int)ceil(log2(depth)));
+    return makeIFace({ { "waddr", addr_width, true }, { "wdata", width, true }, { "wen", 1, true },
+                       { "raddr", addr_width, true }, { "rdata", width, false } }, true);
+  } else if (op == "lutN") {
+    return makeIFace({ { "in", getGenArg(genargs, "N"), true }, { "out", 1, false } }, false);
+  } else if (op == "zext") {
+    return makeIFace({ { "in", getGenArg(genargs, "width_in"), true },
+                       { "out", getGenArg(genargs, "width_out"), false } }, false);
+  } else if (op == "mux") {
+    return makeIFace({ { "in0", width, true }, { "in1", width, true }, { "sel", 1, true },
+                       { "out", width, false } }, false);
+  } else if (op == "not") {
+    return makeIFace({ { "in", width, true }, { "out", width, false } }, false);
+  } else if (op == "orr") {
+    return makeIFace({ { "in", width, true }, { "out", 1, false } }, false);
+  } else if (comparisons.count(op)) {
+    return makeIFace({ { "in0", width, true }, { "in1", width, true }, { "out", 1, false } }, false);
+  }
+
+  return makeIFace({ { "in0", width, true }, { "in1", width, true }, { "out", width, false } }, false);
 }
 
 }
@@ -1,11 +1,22 @@
 #ifndef JITSIM_COREIR_PRIMITIVES_HPP_INCLUDED
 #define JITSIM_COREIR_PRIMITIVES_HPP_INCLUDED
 
-#include <coreir/ir/module.h>
+#include <jitsim/circuit.hpp>
 #include <jitsim/primitive.hpp>
 
+#include <string>
+#include <unordered_map>
+
 namespace JITSim {
-  Primitive BuildCoreIRPrimitive(CoreIR::Module *mod);
+  /* Int and Bool generator arguments of a primitive, by name */
+  using GenArgs = std::unordered_map<std::string, int>;
+
+  bool IsCoreIRPrimitive(const std::string &name);
+  Primitive BuildCoreIRPrimitive(const std::string &name, const GenArgs &genargs);
+
+  /* The ports of a primitive for loaders that bypass the CoreIR library,
+   * with inputs in the order the generators take their arguments */
+  IFace BuildCoreIRPrimitiveIFace(const std::string &name, const GenArgs &genargs);
 }
 
 #endif
@@ -0,0 +1,101 @@
+#include <jitsim/intern.hpp>
+
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace JITSim {
+
+using namespace std;
+
+/* Name lookups far outnumber new names once a circuit is built */
+static shared_timed_mutex intern_lock;
+
+/* Names live in fixed size chunks that never move, so GetSymbolName
+ * indexes them without taking the lock, and the ID map keys point into
+ * them. A thread only holds a Symbol after the interning thread stored
+ * its name */
+static const unsigned SymbolChunkBits = 16;
+static const unsigned SymbolChunkSize = 1u << SymbolChunkBits;
+static const unsigned MaxSymbolChunks = 1u << 12;
+
+static unique_ptr<string[]> symbol_chunks[MaxSymbolChunks];
+static llvm::DenseMap<llvm::StringRef, Symbol> symbol_ids;
+
+Symbol InternSymbol(const string &name)
+{
+  lock_guard<shared_timed_mutex> lock(intern_lock);
+  auto iter = symbol_ids.find(name);
+  if (iter != symbol_ids.end()) {
+    return iter->second;
+  }
+
+  Symbol sym = symbol_ids.size();
+  unsigned chunk = sym >> SymbolChunkBits;
+  assert(chunk < MaxSymbolChunks && "Symbol table full");
+  if (!symbol_chunks[chunk]) {
+    symbol_chunks[chunk].reset(new string[SymbolChunkSize]);
+  }
+  string &stored = symbol_chunks[chunk][sym & (SymbolChunkSize - 1)];
+  stored = name;
+  symbol_ids[stored] = sym;
+
+  return sym;
+}
+
+Symbol LookupSymbol(const string &name)
+{
+  shared_lock<shared_timed_mutex> lock(intern_lock);
+  auto iter = symbol_ids.find(name);
+  if (iter == symbol_ids.end()) {
+    return NoSymbol;
+  }
+
+  return iter->second;
+}
+
+const string & GetSymbolName(Symbol sym)
+{
+  /* LookupSymbol hands out NoSymbol for unknown names, which name nothing */
+  static const string no_name;
+  if (sym == NoSymbol) {
+    return no_name;
+  }
+
+  return symbol_chunks[sym >> SymbolChunkBits][sym & (SymbolChunkSize - 1)];
+}
+
+/* APInt's operator== asserts on mismatched widths */
+struct ConstantEq {
+  bool operator()(const llvm::APInt &a, const llvm::APInt &b) const
+  {
+    return a.getBitWidth() == b.getBitWidth() && a == b;
+  }
+};
+
+struct ConstantHash {
+  size_t operator()(const llvm::APInt &val) const
+  {
+    return llvm::hash_value(val);
+  }
+};
+
+const llvm::APInt & InternConstant(const llvm::APInt &val)
+{
+  /* Netlists repeat a few constants (zeros, ones, LUT inits) across every
+   * instance, so the pool only grows with the distinct values loaded.
+   * Set nodes never move, so the returned reference stays valid */
+  static mutex constants_lock;
+  static unordered_set<llvm::APInt, ConstantHash, ConstantEq> constants;
+
+  lock_guard<mutex> lock(constants_lock);
+  return *constants.insert(val).first;
+}
+
+}
@@ -0,0 +1,1189 @@
+#include <jitsim/json_loader.hpp>
+#include "coreir_primitives.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace JITSim {
+
+using namespace std;
+
+namespace {
+
+/* Pull parser over a buffered stream, so the file is never held in memory.
+ * Containers are walked with beginObject/nextKey and beginArray/nextElement,
+ * which return false when the container closes or on a syntax error, so
+ * callers check ok() after each loop */
+class JSONReader {
+private:
+  istream &in;
+  vector<char> buf;
+  size_t pos;
+  size_t end;
+  unsigned line;
+  vector<bool> first_in_container;
+  string error;
+
+  int peekRaw()
+  {
+    if (pos == end) {
+      in.read(buf.data(), buf.size());
+      end = in.gcount();
+      pos = 0;
+      if (end == 0) {
+        return -1;
+      }
+    }
+
+    return (unsigned char)buf[pos];
+  }
+
+  int getRaw()
+  {
+    int c = peekRaw();
+    if (c != -1) {
+      pos++;
+      if (c == '\n') {
+        line++;
+      }
+    }
+
+    return c;
+  }
+
+  void skipSpace()
+  {
+    int c = peekRaw();
+    while (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+      getRaw();
+      c = peekRaw();
+    }
+  }
+
+  /* Consumes the separating comma, or the closing character at the end */
+  bool nextItem(char close)
+  {
+    if (!ok()) {
+      return false;
+    }
+
+    skipSpace();
+    if (peekRaw() == close) {
+      getRaw();
+      first_in_container.pop_back();
+      return false;
+    }
+
+    if (!first_in_container.back() && !expect(',')) {
+      return false;
+    }
+    first_in_container.back() = false;
+
+    return true;
+  }
+
+public:
+  JSONReader(istream &in_)
+    : in(in_), buf(1 << 16), pos(0), end(0), line(1), first_in_container(), error()
+  {}
+
+  bool ok() const { return error.empty(); }
+  const string & getError() const { return error; }
+
+  /* Keeps the first error, later ones are usually fallout */
+  bool fail(const string &msg)
+  {
+    if (ok()) {
+      error = "line " + to_string(line) + ": " + msg;
+    }
+
+    return false;
+  }
+
+  int peek()
+  {
+    skipSpace();
+    return peekRaw();
+  }
+
+  bool expect(char c)
+  {
+    skipSpace();
+    if (getRaw() != c) {
+      return fail(string("expected '") + c + "'");
+    }
+
+    return true;
+  }
+
+  bool beginObject()
+  {
+    if (!expect('{')) {
+      return false;
+    }
+    first_in_container.push_back(true);
+
+    return true;
+  }
+
+  bool beginArray()
+  {
+    if (!expect('[')) {
+      return false;
+    }
+    first_in_container.push_back(true);
+
+    return true;
+  }
+
+  bool nextKey(string &key)
+  {
+    return nextItem('}') && readString(key) && expect(':');
+  }
+
+  bool nextElement()
+  {
+    return nextItem(']');
+  }
+
+  /* Consumes the end of an array that must have no more elements */
+  bool endArray()
+  {
+    if (nextElement()) {
+      return fail("unexpected array element");
+    }
+
+    return ok();
+  }
+
+  bool readString(string &out)
+  {
+    if (!expect('"')) {
+      return false;
+    }
+
+    out.clear();
+    while (true) {
+      int c = getRaw();
+      if (c == -1) {
+        return fail("unterminated string");
+      } else if (c == '"') {
+        return true;
+      } else if (c != '\\') {
+        out += (char)c;
+        continue;
+      }
+
+      c = getRaw();
+      switch (c) {
+        case 'n': out += '\n'; break;
+        case 't': out += '\t'; break;
+        case 'r': out += '\r'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'u': {
+          string hex;
+          for (int i = 0; i < 4; i++) {
+            hex += (char)getRaw();
+          }
+          unsigned code;
+          if (llvm::StringRef(hex).getAsInteger(16, code) || code > 0x7f) {
+            return fail("only ASCII \\u escapes are supported");
+          }
+          out += (char)code;
+          break;
+        }
+        case -1:
+          return fail("unterminated string");
+        default:
+          out += (char)c;
+      }
+    }
+  }
+
+  bool readInt(int64_t &out)
+  {
+    skipSpace();
+    string digits;
+    int c = peekRaw();
+    while (c == '-' || isdigit(c)) {
+      digits += (char)getRaw();
+      c = peekRaw();
+    }
+
+    if (llvm::StringRef(digits).getAsInteger(10, out)) {
+      return fail("expected an integer");
+    }
+
+    return true;
+  }
+
+  bool readBool(bool &out)
+  {
+    skipSpace();
+    string word;
+    while (isalpha(peekRaw())) {
+      word += (char)getRaw();
+    }
+
+    if (word == "true") {
+      out = true;
+    } else if (word == "false") {
+      out = false;
+    } else {
+      return fail("expected a boolean");
+    }
+
+    return true;
+  }
+
+  bool skipValue()
+  {
+    int c = peek();
+    if (c == '{') {
+      string key;
+      beginObject();
+      while (nextKey(key)) {
+        if (!skipValue()) {
+          return false;
+        }
+      }
+      return ok();
+    } else if (c == '[') {
+      beginArray();
+      while (nextElement()) {
+        if (!skipValue()) {
+          return false;
+        }
+      }
+      return ok();
+    } else if (c == '"') {
+      string str;
+      return readString(str);
+    } else if (c == -1) {
+      return fail("unexpected end of file");
+    }
+
+    /* Numbers, booleans and null */
+    while (c != -1 && c != ',' && c != '}' && c != ']' && !isspace(c)) {
+      getRaw();
+      c = peekRaw();
+    }
+
+    return true;
+  }
+};
+
+struct ArgValue {
+  enum Kind { Int, Bool, BitVector, Other };
+
+  Kind kind = Other;
+  int64_t int_val = 0;
+  llvm::APInt bits;
+};
+
+struct PortDesc {
+  Symbol name;
+  int width;
+  bool is_input;
+  bool is_clock;
+};
+
+/* inst.port or inst.port.bit, with bit -1 for the whole port */
+struct Endpoint {
+  Symbol owner;
+  Symbol port;
+  int bit;
+};
+
+struct InstanceDesc {
+  Symbol name;
+  Symbol ref;
+  bool generated = false;
+  unsigned num_modargs = 0;
+  GenArgs genargs;
+  /* BitVector module arguments as binary digits, most significant first */
+  vector<pair<Symbol, Symbol>> args;
+  /* The value of a constant */
+  bool has_value = false;
+  llvm::APInt value;
+};
+
+/* Everything needed to build a Definition once the modules it
+ * instantiates exist. Names are interned, so a module costs little more
+ * than its instance and connection records */
+struct ModuleDesc {
+  vector<PortDesc> ports;
+  bool has_def = false;
+  vector<InstanceDesc> instances;
+  vector<pair<Endpoint, Endpoint>> connections;
+
+  const Definition *defn = nullptr;
+  bool visiting = false;
+};
+
+}
+
+/* Parses CoreIR's N'hXX style literals, with h, d, o and b radixes */
+static bool parseBitVector(const string &literal, unsigned width, llvm::APInt &out)
+{
+  size_t quote = literal.find('\'');
+  if (quote == string::npos || quote + 1 >= literal.size()) {
+    return false;
+  }
+
+  unsigned radix;
+  switch (literal[quote + 1]) {
+    case 'h': radix = 16; break;
+    case 'd': radix = 10; break;
+    case 'o': radix = 8; break;
+    case 'b': radix = 2; break;
+    default: return false;
+  }
+
+  string digits;
+  for (size_t i = quote + 2; i < literal.size(); i++) {
+    if (literal[i] != '_') {
+      digits += literal[i];
+    }
+  }
+
+  llvm::APInt val;
+  if (llvm::StringRef(digits).getAsInteger(radix, val)) {
+    return false;
+  }
+  out = val.zextOrTrunc(width);
+
+  return true;
+}
+
+/* ["Int", 5], ["Bool", true] or [["BitVector", N], "N'hXX"]. Other kinds
+ * are skipped and left as ArgValue::Other */
+static bool readValue(JSONReader &reader, ArgValue &val)
+{
+  val.kind = ArgValue::Other;
+  if (reader.peek() != '[') {
+    return reader.skipValue();
+  }
+
+  if (!reader.beginArray() || !reader.nextElement()) {
+    return reader.fail("malformed value");
+  }
+
+  if (reader.peek() == '[') {
+    string kind;
+    int64_t width;
+    string literal;
+    if (!reader.beginArray() || !reader.nextElement() || !reader.readString(kind) ||
+        !reader.nextElement() || !reader.readInt(width) || !reader.endArray() ||
+        !reader.nextElement() || !reader.readString(literal) || !reader.endArray()) {
+      return reader.fail("malformed value");
+    }
+    if (kind != "BitVector" || width <= 0 || !parseBitVector(literal, width, val.bits)) {
+      return reader.fail("unsupported value " + literal);
+    }
+    val.kind = ArgValue::BitVector;
+
+    return true;
+  }
+
+  string kind;
+  if (!reader.readString(kind) || !reader.nextElement()) {
+    return reader.fail("malformed value");
+  }
+
+  if (kind == "Int") {
+    if (!reader.readInt(val.int_val)) {
+      return false;
+    }
+    val.kind = ArgValue::Int;
+  } else if (kind == "Bool") {
+    bool b;
+    if (!reader.readBool(b)) {
+      return false;
+    }
+    val.int_val = b;
+    val.kind = ArgValue::Bool;
+  } else if (!reader.skipValue()) {
+    return false;
+  }
+
+  return reader.endArray();
+}
+
+/* "BitIn", "Bit", ["Array", N, "BitIn"], ["Named", "coreir.clkIn"] or
+ * ["Named", "coreir.arstIn"] */
+static bool readPortType(JSONReader &reader, PortDesc &port)
+{
+  port.is_clock = false;
+
+  if (reader.peek() == '"') {
+    string kind;
+    if (!reader.readString(kind)) {
+      return false;
+    }
+    if (kind != "BitIn" && kind != "Bit") {
+      return reader.fail("unsupported port type " + kind);
+    }
+    port.width = 1;
+    port.is_input = kind == "BitIn";
+
+    return true;
+  }
+
+  string kind;
+  if (!reader.beginArray() || !reader.nextElement() || !reader.readString(kind) || !reader.nextElement()) {
+    return reader.fail("malformed type");
+  }
+
+  if (kind == "Array") {
+    int64_t len;
+    PortDesc elem;
+    if (!reader.readInt(len) || !reader.nextElement() || !readPortType(reader, elem) || !reader.endArray()) {
+      return reader.fail("malformed array type");
+    }
+    if (elem.width != 1 || elem.is_clock || len <= 0) {
+      return reader.fail("nested ports need the CoreIR loader to flatten them");
+    }
+    port.width = len;
+    port.is_input = elem.is_input;
+
+    return true;
+  } else if (kind == "Named") {
+    string named;
+    if (!reader.readString(named) || !reader.endArray()) {
+      return reader.fail("malformed named type");
+    }
+    if (named == "coreir.arstIn" || named == "coreir.arst") {
+      /* Resets are plain bits: the reset primitives read them in both
+       * compute_output and update_state to act asynchronously */
+      port.width = 1;
+      port.is_input = named == "coreir.arstIn";
+
+      return true;
+    }
+    if (named != "coreir.clkIn" && named != "coreir.clk") {
+      return reader.fail("unsupported named type " + named);
+    }
+    port.width = 1;
+    port.is_input = named == "coreir.clkIn";
+    port.is_clock = true;
+
+    return true;
+  }
+
+  return reader.fail("unsupported type " + kind);
+}
+
+/* ["Record", [[name, type], ...]] */
+static bool readModuleType(JSONReader &reader, vector<PortDesc> &ports)
+{
+  string kind;
+  if (!reader.beginArray() || !reader.nextElement() || !reader.readString(kind) ||
+      kind != "Record" || !reader.nextElement() || !reader.beginArray()) {
+    return reader.fail("module types must be records");
+  }
+
+  while (reader.nextElement()) {
+    string name;
+    PortDesc port;
+    if (!reader.beginArray() || !reader.nextElement() || !reader.readString(name) ||
+        !reader.nextElement() || !readPortType(reader, port) || !reader.endArray()) {
+      return reader.fail("malformed record field");
+    }
+    port.name = InternSymbol(name);
+    ports.push_back(port);
+  }
+
+  return reader.ok() && reader.endArray();
+}
+
+static bool readInstance(JSONReader &reader, InstanceDesc &inst)
+{
+  if (!reader.beginObject()) {
+    return false;
+  }
+
+  string key;
+  while (reader.nextKey(key)) {
+    if (key == "modref" || key == "genref") {
+      string ref;
+      if (!reader.readString(ref)) {
+        return false;
+      }
+      inst.ref = InternSymbol(ref);
+      inst.generated = key == "genref";
+    } else if (key == "genargs") {
+      string arg;
+      if (!reader.beginObject()) {
+        return false;
+      }
+      while (reader.nextKey(arg)) {
+        ArgValue val;
+        if (!readValue(reader, val)) {
+          return false;
+        }
+        if (val.kind != ArgValue::Int && val.kind != ArgValue::Bool) {
+          return reader.fail("unsupported generator argument " + arg);
+        }
+        inst.genargs[arg] = val.int_val;
+      }
+    } else if (key == "modargs") {
+      string arg;
+      if (!reader.beginObject()) {
+        return false;
+      }
+      while (reader.nextKey(arg)) {
+        ArgValue val;
+        if (!readValue(reader, val)) {
+          return false;
+        }
+        inst.num_modargs++;
+
+        if (val.kind == ArgValue::BitVector) {
+          string digits = val.bits.toString(2, false);
+          digits.insert(0, val.bits.getBitWidth() - digits.size(), '0');
+          inst.args.emplace_back(InternSymbol(arg), InternSymbol(digits));
+        } else if (val.kind == ArgValue::Bool) {
+          inst.args.emplace_back(InternSymbol(arg), InternSymbol(val.int_val ? "1" : "0"));
+        }
+
+        if (arg == "value" && val.kind == ArgValue::BitVector) {
+          inst.value = val.bits;
+          inst.has_value = true;
+        } else if (arg == "value" && val.kind == ArgValue::Bool) {
+          inst.value = llvm::APInt(1, val.int_val);
+          inst.has_value = true;
+        }
+      }
+    } else if (!reader.skipValue()) {
+      return false;
+    }
+  }
+
+  return reader.ok();
+}
+
+static bool parseEndpoint(const string &path, Endpoint &ep)
+{
+  size_t first_dot = path.find('.');
+  if (first_dot == string::npos) {
+    return false;
+  }
+  size_t second_dot = path.find('.', first_dot + 1);
+
+  ep.owner = InternSymbol(path.substr(0, first_dot));
+  ep.port = InternSymbol(path.substr(first_dot + 1, second_dot - first_dot - 1));
+  ep.bit = -1;
+  if (second_dot != string::npos) {
+    unsigned bit;
+    if (llvm::StringRef(path).substr(second_dot + 1).getAsInteger(10, bit)) {
+      return false;
+    }
+    ep.bit = bit;
+  }
+
+  return true;
+}
+
+static bool readConnections(JSONReader &reader, vector<pair<Endpoint, Endpoint>> &connections)
+{
+  if (!reader.beginArray()) {
+    return false;
+  }
+
+  while (reader.nextElement()) {
+    string first, second;
+    Endpoint first_ep, second_ep;
+    if (!reader.beginArray() || !reader.nextElement() || !reader.readString(first) ||
+        !reader.nextElement() || !reader.readString(second) || !reader.endArray()) {
+      return reader.fail("malformed connection");
+    }
+    if (!parseEndpoint(first, first_ep) || !parseEndpoint(second, second_ep)) {
+      return reader.fail("unsupported connection " + first + " <-> " + second);
+    }
+    connections.emplace_back(first_ep, second_ep);
+  }
+
+  return reader.ok();
+}
+
+static bool readModule(JSONReader &reader, ModuleDesc &mod)
+{
+  if (!reader.beginObject()) {
+    return false;
+  }
+
+  string key;
+  while (reader.nextKey(key)) {
+    if (key == "type") {
+      if (!readModuleType(reader, mod.ports)) {
+        return false;
+      }
+    } else if (key == "instances") {
+      string name;
+      mod.has_def = true;
+      if (!reader.beginObject()) {
+        return false;
+      }
+      while (reader.nextKey(name)) {
+        mod.instances.emplace_back();
+        mod.instances.back().name = InternSymbol(name);
+        if (!readInstance(reader, mod.instances.back())) {
+          return false;
+        }
+      }
+    } else if (key == "connections") {
+      mod.has_def = true;
+      if (!readConnections(reader, mod.connections)) {
+        return false;
+      }
+    } else if (!reader.skipValue()) {
+      return false;
+    }
+  }
+
+  return reader.ok();
+}
+
+static bool readNetlist(JSONReader &reader, unordered_map<string, ModuleDesc> &modules, string &top)
+{
+  if (!reader.beginObject()) {
+    return false;
+  }
+
+  string key;
+  while (reader.nextKey(key)) {
+    if (key == "top") {
+      if (!reader.readString(top)) {
+        return false;
+      }
+      continue;
+    } else if (key != "namespaces") {
+      if (!reader.skipValue()) {
+        return false;
+      }
+      continue;
+    }
+
+    string ns;
+    if (!reader.beginObject()) {
+      return false;
+    }
+    while (reader.nextKey(ns)) {
+      string ns_key;
+      if (!reader.beginObject()) {
+        return false;
+      }
+      while (reader.nextKey(ns_key)) {
+        if (ns_key != "modules") {
+          if (!reader.skipValue()) {
+            return false;
+          }
+          continue;
+        }
+
+        string name;
+        if (!reader.beginObject()) {
+          return false;
+        }
+        while (reader.nextKey(name)) {
+          if (!readModule(reader, modules[ns + "." + name])) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  return reader.ok();
+}
+
+static bool isConstantRef(const string &ref)
+{
+  return ref == "corebit.const" || ref == "coreir.const";
+}
+
+static bool isTermRef(const string &ref)
+{
+  return ref == "corebit.term" || ref == "coreir.term";
+}
+
+/* Index of port among clocks, or -1 */
+static int findClock(const vector<ClkSource> &clocks, Symbol port)
+{
+  for (size_t i = 0; i < clocks.size(); i++) {
+    if (clocks[i].getSymbol() == port) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int findClock(const vector<ClkSink> &clocks, Symbol port)
+{
+  for (size_t i = 0; i < clocks.size(); i++) {
+    if (clocks[i].getSymbol() == port) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static string endpointRepr(const Endpoint &ep)
+{
+  string repr = GetSymbolName(ep.owner) + "." + GetSymbolName(ep.port);
+  if (ep.bit >= 0) {
+    repr += "." + to_string(ep.bit);
+  }
+
+  return repr;
+}
+
+namespace {
+
+/* Drives one bit of a sink. Owners are instance indices, or the module's
+ * own inputs or a constant */
+struct BitDriver {
+  static const int SelfOwner = -1;
+  static const int ConstOwner = -2;
+  static const int NoOwner = -3;
+
+  int owner;
+  unsigned port;
+  int bit;
+};
+
+struct ResolvedEnd {
+  enum Role { Driver, Sink, ClockDriver, ClockSink, Ignored };
+
+  Role role;
+  int owner;
+  unsigned port;
+  int width;
+};
+
+class NetlistBuilder {
+private:
+  unordered_map<string, ModuleDesc> &modules;
+  unordered_map<string, const Definition *> primitives;
+  deque<Definition> definitions;
+
+  const Definition * resolveInstance(const InstanceDesc &inst);
+  bool connectModule(const string &name, const ModuleDesc &mod, const IFace &iface,
+                     const vector<const Definition *> &child_defns,
+                     const unordered_map<Symbol, pair<ResolvedEnd::Role, int>> &owners,
+                     const vector<llvm::APInt> &constants,
+                     vector<vector<size_t>> &sink_offsets, vector<BitDriver> &nets,
+                     vector<vector<int>> &clk_drivers);
+
+public:
+  NetlistBuilder(unordered_map<string, ModuleDesc> &modules_)
+    : modules(modules_), primitives(), definitions()
+  {}
+
+  const Definition * buildPrimitive(const string &name, const GenArgs &genargs);
+  const Definition * buildModule(const string &name);
+
+  deque<Definition> takeDefinitions() { return move(definitions); }
+};
+
+}
+
+const Definition * NetlistBuilder::buildPrimitive(const string &name, const GenArgs &genargs)
+{
+  /* Every distinct set of generator arguments is its own definition, named
+   * the way MaterializeArgs names uniquified modules */
+  vector<pair<string, int>> sorted_args(genargs.begin(), genargs.end());
+  sort(sorted_args.begin(), sorted_args.end());
+  string full_name = name;
+  for (const auto &arg : sorted_args) {
+    full_name += "_" + arg.first + "_" + to_string(arg.second);
+  }
+
+  auto iter = primitives.find(full_name);
+  if (iter != primitives.end()) {
+    return iter->second;
+  }
+
+  if (!IsCoreIRPrimitive(name)) {
+    cerr << "Unsupported primitive " << name << endl;
+    return nullptr;
+  }
+
+  definitions.emplace_back(full_name, BuildCoreIRPrimitiveIFace(name, genargs), BuildCoreIRPrimitive(name, genargs));
+  primitives[full_name] = &definitions.back();
+
+  return &definitions.back();
+}
+
+const Definition * NetlistBuilder::resolveInstance(const InstanceDesc &inst)
+{
+  const string &ref = GetSymbolName(inst.ref);
+
+  if (inst.generated && ref == "mantle.reg") {
+    /* Without resets mantle.reg generates a plain coreir.reg, and its
+     * enable is the mux foldRegisterEnables would fold anyway */
+    for (const char *flag : { "has_clr", "has_rst" }) {
+      auto iter = inst.genargs.find(flag);
+      if (iter != inst.genargs.end() && iter->second) {
+        cerr << "mantle.reg with " << flag << " needs the CoreIR loader" << endl;
+        return nullptr;
+      }
+    }
+    auto width = inst.genargs.find("width");
+    auto has_en = inst.genargs.find("has_en");
+    GenArgs reg_args = { { "width", width == inst.genargs.end() ? 1 : width->second } };
+    if (has_en != inst.genargs.end() && has_en->second) {
+      reg_args["en_low"] = 0;
+      return buildPrimitive("jitsim.reg_en", reg_args);
+    }
+    return buildPrimitive("coreir.reg", reg_args);
+  } else if (inst.generated) {
+    return buildPrimitive(ref, inst.genargs);
+  }
+
+  auto iter = modules.find(ref);
+  if (inst.num_modargs > 0 && iter != modules.end() && iter->second.has_def) {
+    cerr << "Module arguments on " << ref << " need the CoreIR loader" << endl;
+    return nullptr;
+  }
+
+  return buildModule(ref);
+}
+
+const Definition * NetlistBuilder::buildModule(const string &name)
+{
+  auto iter = modules.find(name);
+  if (iter == modules.end() || !iter->second.has_def) {
+    /* Declarations without a body come from the CoreIR libraries */
+    if (IsCoreIRPrimitive(name)) {
+      return buildPrimitive(name, GenArgs());
+    }
+    cerr << "Unknown module " << name << endl;
+    return nullptr;
+  }
+
+  ModuleDesc &mod = iter->second;
+  if (mod.defn) {
+    return mod.defn;
+  } else if (mod.visiting) {
+    cerr << "Module " << name << " instantiates itself" << endl;
+    return nullptr;
+  }
+  mod.visiting = true;
+
+  /* Instances and ports are ordered by name as in a CoreIR ModuleDef and
+   * RecordType, so both loaders lay out state and ports identically */
+  sort(mod.instances.begin(), mod.instances.end(), [](const InstanceDesc &a, const InstanceDesc &b) {
+    return GetSymbolName(a.name) < GetSymbolName(b.name);
+  });
+  sort(mod.ports.begin(), mod.ports.end(), [](const PortDesc &a, const PortDesc &b) {
+    return GetSymbolName(a.name) < GetSymbolName(b.name);
+  });
+
+  /* Constants and terminators only live on as slices */
+  vector<const Definition *> child_defns;
+  vector<const InstanceDesc *> child_descs;
+  vector<llvm::APInt> constants;
+  unordered_map<Symbol, pair<ResolvedEnd::Role, int>> owners;
+  for (const InstanceDesc &inst : mod.instances) {
+    const string &ref = GetSymbolName(inst.ref);
+    if (isConstantRef(ref)) {
+      if (!inst.has_value) {
+        cerr << "Constant " << GetSymbolName(inst.name) << " in " << name << " has no value" << endl;
+        return nullptr;
+      }
+      owners[inst.name] = { ResolvedEnd::Driver, constants.size() };
+      constants.push_back(inst.value);
+    } else if (isTermRef(ref)) {
+      owners[inst.name] = { ResolvedEnd::Ignored, 0 };
+    } else {
+      const Definition *defn = resolveInstance(inst);
+      if (!defn) {
+        return nullptr;
+      }
+      owners[inst.name] = { ResolvedEnd::Sink, child_defns.size() };
+      child_defns.push_back(defn);
+      child_descs.push_back(&inst);
+    }
+  }
+
+  vector<Sink> sinks;
+  vector<Source> sources;
+  vector<ClkSink> clk_sinks;
+  vector<ClkSource> clk_sources;
+  for (const PortDesc &port : mod.ports) {
+    const string &port_name = GetSymbolName(port.name);
+    if (port.is_clock && port.is_input) {
+      clk_sources.emplace_back(port_name);
+    } else if (port.is_clock) {
+      clk_sinks.emplace_back(port_name, nullptr);
+    } else if (port.is_input) {
+      sources.emplace_back(port_name, port.width);
+    } else {
+      sinks.emplace_back(port_name, port.width);
+    }
+  }
+  IFace iface("self", move(sinks), move(sources), move(clk_sinks), move(clk_sources), true);
+
+  vector<vector<size_t>> sink_offsets;
+  vector<BitDriver> nets;
+  vector<vector<int>> clk_drivers;
+  if (!connectModule(name, mod, iface, child_defns, owners, constants, sink_offsets, nets, clk_drivers)) {
+    return nullptr;
+  }
+
+  vector<Instance> instances;
+  instances.reserve(child_defns.size());
+  for (size_t i = 0; i < child_defns.size(); i++) {
+    instances.emplace_back(child_defns[i]->makeInstance(GetSymbolName(child_descs[i]->name)));
+    for (const auto &arg : child_descs[i]->args) {
+      instances.back().setArg(GetSymbolName(arg.first), GetSymbolName(arg.second));
+    }
+  }
+
+  definitions.emplace_back(name, move(iface), move(instances),
+    [&](Definition &defn, vector<Instance> &insts) {
+      auto makeSlice = [&](const BitDriver &driver) {
+        if (driver.owner == BitDriver::SelfOwner) {
+          return SourceSlice(&defn, nullptr, &defn.getIFace().getSources()[driver.port], driver.bit, 1);
+        } else if (driver.owner == BitDriver::ConstOwner) {
+          return SourceSlice(llvm::APInt(1, constants[driver.port][driver.bit]));
+        }
+        const Instance &inst = insts[driver.owner];
+        return SourceSlice(nullptr, &inst, &inst.getIFace().getSources()[driver.port], driver.bit, 1);
+      };
+
+      /* One slice per bit, which Select merges back into whole ports */
+      auto connectSinks = [&](vector<Sink> &sinks, const vector<size_t> &offsets) {
+        for (size_t i = 0; i < sinks.size(); i++) {
+          vector<SourceSlice> slices;
+          slices.reserve(sinks[i].getWidth());
+          for (int bit = 0; bit < sinks[i].getWidth(); bit++) {
+            slices.push_back(makeSlice(nets[offsets[i] + bit]));
+          }
+          sinks[i].connect(Select(move(slices)));
+        }
+      };
+
+      connectSinks(defn.getIFace().getSinks(), sink_offsets[0]);
+      for (size_t i = 0; i < insts.size(); i++) {
+        connectSinks(insts[i].getIFace().getSinks(), sink_offsets[i + 1]);
+
+        vector<ClkSink> &clk_sinks = insts[i].getIFace().getClkSinks();
+        for (size_t j = 0; j < clk_sinks.size(); j++) {
+          if (clk_drivers[i][j] >= 0) {
+            clk_sinks[j].connect(&defn.getIFace().getClkSources()[clk_drivers[i][j]]);
+          }
+        }
+      }
+    });
+
+  mod.defn = &definitions.back();
+  mod.visiting = false;
+  vector<InstanceDesc>().swap(mod.instances);
+  vector<pair<Endpoint, Endpoint>>().swap(mod.connections);
+
+  return mod.defn;
+}
+
+/* Resolves every connection to a driver for each sink bit. Sinks are
+ * numbered densely: the module's outputs, then each instance's inputs,
+ * with sink_offsets giving the first bit of every port. clk_drivers gives
+ * the module clock input feeding each instance clock input, or -1 */
+bool NetlistBuilder::connectModule(const string &name, const ModuleDesc &mod, const IFace &iface,
+                                   const vector<const Definition *> &child_defns,
+                                   const unordered_map<Symbol, pair<ResolvedEnd::Role, int>> &owners,
+                                   const vector<llvm::APInt> &constants,
+                                   vector<vector<size_t>> &sink_offsets, vector<BitDriver> &nets,
+                                   vector<vector<int>> &clk_drivers)
+{
+  size_t num_bits = 0;
+  sink_offsets.resize(child_defns.size() + 1);
+  for (const Sink &sink : iface.getSinks()) {
+    sink_offsets[0].push_back(num_bits);
+    num_bits += sink.getWidth();
+  }
+  for (size_t i = 0; i < child_defns.size(); i++) {
+    for (const Source &src : child_defns[i]->getIFace().getSources()) {
+      sink_offsets[i + 1].push_back(num_bits);
+      num_bits += src.getWidth();
+    }
+  }
+  nets.assign(num_bits, { BitDriver::NoOwner, 0, 0 });
+
+  clk_drivers.resize(child_defns.size());
+  for (size_t i = 0; i < child_defns.size(); i++) {
+    clk_drivers[i].assign(child_defns[i]->getIFace().getClkSources().size(), -1);
+  }
+
+  Symbol self = InternSymbol("self");
+
+  /* An instance's inputs are its definition's sources, and vice versa */
+  auto resolvePort = [&](const IFace &defn_iface, Symbol port, int owner, bool is_instance, ResolvedEnd &end) {
+    end.owner = owner;
+    if (defn_iface.hasSource(port)) {
+      const Source *src = defn_iface.getSource(port);
+      end.role = is_instance ? ResolvedEnd::Sink : ResolvedEnd::Driver;
+      end.port = src - defn_iface.getSources().data();
+      end.width = src->getWidth();
+    } else if (defn_iface.hasSink(port)) {
+      const Sink *sink = defn_iface.getSink(port);
+      end.role = is_instance ? ResolvedEnd::Driver : ResolvedEnd::Sink;
+      end.port = sink - defn_iface.getSinks().data();
+      end.width = sink->getWidth();
+    } else if (findClock(defn_iface.getClkSources(), port) >= 0) {
+      end.role = is_instance ? ResolvedEnd::ClockSink : ResolvedEnd::ClockDriver;
+      end.port = findClock(defn_iface.getClkSources(), port);
+      end.width = 1;
+    } else if (findClock(defn_iface.getClkSinks(), port) >= 0) {
+      end.role = is_instance ? ResolvedEnd::ClockDriver : ResolvedEnd::ClockSink;
+      end.port = findClock(defn_iface.getClkSinks(), port);
+      end.width = 1;
+    } else {
+      return false;
+    }
+
+    return true;
+  };
+
+  auto resolve = [&](const Endpoint &ep, ResolvedEnd &end) {
+    if (ep.owner == self) {
+      if (!resolvePort(iface, ep.port, BitDriver::SelfOwner, false, end)) {
+        return false;
+      }
+    } else {
+      auto iter = owners.find(ep.owner);
+      if (iter == owners.end()) {
+        return false;
+      }
+
+      int idx = iter->second.second;
+      switch (iter->second.first) {
+        case ResolvedEnd::Ignored:
+          end.role = ResolvedEnd::Ignored;
+          return true;
+        case ResolvedEnd::Driver:
+          if (GetSymbolName(ep.port) != "out") {
+            return false;
+          }
+          end = { ResolvedEnd::Driver, BitDriver::ConstOwner, (unsigned)idx, (int)constants[idx].getBitWidth() };
+          break;
+        case ResolvedEnd::Sink:
+          if (!resolvePort(child_defns[idx]->getIFace(), ep.port, idx, true, end)) {
+            return false;
+          }
+          break;
+        case ResolvedEnd::ClockDriver:
+        case ResolvedEnd::ClockSink:
+          /* Owners are never clocks */
+          return false;
+      }
+    }
+
+    return end.role == ResolvedEnd::Ignored || ep.bit < end.width;
+  };
+
+  for (const auto &conn : mod.connections) {
+    ResolvedEnd first, second;
+    string repr = endpointRepr(conn.first) + " <-> " + endpointRepr(conn.second);
+    if (!resolve(conn.first, first) || !resolve(conn.second, second)) {
+      cerr << "Invalid connection " << repr << " in " << name << endl;
+      return false;
+    }
+
+    bool first_clock = first.role == ResolvedEnd::ClockDriver || first.role == ResolvedEnd::ClockSink;
+    bool second_clock = second.role == ResolvedEnd::ClockDriver || second.role == ResolvedEnd::ClockSink;
+    if (first.role == ResolvedEnd::Ignored || second.role == ResolvedEnd::Ignored) {
+      continue;
+    } else if (first_clock || second_clock) {
+      /* Only instance clocks fed straight from the module's clock inputs
+       * are handled, the CoreIR loader decides what other clocking means */
+      const ResolvedEnd &driver = first.role == ResolvedEnd::ClockDriver ? first : second;
+      const ResolvedEnd &sink = first.role == ResolvedEnd::ClockDriver ? second : first;
+      if (driver.role != ResolvedEnd::ClockDriver || driver.owner != BitDriver::SelfOwner ||
+          sink.role != ResolvedEnd::ClockSink || sink.owner < 0) {
+        cerr << "Clock connection " << repr << " in " << name << " needs the CoreIR loader" << endl;
+        return false;
+      }
+      clk_drivers[sink.owner][sink.port] = driver.port;
+      continue;
+    } else if (first.role == second.role) {
+      cerr << "Connection " << repr << " in " << name << " joins two " <<
+              (first.role == ResolvedEnd::Driver ? "outputs" : "inputs") << endl;
+      return false;
+    }
+
+    bool first_drives = first.role == ResolvedEnd::Driver;
+    const ResolvedEnd &driver = first_drives ? first : second;
+    const ResolvedEnd &sink = first_drives ? second : first;
+    int driver_bit = first_drives ? conn.first.bit : conn.second.bit;
+    int sink_bit = first_drives ? conn.second.bit : conn.first.bit;
+
+    int num_driven = sink_bit < 0 ? sink.width : 1;
+    if (num_driven != (driver_bit < 0 ? driver.width : 1)) {
+      cerr << "Width mismatch in connection " << repr << " in " << name << endl;
+      return false;
+    }
+
+    size_t base = sink_offsets[sink.owner + 1][sink.port] + max(sink_bit, 0);
+    for (int i = 0; i < num_driven; i++) {
+      BitDriver &net = nets[base + i];
+      if (net.owner != BitDriver::NoOwner) {
+        cerr << "Multiple drivers for " << repr << " in " << name << endl;
+        return false;
+      }
+      net = { driver.owner, driver.port, max(driver_bit, 0) + i };
+    }
+  }
+
+  for (const BitDriver &net : nets) {
+    if (net.owner == BitDriver::NoOwner) {
+      cerr << "Unconnected input in " << name << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+unique_ptr<Circuit> LoadJSONNetlist(const string &path)
+{
+  ifstream in(path, ios::binary);
+  if (!in) {
+    cerr << "Unable to open " << path << endl;
+    return nullptr;
+  }
+
+  JSONReader reader(in);
+  unordered_map<string, ModuleDesc> modules;
+  string top;
+  if (!readNetlist(reader, modules, top)) {
+    cerr << path << ": " << reader.getError() << endl;
+    return nullptr;
+  } else if (top.empty()) {
+    cerr << path << ": no top module" << endl;
+    return nullptr;
+  }
+
+  /* The top is built last, which is where Circuit expects it */
+  NetlistBuilder builder(modules);
+  if (!builder.buildModule(top)) {
+    return nullptr;
+  }
+
+  return std::make_unique<Circuit>(builder.takeDefinitions());
+}
+
+}
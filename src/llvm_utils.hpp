@@ -2,6 +2,7 @@
 #define JITSIM_LLVM_UTILS_HPP_INCLUDED
 
 #include "utils.hpp"
+#include <jitsim/builder.hpp>
 #include <llvm/IR/DerivedTypes.h>
 
 namespace JITSim {
@@ -16,6 +17,61 @@ namespace JITSim {
   
     return llvm::StructType::create(context, elem_types, name);
   }
+
+  /* Batched values live in memory as one element per lane, each rounded up
+   * to whole bytes and packed back to back. Bit sliced values are stored as
+   * their words in order. Scalar values are loaded and stored as plain integers */
+  static inline uint64_t GetLaneElementsBytes(const ModuleEnvironment &mod_env, unsigned width)
+  {
+    if (mod_env.isBitSliced()) {
+      return (uint64_t)width * mod_env.getLanes() / 8;
+    }
+
+    return (uint64_t)mod_env.getLanes() * getNumBytes(width);
+  }
+
+  static inline llvm::Value * LoadLaneElements(FunctionEnvironment &env, llvm::Value *ptr, unsigned width,
+                                               const llvm::Twine &name = "")
+  {
+    unsigned lanes = env.getModule().getLanes();
+    if (env.getModule().isBitSliced()) {
+      llvm::Type *type = env.getModule().getValueType(width);
+      llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, type->getPointerTo());
+      return env.getIRBuilder().CreateAlignedLoad(addr, 1, name);
+    }
+
+    if (lanes == 1) {
+      llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, llvm::Type::getIntNPtrTy(env.getContext(), width));
+      return env.getIRBuilder().CreateLoad(addr, name);
+    }
+
+    llvm::Type *elem_type = llvm::Type::getIntNTy(env.getContext(), getNumBytes(width) * 8);
+    llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, llvm::VectorType::get(elem_type, lanes)->getPointerTo());
+    llvm::Value *elems = env.getIRBuilder().CreateAlignedLoad(addr, 1);
+
+    return env.getIRBuilder().CreateTrunc(elems, env.getModule().getValueType(width), name);
+  }
+
+  static inline void StoreLaneElements(FunctionEnvironment &env, llvm::Value *val, llvm::Value *ptr, unsigned width)
+  {
+    unsigned lanes = env.getModule().getLanes();
+    if (env.getModule().isBitSliced()) {
+      llvm::Type *type = env.getModule().getValueType(width);
+      llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, type->getPointerTo());
+      env.getIRBuilder().CreateAlignedStore(val, addr, 1);
+      return;
+    }
+
+    if (lanes == 1) {
+      llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, llvm::Type::getIntNPtrTy(env.getContext(), width));
+      env.getIRBuilder().CreateStore(val, addr);
+      return;
+    }
+
+    llvm::Type *elem_type = llvm::VectorType::get(llvm::Type::getIntNTy(env.getContext(), getNumBytes(width) * 8), lanes);
+    llvm::Value *addr = env.getIRBuilder().CreateBitCast(ptr, elem_type->getPointerTo());
+    env.getIRBuilder().CreateAlignedStore(env.getIRBuilder().CreateZExt(val, elem_type), addr, 1);
+  }
 }
 
 #endif
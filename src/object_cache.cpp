@@ -0,0 +1,197 @@
+#include <jitsim/object_cache.hpp>
+#include <jitsim/circuit.hpp>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+/* Bump whenever the lowering of primitives or definitions changes so stale
+ * objects from older builds are never linked in */
+static const char *CacheVersion = "jitsim-objcache-4";
+
+DiskObjectCache::DiskObjectCache(const string &cache_dir_, const TargetMachine &target_machine)
+  : cache_dir(cache_dir_),
+    target_desc(target_machine.getTargetTriple().getTriple() + "|" +
+                target_machine.getTargetCPU().str() + "|" +
+                target_machine.getTargetFeatureString().str()),
+    defn_hashes(),
+    pending_keys(),
+    pending_lock()
+{
+  if (auto err = sys::fs::create_directories(cache_dir)) {
+    errs() << "Unable to create object cache directory " << cache_dir << ": " << err.message() << "\n";
+  }
+}
+
+static void hashField(MD5 &hash, const string &field)
+{
+  hash.update(field);
+  hash.update(StringRef("\0", 1));
+}
+
+static string finishHash(MD5 &hash)
+{
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<32> str;
+  MD5::stringifyResult(result, str);
+
+  return str.str();
+}
+
+const string & DiskObjectCache::hashDefinition(const Definition &defn)
+{
+  auto iter = defn_hashes.find(&defn);
+  if (iter != defn_hashes.end()) {
+    return iter->second;
+  }
+
+  MD5 hash;
+  hashField(hash, defn.getName());
+
+  const IFace &iface = defn.getIFace();
+  for (const Source &src : iface.getSources()) {
+    hashField(hash, "src " + src.getName() + " " + to_string(src.getWidth()));
+  }
+  for (const Sink &sink : iface.getSinks()) {
+    hashField(hash, "sink " + sink.getName() + " " + to_string(sink.getWidth()));
+  }
+  for (const ClkSource &clk : iface.getClkSources()) {
+    hashField(hash, "clksrc " + clk.getName());
+  }
+  for (const ClkSink &clk : iface.getClkSinks()) {
+    hashField(hash, "clksink " + clk.getName());
+  }
+
+  const SimInfo &siminfo = defn.getSimInfo();
+  hashField(hash, "state " + to_string(siminfo.getNumStateBytes()));
+
+  if (!siminfo.isPrimitive()) {
+    for (const Instance &inst : defn.getInstances()) {
+      hashField(hash, "inst " + inst.getName());
+      hashField(hash, hashDefinition(inst.getDefinition()));
+
+      /* Instance arguments feed primitive code generation (LUT contents etc) */
+      vector<pair<string, string>> args;
+      for (const auto &arg : inst.getArgs()) {
+        args.emplace_back(GetSymbolName(arg.first), GetSymbolName(arg.second));
+      }
+      sort(args.begin(), args.end());
+      for (const auto &arg : args) {
+        hashField(hash, "arg " + arg.first + "=" + arg.second);
+      }
+
+      for (const Sink &sink : inst.getIFace().getSinks()) {
+        if (sink.isConnected()) {
+          hashField(hash, sink.getName() + "<-" + sink.getSelect().repr());
+        }
+      }
+      /* Clock wiring decides which update_state_<clk> steps an instance */
+      for (const ClkSink &clk : inst.getIFace().getClkSinks()) {
+        if (clk.isConnected()) {
+          hashField(hash, clk.getName() + "<-" + clk.getSource()->getName());
+        }
+      }
+    }
+
+    for (const Sink &sink : iface.getSinks()) {
+      hashField(hash, sink.getName() + "<-" + sink.getSelect().repr());
+    }
+  }
+
+  return defn_hashes[&defn] = finishHash(hash);
+}
+
+string DiskObjectCache::getKey(const Definition &defn, const string &kind, unsigned opt_level)
+{
+  MD5 hash;
+  hashField(hash, CacheVersion);
+  hashField(hash, LLVM_VERSION_STRING);
+  hashField(hash, target_desc);
+  hashField(hash, "O" + to_string(opt_level));
+  hashField(hash, kind);
+  hashField(hash, hashDefinition(defn));
+
+  return finishHash(hash);
+}
+
+string DiskObjectCache::getObjectPath(const string &key) const
+{
+  return cache_dir + "/" + key + ".o";
+}
+
+DiskObjectCache::ObjectPtr DiskObjectCache::loadObject(const string &key)
+{
+  auto buffer = MemoryBuffer::getFile(getObjectPath(key), -1, false);
+  if (!buffer) {
+    return nullptr;
+  }
+
+  auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+  if (!object) {
+    logAllUnhandledErrors(object.takeError(), errs(),
+                          "Ignoring corrupt cached object " + getObjectPath(key) + ": ");
+    return nullptr;
+  }
+
+  return make_shared<object::OwningBinary<object::ObjectFile>>(move(*object), move(*buffer));
+}
+
+bool DiskObjectCache::hasObject(const string &key) const
+{
+  return !key.empty() && sys::fs::exists(getObjectPath(key));
+}
+
+void DiskObjectCache::setModuleKey(const Module *module, const string &key)
+{
+  lock_guard<mutex> lock(pending_lock);
+  pending_keys[module] = key;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module *module, MemoryBufferRef obj)
+{
+  string key;
+  {
+    lock_guard<mutex> lock(pending_lock);
+    auto iter = pending_keys.find(module);
+    if (iter == pending_keys.end()) {
+      return;
+    }
+    key = move(iter->second);
+    pending_keys.erase(iter);
+  }
+
+  /* Write to a temporary and rename so concurrent runs never see partial objects */
+  int fd;
+  SmallString<128> tmp_path;
+  if (sys::fs::createUniqueFile(getObjectPath(key) + "-%%%%%%.tmp", fd, tmp_path)) {
+    return;
+  }
+
+  {
+    raw_fd_ostream out(fd, true);
+    out << obj.getBuffer();
+  }
+
+  if (sys::fs::rename(tmp_path, getObjectPath(key))) {
+    sys::fs::remove(tmp_path);
+  }
+}
+
+unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module *module)
+{
+  /* Lookups happen by key before any IR is generated, see JIT::addLazyFunction */
+  return nullptr;
+}
+
+}
@@ -0,0 +1,223 @@
+#include <jitsim/probes.hpp>
+#include "utils.hpp"
+
+#include <llvm/Support/raw_ostream.h>
+
+namespace JITSim {
+
+using namespace std;
+
+ProbeLayout::ProbeLayout(const Definition &top, const vector<string> &signals, bool traced_)
+  : region_bytes(),
+    inst_offsets(),
+    source_signals(),
+    sink_signals(),
+    probed_sources(),
+    probed_sinks(),
+    traced(traced_)
+{
+  for (const string &signal : signals) {
+    if (signal == "*") {
+      probeAll(top);
+    } else if (!addProbe(top, signal)) {
+      llvm::errs() << "Ignoring unknown probe " << signal << "\n";
+    }
+  }
+
+  layoutDefinition(top);
+}
+
+static vector<string> splitPath(const string &path)
+{
+  vector<string> parts;
+  size_t start = 0;
+  while (true) {
+    size_t dot = path.find('.', start);
+    parts.push_back(path.substr(start, dot - start));
+    if (dot == string::npos) {
+      return parts;
+    }
+    start = dot + 1;
+  }
+}
+
+bool ProbeLayout::addProbe(const Definition &top, const string &path)
+{
+  vector<string> parts = splitPath(path);
+  if (parts.size() < 2) {
+    return false;
+  }
+
+  const Definition *defn = &top;
+  const Instance *inst = nullptr;
+  for (unsigned i = 0; i < parts.size() - 1; i++) {
+    if (!defn->hasInstance(parts[i])) {
+      return false;
+    }
+    inst = &defn->getInstance(parts[i]);
+    defn = &inst->getDefinition();
+  }
+
+  const IFace &iface = inst->getIFace();
+  const string &port = parts.back();
+  if (port == "*") {
+    probeInstance(*inst);
+  } else if (iface.hasSource(port)) {
+    probed_sources.insert(iface.getSource(port));
+  } else if (iface.hasSink(port)) {
+    probed_sinks.insert(iface.getSink(port));
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void ProbeLayout::probeAll(const Definition &defn)
+{
+  for (const Instance &inst : defn.getInstances()) {
+    probeInstance(inst);
+  }
+}
+
+void ProbeLayout::probeInstance(const Instance &inst)
+{
+  for (const Source &src : inst.getIFace().getSources()) {
+    probed_sources.insert(&src);
+  }
+  for (const Sink &sink : inst.getIFace().getSinks()) {
+    probed_sinks.insert(&sink);
+  }
+
+  probeAll(inst.getDefinition());
+}
+
+unsigned ProbeLayout::layoutDefinition(const Definition &defn)
+{
+  auto iter = region_bytes.find(&defn);
+  if (iter != region_bytes.end()) {
+    return iter->second;
+  }
+
+  unsigned offset = 0;
+  for (const Instance &inst : defn.getInstances()) {
+    for (const Source &src : inst.getIFace().getSources()) {
+      if (probed_sources.count(&src)) {
+        source_signals[&src] = { offset, (unsigned)src.getWidth() };
+        offset += JITSim::getNumBytes(src.getWidth());
+      }
+    }
+    for (const Sink &sink : inst.getIFace().getSinks()) {
+      if (probed_sinks.count(&sink)) {
+        sink_signals[&sink] = { offset, (unsigned)sink.getWidth() };
+        offset += JITSim::getNumBytes(sink.getWidth());
+      }
+    }
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    unsigned child_bytes = layoutDefinition(inst.getDefinition());
+    if (child_bytes > 0) {
+      inst_offsets[&inst] = offset;
+      offset += child_bytes;
+    }
+  }
+
+  region_bytes[&defn] = offset;
+
+  return offset;
+}
+
+unsigned ProbeLayout::getNumBytes(const Definition &defn) const
+{
+  auto iter = region_bytes.find(&defn);
+  if (iter == region_bytes.end()) {
+    return 0;
+  }
+
+  return iter->second;
+}
+
+const ProbeLayout::Signal * ProbeLayout::getSignal(const Source *src) const
+{
+  auto iter = source_signals.find(src);
+  if (iter == source_signals.end()) {
+    return nullptr;
+  }
+
+  return &iter->second;
+}
+
+const ProbeLayout::Signal * ProbeLayout::getSignal(const Sink *sink) const
+{
+  auto iter = sink_signals.find(sink);
+  if (iter == sink_signals.end()) {
+    return nullptr;
+  }
+
+  return &iter->second;
+}
+
+const ProbeLayout::Signal * ProbeLayout::lookup(const Definition &top, const vector<string> &inst_names,
+                                                const string &port, unsigned &offset) const
+{
+  offset = 0;
+  if (inst_names.empty()) {
+    return nullptr;
+  }
+
+  const Definition *defn = &top;
+  for (unsigned i = 0; i < inst_names.size() - 1; i++) {
+    if (!defn->hasInstance(inst_names[i])) {
+      return nullptr;
+    }
+    const Instance &inst = defn->getInstance(inst_names[i]);
+    if (!hasProbes(inst.getDefinition())) {
+      return nullptr;
+    }
+    offset += getOffset(&inst);
+    defn = &inst.getDefinition();
+  }
+
+  if (!defn->hasInstance(inst_names.back())) {
+    return nullptr;
+  }
+  const IFace &iface = defn->getInstance(inst_names.back()).getIFace();
+
+  const Signal *signal = nullptr;
+  if (iface.hasSource(port)) {
+    signal = getSignal(iface.getSource(port));
+  } else if (iface.hasSink(port)) {
+    signal = getSignal(iface.getSink(port));
+  }
+
+  if (signal) {
+    offset += signal->offset;
+  }
+
+  return signal;
+}
+
+string ProbeLayout::getSignature(const Definition &defn) const
+{
+  string signature = to_string(getNumBytes(defn)) + (traced ? " traced" : "");
+  for (const Instance &inst : defn.getInstances()) {
+    for (const Source &src : inst.getIFace().getSources()) {
+      if (const Signal *signal = getSignal(&src)) {
+        signature += " " + inst.getName() + "." + src.getName() + "@" + to_string(signal->offset);
+      }
+    }
+    for (const Sink &sink : inst.getIFace().getSinks()) {
+      if (const Signal *signal = getSignal(&sink)) {
+        signature += " " + inst.getName() + "." + sink.getName() + "@" + to_string(signal->offset);
+      }
+    }
+    if (hasProbes(inst.getDefinition())) {
+      signature += " " + inst.getName() + "@" + to_string(getOffset(&inst));
+    }
+  }
+
+  return signature;
+}
+
+}
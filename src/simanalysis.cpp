@@ -1,7 +1,8 @@
 #include <jitsim/simanalysis.hpp>
 #include <jitsim/circuit.hpp>
 
-#include <unordered_set>
+#include <algorithm>
+#include <cstring>
 
 namespace JITSim {
 
@@ -21,207 +22,252 @@ static vector<const Instance *> filterStatefulInstances(const vector<Instance> &
   return stateful;
 }
 
-/* Returns set of every Source the Sinks in frontier depend on */ unordered_set<const SourceSlice *> getDependencies(unordered_set<const Sink *> frontier)
+/* Marks every instance and definition source the Sinks in frontier depend
+ * on, indexed by position in instances and in defn_iface's sources. Each
+ * instance's inputs are pushed the first time it is reached, so every net
+ * is walked once without hashing */
+static void getDependencies(const IFace &defn_iface,
+                            const vector<Instance> &instances,
+                            vector<const Sink *> frontier,
+                            vector<bool> &dep_insts,
+                            vector<bool> &dep_srcs)
 {
-  unordered_set<const SourceSlice *> visited;
+  const Source *first_src = defn_iface.getSources().data();
+  dep_insts.assign(instances.size(), false);
+  dep_srcs.assign(defn_iface.getSources().size(), false);
 
   while (frontier.size() > 0) {
-    unordered_set<const Sink *> old_frontier = move(frontier);
-    frontier.clear();
-
-    for (const Sink *sink : old_frontier) {
-      const Select &sel = sink->getSelect();
-      for (const SourceSlice &slice : sel.getSlices()) {
-        if (slice.isConstant()) {
+    const Sink *sink = frontier.back();
+    frontier.pop_back();
+
+    const Select &sel = sink->getSelect();
+    for (const SourceSlice &slice : sel.getSlices()) {
+      if (slice.isConstant()) {
+        continue;
+      } else if (slice.isDefinitionAttached()) {
+        dep_srcs[slice.getSource() - first_src] = true;
+      } else {
+        const Instance *depinst = slice.getInstance();
+        size_t idx = depinst - instances.data();
+        if (dep_insts[idx]) {
           continue;
-        } else if (slice.isDefinitionAttached()) {
-          visited.insert(&slice);
-        } else {
-          const Instance *depinst = slice.getInstance();
-          visited.insert(&slice);
-
-          const SimInfo &inst_info = depinst->getSimInfo();
-          for (const Source *src : inst_info.getOutputSources()) {
-            const Sink *inst_sink = depinst->getIFace().getSink(src);
-            frontier.insert(inst_sink);
-          }
+        }
+        dep_insts[idx] = true;
+
+        const SimInfo &inst_info = depinst->getSimInfo();
+        for (const Source *src : inst_info.getOutputSources()) {
+          frontier.push_back(depinst->getIFace().getSink(src));
         }
       }
     }
   }
-
-  return visited;
 }
 
-static unordered_set<const Instance *> getInstances(const unordered_set<const SourceSlice *> &slices)
+/* Calls fn with the index of every instance whose outputs feed the inputs
+ * that compute inst's outputs, once per slice */
+template <typename Fn>
+static void forEachOutputDep(const Instance *inst, const vector<Instance> &instances, Fn fn)
 {
-  unordered_set<const Instance *> instances;
-
-  for (const SourceSlice *slice : slices) {
-    if (slice->isInstanceAttached()) {
-      instances.insert(slice->getInstance());
+  const InstanceIFace &inst_iface = inst->getIFace();
+  for (const Source *defn_source : inst->getSimInfo().getOutputSources()) {
+    const Select &sel = inst_iface.getSink(defn_source)->getSelect();
+    for (const SourceSlice &slice : sel.getSlices()) {
+      if (slice.isInstanceAttached()) {
+        fn(slice.getInstance() - instances.data());
+      }
     }
   }
-
-  return instances;
 }
 
-static vector<const Instance *> topoSortInstances(unordered_set<const Instance *> &unsorted)
+/* Kahn's algorithm over instance indices. Dependents are kept in one flat
+ * array, with dep_begin[i] marking where the instances consuming instance
+ * i start, and ties are broken by instance order so codegen is stable */
+static vector<const Instance *> topoSortInstances(const vector<bool> &included,
+                                                  const vector<Instance> &instances)
 {
-  unordered_set<const Instance *> sorted;
-  vector<const Instance *> output;
+  size_t num_insts = instances.size();
+  size_t num_included = count(included.begin(), included.end(), true);
+
+  vector<unsigned> num_deps(num_insts, 0);
+  vector<unsigned> dep_begin(num_insts + 1, 0);
+  for (size_t i = 0; i < num_insts; i++) {
+    if (included[i]) {
+      forEachOutputDep(&instances[i], instances, [&](size_t dep) {
+        num_deps[i]++;
+        dep_begin[dep + 1]++;
+      });
+    }
+  }
+  for (size_t i = 0; i < num_insts; i++) {
+    dep_begin[i + 1] += dep_begin[i];
+  }
 
-  while (!unsorted.empty()) {
-    bool found = false;
-    for (const Instance *candidate : unsorted) {
-      const SimInfo &inst_siminfo = candidate->getSimInfo();
-      const InstanceIFace &inst_iface = candidate->getIFace();
-      bool instance_satisfied = true;
-      for (const Source *defn_source : inst_siminfo.getOutputSources()) {
-        const Sink *inst_sink = inst_iface.getSink(defn_source);
-        bool sink_satisfied = true;
-
-        const Select &sel = inst_sink->getSelect();
-        for (const SourceSlice &slice : sel.getSlices()) {
-          if (slice.isConstant() || slice.isDefinitionAttached()) {
-            continue;
-          } else {
-            const Instance *depinst = slice.getInstance();
-            if (sorted.count(depinst) == 0) {
-              sink_satisfied = false;
-              break;
-            }
-          }
-        }
-        if (!sink_satisfied) {
-          instance_satisfied = false;
-          break;
-        }
-      }
+  vector<unsigned> dependents(dep_begin[num_insts]);
+  vector<unsigned> fill(dep_begin.begin(), dep_begin.end() - 1);
+  for (size_t i = 0; i < num_insts; i++) {
+    if (included[i]) {
+      forEachOutputDep(&instances[i], instances, [&](size_t dep) {
+        dependents[fill[dep]++] = i;
+      });
+    }
+  }
+
+  vector<const Instance *> output;
+  output.reserve(num_included);
+  for (size_t i = 0; i < num_insts; i++) {
+    if (included[i] && num_deps[i] == 0) {
+      output.push_back(&instances[i]);
+    }
+  }
 
-      if (instance_satisfied) {
-        unsorted.erase(candidate);
-        sorted.insert(candidate);
-        output.push_back(candidate);
-        found = true;
-        break;
+  /* output doubles as the queue of instances whose deps are all placed */
+  for (size_t next = 0; next < output.size(); next++) {
+    size_t idx = output[next] - instances.data();
+    for (unsigned j = dep_begin[idx]; j < dep_begin[idx + 1]; j++) {
+      unsigned dependent = dependents[j];
+      if (--num_deps[dependent] == 0) {
+        output.push_back(&instances[dependent]);
       }
     }
-    (void)found;
-    assert(found);
   }
 
+  /* Anything left over sits on a combinational loop */
+  assert(output.size() == num_included);
+
   return output;
 }
 
 static void analyzeDependencies(const IFace &defn_iface,
-                                const unordered_set<const Sink *> &frontier,
+                                const vector<Instance> &defn_instances,
+                                vector<const Sink *> frontier,
                                 vector<const Instance *> &instances,
-                                vector<const Source *> &dep_srcs)
+                                vector<const Source *> &dep_srcs,
+                                vector<bool> &dep_insts)
 {
-  unordered_set<const SourceSlice *> deps = getDependencies(frontier);
-  unordered_set<const Instance *> unsorted_insts = getInstances(deps);
-  instances = topoSortInstances(unsorted_insts);
-
-  unordered_set<const Source *> dep_src_set;
-  for (const SourceSlice *slice : deps) {
-    if (slice->isDefinitionAttached()) {
-      dep_src_set.insert(slice->getSource());
-    }
-  }
+  vector<bool> dep_src_bits;
+  getDependencies(defn_iface, defn_instances, move(frontier), dep_insts, dep_src_bits);
+  instances = topoSortInstances(dep_insts, defn_instances);
 
   /* Preserve ordering of sources */
-  for (const Source &src : defn_iface.getSources()) {
-    if (dep_src_set.count(&src) > 0) {
-      dep_srcs.push_back(&src);
+  const vector<Source> &sources = defn_iface.getSources();
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (dep_src_bits[i]) {
+      dep_srcs.push_back(&sources[i]);
     }
   }
 }
 
-void SimInfo::analyzeStateDeps(const IFace &defn_iface)
+void SimInfo::analyzeStateDeps(const IFace &defn_iface, const vector<Instance> &instances)
 {
-  unordered_set<const Sink *> frontier;
+  vector<const Sink *> frontier;
   for (const Instance *stateful_inst : stateful_insts) {
     const SimInfo &inst_info = stateful_inst->getSimInfo();
     for (const Source *src : inst_info.getStateSources()) {
-      frontier.insert(stateful_inst->getIFace().getSink(src));
+      frontier.push_back(stateful_inst->getIFace().getSink(src));
     }
   }
 
-  analyzeDependencies(defn_iface, frontier, state_deps, state_dep_srcs);
+  analyzeDependencies(defn_iface, instances, move(frontier), state_deps, state_dep_srcs, state_deps_lookup);
 }
 
-void SimInfo::analyzeOutputDeps(const IFace &defn_iface)
+void SimInfo::analyzeOutputDeps(const IFace &defn_iface, const vector<Instance> &instances)
 {
-  unordered_set<const Sink *> frontier;
+  vector<const Sink *> frontier;
   for (const Sink &sink : defn_iface.getSinks()) {
-    frontier.insert(&sink);
+    frontier.push_back(&sink);
   }
 
-  analyzeDependencies(defn_iface, frontier, output_deps, output_dep_srcs);
+  analyzeDependencies(defn_iface, instances, move(frontier), output_deps, output_dep_srcs, output_deps_lookup);
+}
+
+/* Splits update_state by the definition's clock inputs. A domain's state
+ * deps are only what its own ticks read, so stepping one clock skips the
+ * logic feeding registers on every other clock */
+void SimInfo::analyzeClockDomains(const IFace &defn_iface, const vector<Instance> &instances)
+{
+  clock_domains.resize(defn_iface.getClkSources().size());
+  for (const Instance *stateful_inst : stateful_insts) {
+    const SimInfo &inst_info = stateful_inst->getSimInfo();
+    const vector<ClkSink> &clk_sinks = stateful_inst->getIFace().getClkSinks();
+    for (unsigned i = 0; i < clk_sinks.size(); i++) {
+      int clk = defn_iface.getClkSourceIndex(clk_sinks[i].getSource());
+      if (clk >= 0 && inst_info.hasClockDomain(i)) {
+        clock_domains[clk].ticks.emplace_back(stateful_inst, i);
+      }
+    }
+  }
+
+  for (ClockDomain &domain : clock_domains) {
+    if (domain.ticks.empty()) {
+      continue;
+    }
+
+    vector<const Sink *> frontier;
+    for (const auto &tick : domain.ticks) {
+      for (const Source *src : tick.first->getSimInfo().getClockStateSources(tick.second)) {
+        frontier.push_back(tick.first->getIFace().getSink(src));
+      }
+    }
+
+    vector<bool> dep_insts;
+    analyzeDependencies(defn_iface, instances, move(frontier), domain.state_deps, domain.state_dep_srcs, dep_insts);
+  }
 }
 
 void SimInfo::calculateStateOffsets()
 {
   unsigned offset = 0;
   for (const Instance *inst : stateful_insts) {
-    offset_map[inst] = offset;
+    offsets[getInstNum(inst)] = offset;
     offset += inst->getDefinition().getSimInfo().getNumStateBytes();
   }
 
   num_state_bytes = offset;
 }
 
-void SimInfo::calculateInstanceNumbers(const vector<Instance> &instances)
+unsigned SimInfo::getInstNum(const Instance *inst) const
 {
-  unsigned num = 0;
-  for (const Instance &inst : instances) {
-    inst_nums[&inst] = num;
-    num++;
-  }
+  return inst - first_inst;
 }
 
 SimInfo::SimInfo(const IFace &defn_iface, const vector<Instance> &instances)
   : stateful_insts(filterStatefulInstances(instances)),
     state_deps(),
     output_deps(),
-    state_deps_lookup(),
-    output_deps_lookup(),
-    offset_map(),
+    first_inst(instances.data()),
+    state_deps_lookup(instances.size(), false),
+    output_deps_lookup(instances.size(), false),
+    offsets(instances.size(), 0),
     primitive(),
     is_stateful(stateful_insts.size() > 0),
     num_state_bytes(0),
     state_dep_srcs(),
-    output_dep_srcs()
+    output_dep_srcs(),
+    clock_domains()
 {
   if (is_stateful) {
-    analyzeStateDeps(defn_iface);
+    analyzeStateDeps(defn_iface, instances);
+    analyzeClockDomains(defn_iface, instances);
     calculateStateOffsets();
   }
-  calculateInstanceNumbers(instances);
-
-  analyzeOutputDeps(defn_iface);
-
-  for (const Instance *inst : output_deps) {
-    output_deps_lookup.insert(inst);
-  }
 
-  for (const Instance *inst : state_deps) {
-    state_deps_lookup.insert(inst);
-  }
+  analyzeOutputDeps(defn_iface, instances);
 }
 
 SimInfo::SimInfo(const IFace &defn_iface, const Primitive &primitive_)
   : stateful_insts(),
     state_deps(),
     output_deps(),
+    first_inst(nullptr),
     state_deps_lookup(),
     output_deps_lookup(),
+    offsets(),
     primitive(primitive_),
     is_stateful(primitive->is_stateful),
     num_state_bytes(primitive->num_state_bytes),
     state_dep_srcs(),
-    output_dep_srcs()
+    output_dep_srcs(),
+    clock_domains(defn_iface.getClkSources().size())
 {
   if (is_stateful) {
     for (const Source &src : defn_iface.getSources()) {
@@ -240,6 +286,67 @@ SimInfo::SimInfo(const IFace &defn_iface, const Primitive &primitive_)
   }
 }
 
+SimInfo::SimInfo(const IFace &defn_iface, const vector<Instance> &instances, const SimOrders &orders)
+  : stateful_insts(filterStatefulInstances(instances)),
+    state_deps(),
+    output_deps(),
+    first_inst(instances.data()),
+    state_deps_lookup(instances.size(), false),
+    output_deps_lookup(instances.size(), false),
+    offsets(instances.size(), 0),
+    primitive(),
+    is_stateful(stateful_insts.size() > 0),
+    num_state_bytes(0),
+    state_dep_srcs(),
+    output_dep_srcs(),
+    clock_domains()
+{
+  auto restoreInsts = [&](const vector<uint32_t> &order, vector<const Instance *> &deps, vector<bool> &lookup) {
+    for (uint32_t idx : order) {
+      deps.push_back(&instances[idx]);
+      lookup[idx] = true;
+    }
+  };
+  auto restoreSrcs = [&](const vector<uint32_t> &order, vector<const Source *> &srcs) {
+    for (uint32_t idx : order) {
+      srcs.push_back(&defn_iface.getSources()[idx]);
+    }
+  };
+
+  restoreInsts(orders.state_deps, state_deps, state_deps_lookup);
+  restoreInsts(orders.output_deps, output_deps, output_deps_lookup);
+  restoreSrcs(orders.state_dep_srcs, state_dep_srcs);
+  restoreSrcs(orders.output_dep_srcs, output_dep_srcs);
+
+  /* Clock domains are rebuilt from the saved clock wiring, as they only
+   * walk the logic in front of the stateful instances */
+  if (is_stateful) {
+    analyzeClockDomains(defn_iface, instances);
+    calculateStateOffsets();
+  }
+}
+
+SimOrders SimInfo::getOrders(const IFace &defn_iface) const
+{
+  SimOrders orders;
+  for (const Instance *inst : state_deps) {
+    orders.state_deps.push_back(getInstNum(inst));
+  }
+  for (const Instance *inst : output_deps) {
+    orders.output_deps.push_back(getInstNum(inst));
+  }
+
+  const Source *first_src = defn_iface.getSources().data();
+  for (const Source *src : state_dep_srcs) {
+    orders.state_dep_srcs.push_back(src - first_src);
+  }
+  for (const Source *src : output_dep_srcs) {
+    orders.output_dep_srcs.push_back(src - first_src);
+  }
+
+  return orders;
+}
+
 void SimInfo::initializeState(uint8_t *state) const
 {
   for (const Instance *stateful : stateful_insts) {
@@ -261,6 +368,52 @@ vector<uint8_t> SimInfo::allocateState() const
   return state;
 }
 
+void SimInfo::spreadStateToLanes(const uint8_t *state, uint8_t *batch_state, unsigned lanes) const
+{
+  for (const Instance *stateful : stateful_insts) {
+    const SimInfo &inst_info = stateful->getSimInfo();
+    const uint8_t *inst_state = state + getOffset(stateful);
+    uint8_t *inst_batch_state = batch_state + getOffset(stateful) * lanes;
+
+    if (!inst_info.isPrimitive()) {
+      inst_info.spreadStateToLanes(inst_state, inst_batch_state, lanes);
+      continue;
+    }
+
+    unsigned elem_bytes = inst_info.getPrimitive().state_elem_bytes;
+    for (unsigned elem = 0; elem * elem_bytes < inst_info.getNumStateBytes(); elem++) {
+      for (unsigned lane = 0; lane < lanes; lane++) {
+        memcpy(inst_batch_state + (elem * lanes + lane) * elem_bytes, inst_state + elem * elem_bytes, elem_bytes);
+      }
+    }
+  }
+}
+
+vector<uint8_t> SimInfo::allocateBitSlicedState(unsigned lanes) const
+{
+  /* Offsets scale by lanes like batched state, so bit b of the scalar state
+   * simply becomes word b, with every simulation starting out the same */
+  vector<uint8_t> state = allocateState();
+  unsigned word_bytes = lanes / 8;
+  vector<uint8_t> sliced_state(num_state_bytes * lanes, 0);
+  for (unsigned bit = 0; bit < num_state_bytes * 8; bit++) {
+    if (state[bit / 8] & (1 << (bit % 8))) {
+      memset(sliced_state.data() + bit * word_bytes, 0xff, word_bytes);
+    }
+  }
+
+  return sliced_state;
+}
+
+vector<uint8_t> SimInfo::allocateBatchState(unsigned lanes) const
+{
+  vector<uint8_t> state = allocateState();
+  vector<uint8_t> batch_state(num_state_bytes * lanes, 0);
+  spreadStateToLanes(state.data(), batch_state.data(), lanes);
+
+  return batch_state;
+}
+
 void SimInfo::print(const string &prefix) const
 {
   cout << prefix << "Bytes for state: " << num_state_bytes << endl;
@@ -288,6 +441,17 @@ void SimInfo::print(const string &prefix) const
   for (const Source *src : state_dep_srcs) {
     cout << prefix << "  self." << src->getName() << endl;
   }
+
+  for (unsigned i = 0; i < clock_domains.size() && !isPrimitive(); i++) {
+    if (!hasClockDomain(i)) {
+      continue;
+    }
+
+    cout << prefix << "Clock domain " << i << ":\n";
+    for (const auto &tick : clock_domains[i].ticks) {
+      cout << prefix << "  " << tick.first->getName() << endl;
+    }
+  }
 }
 
 }
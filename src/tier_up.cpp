@@ -0,0 +1,86 @@
+#include <jitsim/tier_up.hpp>
+
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+
+namespace JITSim {
+
+using namespace std;
+
+static llvm::TargetMachine * selectTarget(unsigned opt_level)
+{
+  llvm::CodeGenOpt::Level codegen_level = llvm::CodeGenOpt::Default;
+  if (opt_level >= 3) {
+    codegen_level = llvm::CodeGenOpt::Aggressive;
+  }
+
+  return llvm::EngineBuilder().setOptLevel(codegen_level).selectTarget();
+}
+
+TierUpCompiler::TierUpCompiler(JIT &jit_, const llvm::DataLayout &data_layout, unsigned opt_level_)
+  : jit(jit_),
+    target_machine(selectTarget(opt_level_)),
+    builder(data_layout, *target_machine),
+    opt_level(opt_level_),
+    requests(),
+    finished(),
+    lock(),
+    wakeup(),
+    shutting_down(false),
+    worker([this]() { run(); })
+{
+}
+
+TierUpCompiler::~TierUpCompiler()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    shutting_down = true;
+  }
+  wakeup.notify_one();
+  worker.join();
+}
+
+void TierUpCompiler::enqueue(const string &name, ModuleGenerator generator, const string &cache_key)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    requests.push_back({ name, generator, cache_key });
+  }
+  wakeup.notify_one();
+}
+
+vector<TierUpCompiler::Result> TierUpCompiler::takeFinished()
+{
+  vector<Result> done;
+
+  lock_guard<mutex> guard(lock);
+  done.swap(finished);
+
+  return done;
+}
+
+void TierUpCompiler::run()
+{
+  while (true) {
+    Request request;
+    {
+      unique_lock<mutex> guard(lock);
+      wakeup.wait(guard, [this]() { return shutting_down || !requests.empty(); });
+      if (shutting_down) {
+        return;
+      }
+
+      request = move(requests.front());
+      requests.pop_front();
+    }
+
+    /* The builder's LLVMContext is only ever touched from this thread */
+    DiskObjectCache::ObjectPtr object =
+      jit.compileObject(request.generator(builder), *target_machine, opt_level, request.cache_key);
+
+    lock_guard<mutex> guard(lock);
+    finished.emplace_back(request.name, move(object));
+  }
+}
+
+}
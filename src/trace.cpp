@@ -0,0 +1,215 @@
+#include <jitsim/trace.hpp>
+#include "utils.hpp"
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+#include <cstring>
+
+namespace JITSim {
+
+using namespace std;
+
+thread_local TraceWriter *TraceWriter::current = nullptr;
+
+/* VCD identifiers are strings of the printable characters '!' to '~' */
+static string makeIdentifier(unsigned idx)
+{
+  string id;
+  do {
+    id += (char)('!' + idx % 94);
+    idx /= 94;
+  } while (idx > 0);
+
+  return id;
+}
+
+TraceWriter::TraceWriter(const Definition &top, const ProbeLayout &layout, const uint8_t *probes_,
+                         const string &path, size_t capacity)
+  : probes(probes_),
+    num_bytes(layout.getNumBytes(top)),
+    signals(),
+    time(0),
+    ring(capacity),
+    head(0),
+    tail(0),
+    done(false),
+    out(path),
+    writer()
+{
+  assert((capacity & (capacity - 1)) == 0 && "Trace ring capacity must be a power of two");
+
+  if (!out.is_open()) {
+    llvm::errs() << "Unable to open trace file " << path << "\n";
+    return;
+  }
+
+  writeHeader(top, layout);
+
+  writer = thread([this]() { drain(); });
+}
+
+TraceWriter::~TraceWriter()
+{
+  if (current == this) {
+    current = nullptr;
+  }
+
+  done = true;
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
+
+void TraceWriter::declareScope(const Definition &defn, const ProbeLayout &layout, unsigned base)
+{
+  for (const Instance &inst : defn.getInstances()) {
+    const Definition &inst_defn = inst.getDefinition();
+    vector<pair<string, const ProbeLayout::Signal *>> ports;
+    for (const Source &src : inst.getIFace().getSources()) {
+      if (const ProbeLayout::Signal *signal = layout.getSignal(&src)) {
+        ports.emplace_back(src.getName(), signal);
+      }
+    }
+    for (const Sink &sink : inst.getIFace().getSinks()) {
+      if (const ProbeLayout::Signal *signal = layout.getSignal(&sink)) {
+        ports.emplace_back(sink.getName(), signal);
+      }
+    }
+
+    if (ports.empty() && !layout.hasProbes(inst_defn)) {
+      continue;
+    }
+
+    out << "$scope module " << inst.getName() << " $end\n";
+    for (const auto &port : ports) {
+      TracedSignal traced { makeIdentifier(signals.size()), port.second->width };
+      out << "$var wire " << traced.width << " " << traced.id << " " << port.first << " $end\n";
+      signals[base + port.second->offset] = traced;
+    }
+    if (layout.hasProbes(inst_defn)) {
+      declareScope(inst_defn, layout, base + layout.getOffset(&inst));
+    }
+    out << "$upscope $end\n";
+  }
+}
+
+void TraceWriter::writeHeader(const Definition &top, const ProbeLayout &layout)
+{
+  out << "$timescale 1ns $end\n";
+  out << "$scope module " << top.getName() << " $end\n";
+  declareScope(top, layout, 0);
+  out << "$upscope $end\n";
+  out << "$enddefinitions $end\n";
+
+  /* The probe buffer starts out zeroed, and only changes get pushed */
+  out << "#0\n$dumpvars\n";
+  for (const auto &signal : signals) {
+    if (signal.second.width == 1) {
+      out << "0" << signal.second.id << "\n";
+    } else {
+      out << "b0 " << signal.second.id << "\n";
+    }
+  }
+  out << "$end\n";
+}
+
+void TraceWriter::push(const uint8_t *slot)
+{
+  /* Slots of other probe buffers could alias a traced offset */
+  if (slot < probes || slot >= probes + num_bytes) {
+    return;
+  }
+
+  uint32_t offset = slot - probes;
+  auto iter = signals.find(offset);
+  if (iter == signals.end()) {
+    return;
+  }
+
+  unsigned num_bytes = getNumBytes(iter->second.width);
+  uint64_t pos = head.load(memory_order_relaxed);
+  for (uint32_t chunk = 0; chunk * 8 < num_bytes; chunk++, pos++) {
+    Entry entry { time, offset, chunk, 0 };
+    memcpy(&entry.bits, slot + chunk * 8, min(8u, num_bytes - chunk * 8));
+
+    while (pos - tail.load(memory_order_acquire) >= ring.size()) {
+      this_thread::yield();
+    }
+    ring[pos & (ring.size() - 1)] = entry;
+    head.store(pos + 1, memory_order_release);
+  }
+}
+
+void TraceWriter::drain()
+{
+  uint64_t written_time = 0;
+  vector<uint64_t> value;
+
+  while (true) {
+    uint64_t pos = tail.load(memory_order_relaxed);
+    uint64_t end = head.load(memory_order_acquire);
+    if (pos == end) {
+      if (done) {
+        /* Pick up entries pushed right before shutdown */
+        if (head.load(memory_order_acquire) == pos) {
+          break;
+        }
+        continue;
+      }
+      this_thread::sleep_for(chrono::microseconds(100));
+      continue;
+    }
+
+    for (; pos != end; pos++) {
+      const Entry &entry = ring[pos & (ring.size() - 1)];
+      const TracedSignal &signal = signals.find(entry.offset)->second;
+      unsigned num_chunks = (signal.width + 63) / 64;
+
+      if (entry.chunk == 0) {
+        value.assign(num_chunks, 0);
+      }
+      value[entry.chunk] = entry.bits;
+      if (entry.chunk + 1 != num_chunks) {
+        continue;
+      }
+
+      if (entry.time != written_time) {
+        out << "#" << entry.time << "\n";
+        written_time = entry.time;
+      }
+
+      if (signal.width == 1) {
+        out << (value[0] & 1) << signal.id << "\n";
+      } else {
+        out << "b";
+        for (int bit = signal.width - 1; bit >= 0; bit--) {
+          out << ((value[bit / 64] >> (bit % 64)) & 1);
+        }
+        out << " " << signal.id << "\n";
+      }
+    }
+
+    tail.store(pos, memory_order_release);
+  }
+
+  out.flush();
+}
+
+}
+
+using JITSim::TraceWriter;
+
+void jitsim_trace_change(const uint8_t *slot)
+{
+  if (TraceWriter::current) {
+    TraceWriter::current->push(slot);
+  }
+}
+
+void jitsim_trace_cycle()
+{
+  if (TraceWriter::current) {
+    TraceWriter::current->advance();
+  }
+}
@@ -1,6 +1,11 @@
 #ifndef JITSIM_UTILS_HPP_INCLUDED
 #define JITSIM_UTILS_HPP_INCLUDED
 
+#include <llvm/ADT/APInt.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 namespace JITSim {
   template<class T> static T& condDeref(T& t) { return t; }
   template<class T> static T& condDeref(T*& t) { return *t; }
@@ -13,6 +18,20 @@ namespace JITSim {
       return bits / 8 + 1;
     }
   }
+
+  /* Reads a bits wide value stored as whole bytes, copying it into zeroed
+   * words so the bytes past the end of the value are never touched */
+  inline llvm::APInt loadAPInt(const uint8_t *ptr, unsigned bits)
+  {
+    unsigned num64s = bits / 64;
+    if (bits % 64 != 0) {
+      num64s++;
+    }
+    std::vector<uint64_t> safe_arr(num64s, 0);
+    memcpy(safe_arr.data(), ptr, getNumBytes(bits));
+
+    return llvm::APInt(bits, llvm::ArrayRef<uint64_t>(safe_arr.data(), num64s));
+  }
 }
 
 #endif
@@ -0,0 +1,136 @@
+#ifndef JITSIM_TESTS_COMPARE_HPP_INCLUDED
+#define JITSIM_TESTS_COMPARE_HPP_INCLUDED
+
+#include <jitsim/circuit.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* Shared by the checks: circuits are compared through a canonical text
+ * form, so a mismatch can point at the first line that differs */
+
+namespace JITSimTest {
+
+inline std::string describeSelect(const JITSim::Sink &sink)
+{
+  if (!sink.isConnected()) {
+    return "unconnected";
+  }
+
+  std::string desc;
+  for (const JITSim::SourceSlice &slice : sink.getSelect().getSlices()) {
+    if (slice.isConstant()) {
+      desc += " " + std::to_string(slice.getWidth()) + "'" + slice.getConstant().toString(16, false);
+    } else {
+      desc += " " + slice.repr();
+    }
+  }
+
+  return desc;
+}
+
+inline std::string describeClock(const JITSim::ClkSink &clk)
+{
+  return clk.isConnected() ? clk.getSource()->getName() : "unconnected";
+}
+
+/* Ports, instances in order along with their arguments and connections,
+ * and the dependency orders of one definition */
+inline std::string DescribeDefinition(const JITSim::Definition &defn)
+{
+  std::ostringstream out;
+  const JITSim::IFace &iface = defn.getIFace();
+
+  out << "definition " << defn.getName() << "\n";
+  for (const JITSim::Source &src : iface.getSources()) {
+    out << "  input " << src.getName() << " " << src.getWidth() << "\n";
+  }
+  for (const JITSim::Sink &sink : iface.getSinks()) {
+    out << "  output " << sink.getName() << " " << sink.getWidth() << " <-" << describeSelect(sink) << "\n";
+  }
+  for (const JITSim::ClkSource &clk : iface.getClkSources()) {
+    out << "  clock input " << clk.getName() << "\n";
+  }
+  for (const JITSim::ClkSink &clk : iface.getClkSinks()) {
+    out << "  clock output " << clk.getName() << "\n";
+  }
+
+  for (const JITSim::Instance &inst : defn.getInstances()) {
+    out << "  instance " << inst.getName() << " of " << inst.getDefinition().getName() << "\n";
+    for (const auto &arg : inst.getArgs()) {
+      out << "    arg " << JITSim::GetSymbolName(arg.first) << " = " << JITSim::GetSymbolName(arg.second) << "\n";
+    }
+    for (const JITSim::Sink &sink : inst.getIFace().getSinks()) {
+      out << "    " << sink.getName() << " <-" << describeSelect(sink) << "\n";
+    }
+    for (const JITSim::ClkSink &clk : inst.getIFace().getClkSinks()) {
+      out << "    clock " << clk.getName() << " <- " << describeClock(clk) << "\n";
+    }
+  }
+
+  JITSim::SimOrders orders = defn.getSimInfo().getOrders(iface);
+  auto describeOrder = [&](const char *what, const std::vector<uint32_t> &order) {
+    out << "  " << what;
+    for (uint32_t idx : order) {
+      out << " " << idx;
+    }
+    out << "\n";
+  };
+  describeOrder("state deps", orders.state_deps);
+  describeOrder("output deps", orders.output_deps);
+  describeOrder("state dep sources", orders.state_dep_srcs);
+  describeOrder("output dep sources", orders.output_dep_srcs);
+
+  return out.str();
+}
+
+/* Every unique definition by name, then the top */
+inline std::string DescribeCircuit(const JITSim::Circuit &circuit)
+{
+  std::vector<std::string> defns;
+  for (const JITSim::Definition *defn : circuit.getUniqueDefinitions()) {
+    defns.push_back(DescribeDefinition(*defn));
+  }
+  std::sort(defns.begin(), defns.end());
+
+  std::string desc;
+  for (const std::string &defn : defns) {
+    desc += defn;
+  }
+
+  return desc + "top " + circuit.getTopDefinition().getName() + "\n";
+}
+
+/* Reports the first differing line on stderr */
+inline bool CheckSame(const std::string &what, const std::string &expected, const std::string &actual)
+{
+  if (expected == actual) {
+    return true;
+  }
+
+  std::istringstream expected_lines(expected), actual_lines(actual);
+  std::string expected_line, actual_line;
+  for (unsigned line = 1; ; line++) {
+    bool has_expected = (bool)std::getline(expected_lines, expected_line);
+    bool has_actual = (bool)std::getline(actual_lines, actual_line);
+    if (!has_expected) {
+      expected_line = "<end>";
+    }
+    if (!has_actual) {
+      actual_line = "<end>";
+    }
+    if (expected_line != actual_line) {
+      std::cerr << what << ": line " << line << " differs\n"
+                << "  expected: " << expected_line << "\n"
+                << "  actual:   " << actual_line << "\n";
+      return false;
+    }
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+#include <jitsim/circuit_file.hpp>
+#include <jitsim/json_loader.hpp>
+
+#include "compare.hpp"
+
+using namespace std;
+
+/* Saves circuits to a circuit file, loads them back and checks that the
+ * definitions, connections and dependency orders survive unchanged */
+
+/* Two structurally identical children under different names, a folded
+ * mux feedback register, a reset register on a second clock, slices and
+ * constants */
+static const char *Mixed = R"({"top":"global.Top",
+"namespaces":{"global":{"modules":{
+"Swap":{"type":["Record",[["in",["Array",8,"BitIn"]],["out",["Array",8,"Bit"]]]],
+"instances":{},
+"connections":[["self.in.0","self.out.4"],["self.in.1","self.out.5"],["self.in.2","self.out.6"],["self.in.3","self.out.7"],
+               ["self.in.4","self.out.0"],["self.in.5","self.out.1"],["self.in.6","self.out.2"],["self.in.7","self.out.3"]]},
+"SwapCopy":{"type":["Record",[["in",["Array",8,"BitIn"]],["out",["Array",8,"Bit"]]]],
+"instances":{},
+"connections":[["self.in.0","self.out.4"],["self.in.1","self.out.5"],["self.in.2","self.out.6"],["self.in.3","self.out.7"],
+               ["self.in.4","self.out.0"],["self.in.5","self.out.1"],["self.in.6","self.out.2"],["self.in.7","self.out.3"]]},
+"Top":{"type":["Record",[["a",["Array",8,"BitIn"]],["en","BitIn"],["rst",["Named","coreir.arstIn"]],
+                         ["CLKA",["Named","coreir.clkIn"]],["CLKB",["Named","coreir.clkIn"]],
+                         ["swapped",["Array",8,"Bit"]],["held",["Array",8,"Bit"]],["count",["Array",8,"Bit"]]]],
+"instances":{
+  "s0":{"modref":"global.Swap"},
+  "s1":{"modref":"global.SwapCopy"},
+  "hold":{"genref":"coreir.reg","genargs":{"width":["Int",8]},"modargs":{"init":[["BitVector",8],"8'h5a"]}},
+  "hold_mux":{"genref":"coreir.mux","genargs":{"width":["Int",8]}},
+  "counter":{"genref":"coreir.reg_arst","genargs":{"width":["Int",8]},
+             "modargs":{"init":[["BitVector",8],"8'h00"],"arst_posedge":["Bool",false]}},
+  "inc":{"genref":"coreir.add","genargs":{"width":["Int",8]}},
+  "one":{"genref":"coreir.const","genargs":{"width":["Int",8]},"modargs":{"value":[["BitVector",8],"8'h01"]}}
+},
+"connections":[
+  ["s0.in","self.a"],["s1.in","s0.out"],["s1.out","self.swapped"],
+  ["hold_mux.in0","hold.out"],["hold_mux.in1","s0.out"],["hold_mux.sel","self.en"],
+  ["hold.in","hold_mux.out"],["hold.clk","self.CLKA"],["hold.out","self.held"],
+  ["inc.in0","counter.out"],["inc.in1","one.out"],["counter.in","inc.out"],
+  ["counter.clk","self.CLKB"],["counter.arst","self.rst"],["counter.out","self.count"]
+]}
+}}}})";
+
+static string tempPath()
+{
+  char path[] = "/tmp/jitsim_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    cerr << "Unable to create a temporary file\n";
+    exit(1);
+  }
+  close(fd);
+
+  return path;
+}
+
+static bool checkRoundTrip(const string &name, const string &json_path)
+{
+  unique_ptr<JITSim::Circuit> original = JITSim::LoadJSONNetlist(json_path);
+  if (!original) {
+    cerr << name << ": failed to load\n";
+    return false;
+  }
+
+  string path = tempPath();
+  unique_ptr<JITSim::Circuit> loaded;
+  if (JITSim::SaveCircuit(*original, path) && JITSim::IsCircuitFile(path)) {
+    loaded = JITSim::LoadCircuit(path);
+  }
+  unlink(path.c_str());
+  if (!loaded) {
+    cerr << name << ": failed to save and load the circuit file\n";
+    return false;
+  }
+
+  /* Saving keeps the order of the unique definitions too */
+  string original_order, loaded_order;
+  for (const JITSim::Definition *defn : original->getUniqueDefinitions()) {
+    original_order += defn->getName() + "\n";
+  }
+  for (const JITSim::Definition *defn : loaded->getUniqueDefinitions()) {
+    loaded_order += defn->getName() + "\n";
+  }
+
+  return JITSimTest::CheckSame(name + " order", original_order, loaded_order) &&
+         JITSimTest::CheckSame(name, JITSimTest::DescribeCircuit(*original), JITSimTest::DescribeCircuit(*loaded));
+}
+
+int main()
+{
+  bool ok = checkRoundTrip("counter", "tests/counter.json");
+
+  string mixed = tempPath();
+  {
+    ofstream out(mixed);
+    out << Mixed;
+  }
+  ok &= checkRoundTrip("mixed", mixed);
+  unlink(mixed.c_str());
+
+  if (!ok) {
+    return 1;
+  }
+  cout << "circuit file: ok\n";
+
+  return 0;
+}
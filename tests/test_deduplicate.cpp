@@ -0,0 +1,155 @@
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <jitsim/circuit.hpp>
+
+using namespace std;
+using namespace JITSim;
+
+/* Checks Circuit::deduplicate. The top holds cells that each wrap a
+ * register fed from a slice of the top input and a constant. One cell
+ * matches the first under another name and is merged into it, the others
+ * differ from it in an instance argument, the constant or the clock
+ * feeding the register and stay apart. A copy of the top comes right
+ * before it, and the top is still not merged into it */
+
+/* Never compiled, so the generators are empty */
+static const Definition & makeRegister(deque<Definition> &definitions)
+{
+  vector<Sink> sinks;
+  sinks.emplace_back("out", 8);
+  vector<Source> sources;
+  sources.emplace_back("in", 8);
+  vector<ClkSource> clk_sources;
+  clk_sources.emplace_back("clk");
+
+  definitions.emplace_back("test.reg",
+    IFace("self", move(sinks), move(sources), vector<ClkSink>(), move(clk_sources), true),
+    Primitive(true, 1, { "in" }, {},
+      [](auto &env, auto &args, auto &inst) { return vector<llvm::Value *>(); },
+      [](auto &env, auto &args, auto &inst) {}));
+
+  return definitions.back();
+}
+
+static const Definition & makeCell(deque<Definition> &definitions, const string &name, const Definition &reg,
+                                   const string &init, uint64_t constant, unsigned clk)
+{
+  vector<Sink> sinks;
+  sinks.emplace_back("out", 8);
+  vector<Source> sources;
+  sources.emplace_back("in", 8);
+  vector<ClkSource> clk_sources;
+  clk_sources.emplace_back("CLKA");
+  clk_sources.emplace_back("CLKB");
+
+  vector<Instance> instances;
+  instances.emplace_back(reg.makeInstance("r"));
+  instances.back().setArg("init", init);
+
+  definitions.emplace_back(name,
+    IFace("self", move(sinks), move(sources), vector<ClkSink>(), move(clk_sources), true),
+    move(instances),
+    [constant, clk](Definition &defn, vector<Instance> &insts) {
+      Instance &r = insts[0];
+      vector<SourceSlice> slices;
+      slices.emplace_back(&defn, nullptr, &defn.getIFace().getSources()[0], 0, 4);
+      slices.emplace_back(llvm::APInt(4, constant));
+      r.getIFace().getSinks()[0].connect(Select(move(slices)));
+      r.getIFace().getClkSinks()[0].connect(&defn.getIFace().getClkSources()[clk]);
+
+      defn.getIFace().getSinks()[0].connect(Select(SourceSlice(nullptr, &r, &r.getIFace().getSources()[0], 0, 8)));
+    });
+
+  return definitions.back();
+}
+
+static const Definition & makeTop(deque<Definition> &definitions, const string &name,
+                                  const vector<pair<string, const Definition *>> &cells)
+{
+  vector<Sink> sinks;
+  vector<Instance> instances;
+  for (const auto &cell : cells) {
+    sinks.emplace_back("o_" + cell.first, 8);
+    instances.emplace_back(cell.second->makeInstance(cell.first));
+  }
+  vector<Source> sources;
+  sources.emplace_back("in", 8);
+  vector<ClkSource> clk_sources;
+  clk_sources.emplace_back("CLKA");
+  clk_sources.emplace_back("CLKB");
+
+  definitions.emplace_back(name,
+    IFace("self", move(sinks), move(sources), vector<ClkSink>(), move(clk_sources), true),
+    move(instances),
+    [](Definition &defn, vector<Instance> &insts) {
+      for (size_t i = 0; i < insts.size(); i++) {
+        InstanceIFace &cell = insts[i].getIFace();
+        cell.getSinks()[0].connect(Select(SourceSlice(&defn, nullptr, &defn.getIFace().getSources()[0], 0, 8)));
+        for (unsigned clk = 0; clk < 2; clk++) {
+          cell.getClkSinks()[clk].connect(&defn.getIFace().getClkSources()[clk]);
+        }
+        defn.getIFace().getSinks()[i].connect(Select(SourceSlice(nullptr, &insts[i], &cell.getSources()[0], 0, 8)));
+      }
+    });
+
+  return definitions.back();
+}
+
+int main()
+{
+  deque<Definition> definitions;
+  const Definition &reg = makeRegister(definitions);
+  vector<pair<string, const Definition *>> cells = {
+    { "a", &makeCell(definitions, "CellA", reg, "0", 5, 0) },
+    { "b", &makeCell(definitions, "CellB", reg, "0", 5, 0) },
+    { "arg", &makeCell(definitions, "CellArg", reg, "1", 5, 0) },
+    { "constant", &makeCell(definitions, "CellConstant", reg, "0", 6, 0) },
+    { "clock", &makeCell(definitions, "CellClock", reg, "0", 5, 1) }
+  };
+  makeTop(definitions, "Twin", cells);
+  makeTop(definitions, "Top", cells);
+
+  Circuit circuit(move(definitions));
+
+  vector<string> unique;
+  for (const Definition *defn : circuit.getUniqueDefinitions()) {
+    unique.push_back(defn->getName());
+  }
+  const vector<string> expected = { "test.reg", "CellA", "CellArg", "CellConstant", "CellClock", "Twin", "Top" };
+
+  bool ok = true;
+  if (unique != expected) {
+    cerr << "unique definitions:";
+    for (const string &name : unique) {
+      cerr << " " << name;
+    }
+    cerr << "\n";
+    ok = false;
+  }
+
+  const Definition &top = circuit.getTopDefinition();
+  if (top.getName() != "Top" || &top != &circuit.getDefinitions().back()) {
+    cerr << "the top was replaced by " << top.getName() << "\n";
+    ok = false;
+  }
+  if (&top.getInstance("b").getDefinition() != &top.getInstance("a").getDefinition()) {
+    cerr << "b was not merged into a\n";
+    ok = false;
+  }
+  for (const char *cell : { "arg", "constant", "clock" }) {
+    if (&top.getInstance(cell).getDefinition() == &top.getInstance("a").getDefinition()) {
+      cerr << cell << " was merged into a\n";
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  cout << "deduplicate: ok\n";
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#include <jitsim/jit_frontend.hpp>
+#include <jitsim/json_loader.hpp>
+
+using namespace std;
+
+/* Checks Circuit::foldRegisterEnables against the registers it rewrites.
+ * The same design is loaded once with each mux feeding its register
+ * directly, which folds, and once through a pass through module, which
+ * does not. Both are stepped through the same stimulus and compared with
+ * each other and with a model of the registers every cycle. The design
+ * has an active high and an active low enable, a register whose output
+ * also feeds an adder, and a negative edge reset register with a mux
+ * enable, which is never folded */
+
+static const char *Wire = R"("Wire":{"type":["Record",[["I",["Array",8,"BitIn"]],["O",["Array",8,"Bit"]]]],
+"instances":{},
+"connections":[["self.I","self.O"]]},
+)";
+
+static string reg(const string &name, const string &init)
+{
+  return "\"" + name + "\":{\"genref\":\"coreir.reg\",\"genargs\":{\"width\":[\"Int\",8]},"
+         "\"modargs\":{\"init\":[[\"BitVector\",8],\"8'h" + init + "\"]}},\n";
+}
+
+static string inst(const string &name, const string &genref)
+{
+  return "\"" + name + "\":{\"genref\":\"" + genref + "\",\"genargs\":{\"width\":[\"Int\",8]}},\n";
+}
+
+static string conn(const string &a, const string &b)
+{
+  return "[\"" + a + "\",\"" + b + "\"],";
+}
+
+static string writeDesign(bool through_wire)
+{
+  string insts = reg("hi", "11") + reg("lo", "22") + reg("shared", "33") +
+                 "\"ar\":{\"genref\":\"coreir.reg_arst\",\"genargs\":{\"width\":[\"Int\",8]},"
+                 "\"modargs\":{\"init\":[[\"BitVector\",8],\"8'h44\"],\"arst_posedge\":[\"Bool\",false]}},\n" +
+                 inst("mux_hi", "coreir.mux") + inst("mux_lo", "coreir.mux") + inst("mux_shared", "coreir.mux") +
+                 inst("mux_ar", "coreir.mux") + inst("sum", "coreir.add");
+
+  string conns;
+  for (const char *name : { "hi", "lo", "shared", "ar" }) {
+    string reg_name = name, mux = string("mux_") + name;
+    if (through_wire) {
+      insts += "\"wire_" + reg_name + "\":{\"modref\":\"global.Wire\"},\n";
+      conns += conn("wire_" + reg_name + ".I", mux + ".out") + conn(reg_name + ".in", "wire_" + reg_name + ".O");
+    } else {
+      conns += conn(reg_name + ".in", mux + ".out");
+    }
+    conns += conn(reg_name + ".clk", "self.CLK") + conn("self.q_" + reg_name, reg_name + ".out");
+  }
+  insts.erase(insts.size() - 2);
+
+  /* mux_lo holds on in1, so its register loads while en is low */
+  conns += conn("mux_hi.in0", "hi.out") + conn("mux_hi.in1", "self.d") + conn("mux_hi.sel", "self.en") +
+           conn("mux_lo.in0", "self.d") + conn("mux_lo.in1", "lo.out") + conn("mux_lo.sel", "self.en") +
+           conn("sum.in0", "shared.out") + conn("sum.in1", "self.d") + conn("self.sum", "sum.out") +
+           conn("mux_shared.in0", "shared.out") + conn("mux_shared.in1", "sum.out") +
+           conn("mux_shared.sel", "self.en2") +
+           conn("mux_ar.in0", "ar.out") + conn("mux_ar.in1", "self.d") + conn("mux_ar.sel", "self.en") +
+           conn("ar.arst", "self.rst");
+  conns.pop_back();
+
+  char path[] = "/tmp/jitsim_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    cerr << "Unable to create a temporary file\n";
+    exit(1);
+  }
+  close(fd);
+
+  ofstream out(path);
+  out << "{\"top\":\"global.Top\",\n\"namespaces\":{\"global\":{\"modules\":{\n"
+      << (through_wire ? Wire : "")
+      << "\"Top\":{\"type\":[\"Record\",[[\"d\",[\"Array\",8,\"BitIn\"]],[\"en\",\"BitIn\"],[\"en2\",\"BitIn\"],"
+         "[\"rst\",[\"Named\",\"coreir.arstIn\"]],[\"CLK\",[\"Named\",\"coreir.clkIn\"]],"
+         "[\"q_hi\",[\"Array\",8,\"Bit\"]],[\"q_lo\",[\"Array\",8,\"Bit\"]],[\"q_shared\",[\"Array\",8,\"Bit\"]],"
+         "[\"q_ar\",[\"Array\",8,\"Bit\"]],[\"sum\",[\"Array\",8,\"Bit\"]]]],\n"
+      << "\"instances\":{\n" << insts << "},\n"
+      << "\"connections\":[" << conns << "]}\n"
+      << "}}}}\n";
+
+  return path;
+}
+
+static unique_ptr<JITSim::Circuit> loadDesign(bool through_wire)
+{
+  string path = writeDesign(through_wire);
+  unique_ptr<JITSim::Circuit> circuit = JITSim::LoadJSONNetlist(path);
+  unlink(path.c_str());
+
+  return circuit;
+}
+
+static bool checkDefinition(const JITSim::Circuit &circuit, const char *inst, const string &expected)
+{
+  const string &actual = circuit.getTopDefinition().getInstance(inst).getDefinition().getName();
+  if (actual.compare(0, expected.size(), expected) != 0) {
+    cerr << inst << " is a " << actual << ", expected " << expected << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+int main()
+{
+  unique_ptr<JITSim::Circuit> folded = loadDesign(false);
+  unique_ptr<JITSim::Circuit> unfolded = loadDesign(true);
+  if (!folded || !unfolded) {
+    cerr << "Failed to load the generated design\n";
+    return 1;
+  }
+
+  bool ok = checkDefinition(*folded, "hi", "jitsim.reg_en_en_low_0") &&
+            checkDefinition(*folded, "lo", "jitsim.reg_en_en_low_1") &&
+            checkDefinition(*folded, "shared", "jitsim.reg_en_en_low_0") &&
+            checkDefinition(*folded, "ar", "coreir.reg_arst") &&
+            checkDefinition(*unfolded, "hi", "coreir.reg_width") &&
+            checkDefinition(*unfolded, "lo", "coreir.reg_width");
+  if (!ok) {
+    return 1;
+  }
+
+  JITSim::JITFrontend folded_jit(*folded);
+  JITSim::JITFrontend unfolded_jit(*unfolded);
+
+  uint8_t hi = 0x11, lo = 0x22, shared = 0x33, ar = 0x44;
+  mt19937 rng(1);
+  for (unsigned cycle = 0; cycle < 1000; cycle++) {
+    uint8_t d = rng();
+    bool en = rng() & 1, en2 = rng() & 1;
+    /* The reset is active low and asserted now and then */
+    bool rst = rng() % 8 != 0;
+
+    for (JITSim::JITFrontend *jit : { &folded_jit, &unfolded_jit }) {
+      jit->setInput("d", d);
+      jit->setInput("en", en);
+      jit->setInput("en2", en2);
+      jit->setInput("rst", rst);
+    }
+
+    uint8_t expected_ar = rst ? ar : 0x44;
+    const pair<const char *, uint64_t> expected[] = {
+      { "q_hi", hi }, { "q_lo", lo }, { "q_shared", shared }, { "sum", (uint8_t)(shared + d) },
+      { "q_ar", expected_ar }
+    };
+    const JITSim::LLVMStruct &folded_out = folded_jit.computeOutput();
+    const JITSim::LLVMStruct &unfolded_out = unfolded_jit.computeOutput();
+    for (const auto &port : expected) {
+      uint64_t folded_val = folded_out.getValue(port.first).getZExtValue();
+      uint64_t unfolded_val = unfolded_out.getValue(port.first).getZExtValue();
+      if (folded_val != port.second || unfolded_val != port.second) {
+        cerr << "cycle " << cycle << ": " << port.first << " is " << folded_val << " folded and "
+             << unfolded_val << " unfolded, expected " << port.second << "\n";
+        return 1;
+      }
+    }
+
+    folded_jit.updateState();
+    unfolded_jit.updateState();
+
+    hi = en ? d : hi;
+    lo = en ? lo : d;
+    shared = en2 ? (uint8_t)(shared + d) : shared;
+    ar = !rst ? 0x44 : en ? d : ar;
+  }
+
+  cout << "fold registers: ok\n";
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+#include <jitsim/coreir.hpp>
+#include <jitsim/json_loader.hpp>
+#include <coreir/ir/context.h>
+#include <coreir/libs/commonlib.h>
+
+#include "compare.hpp"
+
+using namespace std;
+
+/* Loads designs through both the native loader and CoreIR's passes and
+ * checks that they build the same circuit: definitions, instance order,
+ * connections and dependency orders */
+
+/* Two clock domains, a reset register, slices, constants, a terminator
+ * and a mux feedback register the loaders both fold */
+static const char *Mixed = R"({"top":"global.Top",
+"namespaces":{"global":{"modules":{
+"Slice":{"type":["Record",[["in",["Array",8,"BitIn"]],["lo",["Array",4,"Bit"]],["hi",["Array",4,"Bit"]]]],
+"instances":{},
+"connections":[["self.in.0","self.lo.0"],["self.in.1","self.lo.1"],["self.in.2","self.lo.2"],["self.in.3","self.lo.3"],
+               ["self.in.4","self.hi.0"],["self.in.5","self.hi.1"],["self.in.6","self.hi.2"],["self.in.7","self.hi.3"]]},
+"Top":{"type":["Record",[["a",["Array",8,"BitIn"]],["en","BitIn"],["rst",["Named","coreir.arstIn"]],
+                         ["CLKA",["Named","coreir.clkIn"]],["CLKB",["Named","coreir.clkIn"]],
+                         ["sum",["Array",4,"Bit"]],["held",["Array",8,"Bit"]],["count",["Array",8,"Bit"]]]],
+"instances":{
+  "split":{"modref":"global.Slice"},
+  "adder":{"genref":"coreir.add","genargs":{"width":["Int",4]}},
+  "hold":{"genref":"coreir.reg","genargs":{"width":["Int",8]},"modargs":{"init":[["BitVector",8],"8'h5a"]}},
+  "hold_mux":{"genref":"coreir.mux","genargs":{"width":["Int",8]}},
+  "counter":{"genref":"coreir.reg_arst","genargs":{"width":["Int",8]},
+             "modargs":{"init":[["BitVector",8],"8'h00"],"arst_posedge":["Bool",true]}},
+  "inc":{"genref":"coreir.add","genargs":{"width":["Int",8]}},
+  "one":{"genref":"coreir.const","genargs":{"width":["Int",8]},"modargs":{"value":[["BitVector",8],"8'h01"]}},
+  "unused":{"modref":"corebit.term"}
+},
+"connections":[
+  ["split.in","self.a"],
+  ["adder.in0","split.lo"],["adder.in1","split.hi"],["adder.out","self.sum"],
+  ["hold_mux.in0","hold.out"],["hold_mux.in1","self.a"],["hold_mux.sel","self.en"],
+  ["hold.in","hold_mux.out"],["hold.clk","self.CLKA"],["hold.out","self.held"],
+  ["inc.in0","counter.out"],["inc.in1","one.out"],["counter.in","inc.out"],
+  ["counter.clk","self.CLKB"],["counter.arst","self.rst"],["counter.out","self.count"],
+  ["unused.in","self.en"]
+]}
+}}}})";
+
+/* The native loader leaves clocks that do not come straight from a
+ * module clock input to CoreIR */
+static const char *ClockThrough = R"({"top":"global.Top",
+"namespaces":{"global":{"modules":{
+"Top":{"type":["Record",[["CLK",["Named","coreir.clkIn"]],["CLKO",["Named","coreir.clk"]]]],
+"instances":{},
+"connections":[["self.CLKO","self.CLK"]]}
+}}}})";
+
+static unique_ptr<JITSim::Circuit> loadCoreIR(const string &path)
+{
+  using namespace CoreIR;
+
+  Context *ctx = newContext();
+  CoreIRLoadLibrary_commonlib(ctx);
+
+  Module *top = nullptr;
+  if (!loadFromFile(ctx, path, &top) || !top) {
+    deleteContext(ctx);
+    return nullptr;
+  }
+
+  ctx->addPass(new JITSim::MaterializeArgs);
+  ctx->runPasses({"rungenerators", "flattentypes", "materializeargs"});
+
+  auto circuit = make_unique<JITSim::Circuit>(JITSim::BuildFromCoreIR(top));
+
+  deleteContext(ctx);
+
+  return circuit;
+}
+
+/* Writes contents to a temporary file and returns its path */
+static string writeDesign(const char *contents)
+{
+  char path[] = "/tmp/jitsim_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    cerr << "Unable to create a temporary file\n";
+    exit(1);
+  }
+  close(fd);
+
+  ofstream out(path);
+  out << contents;
+
+  return path;
+}
+
+static bool checkLoaders(const string &name, const string &path)
+{
+  unique_ptr<JITSim::Circuit> native = JITSim::LoadJSONNetlist(path);
+  unique_ptr<JITSim::Circuit> coreir = loadCoreIR(path);
+  if (!native || !coreir) {
+    cerr << name << ": " << (native ? "CoreIR" : "native") << " loader failed\n";
+    return false;
+  }
+
+  return JITSimTest::CheckSame(name, JITSimTest::DescribeCircuit(*coreir), JITSimTest::DescribeCircuit(*native));
+}
+
+int main()
+{
+  bool ok = checkLoaders("counter", "tests/counter.json");
+
+  string mixed = writeDesign(Mixed);
+  ok &= checkLoaders("mixed", mixed);
+  unlink(mixed.c_str());
+
+  string clock_through = writeDesign(ClockThrough);
+  if (JITSim::LoadJSONNetlist(clock_through)) {
+    cerr << "clock through: native loader accepted a clock it cannot wire\n";
+    ok = false;
+  }
+  unlink(clock_through.c_str());
+
+  if (!ok) {
+    return 1;
+  }
+  cout << "json loader: ok\n";
+
+  return 0;
+}